@@ -16,15 +16,23 @@ TARGET = ptp.dll
 
 OBJS = \
 	auth.obj \
+	chacha.obj \
 	collect.obj \
+	connpool.obj \
 	debug.obj \
+	ed25519.obj \
 	encode.obj \
 	id.obj \
 	key.obj \
 	list.obj \
 	mutex.obj \
 	net.obj \
+	pool.obj \
         rand.obj \
+	reactor.obj \
+	resolver.obj \
+	secure.obj \
+	sem.obj \
 	store.obj \
 	thread.obj
 
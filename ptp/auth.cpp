@@ -115,19 +115,20 @@ PTP::Authenticator::Challenge(const Identity *id,
 		return -1;
 	if (chal)
 	{
-		// create a random nonce
+		// create a random nonce (as large as the key type allows)
 		BYTE nonce[PTP::Identity::PLAINTEXT_SIZE];
-		PTP::Random::Fill(nonce, sizeof(nonce));
+		int size = id->GetPlaintextSize();
+		PTP::Random::Fill(nonce, size);
 		BYTE resp[RESPONSE_SIZE];
 
 		// calculate nonce digest (expected response)
 		EVP_MD_CTX digestCtx;
 		EVP_DigestInit(&digestCtx, PTP_DIGEST);
-		EVP_DigestUpdate(&digestCtx, nonce, sizeof(nonce));
+		EVP_DigestUpdate(&digestCtx, nonce, size);
 		EVP_DigestFinal(&digestCtx, resp, 0);
 
 		// encrypt nonce (challenge)
-		if (id->Encrypt(nonce, sizeof(nonce), chal) != CHALLENGE_SIZE)
+		if (id->Encrypt(nonce, size, chal) != CHALLENGE_SIZE)
 			return -1;
 
 		// save expected response
@@ -163,13 +164,14 @@ PTP::Authenticator::Respond(const BYTE *chal, BYTE *resp) const
 
 		// decrypt nonce
 		BYTE nonce[PTP::Identity::PLAINTEXT_SIZE];
-		if (m_local->Decrypt(chal, nonce) != sizeof(nonce))
+		int size = m_local->Decrypt(chal, nonce);
+		if (size != m_local->GetPlaintextSize())
 			return -1;
 
 		// calculate nonce digest (response)
 		EVP_MD_CTX digestCtx;
 		EVP_DigestInit(&digestCtx, PTP_DIGEST);
-		EVP_DigestUpdate(&digestCtx, nonce, sizeof(nonce));
+		EVP_DigestUpdate(&digestCtx, nonce, size);
 		EVP_DigestFinal(&digestCtx, resp, 0);
 	}
 	return RESPONSE_SIZE;
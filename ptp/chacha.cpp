@@ -0,0 +1,613 @@
+/*
+ * Copyright (c) 2001 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * 3. Neither the name of the Intel Corporation nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <assert.h>
+#include <ptp/chacha.h>
+#include <ptp/debug.h>
+
+#if defined(__SSE2__) || defined(_M_X64) \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PTP_CHACHA_SSE2
+#include <emmintrin.h>
+#endif
+
+typedef unsigned int Word32;
+#ifdef WIN32
+typedef unsigned __int64 Word64;
+#else
+typedef unsigned long long Word64;
+#endif
+
+#define LOAD32(p) \
+	((Word32) (p)[0] \
+	 | ((Word32) (p)[1] << 8) \
+	 | ((Word32) (p)[2] << 16) \
+	 | ((Word32) (p)[3] << 24))
+#define STORE32(p, v) \
+	((p)[0] = (BYTE) (v), (p)[1] = (BYTE) ((v) >> 8), \
+	 (p)[2] = (BYTE) ((v) >> 16), (p)[3] = (BYTE) ((v) >> 24))
+#define ROTATE(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTER(a, b, c, d) \
+	a += b; d ^= a; d = ROTATE(d, 16); \
+	c += d; b ^= c; b = ROTATE(b, 12); \
+	a += b; d ^= a; d = ROTATE(d, 8); \
+	c += d; b ^= c; b = ROTATE(b, 7)
+
+#ifdef PTP_CHACHA_SSE2
+int PTP::ChaCha::s_simd = 1;
+#else
+int PTP::ChaCha::s_simd = 0;
+#endif
+
+/*
+ * AddSize: Add to a 64-bit byte count kept as two words.
+ */
+static void
+AddSize(Word32 *count, int size)
+{
+	Word32 low = count[0];
+	count[0] += size;
+	if (count[0] < low)
+		count[1]++;
+}
+
+/**
+ * PTP::ChaCha::ChaCha: Class constructor.
+ * Notes: Use &SetKey before encrypting anything.
+ */
+PTP::ChaCha::ChaCha()
+{
+	memset(m_state, 0, sizeof(m_state));
+	m_used = sizeof(m_stream);
+	m_buffered = 0;
+}
+
+/**
+ * PTP::ChaCha::ChaCha: Create a cipher with a key.
+ * @key: Key data.
+ * @keysize: Key size (16 or 32 bytes).
+ * Example:
+ *   BYTE key[PTP::ChaCha::KEY_SIZE];
+ *   PTP::Random::Fill(key, sizeof(key));
+ *   PTP::ChaCha chacha(key);
+ */
+PTP::ChaCha::ChaCha(const BYTE *key, int keysize)
+{
+	memset(m_state, 0, sizeof(m_state));
+	m_used = sizeof(m_stream);
+	m_buffered = 0;
+	SetKey(key, keysize);
+}
+
+#ifdef PTPTL_DLL
+
+/*
+ * PTP::ChaCha::ChaCha: Copy constructor.
+ * @chacha: Source ChaCha.
+ */
+PTP::ChaCha::ChaCha(const ChaCha& chacha)
+{
+	assert(0);
+}
+
+/*
+ * PTP::ChaCha::operator=: Copy constructor.
+ * @chacha: Source ChaCha.
+ */
+PTP::ChaCha&
+PTP::ChaCha::operator=(const ChaCha& chacha)
+{
+	assert(0);
+	return *this;
+}
+
+#endif // PTPTL_DLL
+
+/**
+ * PTP::ChaCha::~ChaCha: Class destructor.
+ */
+PTP::ChaCha::~ChaCha()
+{
+	memset(m_state, 0, sizeof(m_state));
+	memset(m_stream, 0, sizeof(m_stream));
+	memset(m_r, 0, sizeof(m_r));
+	memset(m_pad, 0, sizeof(m_pad));
+}
+
+/**
+ * PTP::ChaCha::SetKey: Set the cipher key.
+ * @key: Key data.
+ * @keysize: Key size (16 or 32 bytes).
+ * Returns: 0 on success or -1 on invalid key size.
+ */
+int
+PTP::ChaCha::SetKey(const BYTE *key, int keysize)
+{
+	if (!key || (keysize != 16 && keysize != 32))
+		return -1;
+
+	const char *sigma = (keysize == 32) ?
+		"expand 32-byte k":"expand 16-byte k";
+	int i;
+	for (i = 0; i < 4; i++)
+		m_state[i] = LOAD32((const BYTE*) sigma + 4 * i);
+	for (i = 0; i < 8; i++)
+		m_state[4 + i] = LOAD32(key + 4 * (i % (keysize / 4)));
+	return 0;
+}
+
+/**
+ * PTP::ChaCha::Start: Start a message.
+ * @nonce: Message nonce (%NONCE_SIZE bytes).
+ * @aad: Additional data authenticated but not encrypted or NULL.
+ * @aadsize: Size of @aad.
+ * Notes: A nonce must never be used twice with the same key.
+ * Example:
+ *   $Start(nonce);
+ *   chacha.Encrypt(data, data, size);
+ *   chacha.Finish(tag);
+ */
+void
+PTP::ChaCha::Start(const BYTE *nonce, const BYTE *aad, int aadsize)
+{
+	int i;
+	m_state[12] = 0;
+	for (i = 0; i < 3; i++)
+		m_state[13 + i] = LOAD32(nonce + 4 * i);
+
+	// the Poly1305 key is the start of block 0
+	BYTE block[BLOCK_SIZE];
+	Block(m_state, block);
+	m_r[0] = LOAD32(block) & 0x3ffffff;
+	m_r[1] = (LOAD32(block + 3) >> 2) & 0x3ffff03;
+	m_r[2] = (LOAD32(block + 6) >> 4) & 0x3ffc0ff;
+	m_r[3] = (LOAD32(block + 9) >> 6) & 0x3f03fff;
+	m_r[4] = (LOAD32(block + 12) >> 8) & 0x00fffff;
+	for (i = 0; i < 4; i++)
+		m_pad[i] = LOAD32(block + 16 + 4 * i);
+	memset(block, 0, sizeof(block));
+	memset(m_h, 0, sizeof(m_h));
+	m_buffered = 0;
+	m_aadsize[0] = m_aadsize[1] = 0;
+	m_size[0] = m_size[1] = 0;
+
+	// the message starts with block 1
+	m_state[12] = 1;
+	m_used = sizeof(m_stream);
+
+	if (aad && aadsize > 0)
+	{
+		Mac(aad, aadsize);
+		MacPad();
+		AddSize(m_aadsize, aadsize);
+	}
+}
+
+/**
+ * PTP::ChaCha::Encrypt: Encrypt part of a message.
+ * @src: Plaintext data.
+ * @dst: [$OUT] Ciphertext data (may be @src).
+ * @size: Data size.
+ * Notes: The key stream and tag are computed in a single pass over
+ *        the data.
+ */
+void
+PTP::ChaCha::Encrypt(const BYTE *src, BYTE *dst, int size)
+{
+	// authenticate each piece while it is still in the cache
+	AddSize(m_size, size);
+	while (size > 0)
+	{
+		int n = (size < STITCH_SIZE) ? size:STITCH_SIZE;
+		Xor(src, dst, n);
+		Mac(dst, n);
+		src += n;
+		dst += n;
+		size -= n;
+	}
+}
+
+/**
+ * PTP::ChaCha::Decrypt: Decrypt part of a message.
+ * @src: Ciphertext data.
+ * @dst: [$OUT] Plaintext data (may be @src).
+ * @size: Data size.
+ * Notes: The plaintext may not be used until &Verify succeeds.
+ */
+void
+PTP::ChaCha::Decrypt(const BYTE *src, BYTE *dst, int size)
+{
+	AddSize(m_size, size);
+	while (size > 0)
+	{
+		int n = (size < STITCH_SIZE) ? size:STITCH_SIZE;
+		Mac(src, n);
+		Xor(src, dst, n);
+		src += n;
+		dst += n;
+		size -= n;
+	}
+}
+
+/**
+ * PTP::ChaCha::Finish: Finish a message.
+ * @tag: [$OUT] Authentication tag (%TAG_SIZE bytes).
+ */
+void
+PTP::ChaCha::Finish(BYTE *tag)
+{
+	int i;
+	BYTE sizes[MAC_BLOCK_SIZE];
+	MacPad();
+	STORE32(sizes, m_aadsize[0]);
+	STORE32(sizes + 4, m_aadsize[1]);
+	STORE32(sizes + 8, m_size[0]);
+	STORE32(sizes + 12, m_size[1]);
+	MacBlocks(sizes, sizeof(sizes));
+
+	// fully reduce h modulo 2^130 - 5
+	Word h0 = m_h[0], h1 = m_h[1], h2 = m_h[2], h3 = m_h[3], h4 = m_h[4];
+	Word c = h1 >> 26;
+	h1 &= 0x3ffffff;
+	h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+	h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+	h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+	h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+	h1 += c;
+
+	Word g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+	Word g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+	Word g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+	Word g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+	Word g4 = h4 + c - (1 << 26);
+
+	// select h or h - p without branching
+	Word mask = (g4 >> 31) - 1;
+	h0 = (h0 & ~mask) | (g0 & mask);
+	h1 = (h1 & ~mask) | (g1 & mask);
+	h2 = (h2 & ~mask) | (g2 & mask);
+	h3 = (h3 & ~mask) | (g3 & mask);
+	h4 = (h4 & ~mask) | (g4 & mask);
+
+	// tag = (h + pad) mod 2^128
+	Word h[4];
+	h[0] = h0 | (h1 << 26);
+	h[1] = (h1 >> 6) | (h2 << 20);
+	h[2] = (h2 >> 12) | (h3 << 14);
+	h[3] = (h3 >> 18) | (h4 << 8);
+	Word64 f = 0;
+	for (i = 0; i < 4; i++)
+	{
+		f += (Word64) h[i] + m_pad[i];
+		STORE32(tag + 4 * i, (Word) f);
+		f >>= 32;
+	}
+}
+
+/**
+ * PTP::ChaCha::Verify: Finish a message and check its tag.
+ * @tag: Received authentication tag (%TAG_SIZE bytes).
+ * Returns: 0 if @tag is valid or -1 otherwise.
+ */
+int
+PTP::ChaCha::Verify(const BYTE *tag)
+{
+	BYTE expect[TAG_SIZE];
+	Finish(expect);
+
+	// compare in constant time
+	BYTE diff = 0;
+	for (int i = 0; i < TAG_SIZE; i++)
+		diff |= expect[i] ^ tag[i];
+	return diff ? -1:0;
+}
+
+/**
+ * PTP::ChaCha::SetSimd: Enable or disable SIMD instructions.
+ * Type: static
+ * @simd: 1 to use SIMD instructions (if available) or 0 for the
+ *        portable implementation.
+ * Returns: 1 if SIMD instructions are now used or 0 otherwise.
+ * Notes: Both implementations produce the same output.
+ */
+int
+PTP::ChaCha::SetSimd(int simd)
+{
+#ifdef PTP_CHACHA_SSE2
+	s_simd = simd ? 1:0;
+#endif
+	return s_simd;
+}
+
+/*
+ * PTP::ChaCha::Fill: Generate the next %BLOCKS blocks of key stream.
+ */
+void
+PTP::ChaCha::Fill()
+{
+	Blocks(m_state, m_stream);
+	m_state[12] += BLOCKS;
+	m_used = 0;
+}
+
+/*
+ * PTP::ChaCha::Xor: Combine data with the key stream.
+ * @src: Source data.
+ * @dst: [$OUT] Destination data (may be @src).
+ * @size: Data size.
+ */
+void
+PTP::ChaCha::Xor(const BYTE *src, BYTE *dst, int size)
+{
+	while (size > 0)
+	{
+		if (m_used == sizeof(m_stream))
+			Fill();
+		int n = sizeof(m_stream) - m_used;
+		if (n > size)
+			n = size;
+		const BYTE *stream = m_stream + m_used;
+		for (int i = 0; i < n; i++)
+			dst[i] = src[i] ^ stream[i];
+		m_used += n;
+		src += n;
+		dst += n;
+		size -= n;
+	}
+}
+
+/*
+ * PTP::ChaCha::Mac: Authenticate data.
+ * @data: Data.
+ * @size: Data size.
+ */
+void
+PTP::ChaCha::Mac(const BYTE *data, int size)
+{
+	if (m_buffered > 0)
+	{
+		int n = MAC_BLOCK_SIZE - m_buffered;
+		if (n > size)
+			n = size;
+		memcpy(m_buffer + m_buffered, data, n);
+		m_buffered += n;
+		data += n;
+		size -= n;
+		if (m_buffered < MAC_BLOCK_SIZE)
+			return;
+		MacBlocks(m_buffer, MAC_BLOCK_SIZE);
+		m_buffered = 0;
+	}
+
+	int blocks = size & ~(MAC_BLOCK_SIZE - 1);
+	if (blocks > 0)
+		MacBlocks(data, blocks);
+	memcpy(m_buffer, data + blocks, size - blocks);
+	m_buffered = size - blocks;
+}
+
+/*
+ * PTP::ChaCha::MacPad: Pad authenticated data to a whole block.
+ */
+void
+PTP::ChaCha::MacPad()
+{
+	if (m_buffered > 0)
+	{
+		memset(m_buffer + m_buffered, 0, MAC_BLOCK_SIZE - m_buffered);
+		MacBlocks(m_buffer, MAC_BLOCK_SIZE);
+		m_buffered = 0;
+	}
+}
+
+/*
+ * PTP::ChaCha::MacBlocks: Authenticate whole blocks.
+ * @data: Data.
+ * @size: Data size (a multiple of %MAC_BLOCK_SIZE).
+ */
+void
+PTP::ChaCha::MacBlocks(const BYTE *data, int size)
+{
+	Word r0 = m_r[0], r1 = m_r[1], r2 = m_r[2], r3 = m_r[3], r4 = m_r[4];
+	Word s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+	Word h0 = m_h[0], h1 = m_h[1], h2 = m_h[2], h3 = m_h[3], h4 = m_h[4];
+
+	for (; size >= MAC_BLOCK_SIZE; size -= MAC_BLOCK_SIZE)
+	{
+		// h += m (with the 2^128 bit set)
+		h0 += LOAD32(data) & 0x3ffffff;
+		h1 += (LOAD32(data + 3) >> 2) & 0x3ffffff;
+		h2 += (LOAD32(data + 6) >> 4) & 0x3ffffff;
+		h3 += (LOAD32(data + 9) >> 6) & 0x3ffffff;
+		h4 += (LOAD32(data + 12) >> 8) | (1 << 24);
+
+		// h *= r (partially reduced modulo 2^130 - 5)
+		Word64 d0 = (Word64) h0 * r0 + (Word64) h1 * s4
+			+ (Word64) h2 * s3 + (Word64) h3 * s2
+			+ (Word64) h4 * s1;
+		Word64 d1 = (Word64) h0 * r1 + (Word64) h1 * r0
+			+ (Word64) h2 * s4 + (Word64) h3 * s3
+			+ (Word64) h4 * s2;
+		Word64 d2 = (Word64) h0 * r2 + (Word64) h1 * r1
+			+ (Word64) h2 * r0 + (Word64) h3 * s4
+			+ (Word64) h4 * s3;
+		Word64 d3 = (Word64) h0 * r3 + (Word64) h1 * r2
+			+ (Word64) h2 * r1 + (Word64) h3 * r0
+			+ (Word64) h4 * s4;
+		Word64 d4 = (Word64) h0 * r4 + (Word64) h1 * r3
+			+ (Word64) h2 * r2 + (Word64) h3 * r1
+			+ (Word64) h4 * r0;
+
+		Word c = (Word) (d0 >> 26);
+		h0 = (Word) d0 & 0x3ffffff;
+		d1 += c; c = (Word) (d1 >> 26); h1 = (Word) d1 & 0x3ffffff;
+		d2 += c; c = (Word) (d2 >> 26); h2 = (Word) d2 & 0x3ffffff;
+		d3 += c; c = (Word) (d3 >> 26); h3 = (Word) d3 & 0x3ffffff;
+		d4 += c; c = (Word) (d4 >> 26); h4 = (Word) d4 & 0x3ffffff;
+		h0 += c * 5;
+		c = h0 >> 26;
+		h0 &= 0x3ffffff;
+		h1 += c;
+
+		data += MAC_BLOCK_SIZE;
+	}
+
+	m_h[0] = h0;
+	m_h[1] = h1;
+	m_h[2] = h2;
+	m_h[3] = h3;
+	m_h[4] = h4;
+}
+
+/*
+ * PTP::ChaCha::Block: Generate one block of key stream.
+ * Type: static
+ * @state: Cipher state.
+ * @out: [$OUT] Key stream (%BLOCK_SIZE bytes).
+ */
+void
+PTP::ChaCha::Block(const Word *state, BYTE *out)
+{
+	Word x[16];
+	int i;
+	for (i = 0; i < 16; i++)
+		x[i] = state[i];
+	for (i = 0; i < 10; i++)
+	{
+		QUARTER(x[0], x[4], x[8], x[12]);
+		QUARTER(x[1], x[5], x[9], x[13]);
+		QUARTER(x[2], x[6], x[10], x[14]);
+		QUARTER(x[3], x[7], x[11], x[15]);
+		QUARTER(x[0], x[5], x[10], x[15]);
+		QUARTER(x[1], x[6], x[11], x[12]);
+		QUARTER(x[2], x[7], x[8], x[13]);
+		QUARTER(x[3], x[4], x[9], x[14]);
+	}
+	for (i = 0; i < 16; i++)
+	{
+		Word v = x[i] + state[i];
+		STORE32(out + 4 * i, v);
+	}
+}
+
+#ifdef PTP_CHACHA_SSE2
+
+#define ADD(a, b) a = _mm_add_epi32(a, b)
+#define XOR_ROTATE(d, a, n) \
+	d = _mm_xor_si128(d, a); \
+	d = _mm_or_si128(_mm_slli_epi32(d, n), _mm_srli_epi32(d, 32 - (n)))
+#define QUARTER4(a, b, c, d) \
+	ADD(a, b); XOR_ROTATE(d, a, 16); \
+	ADD(c, d); XOR_ROTATE(b, c, 12); \
+	ADD(a, b); XOR_ROTATE(d, a, 8); \
+	ADD(c, d); XOR_ROTATE(b, c, 7)
+
+/*
+ * BlocksSse2: Generate four blocks of key stream at once.
+ * @state: Cipher state.
+ * @out: [$OUT] Key stream (4 blocks).
+ * Notes: Each vector holds one state word of all four blocks.
+ */
+static void
+BlocksSse2(const Word32 *state, BYTE *out)
+{
+	__m128i x[16], s[16];
+	int i;
+	for (i = 0; i < 16; i++)
+		s[i] = _mm_set1_epi32((int) state[i]);
+	s[12] = _mm_add_epi32(s[12], _mm_set_epi32(3, 2, 1, 0));
+	for (i = 0; i < 16; i++)
+		x[i] = s[i];
+
+	for (i = 0; i < 10; i++)
+	{
+		QUARTER4(x[0], x[4], x[8], x[12]);
+		QUARTER4(x[1], x[5], x[9], x[13]);
+		QUARTER4(x[2], x[6], x[10], x[14]);
+		QUARTER4(x[3], x[7], x[11], x[15]);
+		QUARTER4(x[0], x[5], x[10], x[15]);
+		QUARTER4(x[1], x[6], x[11], x[12]);
+		QUARTER4(x[2], x[7], x[8], x[13]);
+		QUARTER4(x[3], x[4], x[9], x[14]);
+	}
+
+	// transpose four words at a time back into blocks
+	for (i = 0; i < 16; i += 4)
+	{
+		__m128i a = _mm_add_epi32(x[i], s[i]);
+		__m128i b = _mm_add_epi32(x[i + 1], s[i + 1]);
+		__m128i c = _mm_add_epi32(x[i + 2], s[i + 2]);
+		__m128i d = _mm_add_epi32(x[i + 3], s[i + 3]);
+		__m128i t0 = _mm_unpacklo_epi32(a, b);
+		__m128i t1 = _mm_unpacklo_epi32(c, d);
+		__m128i t2 = _mm_unpackhi_epi32(a, b);
+		__m128i t3 = _mm_unpackhi_epi32(c, d);
+		BYTE *dst = out + 4 * i;
+		_mm_storeu_si128((__m128i*) dst, _mm_unpacklo_epi64(t0, t1));
+		_mm_storeu_si128((__m128i*) (dst + 64),
+				 _mm_unpackhi_epi64(t0, t1));
+		_mm_storeu_si128((__m128i*) (dst + 128),
+				 _mm_unpacklo_epi64(t2, t3));
+		_mm_storeu_si128((__m128i*) (dst + 192),
+				 _mm_unpackhi_epi64(t2, t3));
+	}
+}
+
+#endif // PTP_CHACHA_SSE2
+
+/*
+ * PTP::ChaCha::Blocks: Generate %BLOCKS blocks of key stream.
+ * Type: static
+ * @state: Cipher state (for the first block).
+ * @out: [$OUT] Key stream (%BLOCKS * %BLOCK_SIZE bytes).
+ */
+void
+PTP::ChaCha::Blocks(const Word *state, BYTE *out)
+{
+#ifdef PTP_CHACHA_SSE2
+	if (s_simd)
+	{
+		BlocksSse2(state, out);
+		return;
+	}
+#endif
+	Word s[16];
+	memcpy(s, state, sizeof(s));
+	for (int i = 0; i < BLOCKS; i++)
+	{
+		Block(s, out + i * BLOCK_SIZE);
+		s[12]++;
+	}
+	memset(s, 0, sizeof(s));
+}
@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2001 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * 3. Neither the name of the Intel Corporation nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include <assert.h>
+#include <ptp/connpool.h>
+#include <ptp/debug.h>
+
+/*
+ * PTP::Net::ConnectionPool::Idle: Idle connection.
+ */
+class PTP::Net::ConnectionPool::Idle:public PTP::List::Entry
+{
+public:
+	Idle(Connection *conn, unsigned long time)
+		:m_conn(conn), m_time(time) {}
+	~Idle() {delete m_conn;}
+
+	Connection *m_conn;
+	unsigned long m_time;
+};
+
+/*
+ * GetTime
+ * Returns: Current time (in seconds).
+ */
+static unsigned long
+GetTime()
+{
+#ifdef WIN32
+	return (GetTickCount() / 1000);
+#else
+	return time(NULL);
+#endif
+}
+
+/**
+ * PTP::Net::ConnectionPool::ConnectionPool: Class constructor.
+ * @maxIdle: Maximum idle connections kept per peer.
+ * @timeout: Seconds before an idle connection is closed.
+ */
+PTP::Net::ConnectionPool::ConnectionPool(int maxIdle, int timeout)
+	:m_idle(), m_maxIdle(maxIdle), m_timeout(timeout)
+{
+}
+
+#ifdef PTPTL_DLL
+
+/*
+ * PTP::Net::ConnectionPool::ConnectionPool: Copy constructor.
+ * @pool: Source ConnectionPool.
+ */
+PTP::Net::ConnectionPool::ConnectionPool(const ConnectionPool& pool)
+{
+	assert(0);
+}
+
+/*
+ * PTP::Net::ConnectionPool::operator=: Copy constructor.
+ * @pool: Source ConnectionPool.
+ */
+PTP::Net::ConnectionPool&
+PTP::Net::ConnectionPool::operator=(const ConnectionPool& pool)
+{
+	assert(0);
+	return *this;
+}
+
+#endif // PTPTL_DLL
+
+/**
+ * PTP::Net::ConnectionPool::~ConnectionPool: Class destructor.
+ * Notes: All idle connections are closed.
+ */
+PTP::Net::ConnectionPool::~ConnectionPool()
+{
+	Clear();
+}
+
+/**
+ * PTP::Net::ConnectionPool::Get: Get a connection to a peer.
+ * @type: Connection type (%RAW or %HTTP).
+ * @ip: Destination IP address.
+ * @port: Destination TCP port.
+ * @timeout: Milliseconds to wait for a new connect (0 for infinite).
+ * Returns: Open connection or NULL on error.
+ * Notes: An idle connection to the peer is reused if it is still
+ *        healthy (the peer has not closed it or sent unexpected
+ *        data).  Otherwise a new connection is opened.  Return the
+ *        connection with &Put when done, or delete it.
+ * Example:
+ *   PTP::Net::ConnectionPool pool;
+ *   PTP::Net::Connection *c = pool.$Get(PTP::Net::Connection::HTTP,
+ *                                       ip,
+ *                                       port);
+ *   if (c && c->WriteHttp("GET", "/index.html") == 0)
+ *   {
+ *     BYTE *data = c->ReadHttp();
+ *     ...
+ *   }
+ *   pool.Put(c);
+ */
+PTP::Net::Connection *
+PTP::Net::ConnectionPool::Get(Connection::Type type,
+			      Net::Ip ip,
+			      Net::Port port,
+			      int timeout)
+{
+	Expire();
+
+	Connection *conn = NULL;
+	m_idle.Lock();
+	Idle *idle;
+	PTP_LIST_FOREACH(Idle, idle, &m_idle)
+	{
+		if (idle->m_conn->GetIp() != ip
+		    || idle->m_conn->GetPort() != port
+		    || idle->m_conn->GetType() != type)
+			continue;
+
+		// most recently used first; drop any that went stale
+		m_idle.Remove(idle, 0);
+		if (idle->m_conn->IsIdle())
+		{
+			conn = idle->m_conn;
+			idle->m_conn = NULL;
+		}
+		delete idle;
+		if (conn)
+			break;
+	}
+	m_idle.Unlock();
+
+	if (conn)
+		return conn;
+
+	conn = new Connection(type, ip, port);
+	if (conn->Open(timeout) < 0)
+	{
+		delete conn;
+		return NULL;
+	}
+	return conn;
+}
+
+/**
+ * PTP::Net::ConnectionPool::Put: Return a connection to the pool.
+ * @conn: Connection from &Get (or NULL).
+ * Notes: The connection is deleted instead if it can not carry another
+ *        request (see &PTP::Net::Connection::GetKeepAlive), has unread
+ *        data, or the peer already has the maximum idle connections.
+ */
+void
+PTP::Net::ConnectionPool::Put(Connection *conn)
+{
+	if (!conn)
+		return;
+	if (conn->GetDir() != Connection::OUTBOUND
+	    || !conn->GetKeepAlive()
+	    || !conn->IsIdle()
+	    || m_maxIdle <= 0)
+	{
+		delete conn;
+		return;
+	}
+
+	m_idle.Lock();
+	int count = 0;
+	Idle *idle;
+	PTP_LIST_FOREACH(Idle, idle, &m_idle)
+	{
+		if (idle->m_conn->GetIp() != conn->GetIp()
+		    || idle->m_conn->GetPort() != conn->GetPort())
+			continue;
+
+		// close the least recently used beyond the limit
+		if (++count >= m_maxIdle)
+		{
+			m_idle.Remove(idle, 0);
+			delete idle;
+		}
+	}
+	m_idle.Insert(new Idle(conn, GetTime()), 0);
+	m_idle.Unlock();
+}
+
+/**
+ * PTP::Net::ConnectionPool::Clear: Close all idle connections.
+ */
+void
+PTP::Net::ConnectionPool::Clear()
+{
+	m_idle.Lock();
+	Idle *idle;
+	PTP_LIST_FOREACH(Idle, idle, &m_idle)
+	{
+		m_idle.Remove(idle, 0);
+		delete idle;
+	}
+	m_idle.Unlock();
+}
+
+/**
+ * PTP::Net::ConnectionPool::GetIdle
+ * Returns: Number of idle connections.
+ */
+int
+PTP::Net::ConnectionPool::GetIdle()
+{
+	Expire();
+
+	int count = 0;
+	m_idle.Lock();
+	Idle *idle;
+	PTP_LIST_FOREACH(Idle, idle, &m_idle)
+		count++;
+	m_idle.Unlock();
+	return count;
+}
+
+/*
+ * PTP::Net::ConnectionPool::Expire: Close timed out idle connections.
+ */
+void
+PTP::Net::ConnectionPool::Expire()
+{
+	unsigned long now = GetTime();
+	m_idle.Lock();
+	Idle *idle;
+	PTP_LIST_FOREACH(Idle, idle, &m_idle)
+	{
+		if (now - idle->m_time >= (unsigned long) m_timeout)
+		{
+			m_idle.Remove(idle, 0);
+			delete idle;
+		}
+	}
+	m_idle.Unlock();
+}
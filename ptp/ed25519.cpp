@@ -0,0 +1,1132 @@
+/*
+ * Copyright (c) 2001 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * 3. Neither the name of the Intel Corporation nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <ptp/ed25519.h>
+#include <ptp/debug.h>
+
+#ifdef WIN32
+typedef unsigned __int64 Word64;
+#define W64(x) x##ui64
+#else
+typedef unsigned long long Word64;
+#define W64(x) x##ULL
+#endif
+
+#define ROTR64(v, n) (((v) >> (n)) | ((v) << (64 - (n))))
+
+/*
+ * PTP::Ed25519::Sha512: SHA-512 message digest (FIPS 180-4).
+ */
+class PTP::Ed25519::Sha512
+{
+public:
+	Sha512();
+
+	void Update(const BYTE *data, int size);
+	void Final(BYTE *digest);
+
+protected:
+	enum {BLOCK_SIZE = 128};
+
+	void Block(const BYTE *block);
+
+	Word64 m_state[8];
+	BYTE m_buffer[BLOCK_SIZE];
+	int m_buffered;
+	Word64 m_size;
+};
+
+static const Word64 s_sha512Init[8] =
+{
+	W64(0x6a09e667f3bcc908), W64(0xbb67ae8584caa73b),
+	W64(0x3c6ef372fe94f82b), W64(0xa54ff53a5f1d36f1),
+	W64(0x510e527fade682d1), W64(0x9b05688c2b3e6c1f),
+	W64(0x1f83d9abfb41bd6b), W64(0x5be0cd19137e2179)
+};
+
+static const Word64 s_sha512K[80] =
+{
+	W64(0x428a2f98d728ae22), W64(0x7137449123ef65cd),
+	W64(0xb5c0fbcfec4d3b2f), W64(0xe9b5dba58189dbbc),
+	W64(0x3956c25bf348b538), W64(0x59f111f1b605d019),
+	W64(0x923f82a4af194f9b), W64(0xab1c5ed5da6d8118),
+	W64(0xd807aa98a3030242), W64(0x12835b0145706fbe),
+	W64(0x243185be4ee4b28c), W64(0x550c7dc3d5ffb4e2),
+	W64(0x72be5d74f27b896f), W64(0x80deb1fe3b1696b1),
+	W64(0x9bdc06a725c71235), W64(0xc19bf174cf692694),
+	W64(0xe49b69c19ef14ad2), W64(0xefbe4786384f25e3),
+	W64(0x0fc19dc68b8cd5b5), W64(0x240ca1cc77ac9c65),
+	W64(0x2de92c6f592b0275), W64(0x4a7484aa6ea6e483),
+	W64(0x5cb0a9dcbd41fbd4), W64(0x76f988da831153b5),
+	W64(0x983e5152ee66dfab), W64(0xa831c66d2db43210),
+	W64(0xb00327c898fb213f), W64(0xbf597fc7beef0ee4),
+	W64(0xc6e00bf33da88fc2), W64(0xd5a79147930aa725),
+	W64(0x06ca6351e003826f), W64(0x142929670a0e6e70),
+	W64(0x27b70a8546d22ffc), W64(0x2e1b21385c26c926),
+	W64(0x4d2c6dfc5ac42aed), W64(0x53380d139d95b3df),
+	W64(0x650a73548baf63de), W64(0x766a0abb3c77b2a8),
+	W64(0x81c2c92e47edaee6), W64(0x92722c851482353b),
+	W64(0xa2bfe8a14cf10364), W64(0xa81a664bbc423001),
+	W64(0xc24b8b70d0f89791), W64(0xc76c51a30654be30),
+	W64(0xd192e819d6ef5218), W64(0xd69906245565a910),
+	W64(0xf40e35855771202a), W64(0x106aa07032bbd1b8),
+	W64(0x19a4c116b8d2d0c8), W64(0x1e376c085141ab53),
+	W64(0x2748774cdf8eeb99), W64(0x34b0bcb5e19b48a8),
+	W64(0x391c0cb3c5c95a63), W64(0x4ed8aa4ae3418acb),
+	W64(0x5b9cca4f7763e373), W64(0x682e6ff3d6b2b8a3),
+	W64(0x748f82ee5defb2fc), W64(0x78a5636f43172f60),
+	W64(0x84c87814a1f0ab72), W64(0x8cc702081a6439ec),
+	W64(0x90befffa23631e28), W64(0xa4506cebde82bde9),
+	W64(0xbef9a3f7b2c67915), W64(0xc67178f2e372532b),
+	W64(0xca273eceea26619c), W64(0xd186b8c721c0c207),
+	W64(0xeada7dd6cde0eb1e), W64(0xf57d4f7fee6ed178),
+	W64(0x06f067aa72176fba), W64(0x0a637dc5a2c898a6),
+	W64(0x113f9804bef90dae), W64(0x1b710b35131c471b),
+	W64(0x28db77f523047d84), W64(0x32caab7b40c72493),
+	W64(0x3c9ebe0a15c9bebc), W64(0x431d67c49c100d4c),
+	W64(0x4cc5d4becb3e42b6), W64(0x597f299cfc657e2a),
+	W64(0x5fcb6fab3ad6faec), W64(0x6c44198c4a475817)
+};
+
+/*
+ * Load64: Read a big-endian 64-bit word.
+ */
+static Word64
+Load64(const BYTE *p)
+{
+	Word64 v = 0;
+	for (int i = 0; i < 8; i++)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+/*
+ * Store64: Write a big-endian 64-bit word.
+ */
+static void
+Store64(BYTE *p, Word64 v)
+{
+	for (int i = 7; i >= 0; i--, v >>= 8)
+		p[i] = (BYTE) v;
+}
+
+/*
+ * PTP::Ed25519::Sha512::Sha512: Class constructor.
+ */
+PTP::Ed25519::Sha512::Sha512()
+	:m_buffered(0), m_size(0)
+{
+	memcpy(m_state, s_sha512Init, sizeof(m_state));
+}
+
+/*
+ * PTP::Ed25519::Sha512::Update: Add data to the digest.
+ * @data: Data.
+ * @size: Data size.
+ */
+void
+PTP::Ed25519::Sha512::Update(const BYTE *data, int size)
+{
+	m_size += size;
+	if (m_buffered)
+	{
+		int n = BLOCK_SIZE - m_buffered;
+		if (n > size)
+			n = size;
+		memcpy(m_buffer + m_buffered, data, n);
+		m_buffered += n;
+		data += n;
+		size -= n;
+		if (m_buffered < BLOCK_SIZE)
+			return;
+		Block(m_buffer);
+		m_buffered = 0;
+	}
+	for (; size >= BLOCK_SIZE; data += BLOCK_SIZE, size -= BLOCK_SIZE)
+		Block(data);
+	memcpy(m_buffer, data, size);
+	m_buffered = size;
+}
+
+/*
+ * PTP::Ed25519::Sha512::Final: Finish the digest.
+ * @digest: [$OUT] Digest (%DIGEST_SIZE bytes).
+ */
+void
+PTP::Ed25519::Sha512::Final(BYTE *digest)
+{
+	Word64 bits = m_size << 3;
+	BYTE pad[BLOCK_SIZE + 16];
+	int n = ((m_buffered < BLOCK_SIZE - 16) ? BLOCK_SIZE:2 * BLOCK_SIZE)
+		- m_buffered;
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	Store64(pad + n - 8, bits);
+	Store64(pad + n - 16, m_size >> 61);
+	Update(pad, n);
+
+	for (int i = 0; i < 8; i++)
+		Store64(digest + 8 * i, m_state[i]);
+}
+
+/*
+ * PTP::Ed25519::Sha512::Block: Process one 128-byte block.
+ * @block: Block data.
+ */
+void
+PTP::Ed25519::Sha512::Block(const BYTE *block)
+{
+	Word64 w[80];
+	int i;
+	for (i = 0; i < 16; i++)
+		w[i] = Load64(block + 8 * i);
+	for (i = 16; i < 80; i++)
+	{
+		Word64 s0 = ROTR64(w[i - 15], 1) ^ ROTR64(w[i - 15], 8)
+			^ (w[i - 15] >> 7);
+		Word64 s1 = ROTR64(w[i - 2], 19) ^ ROTR64(w[i - 2], 61)
+			^ (w[i - 2] >> 6);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	Word64 a = m_state[0], b = m_state[1], c = m_state[2];
+	Word64 d = m_state[3], e = m_state[4], f = m_state[5];
+	Word64 g = m_state[6], h = m_state[7];
+	for (i = 0; i < 80; i++)
+	{
+		Word64 s1 = ROTR64(e, 14) ^ ROTR64(e, 18) ^ ROTR64(e, 41);
+		Word64 ch = (e & f) ^ (~e & g);
+		Word64 t1 = h + s1 + ch + s_sha512K[i] + w[i];
+		Word64 s0 = ROTR64(a, 28) ^ ROTR64(a, 34) ^ ROTR64(a, 39);
+		Word64 maj = (a & b) ^ (a & c) ^ (b & c);
+		Word64 t2 = s0 + maj;
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	m_state[0] += a;
+	m_state[1] += b;
+	m_state[2] += c;
+	m_state[3] += d;
+	m_state[4] += e;
+	m_state[5] += f;
+	m_state[6] += g;
+	m_state[7] += h;
+}
+
+/**
+ * PTP::Ed25519::Digest: Compute a SHA-512 message digest.
+ * Type: static
+ * @data: Data.
+ * @size: Data size.
+ * @digest: [$OUT] Digest (%DIGEST_SIZE bytes).
+ */
+void
+PTP::Ed25519::Digest(const BYTE *data, int size, BYTE *digest)
+{
+	Sha512 sha;
+	sha.Update(data, size);
+	sha.Final(digest);
+}
+
+// limb positions and widths for field elements
+static const int s_pos[10] = {0, 26, 51, 77, 102, 128, 153, 179, 204, 230};
+#define WIDTH(i) (((i) & 1) ? 25:26)
+
+// group order L = 2^252 + 27742317777372353535851937790883648493
+static const BYTE s_order[32] =
+{
+	0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58,
+	0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10
+};
+
+// exponents p - 2, (p - 5) / 8 and (p - 1) / 4 (little-endian)
+static const BYTE s_invert[32] =
+{
+	0xeb, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7f
+};
+static const BYTE s_sqrt[32] =
+{
+	0xfd, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x0f
+};
+static const BYTE s_quarter[32] =
+{
+	0xfb, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x1f
+};
+
+// base point B (y = 4/5, x positive) and X25519 base point (u = 9)
+static const BYTE s_base[32] =
+{
+	0x58, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66
+};
+static const BYTE s_base25519[32] = {9};
+
+PTP::Ed25519::Field PTP::Ed25519::s_d;
+PTP::Ed25519::Field PTP::Ed25519::s_d2;
+PTP::Ed25519::Field PTP::Ed25519::s_sqrtm1;
+PTP::Ed25519::Point
+	PTP::Ed25519::s_table[TABLE_WINDOWS][TABLE_ENTRIES];
+PTP::Ed25519 PTP::Ed25519::s_init;
+
+/*
+ * PTP::Ed25519::Ed25519: Compute the curve constants at startup.
+ */
+PTP::Ed25519::Ed25519()
+{
+	Init();
+}
+
+/*
+ * PTP::Ed25519::Init: Compute the curve constants and base point table.
+ * Type: static
+ */
+void
+PTP::Ed25519::Init()
+{
+	// d = -121665 / 121666
+	Field f;
+	memset(&f, 0, sizeof(f));
+	f.v[0] = 121666;
+	Invert(&f, &f);
+	MulSmall(&s_d, &f, -121665);
+	MulSmall(&s_d2, &s_d, 2);
+
+	// sqrt(-1) = 2^((p - 1) / 4)
+	memset(&f, 0, sizeof(f));
+	f.v[0] = 2;
+	Pow(&s_sqrtm1, &f, s_quarter);
+
+	Point base;
+	Decode(&base, s_base);
+	for (int i = 0; i < TABLE_WINDOWS; i++)
+	{
+		Point *row = s_table[i];
+		memset(&row[0], 0, sizeof(row[0]));
+		row[0].Y.v[0] = 1;
+		row[0].Z.v[0] = 1;
+		row[1] = base;
+		for (int j = 2; j < TABLE_ENTRIES; j++)
+			Add(&row[j], &row[j - 1], &base);
+
+		// next window: base * 16
+		for (int k = 0; k < 4; k++)
+			Double(&base, &base);
+	}
+}
+
+/*
+ * PTP::Ed25519::Carry: Reduce wide limbs to a field element.
+ * Type: static
+ * @f: [$OUT] Field element.
+ * @h: Wide limbs (modified).
+ */
+void
+PTP::Ed25519::Carry(Field *f, Wide *h)
+{
+	Wide c;
+	for (int i = 0; i < 10; i++)
+	{
+		int w = WIDTH(i);
+		c = (h[i] + ((Wide) 1 << (w - 1))) >> w;
+		h[i] -= c * ((Wide) 1 << w);
+		if (i < 9)
+			h[i + 1] += c;
+		else
+			h[0] += c * 19;
+	}
+	c = (h[0] + ((Wide) 1 << 25)) >> 26;
+	h[0] -= c * ((Wide) 1 << 26);
+	h[1] += c;
+
+	for (int j = 0; j < 10; j++)
+		f->v[j] = (Limb) h[j];
+}
+
+/*
+ * PTP::Ed25519::FromBytes: Load a field element.
+ * Type: static
+ * @h: [$OUT] Field element.
+ * @s: Little-endian value (32 bytes, top bit ignored).
+ */
+void
+PTP::Ed25519::FromBytes(Field *h, const BYTE *s)
+{
+	for (int i = 0; i < 10; i++)
+	{
+		int first = s_pos[i] >> 3;
+		int last = (s_pos[i] + WIDTH(i) - 1) >> 3;
+		Word64 x = 0;
+		for (int k = last; k >= first; k--)
+			x = (x << 8) | s[k];
+		x >>= (s_pos[i] & 7);
+		h->v[i] = (Limb) (x & ((1 << WIDTH(i)) - 1));
+	}
+}
+
+/*
+ * PTP::Ed25519::ToBytes: Store a fully reduced field element.
+ * Type: static
+ * @s: [$OUT] Little-endian value (32 bytes).
+ * @f: Field element.
+ */
+void
+PTP::Ed25519::ToBytes(BYTE *s, const Field *f)
+{
+	Wide t[10];
+	int i;
+	for (i = 0; i < 10; i++)
+		t[i] = f->v[i];
+	Field g;
+	Carry(&g, t);
+
+	// subtract p if the value is p or more
+	Limb *h = g.v;
+	Limb q = (19 * h[9] + (1 << 24)) >> 25;
+	for (i = 0; i < 10; i++)
+		q = (h[i] + q) >> WIDTH(i);
+	h[0] += 19 * q;
+	for (i = 0; i < 9; i++)
+	{
+		Limb c = h[i] >> WIDTH(i);
+		h[i + 1] += c;
+		h[i] -= c * (1 << WIDTH(i));
+	}
+	h[9] -= (h[9] >> 25) * (1 << 25);
+
+	memset(s, 0, 32);
+	for (i = 0; i < 10; i++)
+	{
+		Word64 x = (Word64) h[i] << (s_pos[i] & 7);
+		for (int k = s_pos[i] >> 3; x; k++, x >>= 8)
+			s[k] |= (BYTE) x;
+	}
+}
+
+/*
+ * PTP::Ed25519::Add: Add field elements (h = f + g).
+ * Type: static
+ */
+void
+PTP::Ed25519::Add(Field *h, const Field *f, const Field *g)
+{
+	for (int i = 0; i < 10; i++)
+		h->v[i] = f->v[i] + g->v[i];
+}
+
+/*
+ * PTP::Ed25519::Sub: Subtract field elements (h = f - g).
+ * Type: static
+ */
+void
+PTP::Ed25519::Sub(Field *h, const Field *f, const Field *g)
+{
+	for (int i = 0; i < 10; i++)
+		h->v[i] = f->v[i] - g->v[i];
+}
+
+/*
+ * PTP::Ed25519::Mul: Multiply field elements (h = f * g).
+ * Type: static
+ * Notes: Limbs of @f and @g must be less than 2^27 in magnitude.
+ */
+void
+PTP::Ed25519::Mul(Field *h, const Field *f, const Field *g)
+{
+	// products of two odd limbs carry an extra factor of two, and
+	// 2^255 wraps around as 19
+	Wide t[10];
+	Wide g19[10];
+	int i;
+	for (i = 0; i < 10; i++)
+	{
+		t[i] = 0;
+		g19[i] = (Wide) 19 * g->v[i];
+	}
+	for (i = 0; i < 10; i++)
+	{
+		Wide fi = f->v[i];
+		Wide fi2 = (i & 1) ? 2 * fi:fi;
+		int j;
+		for (j = 0; j < 10 - i; j++)
+			t[i + j] += ((j & 1) ? fi2:fi) * g->v[j];
+		for (; j < 10; j++)
+			t[i + j - 10] += ((j & 1) ? fi2:fi) * g19[j];
+	}
+	Carry(h, t);
+}
+
+/*
+ * PTP::Ed25519::MulSmall: Multiply a field element by a small integer.
+ * Type: static
+ */
+void
+PTP::Ed25519::MulSmall(Field *h, const Field *f, Limb n)
+{
+	Wide t[10];
+	for (int i = 0; i < 10; i++)
+		t[i] = (Wide) f->v[i] * n;
+	Carry(h, t);
+}
+
+/*
+ * PTP::Ed25519::Pow: Raise a field element to a public power.
+ * Type: static
+ * @e: Little-endian exponent (32 bytes).
+ */
+void
+PTP::Ed25519::Pow(Field *h, const Field *f, const BYTE *e)
+{
+	Field base = *f;
+	Field r;
+	memset(&r, 0, sizeof(r));
+	r.v[0] = 1;
+	for (int i = 255; i >= 0; i--)
+	{
+		Mul(&r, &r, &r);
+		if ((e[i >> 3] >> (i & 7)) & 1)
+			Mul(&r, &r, &base);
+	}
+	*h = r;
+}
+
+/*
+ * PTP::Ed25519::Invert: Invert a field element (h = 1 / f).
+ * Type: static
+ */
+void
+PTP::Ed25519::Invert(Field *h, const Field *f)
+{
+	Pow(h, f, s_invert);
+}
+
+/*
+ * PTP::Ed25519::Swap: Swap field elements if @swap is 1 (in constant
+ *                     time).
+ * Type: static
+ */
+void
+PTP::Ed25519::Swap(Field *f, Field *g, Limb swap)
+{
+	Limb mask = -swap;
+	for (int i = 0; i < 10; i++)
+	{
+		Limb x = mask & (f->v[i] ^ g->v[i]);
+		f->v[i] ^= x;
+		g->v[i] ^= x;
+	}
+}
+
+/*
+ * PTP::Ed25519::IsZero
+ * Type: static
+ * Returns: 1 if the field element is zero or 0 otherwise.
+ */
+int
+PTP::Ed25519::IsZero(const Field *f)
+{
+	BYTE s[32];
+	ToBytes(s, f);
+	BYTE x = 0;
+	for (int i = 0; i < 32; i++)
+		x |= s[i];
+	return (x == 0);
+}
+
+/*
+ * PTP::Ed25519::IsNegative
+ * Type: static
+ * Returns: Low bit of the reduced field element.
+ */
+int
+PTP::Ed25519::IsNegative(const Field *f)
+{
+	BYTE s[32];
+	ToBytes(s, f);
+	return (s[0] & 1);
+}
+
+/*
+ * PTP::Ed25519::Add: Add curve points (r = p + q).
+ * Type: static
+ * Notes: The formula is complete, so @p and @q may be equal.
+ */
+void
+PTP::Ed25519::Add(Point *r, const Point *p, const Point *q)
+{
+	Field a, b, c, d, t;
+	Sub(&a, &p->Y, &p->X);
+	Sub(&t, &q->Y, &q->X);
+	Mul(&a, &a, &t);
+	Add(&b, &p->Y, &p->X);
+	Add(&t, &q->Y, &q->X);
+	Mul(&b, &b, &t);
+	Mul(&c, &p->T, &q->T);
+	Mul(&c, &c, &s_d2);
+	Mul(&d, &p->Z, &q->Z);
+	Add(&d, &d, &d);
+
+	Field e, f, g, h;
+	Sub(&e, &b, &a);
+	Sub(&f, &d, &c);
+	Add(&g, &d, &c);
+	Add(&h, &b, &a);
+	Mul(&r->X, &e, &f);
+	Mul(&r->Y, &g, &h);
+	Mul(&r->T, &e, &h);
+	Mul(&r->Z, &f, &g);
+}
+
+/*
+ * PTP::Ed25519::Double: Double a curve point (r = 2p).
+ * Type: static
+ */
+void
+PTP::Ed25519::Double(Point *r, const Point *p)
+{
+	// dbl-2008-hwcd with a = -1
+	Field a, b, c, e, f, g, h;
+	Mul(&a, &p->X, &p->X);
+	Mul(&b, &p->Y, &p->Y);
+	Mul(&c, &p->Z, &p->Z);
+	MulSmall(&c, &c, 2);
+	Add(&e, &p->X, &p->Y);
+	Mul(&e, &e, &e);
+	Sub(&e, &e, &a);
+	Sub(&e, &e, &b);
+	Sub(&g, &b, &a);
+	Sub(&f, &g, &c);
+	memset(&h, 0, sizeof(h));
+	Sub(&h, &h, &a);
+	Sub(&h, &h, &b);
+
+	Mul(&r->X, &e, &f);
+	Mul(&r->Y, &g, &h);
+	Mul(&r->T, &e, &h);
+	Mul(&r->Z, &f, &g);
+}
+
+/*
+ * PTP::Ed25519::Select: Look up a table entry (in constant time).
+ * Type: static
+ * @r: [$OUT] Point.
+ * @table: Table of TABLE_ENTRIES points.
+ * @index: Entry index.
+ */
+void
+PTP::Ed25519::Select(Point *r, const Point *table, int index)
+{
+	const Limb *src;
+	Limb *dst = (Limb *) r;
+	const int count = sizeof(Point) / sizeof(Limb);
+	memset(r, 0, sizeof(*r));
+	for (int j = 0; j < TABLE_ENTRIES; j++)
+	{
+		// mask is all ones only for the matching entry
+		Limb mask = -(Limb) (((unsigned int) (j ^ index) - 1) >> 31);
+		src = (const Limb *) &table[j];
+		for (int k = 0; k < count; k++)
+			dst[k] |= src[k] & mask;
+	}
+}
+
+/*
+ * PTP::Ed25519::MulBase: Multiply the base point by a scalar.
+ * Type: static
+ * @r: [$OUT] Point.
+ * @scalar: Little-endian scalar (32 bytes).
+ */
+void
+PTP::Ed25519::MulBase(Point *r, const BYTE *scalar)
+{
+	Point t;
+	Select(r, s_table[0], scalar[0] & 0xf);
+	for (int i = 1; i < TABLE_WINDOWS; i++)
+	{
+		int nibble = (scalar[i >> 1] >> ((i & 1) << 2)) & 0xf;
+		Select(&t, s_table[i], nibble);
+		Add(r, r, &t);
+	}
+}
+
+/*
+ * PTP::Ed25519::Mul: Multiply a point by a scalar.
+ * Type: static
+ * @r: [$OUT] Point.
+ * @p: Point.
+ * @scalar: Little-endian scalar (32 bytes).
+ * Notes: Not constant time (use only with public scalars).
+ */
+void
+PTP::Ed25519::Mul(Point *r, const Point *p, const BYTE *scalar)
+{
+	Point table[TABLE_ENTRIES];
+	memset(&table[0], 0, sizeof(table[0]));
+	table[0].Y.v[0] = 1;
+	table[0].Z.v[0] = 1;
+	table[1] = *p;
+	int i;
+	for (i = 2; i < TABLE_ENTRIES; i++)
+		Add(&table[i], &table[i - 1], p);
+
+	*r = table[0];
+	for (i = TABLE_WINDOWS - 1; i >= 0; i--)
+	{
+		for (int k = 0; k < 4; k++)
+			Double(r, r);
+		int nibble = (scalar[i >> 1] >> ((i & 1) << 2)) & 0xf;
+		if (nibble)
+			Add(r, r, &table[nibble]);
+	}
+}
+
+/*
+ * PTP::Ed25519::Encode: Compress a point.
+ * Type: static
+ * @s: [$OUT] Encoded point (32 bytes).
+ * @p: Point.
+ */
+void
+PTP::Ed25519::Encode(BYTE *s, const Point *p)
+{
+	Field z, x, y;
+	Invert(&z, &p->Z);
+	Mul(&x, &p->X, &z);
+	Mul(&y, &p->Y, &z);
+	ToBytes(s, &y);
+	s[31] |= IsNegative(&x) << 7;
+}
+
+/*
+ * PTP::Ed25519::Decode: Decompress a point.
+ * Type: static
+ * @p: [$OUT] Point.
+ * @s: Encoded point (32 bytes).
+ * Returns: 0 on success or -1 if @s is not a valid encoding.
+ */
+int
+PTP::Ed25519::Decode(Point *p, const BYTE *s)
+{
+	// reject non-canonical y
+	BYTE check[32];
+	FromBytes(&p->Y, s);
+	ToBytes(check, &p->Y);
+	check[31] |= s[31] & 0x80;
+	if (memcmp(check, s, 32) != 0)
+		return -1;
+
+	// x^2 = (y^2 - 1) / (d y^2 + 1)
+	Field one, u, v, v3, x, t;
+	memset(&one, 0, sizeof(one));
+	one.v[0] = 1;
+	Mul(&u, &p->Y, &p->Y);
+	Mul(&v, &u, &s_d);
+	Sub(&u, &u, &one);
+	Add(&v, &v, &one);
+
+	// x = u v^3 (u v^7)^((p - 5) / 8)
+	Mul(&v3, &v, &v);
+	Mul(&v3, &v3, &v);
+	Mul(&x, &v3, &v3);
+	Mul(&x, &x, &v);
+	Mul(&x, &x, &u);
+	Pow(&x, &x, s_sqrt);
+	Mul(&x, &x, &v3);
+	Mul(&x, &x, &u);
+
+	Mul(&t, &x, &x);
+	Mul(&t, &t, &v);
+	Sub(&t, &t, &u);
+	if (!IsZero(&t))
+	{
+		Add(&t, &t, &u);
+		Add(&t, &t, &u);
+		if (!IsZero(&t))
+			return -1;
+		Mul(&x, &x, &s_sqrtm1);
+	}
+
+	int sign = s[31] >> 7;
+	if (IsNegative(&x) != sign)
+	{
+		if (IsZero(&x))
+			return -1;
+		memset(&t, 0, sizeof(t));
+		Sub(&x, &t, &x);
+	}
+
+	p->X = x;
+	p->Z = one;
+	Mul(&p->T, &x, &p->Y);
+	return 0;
+}
+
+/*
+ * PTP::Ed25519::Reduce: Reduce a scalar modulo the group order.
+ * Type: static
+ * @r: [$OUT] Little-endian scalar (32 bytes).
+ * @x: 64 byte values (modified).
+ */
+void
+PTP::Ed25519::Reduce(BYTE *r, Wide *x)
+{
+	Wide carry;
+	int i, j;
+	for (i = 63; i >= 32; i--)
+	{
+		carry = 0;
+		for (j = i - 32; j < i - 12; j++)
+		{
+			x[j] += carry - 16 * x[i] * s_order[j - (i - 32)];
+			carry = (x[j] + 128) >> 8;
+			x[j] -= carry * 256;
+		}
+		x[j] += carry;
+		x[i] = 0;
+	}
+	carry = 0;
+	for (j = 0; j < 32; j++)
+	{
+		x[j] += carry - (x[31] >> 4) * s_order[j];
+		carry = x[j] >> 8;
+		x[j] &= 255;
+	}
+	for (j = 0; j < 32; j++)
+		x[j] -= carry * s_order[j];
+	for (i = 0; i < 32; i++)
+	{
+		x[i + 1] += x[i] >> 8;
+		r[i] = (BYTE) (x[i] & 255);
+	}
+}
+
+/*
+ * PTP::Ed25519::Expand: Derive the secret scalar and nonce prefix.
+ * Type: static
+ * @seed: Secret seed (SEED_SIZE bytes).
+ * @scalar: [$OUT] Clamped scalar (32 bytes).
+ * @prefix: [$OUT] Nonce prefix (32 bytes, or NULL).
+ */
+void
+PTP::Ed25519::Expand(const BYTE *seed, BYTE *scalar, BYTE *prefix)
+{
+	BYTE digest[DIGEST_SIZE];
+	Digest(seed, SEED_SIZE, digest);
+	digest[0] &= 248;
+	digest[31] &= 127;
+	digest[31] |= 64;
+	memcpy(scalar, digest, 32);
+	if (prefix)
+		memcpy(prefix, digest + 32, 32);
+	memset(digest, 0, sizeof(digest));
+}
+
+/**
+ * PTP::Ed25519::CreateKey: Compute the public key for a seed.
+ * Type: static
+ * @seed: Secret seed (SEED_SIZE random bytes).
+ * @key: [$OUT] Public key (KEY_SIZE bytes).
+ * Example:
+ *	BYTE seed[PTP::Ed25519::SEED_SIZE];
+ *	BYTE key[PTP::Ed25519::KEY_SIZE];
+ *	PTP::Random::Fill(seed, sizeof(seed));
+ *	$Method(seed, key);
+ */
+void
+PTP::Ed25519::CreateKey(const BYTE *seed, BYTE *key)
+{
+	BYTE scalar[32];
+	Point a;
+	Expand(seed, scalar, NULL);
+	MulBase(&a, scalar);
+	Encode(key, &a);
+	memset(scalar, 0, sizeof(scalar));
+}
+
+/**
+ * PTP::Ed25519::Sign: Sign data.
+ * Type: static
+ * @seed: Secret seed (SEED_SIZE bytes).
+ * @key: Public key for @seed (KEY_SIZE bytes).
+ * @data: Data.
+ * @size: Data size.
+ * @sign: [$OUT] Signature (SIGNATURE_SIZE bytes).
+ * Example:
+ *	BYTE sign[PTP::Ed25519::SIGNATURE_SIZE];
+ *	$Method(seed, key, (BYTE *)"hello", 5, sign);
+ */
+void
+PTP::Ed25519::Sign(const BYTE *seed,
+		   const BYTE *key,
+		   const BYTE *data,
+		   int size,
+		   BYTE *sign)
+{
+	BYTE scalar[32];
+	BYTE prefix[32];
+	Expand(seed, scalar, prefix);
+
+	// r = H(prefix || data), R = r B
+	BYTE digest[DIGEST_SIZE];
+	Sha512 sha;
+	sha.Update(prefix, 32);
+	sha.Update(data, size);
+	sha.Final(digest);
+
+	Wide x[64];
+	int i, j;
+	for (i = 0; i < 64; i++)
+		x[i] = digest[i];
+	BYTE r[32];
+	Reduce(r, x);
+	Point p;
+	MulBase(&p, r);
+	Encode(sign, &p);
+
+	// k = H(R || key || data), S = r + k a
+	Sha512 sha2;
+	sha2.Update(sign, 32);
+	sha2.Update(key, KEY_SIZE);
+	sha2.Update(data, size);
+	sha2.Final(digest);
+	for (i = 0; i < 64; i++)
+		x[i] = digest[i];
+	BYTE k[32];
+	Reduce(k, x);
+
+	for (i = 0; i < 64; i++)
+		x[i] = (i < 32) ? r[i]:0;
+	for (i = 0; i < 32; i++)
+	{
+		for (j = 0; j < 32; j++)
+			x[i + j] += (Wide) k[i] * scalar[j];
+	}
+	Reduce(sign + 32, x);
+
+	memset(scalar, 0, sizeof(scalar));
+	memset(prefix, 0, sizeof(prefix));
+	memset(r, 0, sizeof(r));
+}
+
+/**
+ * PTP::Ed25519::Verify: Verify a signature.
+ * Type: static
+ * @key: Public key (KEY_SIZE bytes).
+ * @data: Data.
+ * @size: Data size.
+ * @sign: Signature (SIGNATURE_SIZE bytes).
+ * Returns: 0 if the signature is valid or -1 otherwise.
+ * Example:
+ *	if ($Method(key, (BYTE *)"hello", 5, sign) < 0)
+ *		printf("invalid signature\n");
+ */
+int
+PTP::Ed25519::Verify(const BYTE *key,
+		     const BYTE *data,
+		     int size,
+		     const BYTE *sign)
+{
+	// require S < L
+	int i;
+	for (i = 31; i >= 0; i--)
+	{
+		if (sign[32 + i] != s_order[i])
+			break;
+	}
+	if (i < 0 || sign[32 + i] > s_order[i])
+		return -1;
+
+	Point a;
+	if (Decode(&a, key) < 0)
+		return -1;
+
+	BYTE digest[DIGEST_SIZE];
+	Sha512 sha;
+	sha.Update(sign, 32);
+	sha.Update(key, KEY_SIZE);
+	sha.Update(data, size);
+	sha.Final(digest);
+	Wide x[64];
+	for (i = 0; i < 64; i++)
+		x[i] = digest[i];
+	BYTE k[32];
+	Reduce(k, x);
+
+	// R' = S B - k A
+	Field zero;
+	memset(&zero, 0, sizeof(zero));
+	Sub(&a.X, &zero, &a.X);
+	Sub(&a.T, &zero, &a.T);
+	Point p, q;
+	Mul(&p, &a, k);
+	MulBase(&q, sign + 32);
+	Add(&p, &p, &q);
+
+	BYTE check[32];
+	Encode(check, &p);
+	return (memcmp(check, sign, 32) == 0) ? 0:-1;
+}
+
+/**
+ * PTP::Ed25519::GetScalar: Derive the X25519 scalar for a seed.
+ * Type: static
+ * @seed: Secret seed (SEED_SIZE bytes).
+ * @scalar: [$OUT] X25519 scalar (SCALAR_SIZE bytes).
+ */
+void
+PTP::Ed25519::GetScalar(const BYTE *seed, BYTE *scalar)
+{
+	Expand(seed, scalar, NULL);
+}
+
+/**
+ * PTP::Ed25519::ToX25519: Convert an Ed25519 public key to an X25519
+ *                         point.
+ * Type: static
+ * @key: Public key (KEY_SIZE bytes).
+ * @point: [$OUT] X25519 point (SCALAR_SIZE bytes).
+ * Returns: 0 on success or -1 if @key is invalid.
+ */
+int
+PTP::Ed25519::ToX25519(const BYTE *key, BYTE *point)
+{
+	Point p;
+	if (Decode(&p, key) < 0)
+		return -1;
+
+	// u = (1 + y) / (1 - y)
+	Field one, n, d;
+	memset(&one, 0, sizeof(one));
+	one.v[0] = 1;
+	Add(&n, &one, &p.Y);
+	Sub(&d, &one, &p.Y);
+	if (IsZero(&d))
+		return -1;
+	Invert(&d, &d);
+	Mul(&n, &n, &d);
+	ToBytes(point, &n);
+	return 0;
+}
+
+/**
+ * PTP::Ed25519::X25519: Compute an X25519 shared secret.
+ * Type: static
+ * @scalar: Secret scalar (SCALAR_SIZE bytes).
+ * @point: Peer point (SCALAR_SIZE bytes), or NULL for the base point.
+ * @shared: [$OUT] Shared secret or public point (SCALAR_SIZE bytes).
+ * Returns: 0 on success or -1 if the result is zero (@point has small
+ *          order).
+ * Example:
+ *	BYTE scalar[PTP::Ed25519::SCALAR_SIZE];
+ *	BYTE point[PTP::Ed25519::SCALAR_SIZE];
+ *	PTP::Ed25519::GetScalar(seed, scalar);
+ *	$Method(scalar, NULL, point);
+ */
+int
+PTP::Ed25519::X25519(const BYTE *scalar, const BYTE *point, BYTE *shared)
+{
+	BYTE k[32];
+	memcpy(k, scalar, 32);
+	k[0] &= 248;
+	k[31] &= 127;
+	k[31] |= 64;
+
+	Field x1, x2, z2, x3, z3, a, aa, b, bb, e, c, d, da, cb;
+	FromBytes(&x1, point ? point:s_base25519);
+	memset(&x2, 0, sizeof(x2));
+	x2.v[0] = 1;
+	memset(&z2, 0, sizeof(z2));
+	x3 = x1;
+	z3 = x2;
+
+	// Montgomery ladder (RFC 7748 section 5)
+	Limb swap = 0;
+	for (int t = 254; t >= 0; t--)
+	{
+		Limb bit = (k[t >> 3] >> (t & 7)) & 1;
+		swap ^= bit;
+		Swap(&x2, &x3, swap);
+		Swap(&z2, &z3, swap);
+		swap = bit;
+
+		Add(&a, &x2, &z2);
+		Mul(&aa, &a, &a);
+		Sub(&b, &x2, &z2);
+		Mul(&bb, &b, &b);
+		Sub(&e, &aa, &bb);
+		Add(&c, &x3, &z3);
+		Sub(&d, &x3, &z3);
+		Mul(&da, &d, &a);
+		Mul(&cb, &c, &b);
+		Add(&x3, &da, &cb);
+		Mul(&x3, &x3, &x3);
+		Sub(&z3, &da, &cb);
+		Mul(&z3, &z3, &z3);
+		Mul(&z3, &z3, &x1);
+		Mul(&x2, &aa, &bb);
+		MulSmall(&z2, &e, 121665);
+		Add(&z2, &z2, &aa);
+		Mul(&z2, &z2, &e);
+	}
+	Swap(&x2, &x3, swap);
+	Swap(&z2, &z3, swap);
+
+	Invert(&z2, &z2);
+	Mul(&x2, &x2, &z2);
+	ToBytes(shared, &x2);
+	memset(k, 0, sizeof(k));
+
+	BYTE x = 0;
+	for (int i = 0; i < 32; i++)
+		x |= shared[i];
+	return x ? 0:-1;
+}
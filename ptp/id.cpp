@@ -38,8 +38,12 @@
 #include <string.h>
 #include <time.h>
 #include <ptp/id.h>
+#include <ptp/rand.h>
 #include <ptp/debug.h>
 
+// Ed25519 algorithm identifier (RFC 8410)
+#define ED25519_OID "1.3.101.112"
+
 /*
  * CryptoInit: Initialize the OpenSSL library.
  */
@@ -48,8 +52,15 @@ class CryptoInit
 public:
 	CryptoInit();
 	~CryptoInit();
+
+	static void Lock(int mode, int type, const char *file, int line);
+	static unsigned long GetThreadId();
 };
 
+// OpenSSL locks (the random number generator, error queues, ...) are
+// shared by every thread doing crypto, including background key
+// generation
+static PTP::Mutex s_cryptoLocks[CRYPTO_NUM_LOCKS];
 static CryptoInit s_crypto;
 
 /*
@@ -58,6 +69,8 @@ static CryptoInit s_crypto;
 CryptoInit::CryptoInit()
 {
 	CRYPTO_malloc_init();
+	CRYPTO_set_id_callback(GetThreadId);
+	CRYPTO_set_locking_callback(Lock);
 	OpenSSL_add_all_algorithms();
 }
 
@@ -69,47 +82,404 @@ CryptoInit::~CryptoInit()
 	ERR_remove_state(0);
 	EVP_cleanup();
 	ERR_free_strings();
+	CRYPTO_set_locking_callback(NULL);
+	CRYPTO_set_id_callback(NULL);
+}
+
+/*
+ * CryptoInit::Lock: Lock or unlock an OpenSSL lock.
+ * Type: static
+ * @mode: CRYPTO_LOCK to lock or CRYPTO_UNLOCK to unlock.
+ * @type: Lock number.
+ * @file: Source file name.
+ * @line: Source line number.
+ */
+void
+CryptoInit::Lock(int mode, int type, const char *file, int line)
+{
+	if (type < 0 || type >= CRYPTO_NUM_LOCKS)
+		return;
+	if (mode & CRYPTO_LOCK)
+		s_cryptoLocks[type].Lock();
+	else
+		s_cryptoLocks[type].Unlock();
+}
+
+/*
+ * CryptoInit::GetThreadId
+ * Type: static
+ * Returns: Identifier of the calling thread.
+ */
+unsigned long
+CryptoInit::GetThreadId()
+{
+#ifdef WIN32
+	return (unsigned long) GetCurrentThreadId();
+#else
+	return (unsigned long) pthread_self();
+#endif
+}
+
+/*
+ * IsEd25519: Check for the Ed25519 algorithm identifier.
+ * @algor: Algorithm identifier.
+ * Returns: 1 if @algor is Ed25519 or 0 otherwise.
+ */
+static int
+IsEd25519(const X509_ALGOR *algor)
+{
+	char oid[32];
+	if (!algor || !algor->algorithm
+	    || OBJ_obj2txt(oid, sizeof(oid), algor->algorithm, 1) <= 0)
+		return 0;
+	return (strcmp(oid, ED25519_OID) == 0);
+}
+
+/*
+ * SetEd25519: Set an algorithm identifier to Ed25519.
+ * @algor: Algorithm identifier.
+ * Returns: 0 on success or -1 on error.
+ */
+static int
+SetEd25519(X509_ALGOR *algor)
+{
+	ASN1_OBJECT *obj = OBJ_txt2obj(ED25519_OID, 1);
+	if (!obj)
+		return -1;
+	ASN1_OBJECT_free(algor->algorithm);
+	algor->algorithm = obj;
+
+	// RFC 8410 requires the parameters to be absent
+	ASN1_TYPE_free(algor->parameter);
+	algor->parameter = NULL;
+	return 0;
+}
+
+/*
+ * SetBits: Set bit string data (with no unused bits).
+ * @str: Bit string.
+ * @data: Data.
+ * @size: Data size.
+ * Returns: 0 on success or -1 on error.
+ */
+static int
+SetBits(ASN1_BIT_STRING *str, const BYTE *data, int size)
+{
+	if (!ASN1_BIT_STRING_set(str, (BYTE*) data, size))
+		return -1;
+
+	// keep trailing zero bits when encoding
+	str->flags &= ~0x07;
+	str->flags |= ASN1_STRING_FLAG_BITS_LEFT;
+	return 0;
+}
+
+/*
+ * PTP::Identity::Request: Queued asynchronous operation.
+ */
+class PTP::Identity::Request:public PTP::List::Entry
+{
+public:
+	enum Op {ENCRYPT, DECRYPT, VERIFY, SIGN};
+
+	Request(Op op,
+		const BYTE *src,
+		int size,
+		BYTE *dst,
+		const BYTE *sign,
+		Callback callback,
+		void *context)
+		:m_op(op), m_src(src), m_size(size), m_dst(dst), m_sign(sign),
+		 m_callback(callback), m_context(context) {}
+
+	Op m_op;
+	const BYTE *m_src;
+	int m_size;
+	BYTE *m_dst;
+	const BYTE *m_sign;
+	Callback m_callback;
+	void *m_context;
+};
+
+/*
+ * PTP::Identity::KeyReserve: RSA key pairs generated in the background.
+ */
+class PTP::Identity::KeyReserve
+{
+public:
+	KeyReserve();
+	~KeyReserve();
+
+	void Resize(int size, int lowWater);
+	RSA *Take();
+	int GetCount();
+
+protected:
+	void Fill();
+
+	static void Generate(void *arg);
+
+	PTP::Mutex m_mutex;
+	RSA **m_keys;
+	int m_count;
+	int m_size;
+	int m_lowWater;
+	int m_pending;
+	int m_stop;
+	PTP::ThreadPool *m_pool;
+};
+
+/*
+ * PTP::Identity::KeyReserve::KeyReserve: Class constructor.
+ * Notes: Keys are not generated until the reserve is first used.
+ */
+PTP::Identity::KeyReserve::KeyReserve()
+	:m_keys(new RSA*[KEY_RESERVE_SIZE]), m_count(0),
+	 m_size(KEY_RESERVE_SIZE), m_lowWater(KEY_RESERVE_LOW_WATER),
+	 m_pending(0), m_stop(0), m_pool(NULL)
+{
+}
+
+/*
+ * PTP::Identity::KeyReserve::~KeyReserve: Class destructor.
+ * Notes: Waits for keys being generated, but not for queued ones.
+ */
+PTP::Identity::KeyReserve::~KeyReserve()
+{
+	m_mutex.Lock();
+	m_stop = 1;
+	m_mutex.Unlock();
+	delete m_pool;
+
+	for (int i = 0; i < m_count; i++)
+		RSA_free(m_keys[i]);
+	delete [] m_keys;
+}
+
+/*
+ * PTP::Identity::KeyReserve::Resize: Change the reserve size.
+ * @size: Number of keys to keep.
+ * @lowWater: Number of keys below which the reserve is refilled.
+ */
+void
+PTP::Identity::KeyReserve::Resize(int size, int lowWater)
+{
+	if (size < 0)
+		size = 0;
+	if (lowWater > size)
+		lowWater = size;
+
+	m_mutex.Lock();
+	RSA **keys = new RSA*[size ? size:1];
+	int count = 0;
+	for (int i = 0; i < m_count; i++)
+	{
+		if (count < size)
+			keys[count++] = m_keys[i];
+		else
+			RSA_free(m_keys[i]);
+	}
+	delete [] m_keys;
+	m_keys = keys;
+	m_count = count;
+	m_size = size;
+	m_lowWater = lowWater;
+	Fill();
+	m_mutex.Unlock();
+}
+
+/*
+ * PTP::Identity::KeyReserve::Take: Take a key from the reserve.
+ * Returns: Key pair or NULL if the reserve is empty.
+ */
+RSA *
+PTP::Identity::KeyReserve::Take()
+{
+	RSA *rsa = NULL;
+	m_mutex.Lock();
+	if (m_count > 0)
+		rsa = m_keys[--m_count];
+	Fill();
+	m_mutex.Unlock();
+	return rsa;
+}
+
+/*
+ * PTP::Identity::KeyReserve::GetCount
+ * Returns: Number of keys in the reserve.
+ */
+int
+PTP::Identity::KeyReserve::GetCount()
+{
+	m_mutex.Lock();
+	int count = m_count;
+	m_mutex.Unlock();
+	return count;
+}
+
+/*
+ * PTP::Identity::KeyReserve::Fill: Queue key generation if the reserve
+ *                                  is below its low-water mark.
+ * Notes: Called with the reserve locked.  Keys are generated one per
+ *        task on idle-priority threads, so a reserve is filled in
+ *        parallel on idle processors without slowing other threads.
+ */
+void
+PTP::Identity::KeyReserve::Fill()
+{
+	if (m_stop || m_count >= m_lowWater)
+		return;
+	if (!m_pool)
+		m_pool = new PTP::ThreadPool(0, CRYPTO_QUEUE_SIZE, 0, 1);
+
+	while (m_count + m_pending < m_size)
+	{
+		if (m_pool->Submit(Generate, this) < 0)
+			break;
+		m_pending++;
+	}
+}
+
+/*
+ * PTP::Identity::KeyReserve::Generate: Generate one key pair.
+ * Type: static
+ * @arg: Key reserve.
+ */
+void
+PTP::Identity::KeyReserve::Generate(void *arg)
+{
+	KeyReserve *reserve = (KeyReserve*) arg;
+	reserve->m_mutex.Lock();
+	int skip = reserve->m_stop
+		|| (reserve->m_count + reserve->m_pending > reserve->m_size);
+	if (skip)
+		reserve->m_pending--;
+	reserve->m_mutex.Unlock();
+	if (skip)
+		return;
+
+	RSA *rsa = RSA_generate_key(KEY_SIZE << 3, KEY_EXPONENT, NULL, NULL);
+
+	reserve->m_mutex.Lock();
+	reserve->m_pending--;
+	if (rsa && !reserve->m_stop && reserve->m_count < reserve->m_size)
+	{
+		reserve->m_keys[reserve->m_count++] = rsa;
+		rsa = NULL;
+	}
+	reserve->m_mutex.Unlock();
+	RSA_free(rsa);
+
+	// pool threads outlive the task; release their OpenSSL error state
+	ERR_remove_state(0);
 }
 
 /**
  * PTP::Identity::Identity: Class constructor.
  * @name: Subject common name or NULL.
+ * @type: Key type (%RSA_KEY or %ED25519_KEY).
+ * Notes: A new key pair is created for the identity.  Creating an
+ *        %RSA_KEY searches for primes and takes much longer than
+ *        creating an %ED25519_KEY.
  * Example:
  *   PTP::Identity john("John Doe");
+ *   PTP::Identity jane("Jane Doe", PTP::Identity::ED25519_KEY);
  */
-PTP::Identity::Identity(const char *name)
+PTP::Identity::Identity(const char *name, KeyType type)
 	:PTP::List::Entry(),
 	 m_cert(NULL), m_key(NULL),
-	 m_name(NULL), m_issuerName(NULL)
+	 m_name(NULL), m_issuerName(NULL),
+	 m_type(RSA_KEY), m_public(NULL), m_seed(NULL), m_private(NULL),
+	 m_requests(new Requests)
+{
+	Init(name, type, NULL);
+}
+
+/*
+ * PTP::Identity::Identity: Class constructor.
+ * @name: Subject common name or NULL.
+ * @type: Key type (%RSA_KEY or %ED25519_KEY).
+ * @rsa: Pre-generated %RSA_KEY key pair (adopted) or NULL.
+ */
+PTP::Identity::Identity(const char *name, KeyType type, RSA *rsa)
+	:PTP::List::Entry(),
+	 m_cert(NULL), m_key(NULL),
+	 m_name(NULL), m_issuerName(NULL),
+	 m_type(RSA_KEY), m_public(NULL), m_seed(NULL), m_private(NULL),
+	 m_requests(new Requests)
+{
+	Init(name, type, rsa);
+}
+
+/*
+ * PTP::Identity::Init: Create a key pair and self-signed certificate.
+ * @name: Subject common name or NULL.
+ * @type: Key type (%RSA_KEY or %ED25519_KEY).
+ * @rsa: Pre-generated %RSA_KEY key pair (adopted) or NULL to generate
+ *       one.
+ */
+void
+PTP::Identity::Init(const char *name, KeyType type, RSA *rsa)
 {
 	if (!name)
 		name = "*Unknown*";
 
 	X509 *cert = X509_new();
 	if (!cert)
+	{
+		RSA_free(rsa);
 		return;
+	}
 
 	X509_set_version(cert, 2);
 	ASN1_INTEGER_set(X509_get_serialNumber(cert), 25L);
 
-	EVP_PKEY *key = EVP_PKEY_new();
-	if (!key)
+	if (type == ED25519_KEY)
 	{
-		X509_free(cert);
-		return;
+		RSA_free(rsa);
+		BYTE *seed = new BYTE[PTP::Ed25519::SEED_SIZE];
+		PTP::Random::Fill(seed, PTP::Ed25519::SEED_SIZE);
+		BYTE key[PTP::Ed25519::KEY_SIZE];
+		PTP::Ed25519::CreateKey(seed, key);
+
+		X509_PUBKEY *pub = X509_get_X509_PUBKEY(cert);
+		if (SetEd25519(pub->algor) < 0
+		    || SetBits(pub->public_key, key, sizeof(key)) < 0)
+		{
+			memset(seed, 0, PTP::Ed25519::SEED_SIZE);
+			delete [] seed;
+			X509_free(cert);
+			return;
+		}
+		m_seed = seed;
 	}
-	RSA *rsa = RSA_generate_key(KEY_SIZE << 3, KEY_EXPONENT, NULL, NULL);
-	if (!rsa)
+	else
 	{
-		EVP_PKEY_free(key);
-		X509_free(cert);
-		return;
+		EVP_PKEY *key = EVP_PKEY_new();
+		if (!key)
+		{
+			RSA_free(rsa);
+			X509_free(cert);
+			return;
+		}
+		if (!rsa)
+		{
+			rsa = RSA_generate_key(
+				KEY_SIZE << 3, KEY_EXPONENT, NULL, NULL);
+		}
+		if (!rsa)
+		{
+			EVP_PKEY_free(key);
+			X509_free(cert);
+			return;
+		}
+		EVP_PKEY_assign_RSA(key, rsa);
+		X509_set_pubkey(cert, key);
+		m_key = key;
 	}
-	EVP_PKEY_assign_RSA(key, rsa);
-	X509_set_pubkey(cert, key);
 
 	m_cert = cert;
-	m_key = key;
+	Decode();
 	SetName(COMMON_NAME, name);
 	m_name = GetName(COMMON_NAME);
 
@@ -124,7 +494,9 @@ PTP::Identity::Identity(const char *name)
 PTP::Identity::Identity(const Identity& ident)
 	:PTP::List::Entry(),
 	 m_cert(NULL), m_key(NULL),
-	 m_name(NULL), m_issuerName(NULL)
+	 m_name(NULL), m_issuerName(NULL),
+	 m_type(RSA_KEY), m_public(NULL), m_seed(NULL), m_private(NULL),
+	 m_requests(new Requests)
 {
 	*this = ident;
 }
@@ -138,7 +510,7 @@ PTP::Identity::operator=(const Identity& ident)
 {
 	delete [] m_issuerName;
 	delete [] m_name;
-	EVP_PKEY_free(m_key);
+	DestroyKey();
 	X509_free(m_cert);
 
 	m_cert = X509_dup(ident.m_cert);
@@ -148,6 +520,12 @@ PTP::Identity::operator=(const Identity& ident)
 		m_key = EVP_PKEY_new();
 		EVP_PKEY_assign_RSA(m_key, rsa);
 	}
+	if (ident.m_seed)
+	{
+		m_seed = new BYTE[PTP::Ed25519::SEED_SIZE];
+		memcpy(m_seed, ident.m_seed, PTP::Ed25519::SEED_SIZE);
+	}
+	Decode();
 	m_name = GetName(COMMON_NAME);
 	m_issuerName = GetIssuerName(COMMON_NAME);
 	
@@ -158,20 +536,42 @@ PTP::Identity::operator=(const Identity& ident)
  * PTP::Identity::Identity: Class constructor.
  */
 PTP::Identity::Identity(X509 *cert, EVP_PKEY *key)
-	:PTP::List::Entry(), m_cert(cert), m_key(key)
+	:PTP::List::Entry(), m_cert(cert), m_key(key),
+	 m_type(RSA_KEY), m_public(NULL), m_seed(NULL), m_private(NULL),
+	 m_requests(new Requests)
 {
+	Decode();
 	m_name = GetName(COMMON_NAME);
 	m_issuerName = GetIssuerName(COMMON_NAME);
 }
 
 /**
  * PTP::Identity::~Identity: Class destructor.
+ * Notes: Queued asynchronous operations are run on the calling thread
+ *        and running ones are waited for, so the identity must not be
+ *        destroyed from an operation's callback.
  */
 PTP::Identity::~Identity()
 {
+	// drain queued operations, then wait for tasks still running one
+	PTP::List *list = &m_requests->list;
+	list->Lock();
+	m_requests->tasks++;
+	list->Unlock();
+	Task((void*) this);
+
+	list->Lock();
+	int wait = (m_requests->tasks > 0);
+	m_requests->waiting = wait;
+	list->Unlock();
+	if (wait)
+		m_requests->idle.Wait();
+
 	delete [] m_issuerName;
 	delete [] m_name;
-	EVP_PKEY_free(m_key);
+	delete m_requests;
+	DestroyKey();
+	RSA_free(m_public);
 	X509_free(m_cert);
 }
 
@@ -247,6 +647,8 @@ PTP::Identity::SetName(int nid, const char *value)
  * PTP::Identity::GetKey: Retrieve public key (RSA) modulus.
  * @data: [$OUT] Key modulus (%KEY_SIZE bytes).
  * Returns: %KEY_SIZE on success or -1 on error.
+ * Notes: For an %ED25519_KEY identity, the Ed25519 public key is
+ *        returned right-aligned (zero-padded) in %KEY_SIZE bytes.
  * Example:
  *   PTP::Identity *id = ...;
  *   BYTE modulus[PTP::Identity::KEY_SIZE];
@@ -255,16 +657,60 @@ PTP::Identity::SetName(int nid, const char *value)
 int
 PTP::Identity::GetKey(BYTE *data) const
 {
-	if (!m_cert)
-		return -1;
-	RSA *key = EVP_PKEY_get1_RSA(X509_get_pubkey(m_cert));
-	if (!key)
+	if (!m_public && m_type != ED25519_KEY)
 		return -1;
 	if (data)
-		BN_bn2bin(key->n, data);
+		memcpy(data, m_modulus, KEY_SIZE);
 	return KEY_SIZE;
 }
 
+/**
+ * PTP::Identity::GetFingerprint: Retrieve public key fingerprint.
+ * @data: [$OUT] Key fingerprint (%FINGERPRINT_SIZE bytes).
+ * Returns: %FINGERPRINT_SIZE on success or -1 on error.
+ * Notes: The fingerprint is the SHA-1 digest of the &GetKey modulus.
+ *        It is a compact identifier for comparing and indexing peers.
+ * Example:
+ *   PTP::Identity *id = ...;
+ *   BYTE fingerprint[PTP::Identity::FINGERPRINT_SIZE];
+ *   id->$GetFingerprint(fingerprint);
+ */
+int
+PTP::Identity::GetFingerprint(BYTE *data) const
+{
+	if (!m_public && m_type != ED25519_KEY)
+		return -1;
+	if (data)
+		memcpy(data, m_fingerprint, FINGERPRINT_SIZE);
+	return FINGERPRINT_SIZE;
+}
+
+/**
+ * PTP::Identity::GetKeyType
+ * Returns: Public key algorithm (%RSA_KEY or %ED25519_KEY).
+ */
+PTP::Identity::KeyType
+PTP::Identity::GetKeyType() const
+{
+	return m_type;
+}
+
+/**
+ * PTP::Identity::GetPlaintextSize
+ * Returns: Maximum plaintext size for &Encrypt and &Decrypt
+ *          (%PLAINTEXT_SIZE or %ED25519_PLAINTEXT_SIZE).
+ * Example:
+ *   PTP::Identity *id = ...;
+ *   BYTE nonce[PTP::Identity::PLAINTEXT_SIZE];
+ *   PTP::Random::Fill(nonce, sizeof(nonce));
+ *   id->Encrypt(nonce, id->$GetPlaintextSize(), cipher);
+ */
+int
+PTP::Identity::GetPlaintextSize() const
+{
+	return (m_type == ED25519_KEY) ? ED25519_PLAINTEXT_SIZE:PLAINTEXT_SIZE;
+}
+
 /**
  * PTP::Identity::GetIssuerName: Get certificate issuer name element.
  * @nid: Element identifier (%COMMON_NAME, %EMAIL_ADDRESS, ...).
@@ -347,7 +793,7 @@ PTP::Identity::GetExpiration() const
 /**
  * PTP::Identity::Encrypt: Encrypt data with public key.
  * @plain: Plaintext data.
- * @size: Plaintext size (%PLAINTEXT_SIZE bytes or less).
+ * @size: Plaintext size (&GetPlaintextSize bytes or less).
  * @cipher: [$OUT] Ciphertext data (%CIPHERTEXT_SIZE bytes) or NULL.
  * Returns: %CIPHERTEXT_SIZE on success or -1 on error.
  * Example:
@@ -359,9 +805,10 @@ PTP::Identity::GetExpiration() const
 int
 PTP::Identity::Encrypt(const BYTE *plain, int size, BYTE *cipher) const
 {
-	if (!m_cert)
-		return -1;
-	RSA *key = EVP_PKEY_get1_RSA(X509_get_pubkey(m_cert));
+	if (m_type == ED25519_KEY)
+		return Seal(plain, size, cipher);
+
+	RSA *key = m_public;
 	if (!key || size <= 0 || size > PLAINTEXT_SIZE)
 		return -1;
 
@@ -384,7 +831,7 @@ PTP::Identity::Encrypt(const BYTE *plain, int size, BYTE *cipher) const
 /**
  * PTP::Identity::Decrypt: Decrypt data with $private key.
  * @cipher: Ciphertext data (%CIPHERTEXT_SIZE bytes).
- * @plain: [$OUT] Plaintext (%PLAINTEXT_SIZE bytes or less) or NULL.
+ * @plain: [$OUT] Plaintext (&GetPlaintextSize bytes or less) or NULL.
  * Returns: Plaintext size on success or -1 on error.
  * Example:
  *   PTP::Identity *id = ...;
@@ -395,10 +842,13 @@ PTP::Identity::Encrypt(const BYTE *plain, int size, BYTE *cipher) const
 int
 PTP::Identity::Decrypt(const BYTE *cipher, BYTE *plain) const
 {
-	if (!m_cert || !m_key)
+	if (!m_cert || !HasPrivateKey() || !cipher)
 		return -1;
-	RSA *key = EVP_PKEY_get1_RSA(m_key);
-	if (!key || !cipher)
+	if (m_type == ED25519_KEY)
+		return Open(cipher, plain);
+
+	RSA *key = GetPrivateKey();
+	if (!key)
 		return -1;
 
 	int plainsize = PLAINTEXT_SIZE;
@@ -416,6 +866,7 @@ PTP::Identity::Decrypt(const BYTE *cipher, BYTE *plain) const
 		if (plainsize <= 0)
 			plainsize = -1;
 	}
+	PutPrivateKey(key);
 	return plainsize;
 }
 
@@ -436,9 +887,27 @@ PTP::Identity::Decrypt(const BYTE *cipher, BYTE *plain) const
 int
 PTP::Identity::Verify(const BYTE *data, int size, const BYTE *sign) const
 {
-	if (!m_cert)
-		return -1;
-	RSA *key = EVP_PKEY_get1_RSA(X509_get_pubkey(m_cert));
+	if (m_type == ED25519_KEY)
+	{
+		if (!data || size <= 0 || !sign)
+			return -1;
+
+		// the rest of the signature must be zero padding
+		BYTE pad = 0;
+		for (int i = PTP::Ed25519::SIGNATURE_SIZE;
+		     i < SIGNATURE_SIZE;
+		     i++)
+			pad |= sign[i];
+		if (pad)
+			return -1;
+		return PTP::Ed25519::Verify(m_modulus + KEY_SIZE
+					    - PTP::Ed25519::KEY_SIZE,
+					    data,
+					    size,
+					    sign);
+	}
+
+	RSA *key = m_public;
 	if (!key || !data || size <= 0 || !sign)
 		return -1;
 
@@ -475,10 +944,27 @@ PTP::Identity::Verify(const BYTE *data, int size, const BYTE *sign) const
 int
 PTP::Identity::Sign(const BYTE *data, int size, BYTE *sign) const
 {
-	if (!m_cert || !m_key)
+	if (!m_cert || !HasPrivateKey() || !data || size <= 0)
 		return -1;
-	RSA *key = EVP_PKEY_get1_RSA(m_key);
-	if (!key || !data || size <= 0)
+	if (m_type == ED25519_KEY)
+	{
+		if (sign)
+		{
+			PTP::Ed25519::Sign(m_seed,
+					   m_modulus + KEY_SIZE
+					   - PTP::Ed25519::KEY_SIZE,
+					   data,
+					   size,
+					   sign);
+			memset(sign + PTP::Ed25519::SIGNATURE_SIZE,
+			       0,
+			       SIGNATURE_SIZE - PTP::Ed25519::SIGNATURE_SIZE);
+		}
+		return SIGNATURE_SIZE;
+	}
+
+	RSA *key = GetPrivateKey();
+	if (!key)
 		return -1;
 
 	int signsize = SIGNATURE_SIZE;
@@ -499,6 +985,7 @@ PTP::Identity::Sign(const BYTE *data, int size, BYTE *sign) const
 			     key) != 1)
 			signsize = -1;
 	}
+	PutPrivateKey(key);
 	return signsize;
 }
 
@@ -518,11 +1005,17 @@ PTP::Identity::Verify(Identity *subj) const
 	if (!m_cert)
 		return -1;
 
+	if (X509_cmp_time(X509_get_notAfter(m_cert), NULL) <= 0)
+		return -1;
+	if (m_type == ED25519_KEY)
+		return VerifyCertificate(subj->m_cert);
 	EVP_PKEY *key = X509_get_pubkey(m_cert);
-	if (!key || X509_cmp_time(X509_get_notAfter(m_cert), NULL) <= 0)
+	if (!key)
 		return -1;
 
-	return ((X509_verify(subj->m_cert, key) == 1) ? 0:-1);
+	int valid = X509_verify(subj->m_cert, key);
+	EVP_PKEY_free(key);
+	return ((valid == 1) ? 0:-1);
 }
 
 /**
@@ -538,7 +1031,7 @@ PTP::Identity::Verify(Identity *subj) const
 int
 PTP::Identity::Sign(Identity *subj, unsigned expire) const
 {
-	if (!m_cert || !m_key)
+	if (!m_cert || !HasPrivateKey())
 		return -1;
 
 	// remove any existing signature
@@ -577,11 +1070,177 @@ PTP::Identity::Sign(Identity *subj, unsigned expire) const
 		X509_EXTENSION_free(ext);
 	}
 
+	if (m_type == ED25519_KEY)
+		return SignCertificate(subj->m_cert);
 	X509_sign(subj->m_cert, m_key, PTP_DIGEST);
 
 	return 0;
 }
 
+/**
+ * PTP::Identity::Encrypt: Encrypt data with public key on a thread pool.
+ * @plain: Plaintext data.
+ * @size: Plaintext size (&GetPlaintextSize bytes or less).
+ * @cipher: [$OUT] Ciphertext data (%CIPHERTEXT_SIZE bytes) or NULL.
+ * @callback: Function called with the result of &Encrypt.
+ * @context: Context passed to @callback.
+ * @pool: Thread pool to encrypt on (see &GetCryptoPool).
+ * Returns: 0 on success or -1 on error.
+ * Notes: @plain and @cipher must remain valid, and the identity must
+ *        not be changed or destroyed, until @callback is called.
+ *        Operations queued on the same identity are run in batches.
+ *        If @pool is NULL or full, the operation runs on the calling
+ *        thread.
+ * Example:
+ *   static void
+ *   Encrypted(const PTP::Identity *id, int size, void *context)
+ *   {
+ *     ...
+ *   }
+ *
+ *   id->$Encrypt(plain, sizeof(plain), cipher, Encrypted, NULL,
+ *               PTP::Identity::GetCryptoPool());
+ */
+int
+PTP::Identity::Encrypt(const BYTE *plain,
+		       int size,
+		       BYTE *cipher,
+		       Callback callback,
+		       void *context,
+		       PTP::ThreadPool *pool) const
+{
+	if (!callback)
+		return -1;
+	return Submit(new Request(Request::ENCRYPT,
+				  plain,
+				  size,
+				  cipher,
+				  NULL,
+				  callback,
+				  context),
+		      pool);
+}
+
+/**
+ * PTP::Identity::Decrypt: Decrypt data with $private key on a thread
+ *                         pool.
+ * @cipher: Ciphertext data (%CIPHERTEXT_SIZE bytes).
+ * @plain: [$OUT] Plaintext (&GetPlaintextSize bytes or less) or NULL.
+ * @callback: Function called with the result of &Decrypt.
+ * @context: Context passed to @callback.
+ * @pool: Thread pool to decrypt on (see &GetCryptoPool).
+ * Returns: 0 on success or -1 on error.
+ * Notes: See the asynchronous &Encrypt.
+ * Example:
+ *   static void
+ *   Decrypted(const PTP::Identity *id, int size, void *context)
+ *   {
+ *     ...
+ *   }
+ *
+ *   id->$Decrypt(cipher, plain, Decrypted, NULL,
+ *               PTP::Identity::GetCryptoPool());
+ */
+int
+PTP::Identity::Decrypt(const BYTE *cipher,
+		       BYTE *plain,
+		       Callback callback,
+		       void *context,
+		       PTP::ThreadPool *pool) const
+{
+	if (!callback)
+		return -1;
+	return Submit(new Request(Request::DECRYPT,
+				  cipher,
+				  0,
+				  plain,
+				  NULL,
+				  callback,
+				  context),
+		      pool);
+}
+
+/**
+ * PTP::Identity::Verify: Check digitally signed data on a thread pool.
+ * @data: Signed data.
+ * @size: Data size (!not including the signature).
+ * @sign: Signature data (%SIGNATURE_SIZE bytes).
+ * @callback: Function called with the result of &Verify.
+ * @context: Context passed to @callback.
+ * @pool: Thread pool to verify on (see &GetCryptoPool).
+ * Returns: 0 on success or -1 on error.
+ * Notes: See the asynchronous &Encrypt.
+ * Example:
+ *   static void
+ *   Verified(const PTP::Identity *id, int invalid, void *context)
+ *   {
+ *     ...
+ *   }
+ *
+ *   id->$Verify(data, datasize, data + datasize, Verified, NULL,
+ *              PTP::Identity::GetCryptoPool());
+ */
+int
+PTP::Identity::Verify(const BYTE *data,
+		      int size,
+		      const BYTE *sign,
+		      Callback callback,
+		      void *context,
+		      PTP::ThreadPool *pool) const
+{
+	if (!callback)
+		return -1;
+	return Submit(new Request(Request::VERIFY,
+				  data,
+				  size,
+				  NULL,
+				  sign,
+				  callback,
+				  context),
+		      pool);
+}
+
+/**
+ * PTP::Identity::Sign: Digitally sign data with $private key on a
+ *                      thread pool.
+ * @data: Data buffer.
+ * @size: Buffer size.
+ * @sign: [$OUT] Signature data (%SIGNATURE_SIZE bytes).
+ * @callback: Function called with the result of &Sign.
+ * @context: Context passed to @callback.
+ * @pool: Thread pool to sign on (see &GetCryptoPool).
+ * Returns: 0 on success or -1 on error.
+ * Notes: See the asynchronous &Encrypt.
+ * Example:
+ *   static void
+ *   Signed(const PTP::Identity *id, int size, void *context)
+ *   {
+ *     ...
+ *   }
+ *
+ *   id->$Sign(data, sizeof(data), sign, Signed, NULL,
+ *            PTP::Identity::GetCryptoPool());
+ */
+int
+PTP::Identity::Sign(const BYTE *data,
+		    int size,
+		    BYTE *sign,
+		    Callback callback,
+		    void *context,
+		    PTP::ThreadPool *pool) const
+{
+	if (!callback)
+		return -1;
+	return Submit(new Request(Request::SIGN,
+				  data,
+				  size,
+				  sign,
+				  NULL,
+				  callback,
+				  context),
+		      pool);
+}
+
 /**
  * PTP::Identity::ExportKey: Encrypt and export a session key.
  * @key: Session key.
@@ -646,12 +1305,667 @@ PTP::Identity::Show() const
 	BIO_free(out);
 }
 
+/**
+ * PTP::Identity::GetCryptoPool
+ * Type: static
+ * Returns: Thread pool for asynchronous identity operations.
+ * Notes: The pool has one worker per processor, each bound to its own
+ *        processor, so that public key operations do not run on (or
+ *        stall) the threads serving network I/O.
+ */
+PTP::ThreadPool *
+PTP::Identity::GetCryptoPool()
+{
+	// created on first use so it is destroyed before the debug heap
+	static PTP::ThreadPool s_pool(0, CRYPTO_QUEUE_SIZE, 1);
+	return &s_pool;
+}
+
+/**
+ * PTP::Identity::Create: Create an identity with a new key pair.
+ * Type: static
+ * @name: Subject common name or NULL.
+ * @type: Key type (%RSA_KEY or %ED25519_KEY).
+ * Returns: Identity on success or NULL on error.
+ * Notes: Unlike the constructor, an %RSA_KEY identity takes a key
+ *        pair generated in the background (see &ReserveKeys), and
+ *        only generates one on the calling thread if the reserve is
+ *        empty.  It is the caller's responsibility to delete the
+ *        returned identity.
+ * Example:
+ *   PTP::Identity *john = $PTP::Identity::Create("John Doe");
+ *   ...
+ *   delete john;
+ */
+PTP::Identity *
+PTP::Identity::Create(const char *name, KeyType type)
+{
+	RSA *rsa = NULL;
+	if (type == RSA_KEY)
+		rsa = GetKeyReserve()->Take();
+
+	Identity *ident = new Identity(name, type, rsa);
+	if (!ident->m_cert)
+	{
+		delete ident;
+		return NULL;
+	}
+	return ident;
+}
+
+/**
+ * PTP::Identity::ReserveKeys: Set the number of RSA key pairs kept
+ *                             generated in the background for &Create.
+ * Type: static
+ * @size: Number of key pairs to keep (0 to keep none).
+ * @lowWater: Number of key pairs below which the reserve is refilled
+ *            (up to @size).
+ * Notes: Key pairs are generated on idle-priority threads, one per
+ *        processor, so they use only otherwise idle processors.  The
+ *        reserve starts filling when it is first used (%KEY_RESERVE_SIZE
+ *        key pairs refilled below %KEY_RESERVE_LOW_WATER by default) or
+ *        when this is called.  Before creating many identities, reserve
+ *        that many key pairs so that they are generated in parallel.
+ * Example:
+ *   PTP::Identity::$ReserveKeys(count, count);
+ *   for (int i = 0; i < count; i++)
+ *       ids[i] = PTP::Identity::Create(names[i]);
+ */
+void
+PTP::Identity::ReserveKeys(int size, int lowWater)
+{
+	GetKeyReserve()->Resize(size, lowWater);
+}
+
+/**
+ * PTP::Identity::GetReservedKeys
+ * Type: static
+ * Returns: Number of RSA key pairs ready for &Create.
+ */
+int
+PTP::Identity::GetReservedKeys()
+{
+	return GetKeyReserve()->GetCount();
+}
+
+/*
+ * PTP::Identity::GetKeyReserve
+ * Type: static
+ * Returns: RSA key reserve for &Create.
+ */
+PTP::Identity::KeyReserve *
+PTP::Identity::GetKeyReserve()
+{
+	// created on first use so it is destroyed before the debug heap
+	static KeyReserve s_reserve;
+	return &s_reserve;
+}
+
 /*
  * PTP::Identity::DestroyKey: Destroy the private key.
  */
 void
 PTP::Identity::DestroyKey()
 {
+	DestroyPrivateKeys();
 	EVP_PKEY_free(m_key);
 	m_key = NULL;
+	if (m_seed)
+	{
+		memset(m_seed, 0, PTP::Ed25519::SEED_SIZE);
+		delete [] m_seed;
+		m_seed = NULL;
+	}
+}
+
+/*
+ * PTP::Identity::Decode: Decode the certificate public key once and
+ *                        cache the RSA key, modulus and fingerprint.
+ *                        Prepare the private key, if any.
+ */
+void
+PTP::Identity::Decode()
+{
+	DestroyPrivateKeys();
+	RSA_free(m_public);
+	m_public = NULL;
+	m_type = RSA_KEY;
+	if (!m_cert)
+		return;
+
+	X509_PUBKEY *pub = X509_get_X509_PUBKEY(m_cert);
+	if (pub && IsEd25519(pub->algor))
+	{
+		ASN1_BIT_STRING *bits = pub->public_key;
+		if (!bits || bits->length != PTP::Ed25519::KEY_SIZE)
+			return;
+		BYTE *key = m_modulus + KEY_SIZE - PTP::Ed25519::KEY_SIZE;
+		memset(m_modulus, 0, KEY_SIZE);
+		memcpy(key, bits->data, PTP::Ed25519::KEY_SIZE);
+		if (PTP::Ed25519::ToX25519(key, m_point) < 0)
+			return;
+
+		EVP_MD_CTX digestCtx;
+		EVP_DigestInit(&digestCtx, EVP_sha1());
+		EVP_DigestUpdate(&digestCtx, m_modulus, KEY_SIZE);
+		EVP_DigestFinal(&digestCtx, m_fingerprint, 0);
+		m_type = ED25519_KEY;
+		return;
+	}
+
+	EVP_PKEY *pkey = X509_get_pubkey(m_cert);
+	if (!pkey)
+		return;
+	RSA *key = EVP_PKEY_get1_RSA(pkey);
+	EVP_PKEY_free(pkey);
+	if (!key)
+		return;
+	int size = BN_num_bytes(key->n);
+	if (size > KEY_SIZE)
+	{
+		RSA_free(key);
+		return;
+	}
+
+	// right-align the modulus in KEY_SIZE bytes
+	memset(m_modulus, 0, KEY_SIZE);
+	BN_bn2bin(key->n, m_modulus + KEY_SIZE - size);
+
+	EVP_MD_CTX digestCtx;
+	EVP_DigestInit(&digestCtx, EVP_sha1());
+	EVP_DigestUpdate(&digestCtx, m_modulus, KEY_SIZE);
+	EVP_DigestFinal(&digestCtx, m_fingerprint, 0);
+
+	// OpenSSL creates the Montgomery context on first use without
+	// locking, so set it up before the key is shared between threads
+	BN_CTX *ctx = BN_CTX_new();
+	if (ctx && !key->_method_mod_n)
+	{
+		key->_method_mod_n = BN_MONT_CTX_new();
+		if (key->_method_mod_n
+		    && !BN_MONT_CTX_set(key->_method_mod_n, key->n, ctx))
+		{
+			BN_MONT_CTX_free(key->_method_mod_n);
+			key->_method_mod_n = NULL;
+		}
+	}
+	BN_CTX_free(ctx);
+
+	m_public = key;
+
+	if (m_key)
+	{
+		m_private = new PrivateKeys;
+		m_private->count = 0;
+		PutPrivateKey(GetPrivateKey());
+	}
+}
+
+/*
+ * PTP::Identity::HasPrivateKey
+ * Returns: 1 if the identity has a private key or 0 otherwise.
+ */
+int
+PTP::Identity::HasPrivateKey() const
+{
+	return (m_key || m_seed);
+}
+
+/*
+ * PTP::Identity::Seal: Encrypt data with an Ed25519 public key.
+ * @plain: Plaintext data.
+ * @size: Plaintext size (%ED25519_PLAINTEXT_SIZE bytes or less).
+ * @cipher: [$OUT] Ciphertext data (%CIPHERTEXT_SIZE bytes) or NULL.
+ * Returns: %CIPHERTEXT_SIZE on success or -1 on error.
+ * Notes: The ciphertext is an ephemeral X25519 public key, the
+ *        ChaCha20-Poly1305 tag and the encrypted plaintext size and
+ *        plaintext (zero-padded).  The ChaCha20-Poly1305 key is the
+ *        SHA-512 digest of the shared secret, ephemeral public key
+ *        and recipient public key.  As every message has a new key,
+ *        the nonce is zero.
+ */
+int
+PTP::Identity::Seal(const BYTE *plain, int size, BYTE *cipher) const
+{
+	if (m_type != ED25519_KEY || size <= 0 || size > ED25519_PLAINTEXT_SIZE)
+		return -1;
+	if (!plain || !cipher)
+		return CIPHERTEXT_SIZE;
+
+	enum {POINT_SIZE = PTP::Ed25519::SCALAR_SIZE};
+	BYTE scalar[POINT_SIZE];
+	BYTE secret[3 * POINT_SIZE];
+	PTP::Random::Fill(scalar, sizeof(scalar));
+	if (PTP::Ed25519::X25519(scalar, NULL, secret + POINT_SIZE) < 0
+	    || PTP::Ed25519::X25519(scalar, m_point, secret) < 0)
+	{
+		memset(scalar, 0, sizeof(scalar));
+		return -1;
+	}
+	memcpy(secret + 2 * POINT_SIZE, m_point, POINT_SIZE);
+	BYTE digest[PTP::Ed25519::DIGEST_SIZE];
+	PTP::Ed25519::Digest(secret, sizeof(secret), digest);
+
+	// copy the plaintext first in case plain == cipher
+	BYTE block[CIPHERTEXT_SIZE - POINT_SIZE - PTP::ChaCha::TAG_SIZE];
+	memset(block, 0, sizeof(block));
+	block[0] = (BYTE) size;
+	memcpy(block + 1, plain, size);
+
+	BYTE nonce[PTP::ChaCha::NONCE_SIZE];
+	memset(nonce, 0, sizeof(nonce));
+	PTP::ChaCha chacha(digest, PTP::ChaCha::KEY_SIZE);
+	chacha.Start(nonce);
+	memcpy(cipher, secret + POINT_SIZE, POINT_SIZE);
+	chacha.Encrypt(block,
+		       cipher + POINT_SIZE + PTP::ChaCha::TAG_SIZE,
+		       sizeof(block));
+	chacha.Finish(cipher + POINT_SIZE);
+
+	memset(scalar, 0, sizeof(scalar));
+	memset(secret, 0, sizeof(secret));
+	memset(digest, 0, sizeof(digest));
+	memset(block, 0, sizeof(block));
+	return CIPHERTEXT_SIZE;
+}
+
+/*
+ * PTP::Identity::Open: Decrypt data with an Ed25519 private key.
+ * @cipher: Ciphertext data (%CIPHERTEXT_SIZE bytes).
+ * @plain: [$OUT] Plaintext (%ED25519_PLAINTEXT_SIZE bytes or less) or
+ *         NULL.
+ * Returns: Plaintext size on success or -1 on error.
+ */
+int
+PTP::Identity::Open(const BYTE *cipher, BYTE *plain) const
+{
+	if (!m_seed)
+		return -1;
+	if (!plain)
+		return ED25519_PLAINTEXT_SIZE;
+
+	enum {POINT_SIZE = PTP::Ed25519::SCALAR_SIZE};
+	BYTE scalar[POINT_SIZE];
+	BYTE secret[3 * POINT_SIZE];
+	PTP::Ed25519::GetScalar(m_seed, scalar);
+	int status = PTP::Ed25519::X25519(scalar, cipher, secret);
+	memset(scalar, 0, sizeof(scalar));
+	if (status < 0)
+		return -1;
+	memcpy(secret + POINT_SIZE, cipher, POINT_SIZE);
+	memcpy(secret + 2 * POINT_SIZE, m_point, POINT_SIZE);
+	BYTE digest[PTP::Ed25519::DIGEST_SIZE];
+	PTP::Ed25519::Digest(secret, sizeof(secret), digest);
+	memset(secret, 0, sizeof(secret));
+
+	BYTE block[CIPHERTEXT_SIZE - POINT_SIZE - PTP::ChaCha::TAG_SIZE];
+	BYTE nonce[PTP::ChaCha::NONCE_SIZE];
+	memset(nonce, 0, sizeof(nonce));
+	PTP::ChaCha chacha(digest, PTP::ChaCha::KEY_SIZE);
+	memset(digest, 0, sizeof(digest));
+	chacha.Start(nonce);
+	chacha.Decrypt(cipher + POINT_SIZE + PTP::ChaCha::TAG_SIZE,
+		       block,
+		       sizeof(block));
+
+	int size = block[0];
+	if (chacha.Verify(cipher + POINT_SIZE) < 0
+	    || size <= 0 || size > ED25519_PLAINTEXT_SIZE)
+		size = -1;
+	else
+		memcpy(plain, block + 1, size);
+	memset(block, 0, sizeof(block));
+	return size;
+}
+
+/*
+ * PTP::Identity::SignCertificate: Sign a certificate with an Ed25519
+ *                                 private key.
+ * @cert: Certificate.
+ * Returns: 0 on success or -1 on error.
+ * Notes: OpenSSL has no Ed25519 support, so the certificate is signed
+ *        as X509_sign would: the algorithm identifiers are set and the
+ *        DER encoding of the certificate info is signed.
+ */
+int
+PTP::Identity::SignCertificate(X509 *cert) const
+{
+	if (!m_seed || SetEd25519(cert->cert_info->signature) < 0
+	    || SetEd25519(cert->sig_alg) < 0)
+		return -1;
+
+	int size = i2d_X509_CINF(cert->cert_info, NULL);
+	if (size <= 0)
+		return -1;
+	BYTE *data = new BYTE[size];
+	BYTE *p = data;
+	i2d_X509_CINF(cert->cert_info, &p);
+
+	BYTE sign[PTP::Ed25519::SIGNATURE_SIZE];
+	PTP::Ed25519::Sign(m_seed,
+			   m_modulus + KEY_SIZE - PTP::Ed25519::KEY_SIZE,
+			   data,
+			   size,
+			   sign);
+	delete [] data;
+	return SetBits(cert->signature, sign, sizeof(sign));
+}
+
+/*
+ * PTP::Identity::VerifyCertificate: Check a certificate signed with
+ *                                   &SignCertificate.
+ * @cert: Certificate.
+ * Returns: 0 on valid signature or -1 if invalid.
+ */
+int
+PTP::Identity::VerifyCertificate(X509 *cert) const
+{
+	if (m_type != ED25519_KEY || !IsEd25519(cert->sig_alg)
+	    || !cert->signature
+	    || cert->signature->length != PTP::Ed25519::SIGNATURE_SIZE)
+		return -1;
+
+	int size = i2d_X509_CINF(cert->cert_info, NULL);
+	if (size <= 0)
+		return -1;
+	BYTE *data = new BYTE[size];
+	BYTE *p = data;
+	i2d_X509_CINF(cert->cert_info, &p);
+
+	int valid = PTP::Ed25519::Verify(
+		m_modulus + KEY_SIZE - PTP::Ed25519::KEY_SIZE,
+		data,
+		size,
+		cert->signature->data);
+	delete [] data;
+	return valid;
+}
+
+/*
+ * PTP::Identity::ExportPrivateKey: Encode the private key.
+ * Returns: PKCS#8 private key on success or NULL on error.
+ * Notes: An Ed25519 key is encoded as described in RFC 8410.  It is
+ *        the caller's responsibility to free the returned key.
+ */
+PKCS8_PRIV_KEY_INFO *
+PTP::Identity::ExportPrivateKey() const
+{
+	if (m_key)
+		return EVP_PKEY2PKCS8(m_key);
+	if (!m_seed)
+		return NULL;
+
+	PKCS8_PRIV_KEY_INFO *pkcs8 = PKCS8_PRIV_KEY_INFO_new();
+	if (!pkcs8)
+		return NULL;
+
+	// CurvePrivateKey ::= OCTET STRING
+	BYTE key[2 + PTP::Ed25519::SEED_SIZE];
+	key[0] = V_ASN1_OCTET_STRING;
+	key[1] = PTP::Ed25519::SEED_SIZE;
+	memcpy(key + 2, m_seed, PTP::Ed25519::SEED_SIZE);
+
+	int status = ASN1_INTEGER_set(pkcs8->version, 0);
+	if (status)
+		status = (SetEd25519(pkcs8->pkeyalg) == 0);
+	if (status)
+		status = ASN1_TYPE_set_octetstring(pkcs8->pkey,
+						   key,
+						   sizeof(key));
+	memset(key, 0, sizeof(key));
+	if (!status)
+	{
+		PKCS8_PRIV_KEY_INFO_free(pkcs8);
+		return NULL;
+	}
+	return pkcs8;
+}
+
+/*
+ * PTP::Identity::ImportPrivateKey: Decode the private key.
+ * @pkcs8: PKCS#8 private key.
+ * Returns: 0 on success or -1 on error.
+ * Notes: The key must match the certificate's public key.
+ */
+int
+PTP::Identity::ImportPrivateKey(PKCS8_PRIV_KEY_INFO *pkcs8)
+{
+	if (!pkcs8 || !m_cert)
+		return -1;
+
+	if (m_type != ED25519_KEY)
+	{
+		EVP_PKEY *key = EVP_PKCS82PKEY(pkcs8);
+		if (!key)
+			return -1;
+		DestroyKey();
+		m_key = key;
+		Decode();
+		return 0;
+	}
+
+	if (!IsEd25519(pkcs8->pkeyalg) || !pkcs8->pkey
+	    || pkcs8->pkey->type != V_ASN1_OCTET_STRING)
+		return -1;
+	ASN1_OCTET_STRING *str = pkcs8->pkey->value.octet_string;
+	if (!str || str->length != 2 + PTP::Ed25519::SEED_SIZE
+	    || str->data[0] != V_ASN1_OCTET_STRING
+	    || str->data[1] != PTP::Ed25519::SEED_SIZE)
+		return -1;
+
+	const BYTE *seed = str->data + 2;
+	BYTE key[PTP::Ed25519::KEY_SIZE];
+	PTP::Ed25519::CreateKey(seed, key);
+	if (memcmp(key,
+		   m_modulus + KEY_SIZE - PTP::Ed25519::KEY_SIZE,
+		   sizeof(key)) != 0)
+		return -1;
+
+	DestroyKey();
+	m_seed = new BYTE[PTP::Ed25519::SEED_SIZE];
+	memcpy(m_seed, seed, PTP::Ed25519::SEED_SIZE);
+	return 0;
+}
+
+/*
+ * PTP::Identity::DestroyPrivateKeys: Free the prepared private keys.
+ */
+void
+PTP::Identity::DestroyPrivateKeys()
+{
+	if (!m_private)
+		return;
+	for (int i = 0; i < m_private->count; i++)
+		RSA_free(m_private->keys[i]);
+	delete m_private;
+	m_private = NULL;
+}
+
+/*
+ * PTP::Identity::GetPrivateKey: Take a prepared private key for the
+ *                               exclusive use of the calling thread.
+ * Returns: Private key on success or NULL on error.
+ * Notes: Release the key with &PutPrivateKey.
+ */
+RSA *
+PTP::Identity::GetPrivateKey() const
+{
+	if (!m_private)
+		return NULL;
+
+	RSA *key = NULL;
+	m_private->mutex.Lock();
+	if (m_private->count > 0)
+		key = m_private->keys[--m_private->count];
+	m_private->mutex.Unlock();
+
+	if (!key)
+	{
+		// all prepared keys are busy; prepare another one
+		RSA *rsa = EVP_PKEY_get1_RSA(m_key);
+		if (!rsa)
+			return NULL;
+		key = PrepareKey(rsa);
+		RSA_free(rsa);
+	}
+	return key;
+}
+
+/*
+ * PTP::Identity::PutPrivateKey: Return a key taken with &GetPrivateKey.
+ * @key: Private key or NULL.
+ */
+void
+PTP::Identity::PutPrivateKey(RSA *key) const
+{
+	if (!key)
+		return;
+
+	m_private->mutex.Lock();
+	if (m_private->count < PRIVATE_KEY_COUNT)
+	{
+		m_private->keys[m_private->count++] = key;
+		key = NULL;
+	}
+	m_private->mutex.Unlock();
+	RSA_free(key);
+}
+
+/*
+ * PTP::Identity::PrepareKey: Copy a private key and precompute its
+ *                            Montgomery contexts and blinding factors.
+ * Type: static
+ * @key: Private key.
+ * Returns: Prepared key on success or NULL on error.
+ * Notes: The copy keeps the CRT parameters of @key.  OpenSSL updates
+ *        the blinding factors and caches on every operation without
+ *        locking, so a prepared key must only be used by one thread
+ *        at a time.
+ */
+RSA *
+PTP::Identity::PrepareKey(const RSA *key)
+{
+	if (!key->n || !key->e || !key->d)
+		return NULL;
+
+	RSA *rsa = RSA_new();
+	if (!rsa)
+		return NULL;
+	rsa->n = BN_dup(key->n);
+	rsa->e = BN_dup(key->e);
+	rsa->d = BN_dup(key->d);
+	if (key->p && key->q && key->dmp1 && key->dmq1 && key->iqmp)
+	{
+		rsa->p = BN_dup(key->p);
+		rsa->q = BN_dup(key->q);
+		rsa->dmp1 = BN_dup(key->dmp1);
+		rsa->dmq1 = BN_dup(key->dmq1);
+		rsa->iqmp = BN_dup(key->iqmp);
+	}
+
+	BN_CTX *ctx = BN_CTX_new();
+	int ok = (ctx && rsa->n && rsa->e && rsa->d);
+	BIGNUM *mod[] = {rsa->n, rsa->p, rsa->q};
+	BN_MONT_CTX **mont[] =
+	{
+		&rsa->_method_mod_n,
+		&rsa->_method_mod_p,
+		&rsa->_method_mod_q
+	};
+	for (int i = 0; ok && i < 3 && mod[i]; i++)
+	{
+		*mont[i] = BN_MONT_CTX_new();
+		ok = (*mont[i] && BN_MONT_CTX_set(*mont[i], mod[i], ctx));
+	}
+	if (ok)
+		ok = RSA_blinding_on(rsa, ctx);
+	BN_CTX_free(ctx);
+
+	if (!ok)
+	{
+		RSA_free(rsa);
+		return NULL;
+	}
+	return rsa;
+}
+
+/*
+ * PTP::Identity::Submit: Queue an asynchronous operation.
+ * @request: Operation.
+ * @pool: Thread pool or NULL.
+ * Returns: 0 on success or -1 on error.
+ * Notes: At most one task per pool thread runs the queued operations
+ *        of an identity, so a burst of operations is run in batches
+ *        instead of as one task each.
+ */
+int
+PTP::Identity::Submit(Request *request, PTP::ThreadPool *pool) const
+{
+	PTP::List *list = &m_requests->list;
+	list->Lock();
+	list->Append(request, 0);
+	int start = (!pool || m_requests->tasks < pool->GetThreads());
+	if (start)
+		m_requests->tasks++;
+	list->Unlock();
+
+	if (start && (!pool || pool->Submit(Task, (void*) this)))
+		Task((void*) this);
+	return 0;
+}
+
+/*
+ * PTP::Identity::Task: Run queued asynchronous operations.
+ * Type: static
+ * @arg: Identity.
+ */
+void
+PTP::Identity::Task(void *arg)
+{
+	const Identity *ident = (const Identity*) arg;
+	PTP::List *list = &ident->m_requests->list;
+	for (;;)
+	{
+		list->Lock();
+		Request *request = (Request*) list->GetHead();
+		if (!list->IsValid(request))
+		{
+			int wake = (!--ident->m_requests->tasks
+				    && ident->m_requests->waiting);
+			list->Unlock();
+
+			// the destructor may free the identity once woken
+			if (wake)
+				ident->m_requests->idle.Post();
+			break;
+		}
+		list->Remove(request, 0);
+		list->Unlock();
+
+		int result = -1;
+		switch (request->m_op)
+		{
+		case Request::ENCRYPT:
+			result = ident->Encrypt(request->m_src,
+						request->m_size,
+						request->m_dst);
+			break;
+		case Request::DECRYPT:
+			result = ident->Decrypt(request->m_src,
+						request->m_dst);
+			break;
+		case Request::VERIFY:
+			result = ident->Verify(request->m_src,
+					       request->m_size,
+					       request->m_sign);
+			break;
+		case Request::SIGN:
+			result = ident->Sign(request->m_src,
+					     request->m_size,
+					     request->m_dst);
+			break;
+		}
+		(*request->m_callback)(ident, result, request->m_context);
+		delete request;
+	}
 }
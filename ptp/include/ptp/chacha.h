@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2001 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * 3. Neither the name of the Intel Corporation nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __PTP_CHACHA_H__
+#define __PTP_CHACHA_H__
+
+#include <ptp/ptp.h>
+
+/**
+ * PTP::ChaCha: ChaCha20-Poly1305 authenticated encryption.
+ * Synopsis: #include <ptp/chacha.h>
+ * Notes: Messages are encrypted as described in RFC 7539.  Four
+ *        ChaCha20 blocks are generated at a time with SSE2 where the
+ *        compiler supports it and with portable code otherwise.
+ *        16-byte keys use the original 128-bit ChaCha key setup.
+ */
+class EXPORT PTP::ChaCha
+{
+public:
+	enum
+	{
+		/**
+		 * PTP::ChaCha::KEY_SIZE: Largest key size.
+		 */
+		KEY_SIZE = 32,
+
+		/**
+		 * PTP::ChaCha::NONCE_SIZE: Message nonce size.
+		 */
+		NONCE_SIZE = 12,
+
+		/**
+		 * PTP::ChaCha::TAG_SIZE: Authentication tag size.
+		 */
+		TAG_SIZE = 16
+	};
+
+	ChaCha();
+	ChaCha(const BYTE *key, int keysize = KEY_SIZE);
+	~ChaCha();
+
+	int SetKey(const BYTE *key, int keysize = KEY_SIZE);
+	void Start(const BYTE *nonce, const BYTE *aad = NULL, int aadsize = 0);
+	void Encrypt(const BYTE *src, BYTE *dst, int size);
+	void Decrypt(const BYTE *src, BYTE *dst, int size);
+	void Finish(BYTE *tag);
+	int Verify(const BYTE *tag);
+
+	static int SetSimd(int simd);
+
+protected:
+	typedef unsigned int Word;
+
+	enum
+	{
+		BLOCK_SIZE = 64,
+		BLOCKS = 4,
+		MAC_BLOCK_SIZE = 16,
+		STITCH_SIZE = BLOCKS * BLOCK_SIZE
+	};
+
+	ChaCha(const ChaCha& chacha);
+	ChaCha& operator=(const ChaCha& chacha);
+
+	void Fill();
+	void Xor(const BYTE *src, BYTE *dst, int size);
+	void Mac(const BYTE *data, int size);
+	void MacBlocks(const BYTE *data, int size);
+	void MacPad();
+
+	static void Block(const Word *state, BYTE *out);
+	static void Blocks(const Word *state, BYTE *out);
+
+	// cipher state (constants, key, block counter and nonce)
+	Word m_state[16];
+	BYTE m_stream[BLOCKS * BLOCK_SIZE];
+	int m_used;
+
+	// Poly1305 state (26-bit limbs) and partial block
+	Word m_r[5];
+	Word m_h[5];
+	Word m_pad[4];
+	BYTE m_buffer[MAC_BLOCK_SIZE];
+	int m_buffered;
+	Word m_aadsize[2];
+	Word m_size[2];
+
+	static int s_simd;
+};
+
+#endif // __PTP_CHACHA_H__
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2001 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * 3. Neither the name of the Intel Corporation nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __PTP_CONNPOOL_H__
+#define __PTP_CONNPOOL_H__
+
+#include <ptp/ptp.h>
+#include <ptp/list.h>
+#include <ptp/net.h>
+
+/**
+ * PTP::Net::ConnectionPool: Reusable outbound connections.
+ * Synopsis: #include <ptp/connpool.h>
+ * Notes: A connection pool keeps idle outbound connections open,
+ *        keyed by IP address and port, so repeated requests to the
+ *        same peer skip the connect (and any proxy probing).  Idle
+ *        connections are closed after a timeout, at most a fixed
+ *        number are kept per peer, and each one is checked before
+ *        it is handed out again.
+ */
+class EXPORT PTP::Net::ConnectionPool
+{
+public:
+	enum
+	{
+		/**
+		 * PTP::Net::ConnectionPool::MAX_IDLE
+		 *
+		 * Default number of idle connections kept per peer.
+		 */
+		MAX_IDLE = 4,
+
+		/**
+		 * PTP::Net::ConnectionPool::IDLE_TIMEOUT
+		 *
+		 * Default seconds an idle connection is kept.
+		 */
+		IDLE_TIMEOUT = 60
+	};
+
+	ConnectionPool(int maxIdle = MAX_IDLE, int timeout = IDLE_TIMEOUT);
+	~ConnectionPool();
+
+	Connection *Get(Connection::Type type,
+			Net::Ip ip,
+			Net::Port port,
+			int timeout = 0);
+	void Put(Connection *conn);
+	void Clear();
+	int GetIdle();
+
+protected:
+	class Idle;
+
+	ConnectionPool(const ConnectionPool& pool);
+	ConnectionPool& operator=(const ConnectionPool& pool);
+
+	void Expire();
+
+	PTP::List m_idle;
+	int m_maxIdle;
+	int m_timeout;
+};
+
+#endif // __PTP_CONNPOOL_H__
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2001 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * 3. Neither the name of the Intel Corporation nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __PTP_ED25519_H__
+#define __PTP_ED25519_H__
+
+#include <ptp/ptp.h>
+
+/**
+ * PTP::Ed25519: Ed25519 signatures and X25519 key agreement.
+ * Synopsis: #include <ptp/ed25519.h>
+ * Notes: Signatures are computed as described in RFC 8032 and key
+ *        agreement as described in RFC 7748.  A 32-byte secret seed
+ *        serves both: &GetScalar derives the X25519 scalar for the
+ *        seed and &ToX25519 converts the matching Ed25519 public key,
+ *        so one key pair can sign and receive encrypted data.
+ */
+class EXPORT PTP::Ed25519
+{
+public:
+	enum
+	{
+		/**
+		 * PTP::Ed25519::SEED_SIZE: Secret key (seed) size.
+		 */
+		SEED_SIZE = 32,
+
+		/**
+		 * PTP::Ed25519::KEY_SIZE: Public key size.
+		 */
+		KEY_SIZE = 32,
+
+		/**
+		 * PTP::Ed25519::SIGNATURE_SIZE: Signature size.
+		 */
+		SIGNATURE_SIZE = 64,
+
+		/**
+		 * PTP::Ed25519::SCALAR_SIZE: X25519 scalar and point size.
+		 */
+		SCALAR_SIZE = 32,
+
+		/**
+		 * PTP::Ed25519::DIGEST_SIZE: SHA-512 digest size.
+		 */
+		DIGEST_SIZE = 64
+	};
+
+	static void CreateKey(const BYTE *seed, BYTE *key);
+	static void Sign(const BYTE *seed,
+			 const BYTE *key,
+			 const BYTE *data,
+			 int size,
+			 BYTE *sign);
+	static int Verify(const BYTE *key,
+			  const BYTE *data,
+			  int size,
+			  const BYTE *sign);
+
+	static void GetScalar(const BYTE *seed, BYTE *scalar);
+	static int ToX25519(const BYTE *key, BYTE *point);
+	static int X25519(const BYTE *scalar, const BYTE *point, BYTE *shared);
+
+	static void Digest(const BYTE *data, int size, BYTE *digest);
+
+protected:
+	class Sha512;
+
+	typedef int Limb;
+#ifdef WIN32
+	typedef __int64 Wide;
+#else
+	typedef long long Wide;
+#endif
+
+	// field element mod 2^255 - 19 (alternating 26- and 25-bit limbs)
+	struct Field
+	{
+		Limb v[10];
+	};
+
+	// curve point in extended coordinates (x = X/Z, y = Y/Z, xy = T/Z)
+	struct Point
+	{
+		Field X;
+		Field Y;
+		Field Z;
+		Field T;
+	};
+
+	enum
+	{
+		TABLE_WINDOWS = 64,
+		TABLE_ENTRIES = 16
+	};
+
+	Ed25519();
+
+	static void Init();
+	static void Carry(Field *f, Wide *h);
+	static void FromBytes(Field *h, const BYTE *s);
+	static void ToBytes(BYTE *s, const Field *f);
+	static void Add(Field *h, const Field *f, const Field *g);
+	static void Sub(Field *h, const Field *f, const Field *g);
+	static void Mul(Field *h, const Field *f, const Field *g);
+	static void MulSmall(Field *h, const Field *f, Limb n);
+	static void Pow(Field *h, const Field *f, const BYTE *e);
+	static void Invert(Field *h, const Field *f);
+	static void Swap(Field *f, Field *g, Limb swap);
+	static int IsZero(const Field *f);
+	static int IsNegative(const Field *f);
+
+	static void Add(Point *r, const Point *p, const Point *q);
+	static void Double(Point *r, const Point *p);
+	static void Select(Point *r, const Point *table, int index);
+	static void MulBase(Point *r, const BYTE *scalar);
+	static void Mul(Point *r, const Point *p, const BYTE *scalar);
+	static void Encode(BYTE *s, const Point *p);
+	static int Decode(Point *p, const BYTE *s);
+
+	static void Reduce(BYTE *r, Wide *x);
+	static void Expand(const BYTE *seed, BYTE *scalar, BYTE *prefix);
+
+	// curve constants and multiples of the base point (j * 16^i * B)
+	static Field s_d;
+	static Field s_d2;
+	static Field s_sqrtm1;
+	static Point s_table[TABLE_WINDOWS][TABLE_ENTRIES];
+	static Ed25519 s_init;
+};
+
+#endif // __PTP_ED25519_H__
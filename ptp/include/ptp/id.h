@@ -41,11 +41,20 @@
 #include <openssl/evp.h>
 #include <ptp/ptp.h>
 #include <ptp/list.h>
+#include <ptp/mutex.h>
+#include <ptp/sem.h>
+#include <ptp/pool.h>
 #include <ptp/key.h>
+#include <ptp/ed25519.h>
 
 /**
  * PTP::Identity: Identity and X509v3 certificate support.
  * Synopsis: #include <ptp/id.h>
+ * Notes: An identity holds either an RSA key or an Ed25519 key (see
+ *        %RSA_KEY and %ED25519_KEY).  The key type is carried by the
+ *        certificate, so peers need not agree on it in advance: each
+ *        side encrypts to and verifies with whatever key the other
+ *        side's certificate holds.
  */
 class EXPORT PTP::Identity:public PTP::List::Entry
 {
@@ -79,6 +88,39 @@ public:
 		 * Digital signature size for &Sign and &Verify.
 		 */
 		SIGNATURE_SIZE = CIPHERTEXT_SIZE,
+
+		/**
+		 * PTP::Identity::FINGERPRINT_SIZE:
+		 * Public key fingerprint size for &GetFingerprint.
+		 */
+		FINGERPRINT_SIZE = SHA_DIGEST_LENGTH,
+
+		/**
+		 * PTP::Identity::ED25519_PLAINTEXT_SIZE:
+		 * Maximum plaintext size for &Encrypt and &Decrypt with an
+		 * %ED25519_KEY identity (see &GetPlaintextSize).
+		 */
+		ED25519_PLAINTEXT_SIZE = CIPHERTEXT_SIZE
+			- PTP::Ed25519::SCALAR_SIZE - PTP::ChaCha::TAG_SIZE - 1
+	};
+
+	// public key algorithm
+	enum KeyType
+	{
+		/**
+		 * PTP::Identity::RSA_KEY: %KEY_SIZE byte RSA key.
+		 */
+		RSA_KEY = 1,
+
+		/**
+		 * PTP::Identity::ED25519_KEY: Ed25519 key.
+		 * Notes: Ed25519 identities sign with Ed25519 and encrypt
+		 *        with an X25519 key agreement and ChaCha20-Poly1305
+		 *        (see PTP::Ed25519).  Ed25519 keys are much faster to
+		 *        create and use, but can not be used with PKCS#7
+		 *        envelopes.
+		 */
+		ED25519_KEY = 2
 	};
 
 	/*
@@ -95,7 +137,18 @@ public:
 		EMAIL_ADDRESS = NID_pkcs9_emailAddress,
 	};
 
-	Identity(const char *name);
+	/**
+	 * PTP::Identity::Callback: Asynchronous operation completion
+	 *                          function.
+	 * @ident: Identity.
+	 * @result: Value returned by the synchronous operation.
+	 * @context: Context passed with the operation.
+	 */
+	typedef void (*Callback)(const Identity *ident,
+				 int result,
+				 void *context);
+
+	Identity(const char *name, KeyType type = RSA_KEY);
 	Identity(const Identity& ident);
 	~Identity();
 
@@ -103,6 +156,9 @@ public:
 	char *GetName(int nid) const;
 	void SetName(int nid, const char *value);
 	int GetKey(BYTE *data) const;
+	int GetFingerprint(BYTE *data) const;
+	KeyType GetKeyType() const;
+	int GetPlaintextSize() const;
 
 	const char *GetIssuerName() const;
 	char *GetIssuerName(int nid) const;
@@ -119,24 +175,118 @@ public:
 	int Sign(const BYTE *data, int size, BYTE *sign) const;
 	int Sign(Identity *subj, unsigned expire) const;
 
+	int Encrypt(const BYTE *plain,
+		    int size,
+		    BYTE *cipher,
+		    Callback callback,
+		    void *context,
+		    PTP::ThreadPool *pool) const;
+	int Decrypt(const BYTE *cipher,
+		    BYTE *plain,
+		    Callback callback,
+		    void *context,
+		    PTP::ThreadPool *pool) const;
+	int Verify(const BYTE *data,
+		   int size,
+		   const BYTE *sign,
+		   Callback callback,
+		   void *context,
+		   PTP::ThreadPool *pool) const;
+	int Sign(const BYTE *data,
+		 int size,
+		 BYTE *sign,
+		 Callback callback,
+		 void *context,
+		 PTP::ThreadPool *pool) const;
+
 	int ExportKey(PTP::Key *key, BYTE *data);
 	PTP::Key *ImportKey(BYTE *data, int size);
 
 	void Show() const;
 
+	static PTP::ThreadPool *GetCryptoPool();
+
+	static Identity *Create(const char *name, KeyType type = RSA_KEY);
+	static void ReserveKeys(int size, int lowWater);
+	static int GetReservedKeys();
+
 protected:
-	enum {EXPIRE_DEFAULT = 30 * 24 * 60 * 60};
+	class Request;
+	class KeyReserve;
+
+	enum
+	{
+		EXPIRE_DEFAULT = 30 * 24 * 60 * 60,
+		PRIVATE_KEY_COUNT = 16,
+		CRYPTO_QUEUE_SIZE = 1024,
+		KEY_RESERVE_SIZE = 4,
+		KEY_RESERVE_LOW_WATER = 2
+	};
+
+	// prepared private keys not in use by any thread
+	struct PrivateKeys
+	{
+		PTP::Mutex mutex;
+		RSA *keys[PRIVATE_KEY_COUNT];
+		int count;
+	};
+
+	// queued asynchronous operations and the tasks running them
+	struct Requests
+	{
+		Requests():tasks(0), waiting(0) {}
+
+		PTP::List list;
+		int tasks;
+		int waiting;
+		PTP::Semaphore idle;
+	};
 
 	friend class PTP::Store;
 
 	Identity& operator=(const Identity& ident);
 	Identity(X509 *cert, EVP_PKEY *key = NULL);
+	Identity(const char *name, KeyType type, RSA *rsa);
+	void Init(const char *name, KeyType type, RSA *rsa);
 	void DestroyKey();
+	void Decode();
+	int HasPrivateKey() const;
+	int Seal(const BYTE *plain, int size, BYTE *cipher) const;
+	int Open(const BYTE *cipher, BYTE *plain) const;
+	int SignCertificate(X509 *cert) const;
+	int VerifyCertificate(X509 *cert) const;
+	PKCS8_PRIV_KEY_INFO *ExportPrivateKey() const;
+	int ImportPrivateKey(PKCS8_PRIV_KEY_INFO *pkcs8);
+	void DestroyPrivateKeys();
+	RSA *GetPrivateKey() const;
+	void PutPrivateKey(RSA *key) const;
+
+	int Submit(Request *request, PTP::ThreadPool *pool) const;
+
+	static RSA *PrepareKey(const RSA *key);
+	static void Task(void *arg);
+	static KeyReserve *GetKeyReserve();
 
 	X509 *m_cert;
 	EVP_PKEY *m_key;
 	char *m_name;
 	char *m_issuerName;
+
+	// public key decoded from m_cert (an Ed25519 key is right-aligned
+	// in m_modulus)
+	KeyType m_type;
+	RSA *m_public;
+	BYTE m_modulus[KEY_SIZE];
+	BYTE m_fingerprint[FINGERPRINT_SIZE];
+	BYTE m_point[PTP::Ed25519::SCALAR_SIZE];
+
+	// Ed25519 private key (seed) or NULL
+	BYTE *m_seed;
+
+	// private key copies with their own Montgomery and blinding state
+	PrivateKeys *m_private;
+
+	Requests *m_requests;
 };
 
 #endif // __PTP_ID_H__
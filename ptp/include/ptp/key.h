@@ -34,20 +34,29 @@
 #ifndef __PTP_KEY_H__
 #define __PTP_KEY_H__
 
+#include <openssl/evp.h>
 #include <openssl/sha.h>
 #include <ptp/ptp.h>
 #include <ptp/list.h>
+#include <ptp/chacha.h>
 
 /**
  * PTP::Key: Symmetric encryption support.
  * Synopsis: #include <ptp/key.h>
  * Notes: The symmetric cipher and key sizes used depend on the
  *        value of $PTP_SESSION_CIPHER and $PTP_SESSION_KEY_SIZE
- *        in ``ptp.h''.
+ *        in ``ptp.h''.  The cipher key schedule is computed once
+ *        when the key is created, so encrypting many small messages
+ *        with one key only costs a per-message IV reset.  Each key
+ *        may instead use ChaCha20-Poly1305 (see &SetCipher), which
+ *        is much faster in software and authenticates the message
+ *        with its tag in place of the digest.
  */
 class EXPORT PTP::Key:public PTP::List::Entry
 {
 public:
+	class Context;
+
 	enum
 	{
 		/**
@@ -57,9 +66,53 @@ public:
 
 		IV_SIZE = PTP_SESSION_IV_SIZE,
 
+		/**
+		 * PTP::Key::MAX_IV_SIZE: Largest IV size of any cipher.
+		 */
+		MAX_IV_SIZE = PTP::ChaCha::NONCE_SIZE,
+
+		/**
+		 * PTP::Key::MAX_DIGEST_SIZE
+		 *
+		 * Largest message digest size of any cipher.
+		 */
+		MAX_DIGEST_SIZE = PTP_DIGEST_SIZE,
+
+		/**
+		 * PTP::Key::CHUNK_SIZE_DEFAULT
+		 *
+		 * Default plaintext size of each &EncryptChunked chunk.
+		 */
+		CHUNK_SIZE_DEFAULT = 0x10000,
+
+		/**
+		 * PTP::Key::MAX_CHUNK_SIZE: Largest chunk size.
+		 */
+		MAX_CHUNK_SIZE = 0x1000000,
+
 		READ_SIZE_DEFAULT = 1024,
 	};
 
+	enum Cipher
+	{
+		/**
+		 * PTP::Key::SESSION_CIPHER
+		 *
+		 * $PTP_SESSION_CIPHER with a $PTP_DIGEST message digest
+		 * (the default).
+		 */
+		SESSION_CIPHER = 0,
+
+		/**
+		 * PTP::Key::CHACHA20_POLY1305
+		 *
+		 * ChaCha20 with a Poly1305 authentication tag (see
+		 * &PTP::ChaCha).  Every message needs its own nonce,
+		 * so calls without an IV fail.
+		 */
+		CHACHA20_POLY1305 = 1
+	};
+
 	/**
 	 * PTP::Key::Read: Read function.
 	 * @data: [$OUT] Data buffer.
@@ -78,6 +131,32 @@ public:
 	 */
 	typedef int (*Write)(const BYTE *data, int size, void *context);
 
+	/**
+	 * PTP::Key::Span: Piece of a message encrypted or decrypted in
+	 *                 place.
+	 * @data: Data.
+	 * @size: Data size.
+	 */
+	struct Span
+	{
+		BYTE *data;
+		int size;
+	};
+
+	/**
+	 * PTP::Key::Message: Message encrypted or decrypted by
+	 *                    &EncryptBatch or &DecryptBatch.
+	 * @src: Source data.
+	 * @size: Source size, replaced by the output size.
+	 * @dst: [$OUT] Output data (may be @src).
+	 */
+	struct Message
+	{
+		const BYTE *src;
+		int size;
+		BYTE *dst;
+	};
+
 	Key();
 	Key(const BYTE *key);
 	Key(const char *passwd, const BYTE *salt, int saltsize);
@@ -87,12 +166,31 @@ public:
 		    int size,
 		    BYTE *dst,
 		    int iv = 1,
-		    int digest = 1) const;
+		    int digest = 1,
+		    Context *ctx = NULL) const;
 	int Decrypt(const BYTE *src,
 		    int size,
 		    BYTE *dst,
 		    int iv = 1,
-		    int digest = 1) const;
+		    int digest = 1,
+		    Context *ctx = NULL) const;
+
+	int Encrypt(Span *spans,
+		    int count,
+		    BYTE *iv,
+		    BYTE *digest,
+		    Context *ctx = NULL) const;
+	int Decrypt(Span *spans,
+		    int count,
+		    const BYTE *iv,
+		    const BYTE *digest,
+		    Context *ctx = NULL) const;
+	int EncryptBatch(Message *msgs,
+			 int count,
+			 Context *ctx = NULL) const;
+	int DecryptBatch(Message *msgs,
+			 int count,
+			 Context *ctx = NULL) const;
 
 	int Encrypt(Read read,
 		    Write write,
@@ -106,24 +204,111 @@ public:
 		    int iv = 1,
 		    int digest = 1,
 		    int readsize = READ_SIZE_DEFAULT) const;
+	int EncryptChunked(Read read,
+			   Write write,
+			   void *context,
+			   PTP::ThreadPool *pool = NULL,
+			   int chunksize = CHUNK_SIZE_DEFAULT) const;
+	int DecryptChunked(Read read,
+			   Write write,
+			   void *context,
+			   PTP::ThreadPool *pool = NULL) const;
+	int EncryptRange(Read read,
+			 Write write,
+			 void *context,
+			 int offset,
+			 int length = -1,
+			 PTP::ThreadPool *pool = NULL,
+			 int chunksize = CHUNK_SIZE_DEFAULT) const;
+	int DecryptRange(Read read,
+			 Write write,
+			 void *context,
+			 int offset,
+			 int length = -1,
+			 PTP::ThreadPool *pool = NULL) const;
+	int GetChunkedSize(int size,
+			   int chunksize = CHUNK_SIZE_DEFAULT,
+			   int offset = 0,
+			   int length = -1) const;
+	static int GetChunkedOffset(int offset,
+				    int chunksize = CHUNK_SIZE_DEFAULT);
 	static int Transfer(Read read,
 			    Write write,
 			    void *context,
 			    int readsize = READ_SIZE_DEFAULT);
+	static int GetCipherSize(int size,
+				 int iv = 1,
+				 int digest = 1,
+				 Cipher cipher = SESSION_CIPHER);
+
+	int SetCipher(Cipher cipher);
+	Cipher GetCipher() const;
+	int GetIvSize() const;
+	int GetDigestSize() const;
 
 	int Export(BYTE *data) const;
+	void Import(const BYTE *data);
 
 protected:
 	friend class PTP::Store;
+	class Batch;
 
 	enum
 	{
-		DIGEST_PADDED_SIZE = PTP_DIGEST_SIZE * 2
+		DIGEST_PADDED_SIZE = PTP_DIGEST_SIZE * 2,
+		STITCH_SIZE = 0x1000,
+		CHUNK_HEADER_SIZE = 4,
+		CHUNK_FINAL = 0x80,
+		BATCH_IV_COUNT = 32
 	};
 
 	Key(const Key& key);
 	Key &operator=(const Key& key);
 
+	void Init(Context *ctx, const BYTE *iv, int enc) const;
+	void Schedule();
+	void GetChunkIv(const BYTE *iv,
+			unsigned long index,
+			int final,
+			BYTE *chunkIv) const;
+	void GetChunkMac(const BYTE *iv,
+			 unsigned long index,
+			 int final,
+			 const BYTE *data,
+			 int size,
+			 BYTE *mac) const;
+	int GetBatchSize(PTP::ThreadPool *pool) const;
+	static long GetChunkCount(int offset, int length, int chunksize);
+	int EncryptSpans(Span *spans,
+			 int count,
+			 const BYTE *iv,
+			 BYTE *digest,
+			 Context *ctx) const;
+	int EncryptChaCha(const BYTE *plain,
+			  int size,
+			  BYTE *cipher,
+			  int iv,
+			  int digest,
+			  Context *ctx) const;
+	int DecryptChaCha(const BYTE *cipher,
+			  int total,
+			  BYTE *plain,
+			  int iv,
+			  int digest,
+			  Context *ctx) const;
+	int EncryptChaCha(Read read,
+			  Write write,
+			  void *context,
+			  int iv,
+			  int digest,
+			  int readsize) const;
+	int DecryptChaCha(Read read,
+			  Write write,
+			  void *context,
+			  int iv,
+			  int digest,
+			  int readsize) const;
+
 	static int ReadAll(Read read, BYTE *buffer, int size, void *context);
 	static int WriteAll(Write write,
 			    const BYTE *buffer,
@@ -132,6 +317,37 @@ protected:
 			    int *total);
 
 	BYTE m_key[KEY_SIZE];
+	Cipher m_cipher;
+
+	// cipher set up with m_key (the expanded key schedule)
+	EVP_CIPHER_CTX m_schedule;
+};
+
+/**
+ * PTP::Key::Context: Reusable cipher state.
+ * Synopsis: #include <ptp/key.h>
+ * Notes: Passing the same context to successive &PTP::Key::Encrypt
+ *        or &PTP::Key::Decrypt calls with one key sets up the cipher
+ *        key only once.  A context can be used with any key, but by
+ *        only one thread at a time.
+ */
+class EXPORT PTP::Key::Context
+{
+public:
+	Context();
+	~Context();
+
+protected:
+	friend class PTP::Key;
+
+	Context(const Context& ctx);
+	Context& operator=(const Context& ctx);
+
+	EVP_CIPHER_CTX m_cipher;
+	PTP::ChaCha m_chacha;
+	BYTE m_key[KEY_SIZE];
+	int m_type;
+	int m_enc;
 };
 
 #endif // __PTP_KEY_H__
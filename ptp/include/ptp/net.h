@@ -52,6 +52,9 @@ class PTP::Net
 {
 public:
 	class Connection;
+	class ConnectionPool;
+	class Reactor;
+	class Resolver;
 
 	/**
 	 * PTP::Net::Ip: IP address.
@@ -84,6 +87,7 @@ public:
 	enum
 	{
 		HTTP_OK = 200,
+		HTTP_PARTIAL_CONTENT = 206,
 		HTTP_BAD_REQUEST = 400,
 		HTTP_UNAUTHORIZED = 401,
 		HTTP_NOT_FOUND = 404
@@ -136,6 +140,77 @@ public:
 		 */
 		INBOUND = 2
 	};
+	enum
+	{
+		/**
+		 * PTP::Net::Connection::AGAIN
+		 *
+		 * Returned by &Read and &Write on a non-blocking
+		 * connection when no data can be transferred without
+		 * blocking.
+		 */
+		AGAIN = -2,
+
+		/**
+		 * PTP::Net::Connection::CHUNKED
+		 *
+		 * Content size for &WriteHttp when the size is not
+		 * known in advance.  The content is then sent in
+		 * pieces with &WriteChunk.
+		 */
+		CHUNKED = -3,
+
+		/**
+		 * PTP::Net::Connection::MAX_HTTP_CONTENT
+		 *
+		 * Largest content &ReadHttp accepts when no maximum
+		 * size is given.
+		 */
+		MAX_HTTP_CONTENT = 0x1000000
+	};
+	enum Option
+	{
+		/**
+		 * PTP::Net::Connection::NO_DELAY
+		 *
+		 * Send small writes immediately instead of waiting to
+		 * fill a packet (TCP_NODELAY).
+		 */
+		NO_DELAY = 0x1,
+
+		/**
+		 * PTP::Net::Connection::LARGE_BUFFERS
+		 *
+		 * Use large socket send and receive buffers.
+		 */
+		LARGE_BUFFERS = 0x2,
+
+		/**
+		 * PTP::Net::Connection::REUSE_PORT
+		 *
+		 * Let several server connections listen on the same
+		 * port (SO_REUSEPORT), so each accepting thread can
+		 * have its own socket.  The first connection takes a
+		 * free port, and the others join it by passing that
+		 * port twice to &SetPortRange.
+		 */
+		REUSE_PORT = 0x4,
+
+		/**
+		 * PTP::Net::Connection::LATENCY
+		 *
+		 * Options for small messages and request/response
+		 * traffic.
+		 */
+		LATENCY = NO_DELAY,
+
+		/**
+		 * PTP::Net::Connection::BULK
+		 *
+		 * Options for large transfers.
+		 */
+		BULK = LARGE_BUFFERS
+	};
 
 	Connection(Type type, Net::Ip ip, Net::Port port);
 	Connection(Type type, Net::Port port);
@@ -146,11 +221,24 @@ public:
 	Dir GetDir() const;
 	Net::Ip GetIp() const;
 	Net::Port GetPort() const;
+	int SetPortRange(Net::Port first, Net::Port last);
 	int GetSocket() const;
+	int GetError() const;
+	int IsIdle() const;
+
+	int SetBlocking(int block);
+	int GetOptions() const;
+	int SetOptions(int options);
+	int GetBacklog() const;
+	void SetBacklog(int backlog);
+	int GetKeepAlive() const;
+	void SetKeepAlive(int keepAlive);
 
 	int Open(int timeout = 0);
 	void Close();
+	void Shutdown();
 	Connection *Accept(int detType = 0);
+	int Accept(Connection **conns, int count, int detType = 0);
 
 	char *ReadHttpHdr(
 		char *hdr = NULL,
@@ -178,12 +266,25 @@ public:
 		const char *type = NULL,
 		int size = 0);
 
+	int ReadContent(BYTE *data, int size, int timeout = 0);
+	int WriteChunk(const BYTE *data, int size);
+
 	int ReadAll(BYTE *data, int size, int timeout = 0);
 	int WriteAll(const BYTE *data, int size);
 
 	int Read(BYTE *data, int size, int timeout = 0);
+	int Write(const BYTE *data, int size);
+	long SendFile(int fd, long offset, long length);
 	int Unget(const BYTE *data, int size);
 
+	int Peek(const BYTE **data, int size, int timeout = 0);
+	int Consume(int size);
+	int ReadUntil(BYTE *data,
+		      int size,
+		      const char *delim,
+		      int timeout = 0);
+	int GetBuffered() const;
+
 	static void SetProxy(Net::Ip ip,
 			     Net::Port port,
 			     int timeout = 1000);
@@ -192,48 +293,94 @@ protected:
 	enum
 	{
 		PROTOCOL = 6,
-		LISTEN_BACKLOG = 6,
-		MAX_PROXY_HEADER = 256
+		LISTEN_BACKLOG = 128,
+		SEND_FILE_SIZE = 0x10000,
+		RECV_BUFFER_SIZE = 0x4000,
+		BULK_BUFFER_SIZE = 0x40000,
+		MAX_GATHER = 4,
+		MAX_PROXY_HEADER = 256,
+		MAX_CHUNK_LINE = 256,
+		ROUTE_CACHE_SIZE = 256,
+		ROUTE_TTL = 300,
+		UNREACHABLE_TTL = 30
 	};
 
 	enum ProxyState
 	{
 		NO_PROXY = 0,
 		PROXY = 1,
-		UNKNOWN = 2
+		UNKNOWN = 2,
+		UNREACHABLE = 3
+	};
+
+	// how a destination was last reached (when a proxy is set)
+	struct Route
+	{
+		Net::Ip ip;
+		Net::Port port;
+		ProxyState state;
+		unsigned long time;
 	};
 
 	Connection(const Connection& conn);
 	Connection& operator=(const Connection& conn);
 
-	int Get(BYTE *data, int size);
-	int UngetData(BYTE *hdr, int size);
+	int Fill(int timeout);
+	int WriteGather(const BYTE **data, const int *size, int count);
+	int WriteHttpData(char *buffer,
+			  const BYTE *data,
+			  const char *type,
+			  int size);
+
+	static int Find(const BYTE *data,
+			int size,
+			int start,
+			const char *delim);
+	static const char *GetHttpValue(const char *hdr, const char *name);
 
 	static int Connect(int s,
 			   PTP::Net::Ip ip,
 			   PTP::Net::Port port,
 			   int timeout);
 	static int Wait(int s, int write, int timeout);
+	static int SetBlocking(int s, int block);
+	static int SetOptions(int s, int options);
+	static int IsPortFree(Net::Port port);
+	static int IsPending();
+	static ProxyState GetRoute(Net::Ip ip, Net::Port port);
+	static void SetRoute(Net::Ip ip, Net::Port port, ProxyState state);
 	static void Close(int s);
 
 	Type m_type;
 	Dir m_dir;
 	Net::Ip m_ip;
 	Net::Port m_port;
+	Net::Port m_lastPort;
 	
 	int m_s;
 	int m_close;
+	int m_block;
+	int m_options;
+	int m_backlog;
+	int m_keepAlive;
+	int m_httpClose;
+	int m_chunked;
+	int m_content;
 	ProxyState m_proxy;
 
-	BYTE *m_unget;
-	BYTE *m_ungetLast;
-	BYTE *m_ungetNext;
+	// receive buffer (m_count bytes starting at m_buffer + m_head)
+	BYTE *m_buffer;
+	int m_bufferSize;
+	int m_head;
+	int m_count;
 
 	PTP::Mutex m_mutex;
 
 	static Net::Ip s_proxyIp;
 	static Net::Port s_proxyPort;
 	static int s_proxyTimeout;
+	static Route s_routes[ROUTE_CACHE_SIZE];
+	static PTP::Mutex s_routeMutex;
 };
 
 #endif // __PTP_NET_H__
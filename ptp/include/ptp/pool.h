@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2001 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * 3. Neither the name of the Intel Corporation nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __PTP_POOL_H__
+#define __PTP_POOL_H__
+
+#include <ptp/ptp.h>
+#include <ptp/mutex.h>
+#include <ptp/sem.h>
+#include <ptp/thread.h>
+
+/**
+ * PTP::ThreadPool: Fixed set of worker threads.
+ * Synopsis: #include <ptp/pool.h>
+ * Notes: Each worker has its own bounded task queue.  A worker runs
+ *        its newest task first and, when idle, steals the oldest task
+ *        from another worker.  Tasks submitted from a worker thread
+ *        are queued on that worker.
+ */
+class EXPORT PTP::ThreadPool
+{
+public:
+	/**
+	 * PTP::ThreadPool::Task: Task function.
+	 * @arg: Argument passed to &Submit.
+	 */
+	typedef void (*Task)(void *arg);
+
+	ThreadPool(int threads = 0,
+		   int queueSize = QUEUE_SIZE_DEFAULT,
+		   int pinned = 0,
+		   int background = 0);
+	~ThreadPool();
+
+	int Submit(Task task, void *arg);
+	void Wait();
+
+	int GetThreads() const;
+
+	static int GetCpuCount();
+
+protected:
+	class Worker;
+
+	enum
+	{
+		QUEUE_SIZE_DEFAULT = 1024
+	};
+
+	ThreadPool(const ThreadPool& pool);
+	ThreadPool& operator=(const ThreadPool& pool);
+
+	int Take(Worker *worker, Task *task, void **arg);
+	void Done();
+
+	static void *Run(void *arg);
+	static void Pin(int cpu);
+	static void Background();
+
+	Worker *m_workers;
+	int m_threads;
+	int m_pinned;
+	int m_background;
+	int m_next;
+	int m_stop;
+	int m_pending;
+	int m_waiters;
+
+	PTP::Mutex m_mutex;
+	PTP::Semaphore m_work;
+	PTP::Semaphore m_idle;
+};
+
+#endif // __PTP_POOL_H__
@@ -79,12 +79,17 @@ public:
 	class Store;
 	class Authenticator;
 	class Key;
+	class ChaCha;
+	class Ed25519;
 	class Random;
+	class SecureConnection;
 
 	// utility
 	class List;
 	class Thread;
+	class ThreadPool;
 	class Mutex;
+	class Semaphore;
 
 	// misc.
 	class Net;
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2001 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * 3. Neither the name of the Intel Corporation nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __PTP_REACTOR_H__
+#define __PTP_REACTOR_H__
+
+#include <ptp/ptp.h>
+#include <ptp/list.h>
+#include <ptp/mutex.h>
+#include <ptp/thread.h>
+#include <ptp/net.h>
+
+/**
+ * PTP::Net::Reactor: Event dispatcher for many connections.
+ * Synopsis: #include <ptp/reactor.h>
+ * Notes: A reactor watches a set of non-blocking connections with
+ *        one or more event loop threads (epoll on Linux, select on
+ *        Win32) and calls back when a connection is readable or
+ *        writable.  Each connection is served by a single loop
+ *        thread, so its callbacks are never run concurrently.
+ */
+class EXPORT PTP::Net::Reactor
+{
+public:
+	class Handler;
+
+	/**
+	 * PTP::Net::Reactor::Callback: Event callback function.
+	 * @handler: Handler returned by &Add.
+	 * @events: Events that occurred (%READ, %WRITE and/or %CLOSE).
+	 * @context: Context passed to &Add.
+	 */
+	typedef void (*Callback)(Handler *handler, int events, void *context);
+
+	enum Event
+	{
+		/**
+		 * PTP::Net::Reactor::READ
+		 *
+		 * Connection has data (or a pending &Accept).
+		 */
+		READ = 1,
+
+		/**
+		 * PTP::Net::Reactor::WRITE
+		 *
+		 * Connection can be written (or a connect finished).
+		 */
+		WRITE = 2,
+
+		/**
+		 * PTP::Net::Reactor::CLOSE
+		 *
+		 * Connection was closed by the peer or failed.
+		 */
+		CLOSE = 4,
+
+		/**
+		 * PTP::Net::Reactor::ONESHOT
+		 *
+		 * Disable the handler after one event until it is
+		 * re-armed with &Modify.
+		 */
+		ONESHOT = 8
+	};
+
+	Reactor(int threads = 1);
+	~Reactor();
+
+	int Start();
+	void Stop();
+
+	Handler *Add(Net::Connection *conn,
+		     int events,
+		     Callback callback,
+		     void *context = NULL);
+	int Modify(Handler *handler, int events);
+	int Remove(Handler *handler);
+
+protected:
+	class Loop;
+
+	enum
+	{
+		MAX_EVENTS = 64,
+		SELECT_TIMEOUT = 100
+	};
+
+	Reactor(const Reactor& reactor);
+	Reactor& operator=(const Reactor& reactor);
+
+	static void *Run(void *arg);
+
+	Loop *m_loops;
+	int m_threads;
+	int m_next;
+	int m_running;
+	PTP::Mutex m_mutex;
+};
+
+/**
+ * PTP::Net::Reactor::Handler: Registered connection.
+ */
+class EXPORT PTP::Net::Reactor::Handler:public PTP::List::Entry
+{
+public:
+	Net::Connection *GetConnection() const;
+	void *GetContext() const;
+	int GetEvents() const;
+
+protected:
+	friend class PTP::Net::Reactor;
+
+	Handler(Net::Connection *conn,
+		int events,
+		Callback callback,
+		void *context,
+		Loop *loop);
+
+	Handler(const Handler& handler);
+	Handler& operator=(const Handler& handler);
+
+	Net::Connection *m_conn;
+	int m_events;
+	Callback m_callback;
+	void *m_context;
+	Loop *m_loop;
+	int m_removed;
+};
+
+#endif // __PTP_REACTOR_H__
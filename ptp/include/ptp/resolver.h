@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2001 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * 3. Neither the name of the Intel Corporation nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __PTP_RESOLVER_H__
+#define __PTP_RESOLVER_H__
+
+#include <ptp/ptp.h>
+#include <ptp/list.h>
+#include <ptp/net.h>
+
+/**
+ * PTP::Net::Resolver: Caching host name resolver.
+ * Synopsis: #include <ptp/resolver.h>
+ * Notes: Resolved addresses are cached for a fixed time, and failed
+ *        lookups for a shorter time, so repeated connects to the same
+ *        peer do not each wait on the system resolver.  Concurrent
+ *        lookups of the same name share a single query.  Lookups can
+ *        also run on a &PTP::ThreadPool with a completion callback.
+ *        &PTP::Net::Lookup uses a default resolver.
+ */
+class EXPORT PTP::Net::Resolver
+{
+public:
+	/**
+	 * PTP::Net::Resolver::Callback: Lookup completion function.
+	 * @name: Host name.
+	 * @ip: IP address or %INVALID on error.
+	 * @context: Context passed to &Lookup.
+	 */
+	typedef void (*Callback)(const char *name, Net::Ip ip, void *context);
+
+	enum
+	{
+		/**
+		 * PTP::Net::Resolver::TTL
+		 *
+		 * Default seconds a resolved address is cached.
+		 */
+		TTL = 300,
+
+		/**
+		 * PTP::Net::Resolver::NEGATIVE_TTL
+		 *
+		 * Default seconds a failed lookup is cached.
+		 */
+		NEGATIVE_TTL = 30,
+
+		/**
+		 * PTP::Net::Resolver::MAX_ENTRIES
+		 *
+		 * Default maximum number of cached names.
+		 */
+		MAX_ENTRIES = 256
+	};
+
+	Resolver(int ttl = TTL,
+		 int negativeTtl = NEGATIVE_TTL,
+		 int maxEntries = MAX_ENTRIES);
+	~Resolver();
+
+	Net::Ip Lookup(const char *name);
+	int Lookup(const char *name,
+		   Callback callback,
+		   void *context,
+		   PTP::ThreadPool *pool);
+	void Clear();
+	int GetCached();
+
+	static Resolver *GetDefault();
+
+protected:
+	class Entry;
+	class Request;
+
+	Resolver(const Resolver& resolver);
+	Resolver& operator=(const Resolver& resolver);
+
+	Entry *Find(const char *name);
+	Entry *Add(const char *name);
+	void Finish(Entry *entry, Net::Ip ip);
+
+	static void Task(void *arg);
+	static Net::Ip Resolve(const char *name);
+
+	PTP::List m_entries;
+	int m_ttl;
+	int m_negativeTtl;
+	int m_maxEntries;
+};
+
+#endif // __PTP_RESOLVER_H__
@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) 2001 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * 3. Neither the name of the Intel Corporation nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __PTP_SECURE_H__
+#define __PTP_SECURE_H__
+
+#include <openssl/evp.h>
+#include <ptp/ptp.h>
+#include <ptp/list.h>
+#include <ptp/id.h>
+#include <ptp/store.h>
+#include <ptp/key.h>
+#include <ptp/net.h>
+
+/**
+ * PTP::SecureConnection: Authenticated, encrypted connection.
+ * Synopsis: #include <ptp/secure.h>
+ * Notes: A secure connection wraps a blocking &PTP::Net::Connection.
+ *        &Connect and &Accept perform a single mutual handshake with
+ *        the local and peer identities, after which all data is sent
+ *        in encrypted records carrying a message authentication code
+ *        and sequence number.  Sessions saved in a &Cache are resumed
+ *        by later connections to the same peer without any public key
+ *        operations.  One thread may read while another writes.
+ */
+class EXPORT PTP::SecureConnection
+{
+public:
+	class Cache;
+
+	enum
+	{
+		/**
+		 * PTP::SecureConnection::MAX_RECORD
+		 *
+		 * Largest amount of data sent in a single record.
+		 */
+		MAX_RECORD = 0x4000,
+
+		/**
+		 * PTP::SecureConnection::SESSION_ID_SIZE
+		 *
+		 * Session identifier size.
+		 */
+		SESSION_ID_SIZE = 16
+	};
+
+	SecureConnection(PTP::Net::Connection *conn,
+			 PTP::Store *store,
+			 Cache *cache = NULL);
+	virtual ~SecureConnection();
+
+	int Connect(int timeout = 0);
+	int Accept(int timeout = 0);
+	void Close();
+
+	int Read(BYTE *data, int size, int timeout = 0);
+	int Write(const BYTE *data, int size);
+
+	PTP::Net::Connection *GetConnection() const;
+	const PTP::Identity *GetPeer() const;
+	int IsResumed() const;
+
+protected:
+	enum Type
+	{
+		HELLO = 1,
+		SERVER_HELLO = 2,
+		KEY_EXCHANGE = 3,
+		FINISHED = 4,
+		DATA = 5,
+		CLOSE = 6
+	};
+
+	enum State
+	{
+		NONE = 0,
+		OPEN = 1,
+		CLOSED = 2,
+		FAILED = 3
+	};
+
+	enum
+	{
+		VERSION = 1,
+		HEADER_SIZE = 3,
+		RANDOM_SIZE = 16,
+		SECRET_SIZE = 48,
+		MAC_SIZE = PTP_DIGEST_SIZE,
+		FINISHED_SIZE = PTP_DIGEST_SIZE,
+		MAX_LABEL = 32
+	};
+
+	SecureConnection(const SecureConnection& conn);
+	SecureConnection& operator=(const SecureConnection& conn);
+
+	virtual int Verify(const PTP::Identity *peer);
+
+	int ReadRecord(Type type, BYTE *data, int size, int timeout);
+	int WriteRecord(Type type, const BYTE *data, int size);
+	int ReadFinished(const char *label, int timeout);
+	int WriteFinished(const char *label);
+	int ExchangeKey(const PTP::Identity *local);
+	int AcceptKey(const PTP::Identity *local, int timeout);
+	void Hash(const BYTE *data, int size);
+	void GetHash(BYTE *digest);
+	void SetKeys(int client);
+	int HandshakeClient(int timeout);
+	int HandshakeServer(int timeout);
+
+	static void Derive(const BYTE *secret,
+			   int secretsize,
+			   const char *label,
+			   const BYTE *seed,
+			   int seedsize,
+			   BYTE *data,
+			   int size);
+	static void Mac(const BYTE *key,
+			UINT32 seq,
+			const BYTE *hdr,
+			const BYTE *data,
+			int size,
+			BYTE *mac);
+
+	PTP::Net::Connection *m_conn;
+	PTP::Store *m_store;
+	Cache *m_cache;
+	PTP::Identity *m_peer;
+	State m_state;
+	int m_resumed;
+
+	// handshake state
+	EVP_MD_CTX m_hash;
+	BYTE m_random[2 * RANDOM_SIZE];
+	BYTE m_session[SESSION_ID_SIZE];
+	BYTE m_secret[SECRET_SIZE];
+
+	// record state (read and write sides are independent)
+	EVP_CIPHER_CTX m_readCtx;
+	EVP_CIPHER_CTX m_writeCtx;
+	BYTE m_readMac[MAC_SIZE];
+	BYTE m_writeMac[MAC_SIZE];
+	UINT32 m_readSeq;
+	UINT32 m_writeSeq;
+	int m_keys;
+
+	// received data (m_count bytes starting at m_readBuffer + m_head)
+	BYTE *m_readBuffer;
+	int m_head;
+	int m_count;
+	BYTE *m_writeBuffer;
+};
+
+/**
+ * PTP::SecureConnection::Cache: Session cache.
+ * Synopsis: #include <ptp/secure.h>
+ * Notes: A cache may be shared by any number of client and server
+ *        connections.  Client sessions are found by peer address
+ *        and server sessions by session identifier.
+ */
+class EXPORT PTP::SecureConnection::Cache
+{
+public:
+	enum
+	{
+		/**
+		 * PTP::SecureConnection::Cache::TTL
+		 *
+		 * Default seconds a session may be resumed.
+		 */
+		TTL = 3600,
+
+		/**
+		 * PTP::SecureConnection::Cache::MAX_ENTRIES
+		 *
+		 * Default maximum number of cached sessions.
+		 */
+		MAX_ENTRIES = 256
+	};
+
+	Cache(int ttl = TTL, int maxEntries = MAX_ENTRIES);
+	~Cache();
+
+	void Clear();
+	int GetCached();
+
+protected:
+	friend class PTP::SecureConnection;
+	class Entry;
+
+	Cache(const Cache& cache);
+	Cache& operator=(const Cache& cache);
+
+	Entry *Find(const BYTE *id);
+	Entry *Find(PTP::Net::Ip ip, PTP::Net::Port port);
+	void Add(const BYTE *id,
+		 PTP::Net::Ip ip,
+		 PTP::Net::Port port,
+		 const BYTE *secret,
+		 const PTP::Identity *peer);
+	void Remove(PTP::Net::Ip ip, PTP::Net::Port port);
+
+	PTP::List m_entries;
+	int m_ttl;
+	int m_maxEntries;
+};
+
+#endif // __PTP_SECURE_H__
@@ -32,20 +32,182 @@
  */
 
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
 #include <ptp/auth.h>
 #include <ptp/rand.h>
+#include <ptp/mutex.h>
+#include <ptp/sem.h>
+#include <ptp/pool.h>
 #include <ptp/key.h>
 #include <ptp/debug.h>
 
+/*
+ * PTP::Key::Batch: Chunks encrypted or decrypted by several threads.
+ * Notes: The calling thread and the pool tasks submitted for a batch
+ *        all take chunks until none remain, so a batch completes even
+ *        when every pool thread is busy.  The last thread to release
+ *        the batch destroys it.
+ */
+class PTP::Key::Batch
+{
+public:
+	Batch(const PTP::Key *key,
+	      int enc,
+	      const BYTE *iv,
+	      unsigned long index,
+	      BYTE **data,
+	      int *size,
+	      int count,
+	      int final)
+		:m_key(key), m_enc(enc), m_index(index), m_data(data),
+		 m_size(size), m_count(count), m_final(final), m_next(0),
+		 m_done(0), m_failed(0), m_refs(1)
+	{
+		memcpy(m_iv, iv, sizeof(m_iv));
+	}
+
+	/*
+	 * Execute: Process all chunks, using @pool threads if not NULL.
+	 * Returns: 0 on success or -1 if any chunk failed.
+	 */
+	int Execute(PTP::ThreadPool *pool)
+	{
+		int tasks = pool ? pool->GetThreads():0;
+		if (tasks > m_count - 1)
+			tasks = m_count - 1;
+		for (int i = 0; i < tasks; i++)
+		{
+			m_mutex.Lock();
+			m_refs++;
+			m_mutex.Unlock();
+			if (pool->Submit(Task, this))
+			{
+				Release();
+				break;
+			}
+		}
+		Run();
+		m_finished.Wait();
+		return m_failed ? -1:0;
+	}
+
+	void Release()
+	{
+		m_mutex.Lock();
+		int last = (--m_refs == 0);
+		m_mutex.Unlock();
+		if (last)
+			delete this;
+	}
+
+protected:
+	static void Task(void *arg)
+	{
+		Batch *batch = (Batch*) arg;
+		batch->Run();
+		batch->Release();
+	}
+
+	void Run()
+	{
+		PTP::Key::Context ctx;
+		for (;;)
+		{
+			m_mutex.Lock();
+			int i = (m_next < m_count) ? m_next++:-1;
+			m_mutex.Unlock();
+			if (i < 0)
+				break;
+
+			BYTE iv[MAX_IV_SIZE];
+			unsigned long index = m_index + i;
+			int final = (m_final && i == m_count - 1);
+			m_key->GetChunkIv(m_iv, index, final, iv);
+			Span span = {m_data[i], m_size[i]};
+			BYTE *tag = m_data[i] + m_size[i];
+			int st = 0;
+			if (m_key->m_cipher == CHACHA20_POLY1305)
+			{
+				// the Poly1305 tag covers the chunk already
+				if (m_enc)
+					m_key->EncryptSpans(&span,
+							    1,
+							    iv,
+							    tag,
+							    &ctx);
+				else
+					st = m_key->Decrypt(&span,
+							    1,
+							    iv,
+							    tag,
+							    &ctx);
+			}
+			else if (m_enc)
+			{
+				// encrypt, then MAC the ciphertext
+				m_key->EncryptSpans(&span, 1, iv, NULL, &ctx);
+				m_key->GetChunkMac(m_iv,
+						   index,
+						   final,
+						   span.data,
+						   span.size,
+						   tag);
+			}
+			else
+			{
+				BYTE mac[PTP_DIGEST_SIZE];
+				m_key->GetChunkMac(m_iv,
+						   index,
+						   final,
+						   span.data,
+						   span.size,
+						   mac);
+				BYTE diff = 0;
+				for (int j = 0; j < (int) sizeof(mac); j++)
+					diff |= mac[j] ^ tag[j];
+				if (diff)
+					st = -1;
+				else
+					m_key->Decrypt(&span, 1, iv, NULL, &ctx);
+			}
+
+			m_mutex.Lock();
+			if (st < 0)
+				m_failed = 1;
+			int last = (++m_done == m_count);
+			m_mutex.Unlock();
+			if (last)
+				m_finished.Post();
+		}
+	}
+
+	const PTP::Key *m_key;
+	int m_enc;
+	BYTE m_iv[MAX_IV_SIZE];
+	unsigned long m_index;	// index of the first chunk
+	BYTE **m_data;		// chunk data, each followed by its tag
+	int *m_size;
+	int m_count;
+	int m_final;		// the last chunk ends the message
+
+	int m_next;
+	int m_done;
+	int m_failed;
+	int m_refs;
+	PTP::Mutex m_mutex;
+	PTP::Semaphore m_finished;
+};
+
 /**
  * PTP::Key::Key: Create a new randomly-generated key.
  */
-PTP::Key::Key():PTP::List::Entry()
+PTP::Key::Key():PTP::List::Entry(), m_cipher(SESSION_CIPHER)
 {
 	PTP::Random::Fill(m_key, sizeof(m_key));
+	Schedule();
 }
 
 /**
@@ -56,9 +218,11 @@ PTP::Key::Key():PTP::List::Entry()
  *   PTP::Random::Fill(data, sizeof(data));
  *   PTP::Key key(data);
  */
-PTP::Key::Key(const BYTE *data):PTP::List::Entry()
+PTP::Key::Key(const BYTE *data)
+	:PTP::List::Entry(), m_cipher(SESSION_CIPHER)
 {
 	memcpy(m_key, data, sizeof(m_key));
+	Schedule();
 }
 
 /**
@@ -75,6 +239,7 @@ PTP::Key::Key(const BYTE *data):PTP::List::Entry()
  *   PTP::Key key("SecretPassword", salt, sizeof(salt));
  */
 PTP::Key::Key(const char *passwd, const BYTE *salt, int saltsize)
+	:m_cipher(SESSION_CIPHER)
 {
 	if (saltsize == -1)
 		saltsize = strlen((const char*) salt);
@@ -85,6 +250,7 @@ PTP::Key::Key(const char *passwd, const BYTE *salt, int saltsize)
 			       PKCS5_DEFAULT_ITER,
 			       sizeof(m_key),
 			       m_key);
+	Schedule();
 }
 
 #ifdef PTPTL_DLL
@@ -116,6 +282,8 @@ PTP::Key::operator=(const Key& key)
  */
 PTP::Key::~Key()
 {
+	EVP_CIPHER_CTX_cleanup(&m_schedule);
+	memset(&m_schedule, 0, sizeof(m_schedule));
 	memset(m_key, 0, sizeof(m_key));
 }
 
@@ -126,7 +294,12 @@ PTP::Key::~Key()
  * @cipher: [$OUT] Ciphertext data or NULL.
  * @iv: 1 to prepend a randomly-generate IV (default).
  * @digest: 1 to append a message digest (default).
+ * @ctx: Cipher context to reuse or NULL.
  * Returns: Ciphertext size on success or -1 on error.
+ * Notes: @cipher may be the same buffer as @plain (if it is large
+ *        enough for the ciphertext).  No memory is allocated.  The
+ *        data is read once, as the digest (or Poly1305 tag) is
+ *        computed along with the cipher.
  * Example:
  *   BYTE plain[] = ...;
  *   int size = $Encrypt(plain, sizeof(plain), NULL);
@@ -139,66 +312,73 @@ PTP::Key::Encrypt(
 	int size,
 	BYTE *cipher,
 	int iv,
-	int digest) const
+	int digest,
+	Context *ctx) const
 {
 	// check arguments
-	int total = size;
-	if (iv)
-		total += IV_SIZE;
-	if (digest)
-		total += PTP_DIGEST_SIZE;
+	int total = GetCipherSize(size, iv, digest, m_cipher);
 	if (!cipher && size > 0)
 		return total;
 	if (!plain || size <= 0)
 		return -1;
+	if (m_cipher == CHACHA20_POLY1305)
+		return EncryptChaCha(plain, size, cipher, iv, digest, ctx);
 
-	// calculate digest
-	BYTE digestData[PTP_DIGEST_SIZE];
-	if (digest)
-	{
-		EVP_MD_CTX digestCtx;
-		EVP_DigestInit(&digestCtx, PTP_DIGEST);
-		EVP_DigestUpdate(&digestCtx, plain, size);
-		EVP_DigestFinal(&digestCtx, digestData, NULL);
-	}
-
-	// allocate a temporary buffer
-	BYTE *buffer = new BYTE[total];
-	BYTE *dst = buffer;
-
-	// create a random IV and append
+	// create a random IV and prepend
+	BYTE *dst = cipher;
 	BYTE ivData[IV_SIZE];
 	if (iv)
 	{
 		PTP::Random::Fill(ivData, sizeof(ivData));
+		if (plain < cipher + total && cipher < plain + size)
+		{
+			// encrypting in place: make room for the IV
+			memmove(cipher + sizeof(ivData), plain, size);
+			plain = cipher + sizeof(ivData);
+		}
 		memcpy(dst, ivData, sizeof(ivData));
 		dst += sizeof(ivData);
 	}
 	else
 		memset(ivData, 0, sizeof(ivData));
 
-	// encrypt data and digest and append
-	EVP_CIPHER_CTX ctx;
-	EVP_EncryptInit(&ctx, PTP_SESSION_CIPHER, (BYTE*) m_key, ivData);
-	EVP_EncryptUpdate(&ctx, dst, &size, (BYTE*) plain, size);
-	dst += size;
+	// digest and encrypt each piece in one pass (the digest comes
+	// first, as an in-place encrypt overwrites @plain)
+	Context local;
+	if (!ctx)
+		ctx = &local;
+	Init(ctx, ivData, 1);
+	EVP_MD_CTX digestCtx;
 	if (digest)
+		EVP_DigestInit(&digestCtx, PTP_DIGEST);
+	while (size > 0)
 	{
-		EVP_EncryptUpdate(&ctx,
+		int n = (size < STITCH_SIZE) ? size:STITCH_SIZE;
+		if (digest)
+			EVP_DigestUpdate(&digestCtx, plain, n);
+		int s = 0;
+		EVP_EncryptUpdate(&ctx->m_cipher, dst, &s, (BYTE*) plain, n);
+		dst += s;
+		plain += n;
+		size -= n;
+	}
+
+	// encrypt digest and append
+	if (digest)
+	{
+		BYTE digestData[PTP_DIGEST_SIZE];
+		EVP_DigestFinal(&digestCtx, digestData, NULL);
+		EVP_EncryptUpdate(&ctx->m_cipher,
 				  dst,
 				  &size,
 				  digestData,
 				  sizeof(digestData));
 		dst += size;
 	}
-	EVP_EncryptFinal(&ctx, dst, &size);
+	EVP_EncryptFinal(&ctx->m_cipher, dst, &size);
 	dst += size;
 
-	// copy out data
-	total = dst - buffer;
-	memcpy(cipher, buffer, total);
-	delete [] buffer;
-	return total;
+	return (dst - cipher);
 }
 
 /**
@@ -208,8 +388,11 @@ PTP::Key::Encrypt(
  * @plain: [$OUT] Plaintext data or NULL.
  * @iv: 1 to fetch prepended IV (default).
  * @digest: 1 to verify appended message digest (default).
+ * @ctx: Cipher context to reuse or NULL.
  * Returns: Plaintext size on success or -1 on error or invalid
  *          message digest.
+ * Notes: @plain may be the same buffer as @cipher.  No memory is
+ *        allocated.
  * Example:
  *   BYTE cipher[] = ...;
  *   int size = $Decrypt(cipher, sizeof(cipher), NULL);
@@ -224,71 +407,439 @@ PTP::Key::Decrypt(
 	int size,
 	BYTE *plain,
 	int iv,
-	int digest) const
+	int digest,
+	Context *ctx) const
 {
 	// check arguments
 	int total = size;
 	if (iv)
-		total -= IV_SIZE;
+		total -= GetIvSize();
 	if (digest)
-		total -= PTP_DIGEST_SIZE;
+		total -= GetDigestSize();
 	if (!plain && total > 0)
 		return total;
 	if (!cipher || total <= 0)
 		return -1;
-
-	const BYTE *src = cipher;
+	if (m_cipher == CHACHA20_POLY1305)
+		return DecryptChaCha(cipher, total, plain, iv, digest, ctx);
 
 	// fetch IV
 	BYTE ivData[IV_SIZE];
 	if (iv)
 	{
-		memcpy(ivData, src, sizeof(ivData));
-		src += sizeof(ivData);
+		memcpy(ivData, cipher, sizeof(ivData));
+		cipher += sizeof(ivData);
 		size -= sizeof(ivData);
 	}
 	else
 		memset(ivData, 0, sizeof(ivData));
 
-	// allocate a temporary buffer
-	BYTE *buffer = new BYTE[size];
-	BYTE *dst = buffer;
+	// the digest (and final block) is decrypted separately below
+	const BYTE *tail = cipher + total;
+	int tailsize = size - total;
+	if (plain != cipher
+	    && plain < cipher + total
+	    && cipher < plain + total)
+	{
+		// decrypting in place: the digest is not overwritten
+		memmove(plain, cipher, total);
+		cipher = plain;
+	}
 
-	// fetch and decrypt data and digest
-	EVP_CIPHER_CTX ctx;
-	EVP_DecryptInit(&ctx, PTP_SESSION_CIPHER, (BYTE*) m_key, ivData);
-	EVP_DecryptUpdate(&ctx, dst, &size, (BYTE*) src, size);
-	dst += size;
-	EVP_DecryptFinal(&ctx, dst, &size);
-	dst += size;
+	// decrypt and digest each piece in one pass
+	Context local;
+	if (!ctx)
+		ctx = &local;
+	Init(ctx, ivData, 0);
+	EVP_MD_CTX digestCtx;
+	if (digest)
+		EVP_DigestInit(&digestCtx, PTP_DIGEST);
+	BYTE *dst = plain;
+	for (size = total; size > 0; )
+	{
+		int n = (size < STITCH_SIZE) ? size:STITCH_SIZE;
+		int s = 0;
+		EVP_DecryptUpdate(&ctx->m_cipher, dst, &s, (BYTE*) cipher, n);
+		if (digest)
+			EVP_DigestUpdate(&digestCtx, dst, s);
+		dst += s;
+		cipher += n;
+		size -= n;
+	}
+	total = dst - plain;
 
+	BYTE last[PTP_DIGEST_SIZE + 2 * EVP_MAX_IV_LENGTH];
+	int lastsize = 0;
+	EVP_DecryptUpdate(&ctx->m_cipher,
+			  last,
+			  &lastsize,
+			  (BYTE*) tail,
+			  tailsize);
+	if (!EVP_DecryptFinal(&ctx->m_cipher, last + lastsize, &size))
+		return -1;
+	lastsize += size;
 	if (digest)
-		dst -= PTP_DIGEST_SIZE;
-	total = dst - buffer;
+		lastsize -= PTP_DIGEST_SIZE;
+	if (lastsize < 0)
+		return -1;
+	memcpy(plain + total, last, lastsize);
+	total += lastsize;
 
-	// calculate digest
+	// check digest
 	if (digest)
 	{
-		EVP_MD_CTX digestCtx;
-		EVP_DigestInit(&digestCtx, PTP_DIGEST);
-		EVP_DigestUpdate(&digestCtx, buffer, total);
+		EVP_DigestUpdate(&digestCtx, last, lastsize);
 		BYTE digestData[PTP_DIGEST_SIZE];
 		EVP_DigestFinal(&digestCtx, digestData, NULL);
-		
-		// check digest
 		if (memcmp(digestData,
-			   buffer + total,
+			   last + lastsize,
 			   sizeof(digestData)) != 0)
 			total = -1;
 	}
+	return total;
+}
+
+/**
+ * PTP::Key::Encrypt: Encrypt a message in place.
+ * @spans: Message pieces (encrypted in place).
+ * @count: Number of pieces.
+ * @iv: [$OUT] Randomly-generated IV (&GetIvSize bytes) or NULL for
+ *      no IV (not with %CHACHA20_POLY1305).
+ * @digest: [$OUT] Encrypted message digest (&GetDigestSize bytes)
+ *          or NULL for no digest.
+ * @ctx: Cipher context to reuse or NULL.
+ * Returns: Message size on success or -1 on error.
+ * Notes: The pieces are encrypted as one message, so sending @iv,
+ *        the pieces and @digest in that order (for example with one
+ *        gathering write) is the same as sending the output of the
+ *        buffer &Encrypt.  No memory is allocated.  Only stream
+ *        ciphers (such as the default OFB mode) are supported, as
+ *        the ciphertext must be the same size as the plaintext.
+ * Example:
+ *   BYTE hdr[] = ..., body[] = ...;
+ *   PTP::Key::Span spans[] = {{hdr, sizeof(hdr)}, {body, sizeof(body)}};
+ *   BYTE iv[PTP::Key::MAX_IV_SIZE];
+ *   BYTE digest[PTP::Key::MAX_DIGEST_SIZE];
+ *   $Encrypt(spans, 2, iv, digest);
+ */
+int
+PTP::Key::Encrypt(
+	Span *spans,
+	int count,
+	BYTE *iv,
+	BYTE *digest,
+	Context *ctx) const
+{
+	// check arguments
+	if (!spans || count < 0
+	    || (m_cipher == SESSION_CIPHER
+		&& EVP_CIPHER_block_size(PTP_SESSION_CIPHER) != 1)
+	    || (m_cipher == CHACHA20_POLY1305 && !iv))
+		return -1;
+	int i;
+	for (i = 0; i < count; i++)
+	{
+		if (spans[i].size < 0 || (spans[i].size > 0 && !spans[i].data))
+			return -1;
+	}
 
-	// copy out data
-	if (total > 0)
-		memcpy(plain, buffer, total);
-	delete [] buffer;
+	BYTE ivData[MAX_IV_SIZE];
+	if (iv)
+	{
+		PTP::Random::Fill(ivData, GetIvSize());
+		memcpy(iv, ivData, GetIvSize());
+	}
+	else
+		memset(ivData, 0, sizeof(ivData));
+	return EncryptSpans(spans, count, ivData, digest, ctx);
+}
+
+/*
+ * PTP::Key::EncryptSpans: Encrypt a message in place with an IV.
+ * @spans: Message pieces (encrypted in place).
+ * @count: Number of pieces.
+ * @iv: IV (&GetIvSize bytes).
+ * @digest: [$OUT] Encrypted message digest or NULL for no digest.
+ * @ctx: Cipher context to reuse or NULL.
+ * Returns: Message size.
+ */
+int
+PTP::Key::EncryptSpans(
+	Span *spans,
+	int count,
+	const BYTE *iv,
+	BYTE *digest,
+	Context *ctx) const
+{
+	Context local;
+	if (!ctx)
+		ctx = &local;
+	Init(ctx, iv, 1);
+	int total = 0;
+	int i;
+	if (m_cipher == CHACHA20_POLY1305)
+	{
+		for (i = 0; i < count; i++)
+		{
+			ctx->m_chacha.Encrypt(spans[i].data,
+					      spans[i].data,
+					      spans[i].size);
+			total += spans[i].size;
+		}
+		if (digest)
+			ctx->m_chacha.Finish(digest);
+		return total;
+	}
+	EVP_MD_CTX digestCtx;
+	if (digest)
+		EVP_DigestInit(&digestCtx, PTP_DIGEST);
+
+	// encrypt each piece in place
+	int size;
+	for (i = 0; i < count; i++)
+	{
+		if (digest)
+			EVP_DigestUpdate(&digestCtx,
+					 spans[i].data,
+					 spans[i].size);
+		EVP_EncryptUpdate(&ctx->m_cipher,
+				  spans[i].data,
+				  &size,
+				  spans[i].data,
+				  spans[i].size);
+		total += spans[i].size;
+	}
+
+	if (digest)
+	{
+		EVP_DigestFinal(&digestCtx, digest, NULL);
+		EVP_EncryptUpdate(&ctx->m_cipher,
+				  digest,
+				  &size,
+				  digest,
+				  PTP_DIGEST_SIZE);
+	}
+	return total;
+}
+
+/**
+ * PTP::Key::Decrypt: Decrypt a message in place.
+ * @spans: Message pieces (decrypted in place).
+ * @count: Number of pieces.
+ * @iv: IV (&GetIvSize bytes) or NULL for no IV (not with
+ *      %CHACHA20_POLY1305).
+ * @digest: Encrypted message digest (&GetDigestSize bytes) or NULL
+ *          for no digest.
+ * @ctx: Cipher context to reuse or NULL.
+ * Returns: Message size on success or -1 on error or invalid message
+ *          digest.
+ * Notes: The pieces must split the ciphertext (less the IV and
+ *        digest) in order.  No memory is allocated.  Only stream
+ *        ciphers are supported.
+ * Example:
+ *   PTP::Key::Span spans[] = {{hdr, sizeof(hdr)}, {body, bodysize}};
+ *   if ($Decrypt(spans, 2, iv, digest) < 0)
+ *       return -1;
+ */
+int
+PTP::Key::Decrypt(
+	Span *spans,
+	int count,
+	const BYTE *iv,
+	const BYTE *digest,
+	Context *ctx) const
+{
+	// check arguments
+	if (!spans || count < 0
+	    || (m_cipher == SESSION_CIPHER
+		&& EVP_CIPHER_block_size(PTP_SESSION_CIPHER) != 1)
+	    || (m_cipher == CHACHA20_POLY1305 && !iv))
+		return -1;
+	int i;
+	for (i = 0; i < count; i++)
+	{
+		if (spans[i].size < 0 || (spans[i].size > 0 && !spans[i].data))
+			return -1;
+	}
+
+	BYTE ivData[MAX_IV_SIZE];
+	memset(ivData, 0, sizeof(ivData));
+	if (iv)
+		memcpy(ivData, iv, GetIvSize());
+
+	Context local;
+	if (!ctx)
+		ctx = &local;
+	Init(ctx, ivData, 0);
+	int total = 0;
+	if (m_cipher == CHACHA20_POLY1305)
+	{
+		for (i = 0; i < count; i++)
+		{
+			ctx->m_chacha.Decrypt(spans[i].data,
+					      spans[i].data,
+					      spans[i].size);
+			total += spans[i].size;
+		}
+		if (digest && ctx->m_chacha.Verify(digest) < 0)
+			total = -1;
+		return total;
+	}
+	EVP_MD_CTX digestCtx;
+	if (digest)
+		EVP_DigestInit(&digestCtx, PTP_DIGEST);
+
+	// decrypt each piece in place
+	int size;
+	for (i = 0; i < count; i++)
+	{
+		EVP_DecryptUpdate(&ctx->m_cipher,
+				  spans[i].data,
+				  &size,
+				  spans[i].data,
+				  spans[i].size);
+		if (digest)
+			EVP_DigestUpdate(&digestCtx,
+					 spans[i].data,
+					 spans[i].size);
+		total += spans[i].size;
+	}
+
+	if (digest)
+	{
+		// decrypt and check message digest
+		BYTE expect[PTP_DIGEST_SIZE];
+		EVP_DecryptUpdate(&ctx->m_cipher,
+				  expect,
+				  &size,
+				  (BYTE*) digest,
+				  sizeof(expect));
+		BYTE digestData[PTP_DIGEST_SIZE];
+		EVP_DigestFinal(&digestCtx, digestData, NULL);
+		if (memcmp(digestData, expect, sizeof(digestData)) != 0)
+			total = -1;
+	}
 	return total;
 }
 
+/**
+ * PTP::Key::EncryptBatch: Encrypt several messages.
+ * @msgs: Messages.  Each size is replaced by the ciphertext size, or
+ *        -1 if the message is invalid.
+ * @count: Number of messages.
+ * @ctx: Cipher context to reuse or NULL.
+ * Returns: 0 on success or -1 if any message could not be encrypted.
+ * Notes: Each ciphertext is the same as the output of the buffer
+ *        &Encrypt (with an IV and digest), and each @dst must hold
+ *        &GetCipherSize bytes.  The cipher is set up once and the
+ *        IVs are drawn together, so many small messages cost little
+ *        more than the cipher itself.  No memory is allocated.  Only
+ *        stream ciphers are supported.
+ * Example:
+ *   PTP::Key::Message msgs[] = {{a, asize, abuf}, {b, bsize, bbuf}};
+ *   $EncryptBatch(msgs, 2);
+ *   send(abuf, msgs[0].size);
+ */
+int
+PTP::Key::EncryptBatch(Message *msgs, int count, Context *ctx) const
+{
+	// check arguments
+	if (!msgs || count < 0
+	    || (m_cipher == SESSION_CIPHER
+		&& EVP_CIPHER_block_size(PTP_SESSION_CIPHER) != 1))
+		return -1;
+
+	Context local;
+	if (!ctx)
+		ctx = &local;
+	int ivsize = GetIvSize();
+	BYTE ivs[BATCH_IV_COUNT * MAX_IV_SIZE];
+	int st = 0;
+	for (int i = 0; i < count; i++)
+	{
+		// draw the IVs for the next messages at once
+		int j = i % BATCH_IV_COUNT;
+		if (j == 0)
+		{
+			int n = count - i;
+			if (n > BATCH_IV_COUNT)
+				n = BATCH_IV_COUNT;
+			PTP::Random::Fill(ivs, n * ivsize);
+		}
+
+		Message *msg = msgs + i;
+		if (!msg->src || !msg->dst || msg->size <= 0)
+		{
+			msg->size = -1;
+			st = -1;
+			continue;
+		}
+
+		// the IV goes in front, so move the plaintext up
+		BYTE *iv = ivs + j * ivsize;
+		memmove(msg->dst + ivsize, msg->src, msg->size);
+		memcpy(msg->dst, iv, ivsize);
+		Span span = {msg->dst + ivsize, msg->size};
+		EncryptSpans(&span, 1, iv, span.data + span.size, ctx);
+		msg->size += ivsize + GetDigestSize();
+	}
+	return st;
+}
+
+/**
+ * PTP::Key::DecryptBatch: Decrypt several messages.
+ * @msgs: Messages.  Each size is replaced by the plaintext size, or
+ *        -1 if the message is invalid or its digest does not match.
+ * @count: Number of messages.
+ * @ctx: Cipher context to reuse or NULL.
+ * Returns: 0 on success or -1 if any message could not be decrypted.
+ * Notes: Each message is the output of the buffer &Encrypt or
+ *        &EncryptBatch.  The cipher is set up once for all of them.
+ *        No memory is allocated.  Only stream ciphers are supported.
+ * Example:
+ *   if ($DecryptBatch(msgs, count) < 0)
+ *       ...check each msgs[i].size...
+ */
+int
+PTP::Key::DecryptBatch(Message *msgs, int count, Context *ctx) const
+{
+	// check arguments
+	if (!msgs || count < 0
+	    || (m_cipher == SESSION_CIPHER
+		&& EVP_CIPHER_block_size(PTP_SESSION_CIPHER) != 1))
+		return -1;
+
+	Context local;
+	if (!ctx)
+		ctx = &local;
+	int ivsize = GetIvSize();
+	int digestsize = GetDigestSize();
+	int st = 0;
+	for (int i = 0; i < count; i++)
+	{
+		Message *msg = msgs + i;
+		int size = msg->size - ivsize - digestsize;
+		if (!msg->src || !msg->dst || size <= 0)
+		{
+			msg->size = -1;
+			st = -1;
+			continue;
+		}
+
+		// the plaintext moves down over the IV
+		BYTE iv[MAX_IV_SIZE];
+		BYTE digest[MAX_DIGEST_SIZE];
+		memcpy(iv, msg->src, ivsize);
+		memcpy(digest, msg->src + ivsize + size, digestsize);
+		memmove(msg->dst, msg->src + ivsize, size);
+		Span span = {msg->dst, size};
+		msg->size = Decrypt(&span, 1, iv, digest, ctx);
+		if (msg->size < 0)
+			st = -1;
+	}
+	return st;
+}
+
 /**
  * PTP::Key::Encrypt: Encrypt data from @read and send to @write.
  * @read: Data read function.
@@ -319,6 +870,13 @@ PTP::Key::Encrypt(
 	// check arguments
 	if (!read)
 		return -1;
+	if (m_cipher == CHACHA20_POLY1305)
+		return EncryptChaCha(read,
+				     write,
+				     context,
+				     iv,
+				     digest,
+				     readsize);
 	int total = 0;
 
 	// create and send a random IV
@@ -333,8 +891,9 @@ PTP::Key::Encrypt(
 	else
 		memset(ivData, 0, sizeof(ivData));
 
-	EVP_CIPHER_CTX ctx;
-	EVP_EncryptInit(&ctx, PTP_SESSION_CIPHER, (BYTE*) m_key, ivData);
+	Context cipherCtx;
+	Init(&cipherCtx, ivData, 1);
+	EVP_CIPHER_CTX &ctx = cipherCtx.m_cipher;
 	EVP_MD_CTX digestCtx;
 	if (digest)
 		EVP_DigestInit(&digestCtx, PTP_DIGEST);
@@ -425,6 +984,13 @@ PTP::Key::Decrypt(
 	// check arguments
 	if (!read)
 		return -1;
+	if (m_cipher == CHACHA20_POLY1305)
+		return DecryptChaCha(read,
+				     write,
+				     context,
+				     iv,
+				     digest,
+				     readsize);
 	int total = 0;
 
 	// fetch IV
@@ -438,8 +1004,9 @@ PTP::Key::Decrypt(
 	else
 		memset(ivData, 0, sizeof(ivData));
 
-	EVP_CIPHER_CTX ctx;
-	EVP_DecryptInit(&ctx, PTP_SESSION_CIPHER, (BYTE*) m_key, ivData);
+	Context cipherCtx;
+	Init(&cipherCtx, ivData, 0);
+	EVP_CIPHER_CTX &ctx = cipherCtx.m_cipher;
 	EVP_MD_CTX digestCtx;
 	if (digest)
 		EVP_DigestInit(&digestCtx, PTP_DIGEST);
@@ -540,73 +1107,546 @@ PTP::Key::Decrypt(
 }
 
 /**
- * PTP::Key::Transfer: Transfer data from @read to @write.
- * Type: static
+ * PTP::Key::EncryptChunked: Encrypt data from @read in independent
+ *                           chunks and send to @write.
  * @read: Data read function.
  * @write: Data write function or NULL.
  * @context: Context for @read and @write.
- * @readsize: Size of read buffer (default: 1024 bytes).
- * Returns: Total transfer size on success or -1 on error.
- * Notes: &Transfer performs no encryption or decryption on the data stream.
+ * @pool: Thread pool to encrypt chunks in parallel or NULL.
+ * @chunksize: Plaintext size of each chunk (default: 64K bytes).
+ * Returns: Total ciphertext size on success or -1 on error.
+ * Notes: The ciphertext is the chunk size and a random IV, followed
+ *        by each chunk's ciphertext and tag.  The tag is an HMAC of
+ *        the ciphertext (or the Poly1305 tag).  Every chunk has its
+ *        own IV derived from its position, and the last chunk (which
+ *        is shorter than @chunksize, possibly empty) is marked, so
+ *        chunks cannot be reordered, dropped or truncated.  @read
+ *        and @write are only called by the calling thread and the
+ *        output is in order.  Only stream ciphers are supported.
+ *        Parts of the data can be sent with &EncryptRange.
  * Example:
- *   // transfer data from stdin to stdout
- *   int Read(BYTE *buffer, int size, void *context)
- *       {return fread(buffer, 1, size, stdin);}
- *   int Write(const BYTE *buffer, int size, void *context)
- *       {return fwrite(buffer, 1, size, stdout);}
- *   ...
- *   $PTP::Key::Transfer(Read, Write, NULL, 2048);
+ *   PTP::ThreadPool pool;
+ *   int size = key->GetChunkedSize(entry->GetSize());
+ *   c->WriteHttp(PTP::Net::HTTP_OK, NULL, NULL, NULL, size);
+ *   key->$EncryptChunked(Read, Write, &ctx, &pool);
  */
 int
-PTP::Key::Transfer(
+PTP::Key::EncryptChunked(
 	Read read,
 	Write write,
 	void *context,
-	int readsize)
+	PTP::ThreadPool *pool,
+	int chunksize) const
 {
-        BYTE *buffer = new BYTE[readsize];
-        int size = 0;
-        for (;;)
-        {
-                int s = (*read)(buffer, readsize, context);
-                if (s <= 0)
-                        break;
-                if (write)
-                        (*write)(buffer, s, context);
-                size += s;
-        }
-        delete [] buffer;
-        return size;
+	return EncryptRange(read, write, context, 0, -1, pool, chunksize);
 }
 
 /**
- * PTP::Key::Export: Export key.
- * @data: [$OUT] Key data (%KEY_SIZE bytes) or NULL.
- * Returns: Data size (always %KEY_SIZE).
+ * PTP::Key::DecryptChunked: Decrypt data from @read in independent
+ *                           chunks and send to @write.
+ * @read: Data read function.
+ * @write: Data write function or NULL.
+ * @context: Context for @read and @write.
+ * @pool: Thread pool to decrypt chunks in parallel or NULL.
+ * Returns: Total plaintext size on success or -1 on error or an
+ *          invalid, missing or reordered chunk.
+ * Notes: Each chunk is verified before it is sent to @write, but a
+ *        message that fails part way will have been partly sent.
  * Example:
- *   PTP::Key *key = ...;
- *   BYTE data[PTP::Key::KEY_SIZE];
- *   key->Export(data);
+ *   int size = key->$DecryptChunked(Read, Write, &ctx, &pool);
+ *   if (size < 0)
+ *       return -1;
  */
 int
-PTP::Key::Export(BYTE *data) const
+PTP::Key::DecryptChunked(
+	Read read,
+	Write write,
+	void *context,
+	PTP::ThreadPool *pool) const
 {
-	if (data)
-		memcpy(data, m_key, KEY_SIZE);
-	return KEY_SIZE;
+	return DecryptRange(read, write, context, 0, -1, pool);
 }
 
-/*
- * PTP::Key::ReadAll: Read data until entire buffer is full.
- * Type: static
+/**
+ * PTP::Key::EncryptRange: Encrypt the chunks holding part of the data
+ *                         from @read and send to @write.
  * @read: Data read function.
- * @buffer: [$OUT] Data buffer.
- * @size: Buffer size.
- * @context: Context for @read.
- * Returns: Number of bytes read or -1 on error.
- */
-int
-PTP::Key::ReadAll(PTP::Key::Read read,
+ * @write: Data write function or NULL.
+ * @context: Context for @read and @write.
+ * @offset: Plaintext offset of the range.
+ * @length: Plaintext size of the range or -1 for the rest of the data.
+ * @pool: Thread pool to encrypt chunks in parallel or NULL.
+ * @chunksize: Plaintext size of each chunk (default: 64K bytes).
+ * Returns: Total ciphertext size on success or -1 on error.
+ * Notes: Only whole chunks are sent, so @read must start at
+ *        &GetChunkedOffset(@offset), not at @offset.  The range is
+ *        sent in the &EncryptChunked format with a new random IV and
+ *        is decrypted with &DecryptRange using the same @offset and
+ *        @length.  If the data ends within the range, the range
+ *        ends with the last chunk.
+ * Example:
+ *   // resume a download at byte 'offset'
+ *   int size = key->GetChunkedSize(filesize,
+ *                                  PTP::Key::CHUNK_SIZE_DEFAULT,
+ *                                  offset);
+ *   fseek(fp, PTP::Key::GetChunkedOffset(offset), SEEK_SET);
+ *   key->$EncryptRange(Read, Write, &ctx, offset, -1, &pool);
+ */
+int
+PTP::Key::EncryptRange(
+	Read read,
+	Write write,
+	void *context,
+	int offset,
+	int length,
+	PTP::ThreadPool *pool,
+	int chunksize) const
+{
+	// check arguments
+	if (!read
+	    || offset < 0
+	    || chunksize <= 0
+	    || chunksize > MAX_CHUNK_SIZE
+	    || (m_cipher == SESSION_CIPHER
+		&& EVP_CIPHER_block_size(PTP_SESSION_CIPHER) != 1))
+		return -1;
+
+	// send the chunk size and a random IV
+	int total = 0;
+	BYTE hdr[CHUNK_HEADER_SIZE + MAX_IV_SIZE];
+	int hdrsize = CHUNK_HEADER_SIZE + GetIvSize();
+	hdr[0] = (BYTE) (chunksize >> 24);
+	hdr[1] = (BYTE) (chunksize >> 16);
+	hdr[2] = (BYTE) (chunksize >> 8);
+	hdr[3] = (BYTE) chunksize;
+	PTP::Random::Fill(hdr + CHUNK_HEADER_SIZE, GetIvSize());
+	if (WriteAll(write, hdr, hdrsize, context, &total) != hdrsize)
+		return -1;
+
+	int count = GetBatchSize(pool);
+	int digestsize = GetDigestSize();
+	BYTE **data = new BYTE*[count];
+	int *size = new int[count];
+	int i;
+	for (i = 0; i < count; i++)
+		data[i] = new BYTE[chunksize + MAX_DIGEST_SIZE];
+
+	unsigned long index = offset / chunksize;
+	long remain = GetChunkCount(offset, length, chunksize);
+	int final = 0;
+	while (!final && remain != 0)
+	{
+		// read a batch of chunks (a short chunk is the last)
+		int n;
+		for (n = 0; n < count && !final && remain != 0; n++)
+		{
+			size[n] = ReadAll(read, data[n], chunksize, context);
+			if (size[n] < 0)
+			{
+				total = -1;
+				break;
+			}
+			final = (size[n] < chunksize);
+			if (remain > 0)
+				remain--;
+		}
+		if (total < 0)
+			break;
+
+		// encrypt the chunks in parallel and send them in order
+		Batch *batch = new Batch(this,
+					 1,
+					 hdr + CHUNK_HEADER_SIZE,
+					 index,
+					 data,
+					 size,
+					 n,
+					 final);
+		batch->Execute(pool);
+		batch->Release();
+		index += n;
+		for (i = 0; i < n && total >= 0; i++)
+		{
+			int s = size[i] + digestsize;
+			if (WriteAll(write, data[i], s, context, &total) != s)
+				total = -1;
+		}
+		if (total < 0)
+			break;
+	}
+
+	for (i = 0; i < count; i++)
+		delete [] data[i];
+	delete [] data;
+	delete [] size;
+	return total;
+}
+
+/**
+ * PTP::Key::DecryptRange: Decrypt part of the data from @read and send
+ *                         to @write.
+ * @read: Data read function.
+ * @write: Data write function or NULL.
+ * @context: Context for @read and @write.
+ * @offset: Plaintext offset of the range.
+ * @length: Plaintext size of the range or -1 for the rest of the data.
+ * @pool: Thread pool to decrypt chunks in parallel or NULL.
+ * Returns: Plaintext size sent to @write on success or -1 on error or
+ *          an invalid, missing or reordered chunk.
+ * Notes: @read supplies the output of &EncryptRange for the same
+ *        @offset and @length.  Only the plaintext from @offset is
+ *        sent to @write, and less than @length is sent only if the
+ *        data ends within the range.
+ * Example:
+ *   // append the rest of a partial download
+ *   fseek(fp, 0, SEEK_END);
+ *   int size = key->$DecryptRange(Read, Write, &ctx, ftell(fp));
+ */
+int
+PTP::Key::DecryptRange(
+	Read read,
+	Write write,
+	void *context,
+	int offset,
+	int length,
+	PTP::ThreadPool *pool) const
+{
+	// check arguments
+	if (!read
+	    || offset < 0
+	    || (m_cipher == SESSION_CIPHER
+		&& EVP_CIPHER_block_size(PTP_SESSION_CIPHER) != 1))
+		return -1;
+
+	// fetch the chunk size and IV
+	BYTE hdr[CHUNK_HEADER_SIZE + MAX_IV_SIZE];
+	int hdrsize = CHUNK_HEADER_SIZE + GetIvSize();
+	if (ReadAll(read, hdr, hdrsize, context) != hdrsize)
+		return -1;
+	int chunksize = ((hdr[0] << 24)
+			 | (hdr[1] << 16)
+			 | (hdr[2] << 8)
+			 | hdr[3]);
+	if (chunksize <= 0 || chunksize > MAX_CHUNK_SIZE)
+		return -1;
+
+	int count = GetBatchSize(pool);
+	int digestsize = GetDigestSize();
+	BYTE **data = new BYTE*[count];
+	int *size = new int[count];
+	int i;
+	for (i = 0; i < count; i++)
+		data[i] = new BYTE[chunksize + digestsize];
+
+	// the range starts part way into its first chunk
+	int skip = offset % chunksize;
+	int total = 0;
+	unsigned long index = offset / chunksize;
+	long remain = GetChunkCount(offset, length, chunksize);
+	int final = 0;
+	while (!final && remain != 0)
+	{
+		// read a batch of chunks (a short chunk is the last)
+		int n;
+		for (n = 0; n < count && !final && remain != 0; n++)
+		{
+			int s = ReadAll(read,
+					data[n],
+					chunksize + digestsize,
+					context);
+			if (s < digestsize)
+			{
+				total = -1;
+				break;
+			}
+			size[n] = s - digestsize;
+			final = (size[n] < chunksize);
+			if (remain > 0)
+				remain--;
+		}
+		if (total < 0)
+			break;
+
+		// decrypt the chunks in parallel and send them in order
+		Batch *batch = new Batch(this,
+					 0,
+					 hdr + CHUNK_HEADER_SIZE,
+					 index,
+					 data,
+					 size,
+					 n,
+					 final);
+		int st = batch->Execute(pool);
+		batch->Release();
+		index += n;
+		if (st < 0)
+		{
+			total = -1;
+			break;
+		}
+		for (i = 0; i < n && total >= 0; i++)
+		{
+			BYTE *start = data[i];
+			int s = size[i];
+			if (skip > 0)
+			{
+				int drop = (skip < s) ? skip:s;
+				start += drop;
+				s -= drop;
+				skip = 0;
+			}
+			if (length >= 0 && s > length - total)
+				s = length - total;
+			if (WriteAll(write, start, s, context, &total) != s)
+				total = -1;
+		}
+		if (total < 0)
+			break;
+	}
+
+	for (i = 0; i < count; i++)
+		delete [] data[i];
+	delete [] data;
+	delete [] size;
+	return total;
+}
+
+/**
+ * PTP::Key::GetChunkedSize: Calculate &EncryptChunked or &EncryptRange
+ *                           ciphertext size.
+ * @size: Plaintext size.
+ * @chunksize: Plaintext size of each chunk.
+ * @offset: Plaintext offset of the range (default: 0).
+ * @length: Plaintext size of the range or -1 for the rest of the data
+ *          (the default).
+ * Returns: Ciphertext size or -1 if an argument is invalid.
+ */
+int
+PTP::Key::GetChunkedSize(int size, int chunksize, int offset, int length)
+	const
+{
+	if (size < 0
+	    || chunksize <= 0
+	    || chunksize > MAX_CHUNK_SIZE
+	    || offset < 0
+	    || offset > size)
+		return -1;
+
+	// the last chunk sent and the plaintext it ends at
+	int first = offset / chunksize;
+	int last = size / chunksize;
+	long count = GetChunkCount(offset, length, chunksize);
+	if (count >= 0 && first + count - 1 < last)
+		last = (int) (first + count - 1);
+	int end = (last < size / chunksize) ? (last + 1) * chunksize:size;
+	return (CHUNK_HEADER_SIZE
+		+ GetIvSize()
+		+ (end - first * chunksize)
+		+ (last - first + 1) * GetDigestSize());
+}
+
+/**
+ * PTP::Key::GetChunkedOffset: Find where &EncryptRange starts reading.
+ * Type: static
+ * @offset: Plaintext offset of the range.
+ * @chunksize: Plaintext size of each chunk.
+ * Returns: Plaintext offset of the chunk holding @offset or -1 if an
+ *          argument is invalid.
+ */
+int
+PTP::Key::GetChunkedOffset(int offset, int chunksize)
+{
+	if (offset < 0 || chunksize <= 0 || chunksize > MAX_CHUNK_SIZE)
+		return -1;
+	return offset - offset % chunksize;
+}
+
+/**
+ * PTP::Key::Transfer: Transfer data from @read to @write.
+ * Type: static
+ * @read: Data read function.
+ * @write: Data write function or NULL.
+ * @context: Context for @read and @write.
+ * @readsize: Size of read buffer (default: 1024 bytes).
+ * Returns: Total transfer size on success or -1 on error.
+ * Notes: &Transfer performs no encryption or decryption on the data stream.
+ * Example:
+ *   // transfer data from stdin to stdout
+ *   int Read(BYTE *buffer, int size, void *context)
+ *       {return fread(buffer, 1, size, stdin);}
+ *   int Write(const BYTE *buffer, int size, void *context)
+ *       {return fwrite(buffer, 1, size, stdout);}
+ *   ...
+ *   $PTP::Key::Transfer(Read, Write, NULL, 2048);
+ */
+int
+PTP::Key::Transfer(
+	Read read,
+	Write write,
+	void *context,
+	int readsize)
+{
+        BYTE *buffer = new BYTE[readsize];
+        int size = 0;
+        for (;;)
+        {
+                int s = (*read)(buffer, readsize, context);
+                if (s <= 0)
+                        break;
+                if (write)
+                        (*write)(buffer, s, context);
+                size += s;
+        }
+        delete [] buffer;
+        return size;
+}
+
+/**
+ * PTP::Key::GetCipherSize: Calculate ciphertext size.
+ * Type: static
+ * @size: Plaintext size.
+ * @iv: 1 to include an IV (default).
+ * @digest: 1 to include a message digest (default).
+ * @cipher: Cipher used (see &GetCipher).
+ * Returns: Size of the ciphertext that &Encrypt produces for @size
+ *          bytes of plaintext, or -1 if @size is invalid.
+ * Notes: The size is calculated without encrypting anything, so a
+ *        stream can be sent with a known length in a single pass.
+ * Example:
+ *   int size = PTP::Key::$GetCipherSize(entry->GetSize(),
+ *                                       1,
+ *                                       1,
+ *                                       key->GetCipher());
+ *   c->WriteHttp(PTP::Net::HTTP_OK, NULL, NULL, NULL, size);
+ *   key->Encrypt(Read, Write, &ctx);
+ */
+int
+PTP::Key::GetCipherSize(int size, int iv, int digest, Cipher cipher)
+{
+	if (size < 0)
+		return -1;
+	if (cipher == CHACHA20_POLY1305)
+	{
+		return size
+			+ (iv ? PTP::ChaCha::NONCE_SIZE:0)
+			+ (digest ? PTP::ChaCha::TAG_SIZE:0);
+	}
+
+	int total = size;
+	if (digest)
+		total += PTP_DIGEST_SIZE;
+
+	// block ciphers always add between 1 and block bytes of padding
+	int block = EVP_CIPHER_block_size(PTP_SESSION_CIPHER);
+	if (block > 1)
+		total = (total / block + 1) * block;
+
+	if (iv)
+		total += IV_SIZE;
+	return total;
+}
+
+/**
+ * PTP::Key::Export: Export key.
+ * @data: [$OUT] Key data (%KEY_SIZE bytes) or NULL.
+ * Returns: Data size (always %KEY_SIZE).
+ * Example:
+ *   PTP::Key *key = ...;
+ *   BYTE data[PTP::Key::KEY_SIZE];
+ *   key->Export(data);
+ */
+int
+PTP::Key::Export(BYTE *data) const
+{
+	if (data)
+		memcpy(data, m_key, KEY_SIZE);
+	return KEY_SIZE;
+}
+
+/**
+ * PTP::Key::Import: Replace the key.
+ * @data: Key data (%KEY_SIZE bytes).
+ * Notes: Messages being encrypted or decrypted with the key by other
+ *        threads at the same time may be garbled.
+ * Example:
+ *   BYTE data[PTP::Key::KEY_SIZE];
+ *   ...
+ *   key->Import(data);
+ */
+void
+PTP::Key::Import(const BYTE *data)
+{
+	memcpy(m_key, data, sizeof(m_key));
+	EVP_CIPHER_CTX_cleanup(&m_schedule);
+	Schedule();
+}
+
+/**
+ * PTP::Key::SetCipher: Choose the cipher used with the key.
+ * @cipher: %SESSION_CIPHER or %CHACHA20_POLY1305.
+ * Returns: 0 on success or -1 on an unknown cipher.
+ * Notes: Both peers must use the same cipher, so the choice is
+ *        normally negotiated.  The key data itself is unchanged.
+ * Example:
+ *   PTP::Key key;
+ *   key.$SetCipher(PTP::Key::CHACHA20_POLY1305);
+ */
+int
+PTP::Key::SetCipher(Cipher cipher)
+{
+	if (cipher != SESSION_CIPHER && cipher != CHACHA20_POLY1305)
+		return -1;
+	m_cipher = cipher;
+	return 0;
+}
+
+/**
+ * PTP::Key::GetCipher: Get the cipher used with the key.
+ * Returns: %SESSION_CIPHER or %CHACHA20_POLY1305.
+ */
+PTP::Key::Cipher
+PTP::Key::GetCipher() const
+{
+	return m_cipher;
+}
+
+/**
+ * PTP::Key::GetIvSize: Get the IV size of the key's cipher.
+ * Returns: IV size (at most %MAX_IV_SIZE).
+ */
+int
+PTP::Key::GetIvSize() const
+{
+	if (m_cipher == CHACHA20_POLY1305)
+		return PTP::ChaCha::NONCE_SIZE;
+	return IV_SIZE;
+}
+
+/**
+ * PTP::Key::GetDigestSize: Get the message digest size of the key's
+ *                          cipher.
+ * Returns: Message digest (or authentication tag) size (at most
+ *          %MAX_DIGEST_SIZE).
+ */
+int
+PTP::Key::GetDigestSize() const
+{
+	if (m_cipher == CHACHA20_POLY1305)
+		return PTP::ChaCha::TAG_SIZE;
+	return PTP_DIGEST_SIZE;
+}
+
+/*
+ * PTP::Key::ReadAll: Read data until entire buffer is full.
+ * Type: static
+ * @read: Data read function.
+ * @buffer: [$OUT] Data buffer.
+ * @size: Buffer size.
+ * @context: Context for @read.
+ * Returns: Number of bytes read or -1 on error.
+ */
+int
+PTP::Key::ReadAll(PTP::Key::Read read,
 		  BYTE *buffer,
 		  int size,
 		  void *context)
@@ -661,3 +1701,448 @@ PTP::Key::WriteAll(PTP::Key::Write write,
 	*total += writesize;
 	return writesize;
 }
+
+/*
+ * PTP::Key::Init: Prepare a cipher context for a message.
+ * @ctx: Cipher context.
+ * @iv: Message IV.
+ * @enc: 1 to encrypt or 0 to decrypt.
+ * Notes: Only the IV is reset if @ctx was last used with this key
+ *        and direction.  Otherwise the key's cipher state is copied
+ *        rather than expanding the key again.  For ChaCha20-Poly1305
+ *        @iv is the message nonce.
+ */
+void
+PTP::Key::Init(Context *ctx, const BYTE *iv, int enc) const
+{
+	int same = (ctx->m_type == m_cipher
+		    && !memcmp(ctx->m_key, m_key, sizeof(m_key)));
+	if (m_cipher == CHACHA20_POLY1305)
+	{
+		// ChaCha20 has no key schedule to speak of
+		if (!same)
+			ctx->m_chacha.SetKey(m_key, sizeof(m_key));
+		ctx->m_chacha.Start(iv);
+		memcpy(ctx->m_key, m_key, sizeof(m_key));
+		ctx->m_type = m_cipher;
+		return;
+	}
+
+	if (same && ctx->m_enc == enc)
+	{
+		EVP_CipherInit(&ctx->m_cipher, NULL, NULL, (BYTE*) iv, enc);
+		return;
+	}
+
+	// stream modes only use the cipher's encrypt direction
+	int mode = PTP_SESSION_CIPHER->flags & EVP_CIPH_MODE;
+	if (enc
+	    || mode == EVP_CIPH_STREAM_CIPHER
+	    || mode == EVP_CIPH_CFB_MODE
+	    || mode == EVP_CIPH_OFB_MODE)
+	{
+		// the schedule is inline in the (0.9.6) context
+		EVP_CIPHER_CTX_cleanup(&ctx->m_cipher);
+		memcpy(&ctx->m_cipher, &m_schedule, sizeof(m_schedule));
+		EVP_CipherInit(&ctx->m_cipher, NULL, NULL, (BYTE*) iv, enc);
+	}
+	else
+	{
+		EVP_CipherInit(&ctx->m_cipher,
+			       PTP_SESSION_CIPHER,
+			       (BYTE*) m_key,
+			       (BYTE*) iv,
+			       enc);
+	}
+	memcpy(ctx->m_key, m_key, sizeof(m_key));
+	ctx->m_type = m_cipher;
+	ctx->m_enc = enc;
+}
+
+/*
+ * PTP::Key::Schedule: Set up the cipher with the key.
+ */
+void
+PTP::Key::Schedule()
+{
+	EVP_CIPHER_CTX_init(&m_schedule);
+	EVP_EncryptInit(&m_schedule, PTP_SESSION_CIPHER, m_key, NULL);
+}
+
+/*
+ * PTP::Key::GetChunkIv: Derive the IV of a chunk.
+ * @iv: Message IV.
+ * @index: Chunk index.
+ * @final: 1 if the chunk is the last.
+ * @chunkIv: [$OUT] Chunk IV.
+ */
+void
+PTP::Key::GetChunkIv(const BYTE *iv,
+		     unsigned long index,
+		     int final,
+		     BYTE *chunkIv) const
+{
+	int ivsize = GetIvSize();
+	memcpy(chunkIv, iv, ivsize);
+	chunkIv[ivsize - 4] ^= (BYTE) (index >> 24);
+	chunkIv[ivsize - 3] ^= (BYTE) (index >> 16);
+	chunkIv[ivsize - 2] ^= (BYTE) (index >> 8);
+	chunkIv[ivsize - 1] ^= (BYTE) index;
+	if (final)
+		chunkIv[0] ^= CHUNK_FINAL;
+}
+
+/*
+ * PTP::Key::GetChunkMac: Calculate the MAC of a chunk (HMAC-SHA1).
+ * @iv: Message IV.
+ * @index: Chunk index.
+ * @final: 1 if the chunk is the last.
+ * @data: Chunk ciphertext.
+ * @size: Chunk size.
+ * @mac: [$OUT] Chunk MAC (%PTP_DIGEST_SIZE bytes).
+ * Notes: The MAC key is derived from the key, so the cipher and the
+ *        MAC never share a key.
+ */
+void
+PTP::Key::GetChunkMac(const BYTE *iv,
+		      unsigned long index,
+		      int final,
+		      const BYTE *data,
+		      int size,
+		      BYTE *mac) const
+{
+	static const char label[] = "PTP chunk MAC";
+	BYTE key[PTP_DIGEST_SIZE];
+	HMAC(PTP_DIGEST,
+	     m_key,
+	     sizeof(m_key),
+	     (BYTE*) label,
+	     sizeof(label) - 1,
+	     key,
+	     NULL);
+
+	BYTE pos[5];
+	pos[0] = (BYTE) (index >> 24);
+	pos[1] = (BYTE) (index >> 16);
+	pos[2] = (BYTE) (index >> 8);
+	pos[3] = (BYTE) index;
+	pos[4] = final ? CHUNK_FINAL:0;
+
+	HMAC_CTX ctx;
+	HMAC_Init(&ctx, key, sizeof(key), PTP_DIGEST);
+	HMAC_Update(&ctx, iv, GetIvSize());
+	HMAC_Update(&ctx, pos, sizeof(pos));
+	HMAC_Update(&ctx, data, size);
+	HMAC_Final(&ctx, mac, NULL);
+	HMAC_cleanup(&ctx);
+	memset(key, 0, sizeof(key));
+}
+
+/*
+ * PTP::Key::GetBatchSize: Get the number of chunks read at a time.
+ * @pool: Thread pool or NULL.
+ * Returns: Enough chunks to keep every pool thread busy.
+ */
+int
+PTP::Key::GetBatchSize(PTP::ThreadPool *pool) const
+{
+	if (!pool)
+		return 1;
+	return 2 * pool->GetThreads() + 1;
+}
+
+/*
+ * PTP::Key::GetChunkCount: Count the chunks holding a range.
+ * @offset: Plaintext offset of the range.
+ * @length: Plaintext size of the range or -1 for the rest of the data.
+ * @chunksize: Plaintext size of each chunk.
+ * Returns: Number of chunks or -1 for every chunk up to the last.
+ */
+long
+PTP::Key::GetChunkCount(int offset, int length, int chunksize)
+{
+	if (length < 0)
+		return -1;
+	if (length == 0)
+		return 0;
+	unsigned long first = offset / chunksize;
+	unsigned long last = ((unsigned long) offset + length - 1) / chunksize;
+	return (long) (last - first + 1);
+}
+
+/*
+ * PTP::Key::EncryptChaCha: Encrypt a buffer with ChaCha20-Poly1305.
+ * @plain: Plaintext data.
+ * @size: Plaintext size.
+ * @cipher: [$OUT] Ciphertext data.
+ * @iv: 1 to prepend a random nonce.
+ * @digest: 1 to append an authentication tag.
+ * @ctx: Cipher context to reuse or NULL.
+ * Returns: Ciphertext size or -1 if @iv is 0.
+ */
+int
+PTP::Key::EncryptChaCha(
+	const BYTE *plain,
+	int size,
+	BYTE *cipher,
+	int iv,
+	int digest,
+	Context *ctx) const
+{
+	// a fixed nonce would reuse the key stream of other messages
+	if (!iv)
+		return -1;
+
+	BYTE *dst = cipher;
+	BYTE nonce[PTP::ChaCha::NONCE_SIZE];
+	PTP::Random::Fill(nonce, sizeof(nonce));
+	if (plain < cipher + sizeof(nonce) + size && cipher < plain + size)
+	{
+		// encrypting in place: make room for the nonce
+		memmove(cipher + sizeof(nonce), plain, size);
+		plain = cipher + sizeof(nonce);
+	}
+	memcpy(dst, nonce, sizeof(nonce));
+	dst += sizeof(nonce);
+
+	Context local;
+	if (!ctx)
+		ctx = &local;
+	Init(ctx, nonce, 1);
+	ctx->m_chacha.Encrypt(plain, dst, size);
+	dst += size;
+	if (digest)
+	{
+		ctx->m_chacha.Finish(dst);
+		dst += PTP::ChaCha::TAG_SIZE;
+	}
+	return (dst - cipher);
+}
+
+/*
+ * PTP::Key::DecryptChaCha: Decrypt a buffer with ChaCha20-Poly1305.
+ * @cipher: Ciphertext data.
+ * @total: Plaintext size.
+ * @plain: [$OUT] Plaintext data.
+ * @iv: 1 to fetch the prepended nonce.
+ * @digest: 1 to verify the appended authentication tag.
+ * @ctx: Cipher context to reuse or NULL.
+ * Returns: Plaintext size or -1 on an invalid tag or if @iv is 0.
+ */
+int
+PTP::Key::DecryptChaCha(
+	const BYTE *cipher,
+	int total,
+	BYTE *plain,
+	int iv,
+	int digest,
+	Context *ctx) const
+{
+	if (!iv)
+		return -1;
+
+	BYTE nonce[PTP::ChaCha::NONCE_SIZE];
+	memcpy(nonce, cipher, sizeof(nonce));
+	cipher += sizeof(nonce);
+
+	BYTE tag[PTP::ChaCha::TAG_SIZE];
+	if (digest)
+		memcpy(tag, cipher + total, sizeof(tag));
+	if (plain > cipher && plain < cipher + total)
+	{
+		// the key stream is applied front to back
+		memmove(plain, cipher, total);
+		cipher = plain;
+	}
+
+	Context local;
+	if (!ctx)
+		ctx = &local;
+	Init(ctx, nonce, 0);
+	ctx->m_chacha.Decrypt(cipher, plain, total);
+	if (digest && ctx->m_chacha.Verify(tag) < 0)
+		return -1;
+	return total;
+}
+
+/*
+ * PTP::Key::EncryptChaCha: Encrypt a stream with ChaCha20-Poly1305.
+ * @read: Data read function.
+ * @write: Data write function or NULL.
+ * @context: Context for @read and @write.
+ * @iv: 1 to send a random nonce first.
+ * @digest: 1 to send an authentication tag last.
+ * @readsize: Size of read buffer.
+ * Returns: Total ciphertext size on success or -1 on error.
+ */
+int
+PTP::Key::EncryptChaCha(
+	Read read,
+	Write write,
+	void *context,
+	int iv,
+	int digest,
+	int readsize) const
+{
+	if (!iv)
+		return -1;
+
+	int total = 0;
+	BYTE nonce[PTP::ChaCha::NONCE_SIZE];
+	PTP::Random::Fill(nonce, sizeof(nonce));
+	if (WriteAll(write, nonce, sizeof(nonce), context, &total)
+	    != sizeof(nonce))
+		return -1;
+
+	Context ctx;
+	Init(&ctx, nonce, 1);
+	BYTE *buffer = new BYTE[readsize];
+	for (;;)
+	{
+		int size = ReadAll(read, buffer, readsize, context);
+		if (size <= 0)
+		{
+			if (size < 0)
+				total = -1;
+			break;
+		}
+		ctx.m_chacha.Encrypt(buffer, buffer, size);
+		if (WriteAll(write, buffer, size, context, &total) != size)
+		{
+			total = -1;
+			break;
+		}
+	}
+
+	if (total >= 0 && digest)
+	{
+		BYTE tag[PTP::ChaCha::TAG_SIZE];
+		ctx.m_chacha.Finish(tag);
+		if (WriteAll(write, tag, sizeof(tag), context, &total)
+		    != sizeof(tag))
+			total = -1;
+	}
+
+	delete [] buffer;
+	return total;
+}
+
+/*
+ * PTP::Key::DecryptChaCha: Decrypt a stream with ChaCha20-Poly1305.
+ * @read: Data read function.
+ * @write: Data write function or NULL.
+ * @context: Context for @read and @write.
+ * @iv: 1 to fetch the nonce first.
+ * @digest: 1 to verify the trailing authentication tag.
+ * @readsize: Size of read buffer.
+ * Returns: Total plaintext size on success or -1 on error or invalid
+ *          authentication tag.
+ */
+int
+PTP::Key::DecryptChaCha(
+	Read read,
+	Write write,
+	void *context,
+	int iv,
+	int digest,
+	int readsize) const
+{
+	if (!iv)
+		return -1;
+
+	int total = 0;
+	BYTE nonce[PTP::ChaCha::NONCE_SIZE];
+	if (ReadAll(read, nonce, sizeof(nonce), context) != sizeof(nonce))
+		return -1;
+
+	Context ctx;
+	Init(&ctx, nonce, 0);
+
+	// the last @keep bytes read may be the tag
+	int keep = digest ? PTP::ChaCha::TAG_SIZE:0;
+	BYTE *buffer = new BYTE[readsize + keep];
+	int size = 0;
+	for (;;)
+	{
+		int s = ReadAll(read,
+				buffer + size,
+				readsize + keep - size,
+				context);
+		if (s < 0)
+		{
+			total = -1;
+			break;
+		}
+		size += s;
+
+		int n = size - keep;
+		if (n > 0)
+		{
+			ctx.m_chacha.Decrypt(buffer, buffer, n);
+			if (WriteAll(write, buffer, n, context, &total) != n)
+			{
+				total = -1;
+				break;
+			}
+			memmove(buffer, buffer + n, keep);
+			size = keep;
+		}
+		if (s == 0)
+			break;
+	}
+
+	if (total >= 0
+	    && digest
+	    && (size != keep || ctx.m_chacha.Verify(buffer) < 0))
+		total = -1;
+
+	delete [] buffer;
+	return total;
+}
+
+/**
+ * PTP::Key::Context::Context: Class constructor.
+ * Example:
+ *   PTP::Key::Context ctx;
+ *   for (...)
+ *       key->Decrypt(packet, size, packet, 1, 1, &ctx);
+ */
+PTP::Key::Context::Context()
+	:m_type(-1), m_enc(-1)
+{
+	EVP_CIPHER_CTX_init(&m_cipher);
+	memset(m_key, 0, sizeof(m_key));
+}
+
+#ifdef PTPTL_DLL
+
+/*
+ * PTP::Key::Context::Context: Copy constructor.
+ * @ctx: Source Context.
+ */
+PTP::Key::Context::Context(const Context& ctx)
+{
+	assert(0);
+}
+
+/*
+ * PTP::Key::Context::operator=: Copy constructor.
+ * @ctx: Source Context.
+ */
+PTP::Key::Context&
+PTP::Key::Context::operator=(const Context& ctx)
+{
+	assert(0);
+	return *this;
+}
+
+#endif // PTPTL_DLL
+
+/**
+ * PTP::Key::Context::~Context: Class destructor.
+ */
+PTP::Key::Context::~Context()
+{
+	EVP_CIPHER_CTX_cleanup(&m_cipher);
+	memset(m_key, 0, sizeof(m_key));
+}
@@ -34,28 +34,74 @@
 #ifdef WIN32
 #include <winsock.h>
 #include <windows.h>
+#include <io.h>
 #else
 #include <sys/types.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <poll.h>
+#include <time.h>
 #endif
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <ptp/net.h>
+#include <ptp/resolver.h>
 #include <ptp/debug.h>
 
 PTP::Net::Ip PTP::Net::Connection::s_proxyIp = 0;
 PTP::Net::Port PTP::Net::Connection::s_proxyPort = 0;
 int PTP::Net::Connection::s_proxyTimeout = 0;
+PTP::Net::Connection::Route
+PTP::Net::Connection::s_routes[PTP::Net::Connection::ROUTE_CACHE_SIZE];
+PTP::Mutex PTP::Net::Connection::s_routeMutex;
 
 #define STRNCMP_CONST(x, y) strncmp((const char*)(x), (y), sizeof(y) - 1)
+#define MATCH_CONST(x, size, y) \
+	((size) >= (int) sizeof(y) - 1 && STRNCMP_CONST((x), (y)) == 0)
+
+/*
+ * MatchNoCase: Compare the start of a string, ignoring case.
+ * @str: String.
+ * @prefix: Prefix string.
+ * Returns: 1 if @str starts with @prefix or 0 otherwise.
+ */
+static int
+MatchNoCase(const char *str, const char *prefix)
+{
+	for (; *prefix; str++, prefix++)
+	{
+		if (tolower((unsigned char) *str)
+		    != tolower((unsigned char) *prefix))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * GetTime
+ * Returns: Current time (in seconds).
+ */
+static unsigned long
+GetTime()
+{
+#ifdef WIN32
+	return (GetTickCount() / 1000);
+#else
+	return time(NULL);
+#endif
+}
 
 #ifdef WIN32
 
@@ -97,6 +143,8 @@ NetInit::~NetInit()
  * @port: [$OUT] URL port number or NULL.
  * @defport: Default port number or 0 for none (default).
  * Returns: IP address or %INVALID on error.
+ * Notes: Host names are resolved through a cache (see
+ *        &PTP::Net::Resolver).
  * Example:
  *   PTP::Net::Port port;
  *   PTP::Net::Ip ip = PTP::Net::Lookup("http://www.linux.org", &port, 8080);
@@ -115,7 +163,6 @@ PTP::Net::Lookup(const char *url, Port *port, Port defport)
 			p = 80;
 	}
 
-	struct hostent *entry = NULL;
 	const char *sep = strchr(url, ':');
 	if (sep)
 		p = (Port) strtoul(sep + 1, NULL, 10);
@@ -135,26 +182,9 @@ PTP::Net::Lookup(const char *url, Port *port, Port defport)
 		url = name;
 	}
 
-	char host[MAX_HOSTNAME];
-	if (strcmp(url, "localhost") == 0)
-	{
-		if (gethostname(host, sizeof(host)) == 0)
-			url = host;
-	}
-	entry = gethostbyname(url);
+	Ip ip = Resolver::GetDefault()->Lookup(url);
 	delete [] name;
-
-	if (!entry)
-		return 0;
-
-	for (int i = 0; entry->h_addr_list[i]; i++)
-	{
-		Ip ip = ntohl(*(Ip*) entry->h_addr_list[i]);
-		if (ip)
-			return ip;
-	}
-	
-	return 0;
+	return ip;
 }
 
 /*
@@ -225,9 +255,11 @@ PTP::Net::Set16(void *dst, UINT16 src)
 PTP::Net::Connection::Connection(Type type, Net::Ip ip, Net::Port port)
 	:PTP::List::Entry(),
 	 m_type(type), m_dir(OUTBOUND),
-	 m_ip(ip), m_port(port),
-	 m_s(-1), m_close(1), m_proxy(UNKNOWN),
-	 m_unget(NULL), m_ungetLast(NULL), m_ungetNext(NULL)
+	 m_ip(ip), m_port(port), m_lastPort(0),
+	 m_s(-1), m_close(1), m_block(1), m_options(0),
+	 m_backlog(LISTEN_BACKLOG), m_keepAlive(1),
+	 m_httpClose(0), m_chunked(0), m_content(0), m_proxy(UNKNOWN),
+	 m_buffer(NULL), m_bufferSize(0), m_head(0), m_count(0)
 {
 }
 
@@ -241,9 +273,11 @@ PTP::Net::Connection::Connection(Type type, Net::Ip ip, Net::Port port)
 PTP::Net::Connection::Connection(Type type, Net::Port port)
 	:PTP::List::Entry(),
          m_type(type), m_dir(INBOUND),
-	 m_ip(0), m_port(port),
-	 m_s(-1), m_close(1), m_proxy(UNKNOWN),
-	 m_unget(NULL), m_ungetLast(NULL), m_ungetNext(NULL)
+	 m_ip(0), m_port(port), m_lastPort(0),
+	 m_s(-1), m_close(1), m_block(1), m_options(0),
+	 m_backlog(LISTEN_BACKLOG), m_keepAlive(1),
+	 m_httpClose(0), m_chunked(0), m_content(0), m_proxy(UNKNOWN),
+	 m_buffer(NULL), m_bufferSize(0), m_head(0), m_count(0)
 {
 }
 
@@ -264,9 +298,11 @@ PTP::Net::Connection::Connection(Type type, Net::Port port)
 PTP::Net::Connection::Connection(Type type, Dir dir, int s, int close)
 	:PTP::List::Entry(),
          m_type(type), m_dir(dir),
-	 m_ip(0), m_port(0),
-	 m_s(s), m_close(close), m_proxy(UNKNOWN),
-	 m_unget(NULL), m_ungetLast(NULL), m_ungetNext(NULL)
+	 m_ip(0), m_port(0), m_lastPort(0),
+	 m_s(s), m_close(close), m_block(1), m_options(0),
+	 m_backlog(LISTEN_BACKLOG), m_keepAlive(1),
+	 m_httpClose(0), m_chunked(0), m_content(0), m_proxy(UNKNOWN),
+	 m_buffer(NULL), m_bufferSize(0), m_head(0), m_count(0)
 {
 }
 
@@ -302,11 +338,12 @@ PTP::Net::Connection::~Connection()
 	if (!this)
 		return;
 	m_mutex.Lock();
-	if (m_unget)
+	if (m_buffer)
 	{
-		delete [] m_unget;
-		m_unget = NULL;
+		delete [] m_buffer;
+		m_buffer = NULL;
 	}
+	m_count = 0;
 	m_mutex.Unlock();
 	Close();
 }
@@ -351,6 +388,34 @@ PTP::Net::Connection::GetPort() const
 	return m_port;
 }
 
+/**
+ * PTP::Net::Connection::SetPortRange: Set the local ports a server may use.
+ * @first: First TCP port to try (or %ANY for any free port).
+ * @last: Last TCP port to try.
+ * Returns: 0 on success or -1 on error.
+ * Notes: &Open binds the first free port in the range, or fails if
+ *        every port is in use.  Pass the same port twice to fail
+ *        immediately if that port is in use.  Without a range, a
+ *        server tries each port from its constructor port upward.
+ *        A port used by any other socket is never free, even with
+ *        %REUSE_PORT set; only a single port passed twice is shared.
+ * Example:
+ *   PTP::Net::Connection c(PTP::Net::Connection::HTTP, 8080);
+ *   c.$SetPortRange(8080, 8089);
+ *   if (c.Open() < 0)
+ *     return -1;
+ *   printf("Listening on port %u\n", c.GetPort());
+ */
+int
+PTP::Net::Connection::SetPortRange(Net::Port first, Net::Port last)
+{
+	if (m_dir != INBOUND || m_s >= 0 || (first && last < first))
+		return -1;
+	m_port = first;
+	m_lastPort = first ? last:0;
+	return 0;
+}
+
 /**
  * PTP::Net::Connection::GetSocket
  * Returns: Socket or -1 if none.
@@ -361,6 +426,166 @@ PTP::Net::Connection::GetSocket() const
 	return m_s;
 }
 
+/**
+ * PTP::Net::Connection::GetError
+ * Returns: Pending socket error code or 0 if none.
+ * Notes: After a non-blocking &Open, the connection becomes writable
+ *        once the connect completes.  &GetError then returns 0 if the
+ *        connect succeeded.
+ */
+int
+PTP::Net::Connection::GetError() const
+{
+	if (m_s < 0)
+		return -1;
+	int error = 0;
+	socklen_t size = sizeof(error);
+	if (getsockopt(m_s, SOL_SOCKET, SO_ERROR, (char*) &error, &size))
+		return -1;
+	return error;
+}
+
+/**
+ * PTP::Net::Connection::IsIdle
+ * Returns: 1 if the connection is open with nothing to read or 0 if
+ *          it is closed, has data, or the peer closed or reset it.
+ * Notes: &IsIdle does not wait.  It is a cheap check that an unused
+ *        connection can still carry a new request.
+ */
+int
+PTP::Net::Connection::IsIdle() const
+{
+	if (m_s < 0 || m_count)
+		return 0;
+
+#ifdef WIN32
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(m_s, &fds);
+	struct timeval tmo;
+	memset(&tmo, 0, sizeof(tmo));
+	int status = select(m_s + 1, &fds, NULL, NULL, &tmo);
+#else
+	struct pollfd fds;
+	fds.fd = m_s;
+	fds.events = POLLIN;
+	fds.revents = 0;
+	int status = poll(&fds, 1, 0);
+#endif
+	return (status == 0);
+}
+
+/**
+ * PTP::Net::Connection::SetBlocking: Set blocking or non-blocking mode.
+ * @block: 1 for blocking (default) or 0 for non-blocking.
+ * Returns: 0 on success or -1 on error.
+ * Notes: In non-blocking mode, &Open starts a connect and returns
+ *        immediately, &Accept returns NULL if no connection is
+ *        pending, and &Read and &Write return %AGAIN if they would
+ *        block.  Non-blocking connections are typically driven
+ *        by a &PTP::Net::Reactor.  A non-blocking &Open only goes
+ *        through the proxy if the destination is known to require it.
+ * Example:
+ *   PTP::Net::Connection c(PTP::Net::Connection::RAW, 6346);
+ *   c.$SetBlocking(0);
+ *   c.Open();
+ */
+int
+PTP::Net::Connection::SetBlocking(int block)
+{
+	m_block = block ? 1:0;
+	if (m_s >= 0)
+		return SetBlocking(m_s, m_block);
+	return 0;
+}
+
+/**
+ * PTP::Net::Connection::GetOptions
+ * Returns: Socket options (see &SetOptions).
+ */
+int
+PTP::Net::Connection::GetOptions() const
+{
+	return m_options;
+}
+
+/**
+ * PTP::Net::Connection::GetBacklog
+ * Returns: Maximum number of pending connections for a server.
+ */
+int
+PTP::Net::Connection::GetBacklog() const
+{
+	return m_backlog;
+}
+
+/**
+ * PTP::Net::Connection::SetBacklog: Set the pending connection limit.
+ * @backlog: Maximum number of connections waiting to be accepted.
+ * Notes: The limit applies when a server connection is next opened.
+ *        Connections beyond it are refused or dropped by the system,
+ *        so servers that see bursts of connections need a larger one.
+ */
+void
+PTP::Net::Connection::SetBacklog(int backlog)
+{
+	m_backlog = backlog;
+}
+
+/**
+ * PTP::Net::Connection::SetOptions: Tune the connection for its traffic.
+ * @options: Socket options (%NO_DELAY, %LARGE_BUFFERS, %REUSE_PORT,
+ *           or the presets %LATENCY and %BULK).
+ * Returns: 0 on success or -1 on error.
+ * Notes: The options are kept if the connection is reopened, and
+ *        connections from &Accept start with the options of the
+ *        server connection.  Buffer sizes are not reduced again once
+ *        %LARGE_BUFFERS is set on an open connection.  %REUSE_PORT
+ *        must be set before a server connection is opened, and
+ *        only joins a port given with &SetPortRange(port, port).
+ * Example:
+ *   PTP::Net::Connection c(PTP::Net::Connection::RAW, ip, port);
+ *   c.$SetOptions(PTP::Net::Connection::LATENCY);
+ */
+int
+PTP::Net::Connection::SetOptions(int options)
+{
+	m_options = options;
+	if (m_s >= 0)
+		return SetOptions(m_s, m_options);
+	return 0;
+}
+
+/**
+ * PTP::Net::Connection::GetKeepAlive
+ * Returns: 1 if the connection stays open after the current HTTP
+ *          request or 0 if it closes.
+ * Notes: &ReadHttpHdr updates the value from each HTTP header read.
+ *        HTTP/1.1 connections stay open unless the peer sends
+ *        "Connection: close".  HTTP/1.0 connections close unless
+ *        the peer sends "Connection: keep-alive".  If the server
+ *        closes the connection, the next request sent with
+ *        &WriteHttp reconnects.
+ */
+int
+PTP::Net::Connection::GetKeepAlive() const
+{
+	return (m_keepAlive && !m_httpClose);
+}
+
+/**
+ * PTP::Net::Connection::SetKeepAlive: Keep the connection open.
+ * @keepAlive: 1 to keep the connection open between HTTP requests
+ *             (default) or 0 to close it.
+ * Notes: After a call with @keepAlive set to 0, &WriteHttp sends
+ *        "Connection: close".
+ */
+void
+PTP::Net::Connection::SetKeepAlive(int keepAlive)
+{
+	m_keepAlive = keepAlive ? 1:0;
+}
+
 /**
  * PTP::Net::Connection::Open: Open the connection.
  * @timeout: Milliseconds to wait for connect (0 for infinite timeout).
@@ -387,6 +612,10 @@ PTP::Net::Connection::Open(int timeout)
 	if (s < 0)
 		return -1;
 
+	// buffer sizes must be set before connecting or listening
+	if (m_options)
+		SetOptions(s, m_options);
+
 	int port = m_port;
 
 	switch (m_dir)
@@ -400,11 +629,48 @@ PTP::Net::Connection::Open(int timeout)
 
 		if (!s_proxyIp)
 			m_proxy = NO_PROXY;
+		else if (m_proxy == UNKNOWN)
+		{
+			// take the path found by an earlier connection
+			m_proxy = GetRoute(m_ip, m_port);
+			if (m_proxy == UNREACHABLE)
+			{
+				m_proxy = UNKNOWN;
+				Close(s);
+				return -1;
+			}
+		}
+		if (!m_block)
+		{
+			// start a non-blocking connect
+			Net::Ip ip = m_ip;
+			Net::Port p = m_port;
+			if (m_proxy == PROXY
+			    || (m_proxy == UNKNOWN && !s_proxyTimeout))
+			{
+				ip = s_proxyIp;
+				p = s_proxyPort;
+				m_proxy = PROXY;
+			}
+			else
+				m_proxy = NO_PROXY;
+
+			SetBlocking(s, 0);
+			if (Connect(s, ip, p, -1))
+			{
+				Close(s);
+				return -1;
+			}
+			break;
+		}
 		switch (m_proxy)
 		{
 		case NO_PROXY:
 			if (Connect(s, m_ip, m_port, timeout))
 			{
+				// the path may have changed, so try both again
+				if (s_proxyIp)
+					SetRoute(m_ip, m_port, UNKNOWN);
 				Close(s);
 				return -1;
 			}
@@ -412,10 +678,14 @@ PTP::Net::Connection::Open(int timeout)
 		case PROXY:
 			if (Connect(s, s_proxyIp, s_proxyPort, timeout))
 			{
+				SetRoute(m_ip, m_port, UNKNOWN);
 				Close(s);
 				return -1;
 			}
 			break;
+		case UNREACHABLE:
+			Close(s);
+			return -1;
 		case UNKNOWN:
 			if (s_proxyTimeout
 			    && Connect(s,
@@ -433,6 +703,8 @@ PTP::Net::Connection::Open(int timeout)
 					s = socket(AF_INET,
 						   SOCK_STREAM,
 						   PROTOCOL);
+					if (s >= 0 && m_options)
+						SetOptions(s, m_options);
 				}
 				if (s >= 0
 				    && Connect(s,
@@ -444,75 +716,82 @@ PTP::Net::Connection::Open(int timeout)
 				}
 				else
 				{
+					SetRoute(m_ip, m_port, UNREACHABLE);
 					Close(s);
 					return -1;
 				}
 			}
+			SetRoute(m_ip, m_port, m_proxy);
 			break;
 		}
 		break;
 
 	case INBOUND:
+	{
+#ifndef WIN32
+		// allow restarts while old connections are in TIME_WAIT
+		// (bind still fails if another socket is listening, unless
+		// both set REUSE_PORT)
+		int opt = 1;
+		setsockopt(s,
+			   SOL_SOCKET,
+			   SO_REUSEADDR,
+			   (char*) &opt,
+			   sizeof(opt));
+#endif
+
+		// try each port in the range until bind succeeds; with
+		// port sharing bind also succeeds on a port that another
+		// server shares, so only a single port is joined as is
+		int last = m_lastPort ? m_lastPort:(port ? 0xffff:0);
+		int probe = ((m_options & REUSE_PORT) && port != last);
 		for (;;)
 		{
-			sockaddr_in addr;
-			socklen_t addrSize = sizeof(addr);
-
-			int active = 0;
-			if (port)
+			if (probe && port && !IsPortFree(port))
 			{
-				int test = socket(AF_INET,
-						  SOCK_STREAM,
-						  PROTOCOL);
-				if (test < 0)
+				if (port >= last)
 				{
 					Close(s);
 					return -1;
 				}
-				
-				active = (Connect(test,
-						  Net::LOOPBACK,
-						  port,
-						  1) == 0);
-				Close(test);
+				port++;
+				continue;
 			}
-			
-			if (!active)
+
+			sockaddr_in addr;
+			socklen_t addrSize = sizeof(addr);
+			memset(&addr, 0, sizeof(addr));
+			addr.sin_family = AF_INET;
+			addr.sin_addr.s_addr = htonl(Net::ANY);
+			addr.sin_port = htons(port);
+
+			if (bind(s, (struct sockaddr*) &addr, sizeof(addr)) == 0
+			    && getsockname(s,
+					   (struct sockaddr*) &addr,
+					   &addrSize) == 0)
 			{
-				int opt = 1;
-				setsockopt(s,
-					   SOL_SOCKET,
-					   SO_REUSEADDR,
-					   (char*) &opt,
-					   sizeof(opt));
-				
-				memset(&addr, 0, sizeof(addr));
-				addr.sin_family = AF_INET;
-				addr.sin_addr.s_addr = htonl(Net::ANY);
-				addr.sin_port = htons(port);
-				
-				if (bind(s,
-					 (struct sockaddr*) &addr,
-					 sizeof(addr)) == 0
-				    && getsockname(s,
-						   (struct sockaddr*) &addr,
-						   &addrSize) == 0)
-				{
-					port = ntohs(addr.sin_port);
-					break;
-				}
+				port = ntohs(addr.sin_port);
+				break;
+			}
+
+			if (port >= last)
+			{
+				Close(s);
+				return -1;
 			}
-			
 			port++;
 		}
-		
-		if (listen(s, LISTEN_BACKLOG) < 0)
+
+		if (listen(s, m_backlog) < 0)
 		{
 			Close(s);
 			return -1;
 		}
+		if (!m_block)
+			SetBlocking(s, 0);
 		break;
 	}
+	}
 
 	m_s = s;
 	m_port = port;
@@ -530,13 +809,38 @@ PTP::Net::Connection::Close()
 	{
 		Close(m_s);
 		m_s = -1;
+
+		// data buffered from the old socket is stale
+		m_mutex.Lock();
+		m_head = 0;
+		m_count = 0;
+		m_mutex.Unlock();
+		m_httpClose = 0;
+		m_chunked = 0;
+		m_content = 0;
 	}
 }
 
+/**
+ * PTP::Net::Connection::Shutdown: Stop all further I/O on the connection.
+ * Notes: Unlike &Close, the socket stays allocated, so &Shutdown may be
+ *        called from another thread to wake a thread blocked in &Read
+ *        or &WriteAll on this connection.
+ */
+void
+PTP::Net::Connection::Shutdown()
+{
+	if (m_s >= 0)
+		shutdown(m_s, 2);
+}
+
 /**
  * PTP::Net::Connection::Accept: Accept a new (inbound) connection.
  * @detType: 1 to determine connection type.
  * Returns: Inbound (client) connection or NULL on error.
+ * Notes: If the server connection is non-blocking, &Accept returns
+ *        NULL when no connection is pending and the new connection
+ *        is also non-blocking.
  * Example:
  *   PTP::Net::Connection server(PTP::Net::Connection::HTTP, 8080);
  *   PTP::Net::Connection *client = server.$Accept();
@@ -559,36 +863,54 @@ PTP::Net::Connection::Accept(int detType)
 
 	struct sockaddr_in addr;
 	socklen_t addrSize = sizeof(addr);
+#ifdef WIN32
 	int s = accept(m_s, (struct sockaddr*) &addr, &addrSize);
 	if (s < 0)
 		return NULL;
 
+	// accepted sockets start out blocking
+	SetBlocking(s, 1);
+#else
+	// set the blocking mode while accepting (unless reading first)
+	int block = m_block || detType;
+	int s = accept4(m_s,
+			(struct sockaddr*) &addr,
+			&addrSize,
+			block ? 0:SOCK_NONBLOCK);
+	if (s < 0)
+		return NULL;
+#endif
 	Connection *c = new Connection(m_type, INBOUND, s, 1);
 	if (c)
 	{
+#ifndef WIN32
+		c->m_block = block;
+#endif
 		c->m_ip = ntohl(addr.sin_addr.s_addr);
 		c->m_port = ntohs(addr.sin_port);
+		if (m_options & ~REUSE_PORT)
+			c->SetOptions(m_options & ~REUSE_PORT);
 	}
 
 	if (detType)
 	{
-		char buffer[64];
-		int size = c->Read((BYTE*) buffer, sizeof(buffer));
+		// look at the first bytes without removing them
+		const BYTE *buffer = NULL;
+		int size = c->Peek(&buffer, 64);
 		if (size <= 0)
 		{
 			delete c;
 			return NULL;
 		}
-		c->Unget((BYTE*) buffer, size);
 		
 		char tunnel[] = "PUT /" PTP_NET_TUNNEL_PREFIX " HTTP/1.0\r\n";
-		if (STRNCMP_CONST(buffer, tunnel) == 0)
+		if (MATCH_CONST(buffer, size, tunnel))
 		{
 			c->m_type = RAW;
 		}
-		else if (STRNCMP_CONST(buffer, "GET ") == 0
-			 || STRNCMP_CONST(buffer, "PUT ") == 0
-			 || STRNCMP_CONST(buffer, "POST ") == 0)
+		else if (MATCH_CONST(buffer, size, "GET ")
+			 || MATCH_CONST(buffer, size, "PUT ")
+			 || MATCH_CONST(buffer, size, "POST "))
 		{
 			c->m_type = HTTP;
 		}
@@ -598,9 +920,47 @@ PTP::Net::Connection::Accept(int detType)
 		}
 	}
 
+	if (!m_block && c->m_block)
+		c->SetBlocking(0);
+
 	return c;
 }
 
+/**
+ * PTP::Net::Connection::Accept: Accept several new (inbound) connections.
+ * @conns: [$OUT] Array for the new connections.
+ * @count: Array size.
+ * @detType: 1 to determine connection type.
+ * Returns: Number of connections accepted or -1 on error.
+ * Notes: A blocking server waits for the first connection.  After
+ *        that, only connections that are already pending are
+ *        accepted, so a burst of connections is taken with one call.
+ *        A non-blocking server returns 0 if no connection is pending.
+ * Example:
+ *   PTP::Net::Connection *clients[16];
+ *   int count = server.$Accept(clients, 16);
+ *   for (int i = 0; i < count; i++)
+ *     ...
+ */
+int
+PTP::Net::Connection::Accept(Connection **conns, int count, int detType)
+{
+	if (!conns || count <= 0 || m_dir != INBOUND || Open() < 0)
+		return -1;
+
+	int n = 0;
+	while (n < count)
+	{
+		if (n > 0 && m_block && Wait(m_s, 0, 0))
+			break;
+		Connection *c = Accept(detType);
+		if (!c)
+			break;
+		conns[n++] = c;
+	}
+	return n;
+}
+
 /**
  * PTP::Net::Connection::ReadHttpHdr: Receive an HTTP header.
  * @hdr: [$OUT] Header data or NULL to allocate.
@@ -609,6 +969,9 @@ PTP::Net::Connection::Accept(int detType)
  * @contentsize: [$OUT] Content size or NULL.
  * @timeout: Milliseconds to wait for data or 0 for infinite.
  * Returns: Header data on success or NULL on error.
+ * Notes: @contentsize is -1 if the content ends when the connection
+ *        is closed or is sent in chunks.  In either case, the
+ *        content can be read with &ReadContent.
  * Example:
  *   PTP::Net::Connection *c = ...;
  *   int status;
@@ -627,55 +990,60 @@ PTP::Net::Connection::ReadHttpHdr(
 	if (maxsize < -1 || (hdr && maxsize < 0) || Open() < 0)
 		return NULL;
 
-	int total = (maxsize >= 0) ? maxsize:512;
-	char *h = hdr;
-	if (!h)
-		h = new char[total + 1];
+	m_mutex.Lock();
 
-	int size = 0;
+	// buffer until the blank line that ends the header
+	int size = -1;
+	int scanned = 0;
 	for (;;)
 	{
-		int remain = total - size - 1;
-		if (remain <= 0)
-		{
-			if (maxsize >= 0)
-				break;
-			else
-			{
-				char *old = h;
-				total *= 2;
-				h = new char[total];
-				memcpy(h, old, size);
-				delete [] old;
-				continue;
-			}
-		}
+		int end1 = Find(m_buffer + m_head, m_count, scanned, "\r\n\r\n");
+		int end2 = Find(m_buffer + m_head, m_count, scanned, "\n\n");
+		if (end1 >= 0 && (end2 < 0 || end1 + 2 <= end2))
+			size = end1 + 4;
+		else if (end2 >= 0)
+			size = end2 + 2;
+		if (size >= 0)
+			break;
 
-		int s = Read((BYTE*) h + size, remain, timeout);
-		if (s < 0)
+		if (maxsize >= 0 && m_count >= maxsize - 1)
 		{
-			size = -1;
+			size = maxsize - 1;
 			break;
 		}
-		size += s;
+		scanned = (m_count > 3) ? (m_count - 3):0;
 
-		h[size] = '\0';
-		int unsize = UngetData((BYTE*) h, size);
-		if (unsize >= 0)
+		int s = Fill(timeout);
+		if (s == AGAIN)
 		{
-			size -= unsize;
-			break;
+			if (Wait(m_s, 0, timeout ? timeout:-1) == 0)
+				continue;
+			s = -1;
 		}
+		if (s < 0)
+			break;
 		else if (!s)
+		{
+			size = m_count;
 			break;
+		}
 	}
 
-	if (size <= 0)
+	if (maxsize >= 0 && size > maxsize - 1)
+		size = maxsize - 1;
+
+	char *h = NULL;
+	if (size > 0)
 	{
-		if (!hdr)
-			delete [] h;
-		return NULL;
+		h = hdr ? hdr:new char[size + 1];
+		memcpy(h, m_buffer + m_head, size);
+		h[size] = '\0';
+		Consume(size);
 	}
+	m_mutex.Unlock();
+
+	if (!h)
+		return NULL;
 
 	if (status)
 	{
@@ -691,25 +1059,63 @@ PTP::Net::Connection::ReadHttpHdr(
 		}
 	}
 
+	// remember how the content is delimited for ReadContent
+	const char *len = GetHttpValue(h, "Content-length");
+	const char *enc = GetHttpValue(h, "Transfer-Encoding");
+	m_chunked = (enc && MatchNoCase(enc, "chunked"));
+	m_content = ((len && !m_chunked)
+		     ? ((int) strtoul(len, NULL, 10))
+		     :(m_chunked ? 0:-1));
 	if (contentsize)
+		*contentsize = m_chunked ? -1:m_content;
+
+	// HTTP/1.1 connections are persistent by default
+	const char *conn = GetHttpValue(h, "Connection");
+	if (conn && MatchNoCase(conn, "close"))
+		m_httpClose = 1;
+	else if (conn && MatchNoCase(conn, "keep-alive"))
+		m_httpClose = 0;
+	else
 	{
-		const char *len = strstr(h, "\nContent-length:");
-		if (!len)
-			len = strstr(h, "\nContent-Length:");
-		*contentsize = len ? ((int) strtoul(len + 16, NULL, 10)):-1;
+		int size = strcspn(h, "\r\n");
+		m_httpClose = (Find((const BYTE*) h, size, 0, "HTTP/1.1") < 0);
 	}
 
 	return h;
 }
       
+/*
+ * PTP::Net::Connection::GetHttpValue: Find an HTTP header field.
+ * Type: static
+ * @hdr: HTTP header.
+ * @name: Field name (case is ignored).
+ * Returns: Field value or NULL if not found.
+ */
+const char *
+PTP::Net::Connection::GetHttpValue(const char *hdr, const char *name)
+{
+	int size = strlen(name);
+	for (const char *line = strchr(hdr, '\n');
+	     line;
+	     line = strchr(line, '\n'))
+	{
+		line++;
+		if (MatchNoCase(line, name) && line[size] == ':')
+			return line + size + 1 + strspn(line + size + 1, " \t");
+	}
+	return NULL;
+}
+
 /**
  * PTP::Net::Connection::ReadHttp: Receive an HTTP header and data.
  * @data: [$OUT] Data buffer or NULL.
- * @maxsize: Maximum content data size or -1 for unlimited.
+ * @maxsize: Maximum content data size or -1 for %MAX_HTTP_CONTENT.
  * @status: [$OUT] HTTP status code or NULL.
  * @contentsize: [$OUT] Content size or NULL.
  * @timeout: Milliseconds to wait for data or 0 for infinite.
  * Returns: Content data on success or NULL on error.
+ * Notes: Chunked content (see &WriteChunk) is decoded.  Without
+ *        @maxsize, content over %MAX_HTTP_CONTENT bytes is refused.
  * Example:
  *   PTP::Net::Connection *c = ...;
  *   int size;
@@ -729,40 +1135,92 @@ PTP::Net::Connection::ReadHttp(
 		return NULL;
 	
 	int size = 0;
-	char *hdr = ReadHttpHdr(NULL, maxsize, status, &size, timeout);
+	char *hdr = ReadHttpHdr(NULL, -1, status, &size, timeout);
+	if (!hdr)
+		return NULL;
 	delete [] hdr;
-	if (!hdr || (maxsize >= 0 && size > maxsize))
+
+	// the peer's content length is not trusted for an allocation
+	if (size > ((maxsize >= 0) ? maxsize:MAX_HTTP_CONTENT))
 	{
-		delete [] hdr;
+		// the unread content makes the connection unusable
+		m_httpClose = 1;
 		return NULL;
 	}
 
-	int total = (size >= 0) ? (size + 1):1024;
+	if (size >= 0)
+	{
+		// read exactly the content, leaving any following request
+		BYTE *d = data ? data:new BYTE[size + 1];
+		if (size > 0 && ReadAll(d, size, timeout) != size)
+		{
+			if (d != data)
+				delete [] d;
+			m_httpClose = 1;
+			return NULL;
+		}
+		m_content = 0;
+		if (contentsize)
+			*contentsize = size;
+		return d;
+	}
+
+	// without a content length, the content is chunked or ends with
+	// the connection
+	if (!m_chunked)
+		m_httpClose = 1;
+
+	int total = (maxsize >= 0) ? (maxsize + 1):1024;
 	BYTE *d = data;
 	if (!d)
 		d = new BYTE[total];
-	if (maxsize < 0 && size > 0)
-		maxsize = size;
 
 	size = 0;
 	for (;;)
 	{
 		int remain = total - size - 1;
-		int s = ReadAll((BYTE*) d + size, remain, timeout);
-		size += s;
+		if (!remain)
+		{
+			if (maxsize >= 0)
+			{
+				// the rest of the content is discarded
+				m_httpClose = 1;
+				break;
+			}
+			if (size >= MAX_HTTP_CONTENT)
+			{
+				delete [] d;
+				m_httpClose = 1;
+				return NULL;
+			}
+
+			BYTE *old = d;
+			total *= 2;
+			if (total > MAX_HTTP_CONTENT + 1)
+				total = MAX_HTTP_CONTENT + 1;
+			d = new BYTE[total];
+			memcpy(d, old, size);
+			delete [] old;
+			continue;
+		}
+
+		int s = ReadContent(d + size, remain, timeout);
+		if (s == AGAIN)
+		{
+			if (Wait(m_s, 0, timeout ? timeout:-1) == 0)
+				continue;
+			s = -1;
+		}
 		if (s < 0)
 		{
-			size = -1;
-			break;
+			if (d != data)
+				delete [] d;
+			m_httpClose = 1;
+			return NULL;
 		}
-		else if (s < remain || maxsize >= 0)
+		else if (!s)
 			break;
-
-		BYTE *old = d;
-		total *= 2;
-		d = new BYTE[total];
-		memcpy(d, old, size);
-		delete [] old;
+		size += s;
 	}
 
 	if (contentsize)
@@ -778,8 +1236,14 @@ PTP::Net::Connection::ReadHttp(
  * @hdr: Extra HTTP header information or NULL.
  * @data: Content data or NULL.
  * @type: Content type or NULL for "application/binary".
- * @size: Content size or -1 if @data is a string.
+ * @size: Content size, -1 if @data is a string, or %CHUNKED.
  * Returns: 0 on success or -1 on error.
+ * Notes: The content size is always sent so the connection can carry
+ *        further requests (see &GetKeepAlive).  If @data is NULL and
+ *        @size is -1, the size is unknown, so "Connection: close"
+ *        is sent instead and the content ends when the connection
+ *        is closed.  If @size is %CHUNKED, @data must be NULL and
+ *        the content is sent afterwards with &WriteChunk.
  * Example:
  *   PTP::Net::Connection *c = ...;
  *   c->$WriteHttp("GET",
@@ -798,6 +1262,9 @@ PTP::Net::Connection::WriteHttp(
 	const char *type,
 	int size)
 {
+	// the server closes the connection after its last response
+	if (m_httpClose && m_dir == OUTBOUND)
+		Close();
 	if (Open() < 0)
 		return -1;
 
@@ -811,17 +1278,18 @@ PTP::Net::Connection::WriteHttp(
 		type = "application/binary";
 	if (size == -1 && data)
 		size = strlen((const char*) data);
-	char *buffer = new char[(strlen(url)
+	char *buffer = new char[(strlen(method)
+				 + strlen(url)
 				 + strlen(hdr)
 				 + strlen(type)
 				 + 256)];
 
 	if (m_proxy != PROXY)
-		sprintf(buffer, "%s %s HTTP/1.0\r\n%s", method, url, hdr);
+		sprintf(buffer, "%s %s HTTP/1.1\r\n%s", method, url, hdr);
 	else
 	{
 		sprintf(buffer,
-			"%s http://%lu.%lu.%lu.%lu:%u%s HTTP/1.0\r\n%s",
+			"%s http://%lu.%lu.%lu.%lu:%u%s HTTP/1.1\r\n%s",
 			method,
 			(m_ip >> 24) & 0xff,
 			(m_ip >> 16) & 0xff,
@@ -831,19 +1299,7 @@ PTP::Net::Connection::WriteHttp(
 			url,
 			hdr);
 	}
-	if (size)
-	{
-		sprintf(buffer + strlen(buffer),
-			"Content-type: %s\r\n"
-			"Content-length: %d\r\n",
-			type,
-			size);
-	}
-	strcat(buffer, "\r\n");
-
-	int hsize = strlen(buffer);
-	int stat = (WriteAll((BYTE*) buffer, hsize) == hsize
-		    && (!data || WriteAll(data, size) == size)) ? 0:-1;
+	int stat = WriteHttpData(buffer, data, type, size);
 	delete [] buffer;
 	return stat;
 }
@@ -854,8 +1310,14 @@ PTP::Net::Connection::WriteHttp(
  * @hdr: Extra HTTP header information or NULL.
  * @data: Content data or NULL.
  * @type: Content type or NULL for "application/binary".
- * @size: Content size or -1 if @data is a string.
+ * @size: Content size, -1 if @data is a string, or %CHUNKED.
  * Returns: 0 on success or -1 on error.
+ * Notes: The content size is always sent so the connection can carry
+ *        further requests (see &GetKeepAlive).  If @data is NULL and
+ *        @size is -1, the size is unknown, so "Connection: close"
+ *        is sent instead and the content ends when the connection
+ *        is closed.  If @size is %CHUNKED, @data must be NULL and
+ *        the content is sent afterwards with &WriteChunk.
  * Example:
  *   PTP::Net::Connection *c = ...;
  *   c->$WriteHttp(PTP::Net::HTTP_OK,
@@ -887,28 +1349,190 @@ PTP::Net::Connection::WriteHttp(
 	switch (status)
 	{
 	case HTTP_OK: statusstr = " OK"; break;
+	case HTTP_PARTIAL_CONTENT: statusstr = " Partial content"; break;
 	case HTTP_BAD_REQUEST: statusstr = " Bad request"; break;
 	case HTTP_UNAUTHORIZED: statusstr = " Unauthorized"; break;
 	case HTTP_NOT_FOUND: statusstr = " Not found"; break;
 	}
-	sprintf(buffer, "HTTP %d%s\r\n%s", status, statusstr, hdr);
-	if (size)
-	{
-		sprintf(buffer + strlen(buffer),
-			"Content-type: %s\r\n"
-			"Content-length: %d\r\n",
-			type,
-			size);
-	}
-	strcat(buffer, "\r\n");
-
-	int hsize = strlen(buffer);
-	int stat = (WriteAll((BYTE*) buffer, hsize) == hsize
-		    && (!data || WriteAll(data, size) == size))	? 0:-1;
+	sprintf(buffer, "HTTP/1.1 %d%s\r\n%s", status, statusstr, hdr);
+	int stat = WriteHttpData(buffer, data, type, size);
 	delete [] buffer;
 	return stat;
 }
 
+/*
+ * PTP::Net::Connection::WriteHttpData: Finish and send an HTTP header and data.
+ * @buffer: HTTP header without content fields or the final blank line.
+ * @data: Content data or NULL.
+ * @type: Content type.
+ * @size: Content size, -1 if unknown, or %CHUNKED.
+ * Returns: 0 on success or -1 on error.
+ */
+int
+PTP::Net::Connection::WriteHttpData(
+	char *buffer,
+	const BYTE *data,
+	const char *type,
+	int size)
+{
+	if (size == CHUNKED && data)
+		return -1;
+
+	char *b = buffer + strlen(buffer);
+	if (size > 0 || size == CHUNKED)
+		b += sprintf(b, "Content-type: %s\r\n", type);
+	if (size >= 0)
+		b += sprintf(b, "Content-length: %d\r\n", size);
+	else if (size == CHUNKED)
+		b += sprintf(b, "Transfer-Encoding: chunked\r\n");
+	else
+		m_httpClose = 1;
+
+	const char *conn = GetHttpValue(buffer, "Connection");
+	if (conn && MatchNoCase(conn, "close"))
+		m_httpClose = 1;
+	else if (!conn && !GetKeepAlive())
+		b += sprintf(b, "Connection: close\r\n");
+	strcpy(b, "\r\n");
+
+	// send the header and data together to avoid a small packet
+	const BYTE *pieces[2] = {(const BYTE*) buffer, data};
+	int sizes[2] = {(int) strlen(buffer), data ? size:0};
+	int total = sizes[0] + sizes[1];
+	return (WriteGather(pieces, sizes, 2) == total) ? 0:-1;
+}
+
+/**
+ * PTP::Net::Connection::ReadContent: Read HTTP content data.
+ * @data: [$OUT] Data buffer.
+ * @size: Buffer size.
+ * @timeout: Milliseconds to wait for data or 0 for infinite.
+ * Returns: Number of bytes read, 0 at the end of the content,
+ *          %AGAIN if a non-blocking connection has no data, or -1
+ *          on error or timeout.
+ * Notes: Reads the content following the last header received by
+ *        &ReadHttpHdr, stopping at its end so the connection can
+ *        carry further requests.  Chunked content is decoded.
+ * Example:
+ *   char *hdr = c->ReadHttpHdr(NULL, -1, &status, NULL);
+ *   BYTE buffer[4096];
+ *   int size;
+ *   while ((size = c->$ReadContent(buffer, sizeof(buffer))) > 0)
+ *     fwrite(buffer, 1, size, fp);
+ */
+int
+PTP::Net::Connection::ReadContent(BYTE *data, int size, int timeout)
+{
+	if (!data || size < 0 || Open() < 0)
+		return -1;
+
+	if (m_chunked && !m_content)
+	{
+		// read the next chunk size, skipping the end of the last chunk
+		char line[MAX_CHUNK_LINE];
+		int s = 0;
+		do
+		{
+			s = ReadUntil((BYTE*) line,
+				      sizeof(line) - 1,
+				      "\n",
+				      timeout);
+			if (s > 0)
+				line[s] = '\0';
+		}
+		while (s > 0 && (*line == '\r' || *line == '\n'));
+
+		// the size must be hex, up to an extension or the line end
+		char *end = line;
+		unsigned long chunk = 0;
+		if (s > 0 && isxdigit(*line))
+		{
+			errno = 0;
+			chunk = strtoul(line, &end, 16);
+			if (errno == ERANGE)
+				end = line;
+		}
+		if (end == line || chunk > INT_MAX
+		    || (*end && *end != ';' && !isspace(*end)))
+		{
+			m_httpClose = 1;
+			return -1;
+		}
+
+		m_content = (int) chunk;
+		if (!m_content)
+		{
+			// skip any trailer fields up to the final blank line
+			do
+			{
+				s = ReadUntil((BYTE*) line,
+					      sizeof(line) - 1,
+					      "\n",
+					      timeout);
+			}
+			while (s > 0 && *line != '\r' && *line != '\n');
+
+			m_chunked = 0;
+			if (s <= 0)
+			{
+				m_httpClose = 1;
+				return -1;
+			}
+			return 0;
+		}
+	}
+
+	// stop at the end of the content (or chunk) if the size is known
+	if (m_content >= 0 && size > m_content)
+		size = m_content;
+	if (!size)
+		return 0;
+
+	int s = Read(data, size, timeout);
+	if (s > 0 && m_content > 0)
+		m_content -= s;
+	else if (!s && (m_content > 0 || m_chunked))
+	{
+		// the connection closed before the end of the content
+		m_httpClose = 1;
+		s = -1;
+	}
+	return s;
+}
+
+/**
+ * PTP::Net::Connection::WriteChunk: Send a piece of chunked content.
+ * @data: Content data.
+ * @size: Data size or 0 to end the content.
+ * Returns: 0 on success or -1 on error.
+ * Notes: The header must have been sent by &WriteHttp with %CHUNKED
+ *        as the content size.
+ * Example:
+ *   c->WriteHttp(PTP::Net::HTTP_OK,
+ *                NULL,
+ *                NULL,
+ *                NULL,
+ *                PTP::Net::Connection::CHUNKED);
+ *   while ((size = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+ *     c->$WriteChunk(buffer, size);
+ *   c->$WriteChunk(NULL, 0);
+ */
+int
+PTP::Net::Connection::WriteChunk(const BYTE *data, int size)
+{
+	if (size < 0 || (size > 0 && !data))
+		return -1;
+
+	// send the chunk in a single write to avoid small packets
+	char line[16];
+	const BYTE *pieces[3] = {(const BYTE*) line,
+				 data,
+				 (const BYTE*) "\r\n"};
+	int sizes[3] = {sprintf(line, "%x\r\n", size), size, 2};
+	int total = sizes[0] + sizes[1] + sizes[2];
+	return (WriteGather(pieces, sizes, 3) == total) ? 0:-1;
+}
+
 /**
  * PTP::Net::Connection::ReadAll: Read data until entire buffer is full.
  * @data: [$OUT] Data buffer.
@@ -926,6 +1550,13 @@ PTP::Net::Connection::ReadAll(BYTE *data, int size, int timeout)
 	while (readsize < size)
 	{
 		int s = Read(data + readsize, size - readsize, timeout);
+		if (s == AGAIN)
+		{
+			// wait for more data on a non-blocking connection
+			if (Wait(m_s, 0, timeout ? timeout:-1))
+				break;
+			continue;
+		}
 		if (s < 0)
 			return -1;
 		else if (s == 0)
@@ -962,6 +1593,13 @@ PTP::Net::Connection::WriteAll(const BYTE *data, int size)
 			      (const char*)(data + writesize),
 			      size - writesize);
 #endif
+		if (s < 0 && !m_block && IsPending())
+		{
+			// wait for room on a non-blocking connection
+			if (Wait(m_s, 1, -1))
+				return -1;
+			continue;
+		}
 		if (s < 0)
 			return -1;
 		else if (s == 0)
@@ -976,7 +1614,8 @@ PTP::Net::Connection::WriteAll(const BYTE *data, int size)
  * @data: [$OUT] Data buffer.
  * @size: Buffer size.
  * @timeout: Milliseconds to wait for data (0 for infinite timeout).
- * Returns: Number of bytes read or -1 on error.
+ * Returns: Number of bytes read, %AGAIN if a non-blocking connection
+ *          has no data, or -1 on error or timeout.
  */
 int
 PTP::Net::Connection::Read(BYTE *data, int size, int timeout)
@@ -986,53 +1625,341 @@ PTP::Net::Connection::Read(BYTE *data, int size, int timeout)
 	if (size <= 0)
 		return size;
 
-	int readsize = Get(data, size);
-	if (!readsize)
+	m_mutex.Lock();
+	if (!m_count && size >= RECV_BUFFER_SIZE)
 	{
-		if (timeout)
-			Wait(m_s, 0, timeout);
+		// large reads go straight to the caller's buffer
+		if (timeout && Wait(m_s, 0, timeout))
+		{
+			m_mutex.Unlock();
+			return -1;
+		}
 #ifdef WIN32
-		readsize = recv(m_s, (char*) data, size, 0);
+		int readsize = recv(m_s, (char*) data, size, 0);
 #else
-		readsize = read(m_s, (char*) data, size);
+		int readsize = read(m_s, (char*) data, size);
 #endif
+		if (readsize < 0 && !m_block && IsPending())
+			readsize = AGAIN;
+		m_mutex.Unlock();
+		return readsize;
+	}
+
+	// small reads are served from one large buffered read
+	if (!m_count)
+	{
+		int s = Fill(timeout);
+		if (s <= 0)
+		{
+			m_mutex.Unlock();
+			return s;
+		}
 	}
+
+	int readsize = (size < m_count) ? size:m_count;
+	memcpy(data, m_buffer + m_head, readsize);
+	Consume(readsize);
+	m_mutex.Unlock();
+
 	return readsize;
 }
 
+/**
+ * PTP::Net::Connection::Write: Write data to connection.
+ * @data: Data buffer.
+ * @size: Buffer size.
+ * Returns: Number of bytes written, %AGAIN if a non-blocking
+ *          connection is full, or -1 on error.
+ * Notes: Unlike &WriteAll, &Write may send only part of @data.
+ */
+int
+PTP::Net::Connection::Write(const BYTE *data, int size)
+{
+	if (Open() < 0)
+		return -1;
+	if (size <= 0)
+		return size;
+
+#ifdef WIN32
+	int writesize = send(m_s, (const char*) data, size, 0);
+#else
+	int writesize = write(m_s, (const char*) data, size);
+#endif
+	if (writesize < 0 && !m_block && IsPending())
+		writesize = AGAIN;
+	return writesize;
+}
+
+/**
+ * PTP::Net::Connection::SendFile: Write part of a file to connection.
+ * @fd: Open file descriptor.
+ * @offset: Starting file offset.
+ * @length: Number of bytes to send.
+ * Returns: Number of bytes written or -1 on error.
+ * Notes: On Linux, the data goes straight from the file to the socket
+ *        with sendfile() and is never copied into the application.
+ *        Elsewhere (or if sendfile() is not supported for @fd), the
+ *        file is read and written in large blocks.  The position
+ *        of @fd is not used.
+ * Example:
+ *   FILE *fp = fopen("index.html", "rb");
+ *   c->WriteHttp(PTP::Net::HTTP_OK, NULL, NULL, "text/html", size);
+ *   c->$SendFile(fileno(fp), 0, size);
+ */
+long
+PTP::Net::Connection::SendFile(int fd, long offset, long length)
+{
+	if (Open() < 0 || fd < 0 || offset < 0)
+		return -1;
+
+	// large files go out faster with large socket buffers
+	if (length >= SEND_FILE_SIZE && !(m_options & LARGE_BUFFERS))
+		SetOptions(m_options | LARGE_BUFFERS);
+
+	long sent = 0;
+
+#ifndef WIN32
+	while (sent < length)
+	{
+		off_t off = offset + sent;
+		ssize_t s = sendfile(m_s, fd, &off, length - sent);
+		if (s < 0 && errno == EINTR)
+			continue;
+		if (s < 0 && !m_block && IsPending())
+		{
+			if (Wait(m_s, 1, -1))
+				return -1;
+			continue;
+		}
+		if (s < 0 && sent == 0 && (errno == EINVAL || errno == ENOSYS))
+			break;
+		if (s < 0)
+			return -1;
+		else if (s == 0)
+			return sent;
+		sent += s;
+	}
+	if (sent >= length)
+		return sent;
+#endif
+
+	// copy through a buffer
+	BYTE *buffer = new BYTE[SEND_FILE_SIZE];
+	while (sent < length)
+	{
+		int size = SEND_FILE_SIZE;
+		if (length - sent < size)
+			size = (int)(length - sent);
+#ifdef WIN32
+		if (_lseek(fd, offset + sent, SEEK_SET) < 0)
+			break;
+		int s = _read(fd, buffer, size);
+#else
+		int s = pread(fd, buffer, size, offset + sent);
+#endif
+		if (s <= 0 || WriteAll(buffer, s) != s)
+			break;
+		sent += s;
+	}
+	delete [] buffer;
+
+	return ((sent < length && sent == 0) ? -1:sent);
+}
+
 /**
  * PTP::Net::Connection::Unget: Return data to read queue.
  * @data: Data buffer.
  * @size: Buffer size.
  * Returns: 0 on success or -1 on failure.
+ * Notes: Returning data that was just read only rewinds the
+ *        receive buffer and does not allocate memory.
  */
 int
 PTP::Net::Connection::Unget(const BYTE *data, int size)
 {
+	if (size <= 0)
+		return 0;
+
 	m_mutex.Lock();
-	BYTE *old = m_unget;
-	if (!old)
+	if (m_buffer && m_head >= size)
 	{
-		m_unget = new BYTE[size];
-		memcpy(m_unget, data, size);
-		m_ungetNext = m_unget;
-		m_ungetLast = m_unget + size;
+		m_head -= size;
+		if (m_buffer + m_head != data)
+			memmove(m_buffer + m_head, data, size);
+	}
+	else if (m_buffer && m_count + size <= m_bufferSize)
+	{
+		memmove(m_buffer + size, m_buffer + m_head, m_count);
+		memcpy(m_buffer, data, size);
+		m_head = 0;
 	}
 	else
 	{
-		int oldsize = m_ungetLast - m_ungetNext;
-		m_unget = new BYTE[size + oldsize];
-		memcpy(m_unget, data, size);
-		memcpy(m_unget + size, m_ungetNext, oldsize);
-		delete [] old;
-		m_ungetNext = m_unget;
-		m_ungetLast = m_unget + size + oldsize;
+		int total = m_count + size;
+		if (total < RECV_BUFFER_SIZE)
+			total = RECV_BUFFER_SIZE;
+		BYTE *buffer = new BYTE[total];
+		memcpy(buffer, data, size);
+		if (m_count)
+			memcpy(buffer + size, m_buffer + m_head, m_count);
+		delete [] m_buffer;
+		m_buffer = buffer;
+		m_bufferSize = total;
+		m_head = 0;
 	}
+	m_count += size;
 	m_mutex.Unlock();
 
 	return 0;
 }
 
+/**
+ * PTP::Net::Connection::Peek: Look at received data without reading it.
+ * @data: [$OUT] Pointer to the received data.
+ * @size: Number of bytes wanted.
+ * @timeout: Milliseconds to wait for data (0 for infinite timeout).
+ * Returns: Number of bytes at @data (at most @size), 0 if the
+ *          connection is closed, %AGAIN if a non-blocking connection
+ *          has no data, or -1 on error.
+ * Notes: &Peek waits only if no data is buffered.  Otherwise it
+ *        returns what has already arrived, which may be less than
+ *        @size.  @data stays valid until the next read from the
+ *        connection.  Use &Consume to remove the data.
+ * Example:
+ *   const BYTE *data;
+ *   int size = c->$Peek(&data, 4);
+ *   if (size == 4 && memcmp(data, "GET ", 4) == 0)
+ *     ...
+ */
+int
+PTP::Net::Connection::Peek(const BYTE **data, int size, int timeout)
+{
+	if (!data || Open() < 0)
+		return -1;
+
+	m_mutex.Lock();
+	int status = 0;
+	if (!m_count)
+		status = Fill(timeout);
+	else if (m_count < size && Wait(m_s, 0, 0) == 0)
+		status = Fill(0);
+
+	if (!m_count)
+	{
+		m_mutex.Unlock();
+		*data = NULL;
+		return status;
+	}
+
+	*data = m_buffer + m_head;
+	int peeksize = (size < m_count) ? size:m_count;
+	m_mutex.Unlock();
+
+	return peeksize;
+}
+
+/**
+ * PTP::Net::Connection::Consume: Discard received data.
+ * @size: Number of bytes to discard.
+ * Returns: Number of bytes discarded.
+ * Notes: Only data that is already buffered (see &Peek) is discarded.
+ */
+int
+PTP::Net::Connection::Consume(int size)
+{
+	m_mutex.Lock();
+	if (size > m_count)
+		size = m_count;
+	if (size > 0)
+	{
+		m_head += size;
+		m_count -= size;
+		if (!m_count)
+			m_head = 0;
+	}
+	m_mutex.Unlock();
+
+	return ((size > 0) ? size:0);
+}
+
+/**
+ * PTP::Net::Connection::ReadUntil: Read data through a delimiter.
+ * @data: [$OUT] Data buffer.
+ * @size: Buffer size.
+ * @delim: Delimiter string (eg. "\r\n").
+ * @timeout: Milliseconds to wait for data (0 for infinite timeout).
+ * Returns: Number of bytes read (including @delim), 0 if the
+ *          connection closed first, or -1 on error or if @delim
+ *          was not found within @size bytes.
+ * Notes: On failure, no data is removed from the connection.
+ * Example:
+ *   char line[256];
+ *   int size = c->$ReadUntil((BYTE*) line, sizeof(line) - 1, "\n");
+ *   if (size > 0)
+ *     line[size] = '\0';
+ */
+int
+PTP::Net::Connection::ReadUntil(BYTE *data,
+				int size,
+				const char *delim,
+				int timeout)
+{
+	if (!data || size <= 0 || !delim || !*delim || Open() < 0)
+		return -1;
+
+	int delimsize = strlen(delim);
+	int scanned = 0;
+	int status = -1;
+
+	m_mutex.Lock();
+	for (;;)
+	{
+		int end = Find(m_buffer + m_head, m_count, scanned, delim);
+		if (end >= 0)
+		{
+			end += delimsize;
+			if (end <= size)
+			{
+				memcpy(data, m_buffer + m_head, end);
+				Consume(end);
+				status = end;
+			}
+			break;
+		}
+		if (m_count >= size)
+			break;
+		scanned = (m_count >= delimsize) ? (m_count - delimsize + 1):0;
+
+		int s = Fill(timeout);
+		if (s == AGAIN)
+		{
+			if (Wait(m_s, 0, timeout ? timeout:-1) == 0)
+				continue;
+			s = -1;
+		}
+		if (s <= 0)
+		{
+			status = s;
+			break;
+		}
+	}
+	m_mutex.Unlock();
+
+	return status;
+}
+
+/**
+ * PTP::Net::Connection::GetBuffered
+ * Returns: Number of received bytes that are buffered but not yet read.
+ * Notes: A reactor only reports new network data, so buffered data
+ *        should be handled before waiting for the next event.
+ */
+int
+PTP::Net::Connection::GetBuffered() const
+{
+	return m_count;
+}
+
 /**
  * PTP::Net::Connection::SetProxy: Set proxy settings.
  * Type: static
@@ -1040,75 +1967,195 @@ PTP::Net::Connection::Unget(const BYTE *data, int size)
  * @port: Proxy TCP port.
  * @timeout: Milliseconds to wait for a direct connection
  *           (0 for proxy only).
+ * Notes: Whether each destination was reached directly, through the
+ *        proxy, or not at all is remembered for a while, so later
+ *        connections to it skip the direct connection timeout.
+ *        Changing the proxy settings forgets these routes.
  */
 void
 PTP::Net::Connection::SetProxy(Net::Ip ip, Net::Port port, int timeout)
 {
+	s_routeMutex.Lock();
 	s_proxyIp = ip;
 	s_proxyPort = port;
 	s_proxyTimeout = timeout;
+	memset(s_routes, 0, sizeof(s_routes));
+	s_routeMutex.Unlock();
 }
 
 /*
- * PTP::Net::Connection::Get: Read data from read queue.
- * @data: [$OUT] Data buffer.
- * @size: Buffer size.
- * Returns: Number of bytes read.
+ * PTP::Net::Connection::Fill: Read more data into the receive buffer.
+ * @timeout: Milliseconds to wait for data (0 for infinite timeout).
+ * Returns: Number of bytes read, 0 if the connection is closed,
+ *          %AGAIN if a non-blocking connection has no data, or -1
+ *          on error.
+ * Notes: The connection mutex must be held.
  */
 int
-PTP::Net::Connection::Get(BYTE *data, int size)
+PTP::Net::Connection::Fill(int timeout)
 {
-	m_mutex.Lock();
-	int readsize =  m_ungetLast - m_ungetNext;
-	if (readsize)
+	if (!m_buffer)
 	{
-		if (readsize > size)
-			readsize = size;
-		
-		memcpy(data, m_ungetNext, readsize);
-		m_ungetNext += readsize;
-		
-		if (m_ungetNext >= m_ungetLast)
+		m_buffer = new BYTE[RECV_BUFFER_SIZE];
+		m_bufferSize = RECV_BUFFER_SIZE;
+		m_head = 0;
+		m_count = 0;
+	}
+
+	// make room at the end of the buffer
+	if (m_head + m_count >= m_bufferSize)
+	{
+		if (m_head > 0)
+		{
+			memmove(m_buffer, m_buffer + m_head, m_count);
+			m_head = 0;
+		}
+		else
 		{
-			delete [] m_unget;
-			m_unget = NULL;
-			m_ungetNext = NULL;
-			m_ungetLast = NULL;
+			BYTE *old = m_buffer;
+			m_bufferSize *= 2;
+			m_buffer = new BYTE[m_bufferSize];
+			memcpy(m_buffer, old, m_count);
+			delete [] old;
 		}
 	}
-	m_mutex.Unlock();
+
+	if (timeout && Wait(m_s, 0, timeout))
+		return -1;
+
+	BYTE *tail = m_buffer + m_head + m_count;
+	int size = m_bufferSize - m_head - m_count;
+#ifdef WIN32
+	int readsize = recv(m_s, (char*) tail, size, 0);
+#else
+	int readsize = read(m_s, (char*) tail, size);
+#endif
+	if (readsize > 0)
+		m_count += readsize;
+	else if (readsize < 0 && !m_block && IsPending())
+		readsize = AGAIN;
 
 	return readsize;
 }
 
 /*
- * PTP::Net::Connection::UngetData: Save data read beyond the HTTP header.
- * @hdr: HTTP header.
- * @size: Header size.
- * Returns: Size of saved data or -1 if none.
+ * PTP::Net::Connection::WriteGather: Write several buffers at once.
+ * @data: Data buffers (NULL if the size is 0).
+ * @size: Buffer sizes.
+ * @count: Number of buffers (at most %MAX_GATHER).
+ * Returns: Number of bytes written or -1 on error.
+ * Notes: The buffers are sent with a single writev() where possible,
+ *        so a header and its data can share a packet.
  */
 int
-PTP::Net::Connection::UngetData(BYTE *hdr, int size)
+PTP::Net::Connection::WriteGather(const BYTE **data,
+				  const int *size,
+				  int count)
 {
-	char *data = strstr((char*) hdr, "\r\n\r\n");
-	if (data)
-		data += 4;
-	else
+	if (Open() < 0 || count < 0 || count > MAX_GATHER)
+		return -1;
+
+	int total = 0;
+	int i;
+	for (i = 0; i < count; i++)
+		total += size[i];
+
+#ifdef WIN32
+	// copy small buffers together; large ones fill packets anyway
+	if (total > SEND_FILE_SIZE)
 	{
-		data = strstr((char*) hdr, "\n\n");
-		if (data)
-			data += 2;
-		else
+		int written = 0;
+		for (i = 0; i < count; i++)
+		{
+			int s = WriteAll(data[i], size[i]);
+			if (s < 0)
+				return -1;
+			written += s;
+			if (s < size[i])
+				break;
+		}
+		return written;
+	}
+
+	BYTE *buffer = new BYTE[total + 1];
+	int offset = 0;
+	for (i = 0; i < count; i++)
+	{
+		if (size[i] > 0)
+			memcpy(buffer + offset, data[i], size[i]);
+		offset += size[i];
+	}
+	int written = WriteAll(buffer, total);
+	delete [] buffer;
+	return written;
+#else
+	struct iovec iov[MAX_GATHER];
+	int first = 0;
+	int n = 0;
+	for (i = 0; i < count; i++)
+	{
+		if (size[i] <= 0)
+			continue;
+		iov[n].iov_base = (void*) data[i];
+		iov[n].iov_len = size[i];
+		n++;
+	}
+
+	int written = 0;
+	while (first < n)
+	{
+		ssize_t s = writev(m_s, iov + first, n - first);
+		if (s < 0 && errno == EINTR)
+			continue;
+		if (s < 0 && !m_block && IsPending())
+		{
+			// wait for room on a non-blocking connection
+			if (Wait(m_s, 1, -1))
+				return -1;
+			continue;
+		}
+		if (s < 0)
 			return -1;
+		else if (s == 0)
+			break;
+		written += s;
+
+		// skip the data already sent
+		while (first < n && s >= (ssize_t) iov[first].iov_len)
+			s -= iov[first++].iov_len;
+		if (first < n)
+		{
+			iov[first].iov_base = (char*) iov[first].iov_base + s;
+			iov[first].iov_len -= s;
+		}
 	}
-	
-	size -= (data - (char*) hdr);
-	if (size > 0)
+	return written;
+#endif
+}
+
+/*
+ * PTP::Net::Connection::Find: Search data for a delimiter.
+ * Type: static
+ * @data: Data buffer.
+ * @size: Buffer size.
+ * @start: Offset to start searching.
+ * @delim: Delimiter string.
+ * Returns: Offset of @delim or -1 if not found.
+ */
+int
+PTP::Net::Connection::Find(const BYTE *data,
+			   int size,
+			   int start,
+			   const char *delim)
+{
+	int delimsize = strlen(delim);
+	for (int i = start; i + delimsize <= size; i++)
 	{
-		Unget((BYTE*) data, size);
-		*data = '\0';
+		if (data[i] == (BYTE) *delim
+		    && memcmp(data + i, delim, delimsize) == 0)
+			return i;
 	}
-	return size;
+	return -1;
 }
 
 /*
@@ -1117,7 +2164,8 @@ PTP::Net::Connection::UngetData(BYTE *hdr, int size)
  * @s: Socket.
  * @ip: Destination IP address.
  * @port: Destination TCP port.
- * @timeout: Milliseconds to wait for connect (or 0 for infinite timeout).
+ * @timeout: Milliseconds to wait for connect (0 for infinite timeout
+ *           or -1 to start a non-blocking connect and return).
  * Returns: 0 on success or -1 on error.
  */
 int
@@ -1132,31 +2180,24 @@ PTP::Net::Connection::Connect(int s,
 	addr.sin_port = htons(port);
 	addr.sin_addr.s_addr = htonl(ip);
 
-	// set non-blocking mode
-	if (timeout)
+	// non-blocking connect (socket is already non-blocking)
+	if (timeout < 0)
 	{
-#ifdef WIN32
-		u_long val = 1;
-		ioctlsocket(s, FIONBIO, &val);
-#else
-		fcntl(s, F_SETFL, O_NONBLOCK);
-#endif
+		int status = connect(s, (struct sockaddr*) &addr, sizeof(addr));
+		return ((status == 0 || IsPending()) ? 0:-1);
 	}
 
+	// set non-blocking mode
+	if (timeout)
+		SetBlocking(s, 0);
+
 	int status = connect(s, (struct sockaddr*) &addr, sizeof(addr));
-	if (status)
+	if (status && timeout && IsPending())
 		status = Wait(s, 1, timeout);
 
 	// set blocking mode
 	if (timeout)
-	{
-#ifdef WIN32
-		u_long val = 0;
-		ioctlsocket(s, FIONBIO, &val);
-#else
-		fcntl(s, F_SETFL, 0);
-#endif
-	}
+		SetBlocking(s, 1);
 
 	return status;
 }
@@ -1165,12 +2206,13 @@ PTP::Net::Connection::Connect(int s,
  * PTP::Net::Connection::Wait: Wait for data.
  * @s: Socket.
  * @write: 1 to wait for write or 0 to wait for read.
- * @timeout: Milliseconds to wait.
+ * @timeout: Milliseconds to wait (-1 for infinite).
  * Returns: 0 on success or -1 on timeout.
  */
 int
 PTP::Net::Connection::Wait(int s, int write, int timeout)
 {
+#ifdef WIN32
 	fd_set fds;
 	FD_ZERO(&fds);
 	FD_SET(s, &fds);
@@ -1182,9 +2224,23 @@ PTP::Net::Connection::Wait(int s, int write, int timeout)
 
 	int status = 0;
 	if (write)
-		status = select(s + 1, NULL, &fds, NULL, &tmo);
+		status = select(s + 1, NULL, &fds, NULL,
+				(timeout < 0) ? NULL:&tmo);
 	else
-		status = select(s + 1, &fds, NULL, NULL, &tmo);
+		status = select(s + 1, &fds, NULL, NULL,
+				(timeout < 0) ? NULL:&tmo);
+#else
+	// poll() has no FD_SETSIZE limit on the socket number
+	struct pollfd fds;
+	fds.fd = s;
+	fds.events = write ? POLLOUT:POLLIN;
+	fds.revents = 0;
+
+	int status = 0;
+	do
+		status = poll(&fds, 1, timeout);
+	while (status < 0 && errno == EINTR);
+#endif
 
 	if (status == 1)
 	{
@@ -1196,6 +2252,185 @@ PTP::Net::Connection::Wait(int s, int write, int timeout)
 	return ((status == 0) ? 0:-1);
 }
 
+/*
+ * PTP::Net::Connection::SetBlocking: Set socket blocking mode.
+ * Type: static
+ * @s: Socket.
+ * @block: 1 for blocking or 0 for non-blocking.
+ * Returns: 0 on success or -1 on error.
+ */
+int
+PTP::Net::Connection::SetBlocking(int s, int block)
+{
+#ifdef WIN32
+	u_long val = block ? 0:1;
+	return ((ioctlsocket(s, FIONBIO, &val) == 0) ? 0:-1);
+#else
+	int flags = fcntl(s, F_GETFL, 0);
+	if (flags < 0)
+		return -1;
+	flags = block ? (flags & ~O_NONBLOCK):(flags | O_NONBLOCK);
+	return ((fcntl(s, F_SETFL, flags) == 0) ? 0:-1);
+#endif
+}
+
+/*
+ * PTP::Net::Connection::SetOptions: Set socket options.
+ * Type: static
+ * @s: Socket.
+ * @options: Socket options (%NO_DELAY, %LARGE_BUFFERS, %REUSE_PORT).
+ * Returns: 0 on success or -1 on error.
+ */
+int
+PTP::Net::Connection::SetOptions(int s, int options)
+{
+	int status = 0;
+
+	int nodelay = (options & NO_DELAY) ? 1:0;
+	if (setsockopt(s,
+		       IPPROTO_TCP,
+		       TCP_NODELAY,
+		       (char*) &nodelay,
+		       sizeof(nodelay)) < 0)
+		status = -1;
+
+	if (options & LARGE_BUFFERS)
+	{
+		int size = BULK_BUFFER_SIZE;
+		if (setsockopt(s,
+			       SOL_SOCKET,
+			       SO_SNDBUF,
+			       (char*) &size,
+			       sizeof(size)) < 0
+		    || setsockopt(s,
+				  SOL_SOCKET,
+				  SO_RCVBUF,
+				  (char*) &size,
+				  sizeof(size)) < 0)
+			status = -1;
+	}
+
+	if (options & REUSE_PORT)
+	{
+#ifdef SO_REUSEPORT
+		int reuse = 1;
+		if (setsockopt(s,
+			       SOL_SOCKET,
+			       SO_REUSEPORT,
+			       (char*) &reuse,
+			       sizeof(reuse)) < 0)
+			status = -1;
+#else
+		status = -1;
+#endif
+	}
+
+	return status;
+}
+
+/*
+ * PTP::Net::Connection::IsPortFree: Check that no socket uses a port.
+ * Type: static
+ * @port: TCP port.
+ * Returns: 1 if a server could bind @port without sharing it, or 0.
+ */
+int
+PTP::Net::Connection::IsPortFree(Net::Port port)
+{
+	int s = socket(AF_INET, SOCK_STREAM, PROTOCOL);
+	if (s < 0)
+		return 0;
+
+#ifndef WIN32
+	// ports in TIME_WAIT count as free, as they do for &Open
+	int opt = 1;
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (char*) &opt, sizeof(opt));
+#endif
+
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(Net::ANY);
+	addr.sin_port = htons(port);
+	int free = (bind(s, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+	Close(s);
+
+	return free;
+}
+
+/*
+ * PTP::Net::Connection::GetRoute: Look up how a destination is reached.
+ * Type: static
+ * @ip: Destination IP address.
+ * @port: Destination TCP port.
+ * Returns: %NO_PROXY, %PROXY, %UNREACHABLE, or %UNKNOWN if there is no
+ *          recent connection to the destination.
+ */
+PTP::Net::Connection::ProxyState
+PTP::Net::Connection::GetRoute(Net::Ip ip, Net::Port port)
+{
+	Route *route = &s_routes[(ip ^ (ip >> 12) ^ port) % ROUTE_CACHE_SIZE];
+	ProxyState state = UNKNOWN;
+
+	s_routeMutex.Lock();
+	if (route->ip == ip && route->port == port)
+	{
+		unsigned long ttl = ((route->state == UNREACHABLE)
+				     ? UNREACHABLE_TTL:ROUTE_TTL);
+		if (GetTime() - route->time < ttl)
+			state = route->state;
+		else
+			route->ip = 0;
+	}
+	s_routeMutex.Unlock();
+
+	return state;
+}
+
+/*
+ * PTP::Net::Connection::SetRoute: Remember how a destination is reached.
+ * Type: static
+ * @ip: Destination IP address.
+ * @port: Destination TCP port.
+ * @state: %NO_PROXY, %PROXY, %UNREACHABLE, or %UNKNOWN to forget.
+ */
+void
+PTP::Net::Connection::SetRoute(Net::Ip ip, Net::Port port, ProxyState state)
+{
+	Route *route = &s_routes[(ip ^ (ip >> 12) ^ port) % ROUTE_CACHE_SIZE];
+
+	s_routeMutex.Lock();
+	if (state != UNKNOWN)
+	{
+		route->ip = ip;
+		route->port = port;
+		route->state = state;
+		route->time = GetTime();
+	}
+	else if (route->ip == ip && route->port == port)
+		route->ip = 0;
+	s_routeMutex.Unlock();
+}
+
+/*
+ * PTP::Net::Connection::IsPending: Check the last socket error.
+ * Type: static
+ * Returns: 1 if the last socket call would have blocked or
+ *          is still in progress or else 0.
+ */
+int
+PTP::Net::Connection::IsPending()
+{
+#ifdef WIN32
+	int error = WSAGetLastError();
+	return (error == WSAEWOULDBLOCK || error == WSAEINPROGRESS);
+#else
+	return (errno == EAGAIN
+		|| errno == EWOULDBLOCK
+		|| errno == EINPROGRESS);
+#endif
+}
+
 /*
  * PTP::Net::Connection::Close: Close a socket.
  * Type: static
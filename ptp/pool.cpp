@@ -0,0 +1,491 @@
+/*
+ * Copyright (c) 2001 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * 3. Neither the name of the Intel Corporation nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include <assert.h>
+#include <ptp/pool.h>
+#include <ptp/debug.h>
+
+#ifdef WIN32
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+// worker running on the current thread (or NULL)
+static THREAD_LOCAL void *s_worker = NULL;
+
+/*
+ * PTP::ThreadPool::Worker: Worker thread and its task queue.
+ */
+class PTP::ThreadPool::Worker
+{
+public:
+	Worker():m_tasks(NULL), m_head(0), m_count(0), m_size(0) {}
+	~Worker() {delete [] m_tasks;}
+
+	int Push(Task task, void *arg);
+	int PopNewest(Task *task, void **arg);
+	int PopOldest(Task *task, void **arg);
+
+	struct Item
+	{
+		Task task;
+		void *arg;
+	};
+
+	Item *m_tasks;
+	int m_head;
+	int m_count;
+	int m_size;
+
+	PTP::Mutex m_mutex;
+	PTP::Thread m_thread;
+	PTP::ThreadPool *m_pool;
+};
+
+/*
+ * PTP::ThreadPool::Worker::Push: Queue a task.
+ * @task: Task function.
+ * @arg: Task argument.
+ * Returns: 0 on success or -1 if the queue is full.
+ */
+int
+PTP::ThreadPool::Worker::Push(Task task, void *arg)
+{
+	m_mutex.Lock();
+	if (m_count >= m_size)
+	{
+		m_mutex.Unlock();
+		return -1;
+	}
+	Item *item = &m_tasks[(m_head + m_count) % m_size];
+	item->task = task;
+	item->arg = arg;
+	m_count++;
+	m_mutex.Unlock();
+	return 0;
+}
+
+/*
+ * PTP::ThreadPool::Worker::PopNewest: Remove the newest task.
+ * @task: [$OUT] Task function.
+ * @arg: [$OUT] Task argument.
+ * Returns: 0 on success or -1 if the queue is empty.
+ * Notes: Used by the owning worker (LIFO keeps its data cache-warm).
+ */
+int
+PTP::ThreadPool::Worker::PopNewest(Task *task, void **arg)
+{
+	m_mutex.Lock();
+	if (!m_count)
+	{
+		m_mutex.Unlock();
+		return -1;
+	}
+	m_count--;
+	Item *item = &m_tasks[(m_head + m_count) % m_size];
+	*task = item->task;
+	*arg = item->arg;
+	m_mutex.Unlock();
+	return 0;
+}
+
+/*
+ * PTP::ThreadPool::Worker::PopOldest: Remove the oldest task.
+ * @task: [$OUT] Task function.
+ * @arg: [$OUT] Task argument.
+ * Returns: 0 on success or -1 if the queue is empty.
+ * Notes: Used by other workers to steal work (FIFO).
+ */
+int
+PTP::ThreadPool::Worker::PopOldest(Task *task, void **arg)
+{
+	m_mutex.Lock();
+	if (!m_count)
+	{
+		m_mutex.Unlock();
+		return -1;
+	}
+	Item *item = &m_tasks[m_head];
+	*task = item->task;
+	*arg = item->arg;
+	m_head = (m_head + 1) % m_size;
+	m_count--;
+	m_mutex.Unlock();
+	return 0;
+}
+
+/**
+ * PTP::ThreadPool::ThreadPool: Class constructor.
+ * @threads: Number of worker threads (0 for one per CPU).
+ * @queueSize: Maximum number of queued tasks.
+ * @pinned: Non-zero to bind each worker thread to one processor.
+ * @background: Non-zero to run the worker threads only on otherwise
+ *              idle processors.
+ * Notes: The worker threads are started immediately.  Pinned workers
+ *        are assigned processors in turn.
+ */
+PTP::ThreadPool::ThreadPool(int threads,
+			    int queueSize,
+			    int pinned,
+			    int background)
+	:m_workers(NULL), m_threads(threads), m_pinned(pinned),
+	 m_background(background), m_next(0),
+	 m_stop(0), m_pending(0), m_waiters(0)
+{
+	if (m_threads <= 0)
+		m_threads = GetCpuCount();
+
+	int size = queueSize / m_threads;
+	if (size < 1)
+		size = 1;
+
+	m_workers = new Worker[m_threads];
+	for (int i = 0; i < m_threads; i++)
+	{
+		Worker *w = &m_workers[i];
+		w->m_tasks = new Worker::Item[size];
+		w->m_size = size;
+		w->m_pool = this;
+	}
+	for (int i = 0; i < m_threads; i++)
+		m_workers[i].m_thread.Start(Run, &m_workers[i]);
+}
+
+#ifdef PTPTL_DLL
+
+/*
+ * PTP::ThreadPool::ThreadPool: Copy constructor.
+ * @pool: Source ThreadPool.
+ */
+PTP::ThreadPool::ThreadPool(const ThreadPool& pool)
+{
+	assert(0);
+}
+
+/*
+ * PTP::ThreadPool::operator=: Copy constructor.
+ * @pool: Source ThreadPool.
+ */
+PTP::ThreadPool&
+PTP::ThreadPool::operator=(const ThreadPool& pool)
+{
+	assert(0);
+	return *this;
+}
+
+#endif // PTPTL_DLL
+
+/**
+ * PTP::ThreadPool::~ThreadPool: Class destructor.
+ * Notes: Queued tasks are run before the workers exit.
+ */
+PTP::ThreadPool::~ThreadPool()
+{
+	m_mutex.Lock();
+	m_stop = 1;
+	m_mutex.Unlock();
+
+	m_work.Post(m_threads);
+	for (int i = 0; i < m_threads; i++)
+		m_workers[i].m_thread.Wait();
+
+	// run anything left behind by a racing worker
+	Task task;
+	void *arg;
+	while (Take(NULL, &task, &arg) == 0)
+	{
+		(*task)(arg);
+		Done();
+	}
+
+	delete [] m_workers;
+}
+
+/**
+ * PTP::ThreadPool::Submit: Queue a task to run on a worker thread.
+ * @task: Task function.
+ * @arg: Argument to @task.
+ * Returns: 0 on success or -1 if all queues are full.
+ * Example:
+ *   void PrintTask(void *arg)
+ *   {
+ *       printf("%s\n", (const char*) arg);
+ *   }
+ *   ...
+ *   PTP::ThreadPool pool;
+ *   pool.$Submit(PrintTask, "Running...");
+ *   pool.Wait();
+ */
+int
+PTP::ThreadPool::Submit(Task task, void *arg)
+{
+	if (!task)
+		return -1;
+
+	m_mutex.Lock();
+	if (m_stop)
+	{
+		m_mutex.Unlock();
+		return -1;
+	}
+	int start = m_next;
+	m_next = (m_next + 1) % m_threads;
+	m_pending++;
+	m_mutex.Unlock();
+
+	// prefer the current worker's own queue
+	Worker *self = (Worker*) s_worker;
+	if (self && self->m_pool == this)
+		start = self - m_workers;
+
+	for (int i = 0; i < m_threads; i++)
+	{
+		if (m_workers[(start + i) % m_threads].Push(task, arg) == 0)
+		{
+			m_work.Post();
+			return 0;
+		}
+	}
+
+	Done();
+	return -1;
+}
+
+/**
+ * PTP::ThreadPool::Wait: Wait until all submitted tasks are complete.
+ * Notes: &Wait must not be called from a task.
+ */
+void
+PTP::ThreadPool::Wait()
+{
+	m_mutex.Lock();
+	if (!m_pending)
+	{
+		m_mutex.Unlock();
+		return;
+	}
+	m_waiters++;
+	m_mutex.Unlock();
+	m_idle.Wait();
+}
+
+/**
+ * PTP::ThreadPool::GetThreads
+ * Returns: Number of worker threads.
+ */
+int
+PTP::ThreadPool::GetThreads() const
+{
+	return m_threads;
+}
+
+/**
+ * PTP::ThreadPool::GetCpuCount
+ * Type: static
+ * Returns: Number of online processors.
+ */
+int
+PTP::ThreadPool::GetCpuCount()
+{
+#ifdef WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	int count = (int) info.dwNumberOfProcessors;
+#else
+	int count = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return ((count > 0) ? count:1);
+}
+
+/*
+ * PTP::ThreadPool::Take: Find a task to run.
+ * @worker: Worker looking for a task (or NULL).
+ * @task: [$OUT] Task function.
+ * @arg: [$OUT] Task argument.
+ * Returns: 0 on success or -1 if all queues are empty.
+ */
+int
+PTP::ThreadPool::Take(Worker *worker, Task *task, void **arg)
+{
+	if (worker && worker->PopNewest(task, arg) == 0)
+		return 0;
+
+	int start = worker ? (worker - m_workers):0;
+	for (int i = 1; i <= m_threads; i++)
+	{
+		Worker *victim = &m_workers[(start + i) % m_threads];
+		if (victim != worker && victim->PopOldest(task, arg) == 0)
+			return 0;
+	}
+	return -1;
+}
+
+/*
+ * PTP::ThreadPool::Done: Mark a task complete.
+ */
+void
+PTP::ThreadPool::Done()
+{
+	m_mutex.Lock();
+	if (--m_pending == 0 && m_waiters)
+	{
+		m_idle.Post(m_waiters);
+		m_waiters = 0;
+	}
+	m_mutex.Unlock();
+}
+
+/*
+ * PTP::ThreadPool::Run: Worker thread.
+ * Type: static
+ * @arg: Worker.
+ * Returns: NULL.
+ */
+void *
+PTP::ThreadPool::Run(void *arg)
+{
+	Worker *worker = (Worker*) arg;
+	ThreadPool *pool = worker->m_pool;
+	s_worker = worker;
+	if (pool->m_pinned)
+		Pin(worker - pool->m_workers);
+	if (pool->m_background)
+		Background();
+
+	for (;;)
+	{
+		// each post of m_work matches one queued task (or stop)
+		pool->m_work.Wait();
+
+		Task task;
+		void *arg;
+		if (pool->Take(worker, &task, &arg) == 0)
+		{
+			(*task)(arg);
+			pool->Done();
+			continue;
+		}
+
+		pool->m_mutex.Lock();
+		int stop = pool->m_stop;
+		pool->m_mutex.Unlock();
+		if (stop)
+			break;
+
+		// the task was taken by a worker that left its own in a
+		// queue already searched, so hand the post on
+		pool->m_work.Post();
+	}
+
+	s_worker = NULL;
+	return NULL;
+}
+
+/*
+ * PTP::ThreadPool::Pin: Bind the calling thread to one processor.
+ * Type: static
+ * @cpu: Processor index (counted among the allowed processors, modulo
+ *       their number).
+ * Notes: Does nothing where thread affinity is not supported.
+ */
+void
+PTP::ThreadPool::Pin(int cpu)
+{
+#ifdef WIN32
+	DWORD_PTR process, system;
+	if (!GetProcessAffinityMask(GetCurrentProcess(), &process, &system))
+		return;
+	int count = 0;
+	DWORD_PTR bit;
+	for (bit = 1; bit; bit <<= 1)
+		count += ((process & bit) != 0);
+	if (count <= 0)
+		return;
+	cpu %= count;
+	for (bit = 1; bit; bit <<= 1)
+	{
+		if ((process & bit) && cpu-- == 0)
+		{
+			SetThreadAffinityMask(GetCurrentThread(), bit);
+			break;
+		}
+	}
+#elif defined(__linux__)
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return;
+	int count = CPU_COUNT(&allowed);
+	if (count <= 0)
+		return;
+	cpu %= count;
+	for (int i = 0; i < CPU_SETSIZE; i++)
+	{
+		if (CPU_ISSET(i, &allowed) && cpu-- == 0)
+		{
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(i, &set);
+			pthread_setaffinity_np(pthread_self(),
+					       sizeof(set),
+					       &set);
+			break;
+		}
+	}
+#endif
+}
+
+/*
+ * PTP::ThreadPool::Background: Lower the priority of the calling
+ *                              thread to idle.
+ * Type: static
+ * Notes: Does nothing where idle scheduling is not supported.
+ */
+void
+PTP::ThreadPool::Background()
+{
+#ifdef WIN32
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_IDLE);
+#elif defined(__linux__) && defined(SCHED_IDLE)
+	struct sched_param param;
+	param.sched_priority = 0;
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+}
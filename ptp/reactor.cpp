@@ -0,0 +1,670 @@
+/*
+ * Copyright (c) 2001 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * 3. Neither the name of the Intel Corporation nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef WIN32
+#include <winsock.h>
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include <ptp/reactor.h>
+#include <ptp/sem.h>
+#include <ptp/debug.h>
+
+#ifdef WIN32
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+// loop running on the current thread (or NULL)
+static THREAD_LOCAL void *s_loop = NULL;
+
+/*
+ * PTP::Net::Reactor::Loop: Single event loop thread.
+ */
+class PTP::Net::Reactor::Loop
+{
+public:
+	Loop();
+	~Loop();
+
+	void Wake();
+	void Reap();
+
+	PTP::List m_handlers;
+	PTP::List m_removed;
+	PTP::Mutex m_mutex;
+	PTP::Thread m_thread;
+	int m_started;
+	int m_stopping;
+	int m_stop;
+
+	// handler whose callback is running, and threads waiting
+	// in &Remove for it to return
+	Handler *m_current;
+	int m_waiters;
+	PTP::Semaphore m_done;
+#ifndef WIN32
+	int m_epoll;
+	int m_wake[2];
+#endif
+};
+
+/*
+ * PTP::Net::Reactor::Loop::Loop: Class constructor.
+ */
+PTP::Net::Reactor::Loop::Loop()
+	:m_handlers(0), m_removed(0), m_started(0), m_stopping(0), m_stop(0),
+	 m_current(NULL), m_waiters(0)
+{
+#ifndef WIN32
+	m_wake[0] = m_wake[1] = -1;
+	m_epoll = epoll_create(MAX_EVENTS);
+	if (m_epoll >= 0 && pipe(m_wake) == 0)
+	{
+		fcntl(m_wake[0], F_SETFL, O_NONBLOCK);
+		fcntl(m_wake[1], F_SETFL, O_NONBLOCK);
+
+		// a NULL handler marks the wake-up pipe
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake[0], &event);
+	}
+#endif
+}
+
+/*
+ * PTP::Net::Reactor::Loop::~Loop: Class destructor.
+ */
+PTP::Net::Reactor::Loop::~Loop()
+{
+	Reap();
+
+	Handler *h;
+	while ((h = (Handler*) m_handlers.GetHead()) != NULL)
+	{
+		m_handlers.Remove(h);
+		delete h;
+	}
+
+#ifndef WIN32
+	if (m_wake[0] >= 0)
+		close(m_wake[0]);
+	if (m_wake[1] >= 0)
+		close(m_wake[1]);
+	if (m_epoll >= 0)
+		close(m_epoll);
+#endif
+}
+
+/*
+ * PTP::Net::Reactor::Loop::Wake: Interrupt the loop thread.
+ */
+void
+PTP::Net::Reactor::Loop::Wake()
+{
+#ifndef WIN32
+	char c = 0;
+	write(m_wake[1], &c, 1);
+#endif
+}
+
+/*
+ * PTP::Net::Reactor::Loop::Reap: Free removed handlers.
+ * Notes: Handlers are only freed between dispatch passes, so
+ *        an event that is already queued never refers to
+ *        freed memory.
+ */
+void
+PTP::Net::Reactor::Loop::Reap()
+{
+	Handler *h;
+	while ((h = (Handler*) m_removed.GetHead()) != NULL)
+	{
+		m_removed.Remove(h);
+		delete h;
+	}
+}
+
+/**
+ * PTP::Net::Reactor::Reactor: Class constructor.
+ * @threads: Number of event loop threads.
+ * Notes: Connections are spread across the loop threads as
+ *        they are added.
+ */
+PTP::Net::Reactor::Reactor(int threads)
+	:m_loops(NULL), m_threads(threads), m_next(0), m_running(0)
+{
+	if (m_threads < 1)
+		m_threads = 1;
+	m_loops = new Loop[m_threads];
+}
+
+#ifdef PTPTL_DLL
+
+/*
+ * PTP::Net::Reactor::Reactor: Copy constructor.
+ * @reactor: Source Reactor.
+ */
+PTP::Net::Reactor::Reactor(const Reactor& reactor)
+{
+	assert(0);
+}
+
+/*
+ * PTP::Net::Reactor::operator=: Copy constructor.
+ * @reactor: Source Reactor.
+ */
+PTP::Net::Reactor&
+PTP::Net::Reactor::operator=(const Reactor& reactor)
+{
+	assert(0);
+	return *this;
+}
+
+#endif // PTPTL_DLL
+
+/**
+ * PTP::Net::Reactor::~Reactor: Class destructor.
+ * Notes: Stops the loop threads and frees all handlers.
+ *        Connections are not closed.
+ */
+PTP::Net::Reactor::~Reactor()
+{
+	Stop();
+	delete [] m_loops;
+}
+
+/**
+ * PTP::Net::Reactor::Start: Start the event loop threads.
+ * Returns: 0 on success or -1 on error.
+ * Example:
+ *   PTP::Net::Reactor reactor(2);
+ *   reactor.$Start();
+ *   ...
+ *   reactor.Stop();
+ */
+int
+PTP::Net::Reactor::Start()
+{
+	m_mutex.Lock();
+	int status = 0;
+	for (int i = 0; i < m_threads && !status; i++)
+	{
+		Loop *loop = &m_loops[i];
+		if (loop->m_started)
+			continue;
+#ifndef WIN32
+		if (loop->m_epoll < 0 || loop->m_wake[0] < 0)
+		{
+			status = -1;
+			break;
+		}
+#endif
+		loop->m_stop = 0;
+		if (loop->m_thread.Start(Run, loop))
+			status = -1;
+		else
+			loop->m_started = 1;
+	}
+	m_running = 1;
+	m_mutex.Unlock();
+
+	if (status)
+		Stop();
+	return status;
+}
+
+/**
+ * PTP::Net::Reactor::Stop: Stop the event loop threads.
+ * Notes: Handlers stay registered and are served again after
+ *        &Start.  &Stop must not be called from a callback.
+ */
+void
+PTP::Net::Reactor::Stop()
+{
+	Loop **stopping = new Loop*[m_threads];
+	int count = 0;
+
+	m_mutex.Lock();
+	for (int i = 0; i < m_threads; i++)
+	{
+		Loop *loop = &m_loops[i];
+		if (!loop->m_started || loop->m_stopping)
+			continue;
+
+		loop->m_mutex.Lock();
+		loop->m_stopping = 1;
+		loop->m_stop = 1;
+		loop->Wake();
+		loop->m_mutex.Unlock();
+		stopping[count++] = loop;
+	}
+	m_running = 0;
+	m_mutex.Unlock();
+
+	// callbacks may call Add while the loops finish
+	for (int i = 0; i < count; i++)
+	{
+		Loop *loop = stopping[i];
+		loop->m_thread.Wait();
+
+		loop->m_mutex.Lock();
+		loop->m_started = 0;
+		loop->m_stopping = 0;
+		loop->Reap();
+		loop->m_mutex.Unlock();
+	}
+	delete [] stopping;
+}
+
+/**
+ * PTP::Net::Reactor::Add: Watch a connection for events.
+ * @conn: Connection (opened if needed).
+ * @events: Events to watch (%READ, %WRITE and %ONESHOT).
+ * @callback: Function to call when events occur.
+ * @context: Context passed to @callback.
+ * Returns: Handler on success or NULL on error.
+ * Notes: %CLOSE is always reported.  The connection is not
+ *        owned by the reactor and must stay valid until the
+ *        handler is removed with &Remove.
+ * Example:
+ *   void OnRead(PTP::Net::Reactor::Handler *h, int events, void *ctx)
+ *   {
+ *       BYTE data[1024];
+ *       int size = h->GetConnection()->Read(data, sizeof(data));
+ *       ...
+ *   }
+ *   ...
+ *   PTP::Net::Connection *c = ...;
+ *   c->SetBlocking(0);
+ *   reactor.$Add(c, PTP::Net::Reactor::READ, OnRead, NULL);
+ */
+PTP::Net::Reactor::Handler *
+PTP::Net::Reactor::Add(Net::Connection *conn,
+		       int events,
+		       Callback callback,
+		       void *context)
+{
+	if (!conn || !callback || conn->Open() < 0)
+		return NULL;
+
+	m_mutex.Lock();
+	Loop *loop = &m_loops[m_next];
+	m_next = (m_next + 1) % m_threads;
+	m_mutex.Unlock();
+
+	Handler *h = new Handler(conn, events, callback, context, loop);
+	if (!h)
+		return NULL;
+
+	loop->m_mutex.Lock();
+	loop->m_handlers.Append(h);
+#ifndef WIN32
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = ((events & READ) ? EPOLLIN:0)
+		| ((events & WRITE) ? EPOLLOUT:0)
+		| ((events & ONESHOT) ? EPOLLONESHOT:0);
+	event.data.ptr = h;
+	if (epoll_ctl(loop->m_epoll,
+		      EPOLL_CTL_ADD,
+		      conn->GetSocket(),
+		      &event) < 0)
+	{
+		loop->m_handlers.Remove(h);
+		delete h;
+		h = NULL;
+	}
+#endif
+	loop->m_mutex.Unlock();
+
+	return h;
+}
+
+/**
+ * PTP::Net::Reactor::Modify: Change the watched events.
+ * @handler: Handler returned by &Add.
+ * @events: Events to watch (%READ, %WRITE and %ONESHOT).
+ * Returns: 0 on success or -1 on error.
+ * Notes: Re-arms a %ONESHOT handler.
+ */
+int
+PTP::Net::Reactor::Modify(Handler *handler, int events)
+{
+	if (!handler)
+		return -1;
+
+	Loop *loop = handler->m_loop;
+	int status = 0;
+
+	loop->m_mutex.Lock();
+	if (handler->m_removed)
+		status = -1;
+	else
+	{
+		handler->m_events = events;
+#ifndef WIN32
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = ((events & READ) ? EPOLLIN:0)
+			| ((events & WRITE) ? EPOLLOUT:0)
+			| ((events & ONESHOT) ? EPOLLONESHOT:0);
+		event.data.ptr = handler;
+		if (epoll_ctl(loop->m_epoll,
+			      EPOLL_CTL_MOD,
+			      handler->m_conn->GetSocket(),
+			      &event) < 0)
+			status = -1;
+#endif
+	}
+	loop->m_mutex.Unlock();
+
+	return status;
+}
+
+/**
+ * PTP::Net::Reactor::Remove: Stop watching a connection.
+ * @handler: Handler returned by &Add.
+ * Returns: 0 on success or -1 on error.
+ * Notes: No callbacks are made for @handler once &Remove returns
+ *        (a running callback is waited for), and @handler must not
+ *        be used again.  &Remove should be called before the
+ *        connection is closed.  It may be called from within a
+ *        callback, including the callback of @handler.
+ */
+int
+PTP::Net::Reactor::Remove(Handler *handler)
+{
+	if (!handler)
+		return -1;
+
+	Loop *loop = handler->m_loop;
+	int status = 0;
+
+	loop->m_mutex.Lock();
+	if (handler->m_removed)
+		status = -1;
+	else
+	{
+#ifndef WIN32
+		epoll_ctl(loop->m_epoll,
+			  EPOLL_CTL_DEL,
+			  handler->m_conn->GetSocket(),
+			  NULL);
+#endif
+		handler->m_removed = 1;
+		loop->m_handlers.Remove(handler);
+		if (loop->m_started)
+		{
+			// free after the current dispatch pass
+			loop->m_removed.Append(handler);
+			loop->Wake();
+		}
+		else
+			delete handler;
+	}
+
+	// the loop thread itself can not be waited for
+	while (loop->m_current == handler && s_loop != loop)
+	{
+		loop->m_waiters++;
+		loop->m_mutex.Unlock();
+		loop->m_done.Wait();
+		loop->m_mutex.Lock();
+	}
+	loop->m_mutex.Unlock();
+
+	return status;
+}
+
+/*
+ * PTP::Net::Reactor::Run: Event loop thread.
+ * Type: static
+ * @arg: Loop.
+ * Returns: NULL.
+ */
+void *
+PTP::Net::Reactor::Run(void *arg)
+{
+	Loop *loop = (Loop*) arg;
+	Handler *ready[MAX_EVENTS];
+	int readyEvents[MAX_EVENTS];
+	s_loop = loop;
+
+	for (;;)
+	{
+		int count = 0;
+
+#ifdef WIN32
+		fd_set rfds, wfds, efds;
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_ZERO(&efds);
+
+		loop->m_mutex.Lock();
+		if (loop->m_stop)
+		{
+			loop->m_mutex.Unlock();
+			break;
+		}
+		Handler *h;
+		int fds = 0;
+		PTP_LIST_FOREACH(Handler, h, &loop->m_handlers)
+		{
+			if (fds >= FD_SETSIZE)
+				break;
+			int s = h->m_conn->GetSocket();
+			if (h->m_events & READ)
+				FD_SET(s, &rfds);
+			if (h->m_events & WRITE)
+				FD_SET(s, &wfds);
+			FD_SET(s, &efds);
+			fds++;
+		}
+		loop->m_mutex.Unlock();
+
+		if (!fds)
+		{
+			::Sleep(SELECT_TIMEOUT);
+			continue;
+		}
+
+		struct timeval tmo;
+		tmo.tv_sec = 0;
+		tmo.tv_usec = SELECT_TIMEOUT * 1000;
+		if (select(0, &rfds, &wfds, &efds, &tmo) <= 0)
+			continue;
+
+		loop->m_mutex.Lock();
+		PTP_LIST_FOREACH(Handler, h, &loop->m_handlers)
+		{
+			if (count >= MAX_EVENTS)
+				break;
+			int s = h->m_conn->GetSocket();
+			int events = 0;
+			if ((h->m_events & READ) && FD_ISSET(s, &rfds))
+				events |= READ;
+			if ((h->m_events & WRITE) && FD_ISSET(s, &wfds))
+				events |= WRITE;
+			if (FD_ISSET(s, &efds))
+				events |= CLOSE;
+			if (events)
+			{
+				ready[count] = h;
+				readyEvents[count++] = events;
+			}
+		}
+#else
+		struct epoll_event events[MAX_EVENTS];
+		int n = epoll_wait(loop->m_epoll, events, MAX_EVENTS, -1);
+		if (n < 0 && errno != EINTR)
+			break;
+
+		loop->m_mutex.Lock();
+		if (loop->m_stop)
+		{
+			loop->m_mutex.Unlock();
+			break;
+		}
+		for (int i = 0; i < n; i++)
+		{
+			Handler *h = (Handler*) events[i].data.ptr;
+			if (!h)
+			{
+				char buffer[64];
+				while (read(loop->m_wake[0],
+					    buffer,
+					    sizeof(buffer)) > 0)
+					;
+				continue;
+			}
+
+			int e = events[i].events;
+			ready[count] = h;
+			readyEvents[count++] = ((e & EPOLLIN) ? READ:0)
+				| ((e & EPOLLOUT) ? WRITE:0)
+				| ((e & (EPOLLHUP | EPOLLERR)) ? CLOSE:0);
+		}
+#endif
+
+		// dispatch with the loop unlocked, so that callbacks can
+		// use any loop; removed handlers are only freed by &Reap
+		for (int i = 0; i < count; i++)
+		{
+			Handler *h = ready[i];
+			if (h->m_removed)
+				continue;
+			if (h->m_events & ONESHOT)
+				h->m_events &= ~(READ | WRITE);
+			loop->m_current = h;
+			loop->m_mutex.Unlock();
+
+			h->m_callback(h, readyEvents[i], h->m_context);
+
+			loop->m_mutex.Lock();
+			loop->m_current = NULL;
+			if (loop->m_waiters)
+			{
+				loop->m_done.Post(loop->m_waiters);
+				loop->m_waiters = 0;
+			}
+		}
+		loop->Reap();
+		loop->m_mutex.Unlock();
+	}
+
+	s_loop = NULL;
+	return NULL;
+}
+
+/*
+ * PTP::Net::Reactor::Handler::Handler: Class constructor.
+ * @conn: Connection.
+ * @events: Watched events.
+ * @callback: Event callback.
+ * @context: Callback context.
+ * @loop: Owning loop.
+ */
+PTP::Net::Reactor::Handler::Handler(Net::Connection *conn,
+				    int events,
+				    Callback callback,
+				    void *context,
+				    Loop *loop)
+	:m_conn(conn), m_events(events), m_callback(callback),
+	 m_context(context), m_loop(loop), m_removed(0)
+{
+}
+
+#ifdef PTPTL_DLL
+
+/*
+ * PTP::Net::Reactor::Handler::Handler: Copy constructor.
+ * @handler: Source Handler.
+ */
+PTP::Net::Reactor::Handler::Handler(const Handler& handler)
+{
+	assert(0);
+}
+
+/*
+ * PTP::Net::Reactor::Handler::operator=: Copy constructor.
+ * @handler: Source Handler.
+ */
+PTP::Net::Reactor::Handler&
+PTP::Net::Reactor::Handler::operator=(const Handler& handler)
+{
+	assert(0);
+	return *this;
+}
+
+#endif // PTPTL_DLL
+
+/**
+ * PTP::Net::Reactor::Handler::GetConnection
+ * Returns: Watched connection.
+ */
+PTP::Net::Connection *
+PTP::Net::Reactor::Handler::GetConnection() const
+{
+	return m_conn;
+}
+
+/**
+ * PTP::Net::Reactor::Handler::GetContext
+ * Returns: Callback context passed to &PTP::Net::Reactor::Add.
+ */
+void *
+PTP::Net::Reactor::Handler::GetContext() const
+{
+	return m_context;
+}
+
+/**
+ * PTP::Net::Reactor::Handler::GetEvents
+ * Returns: Currently watched events.
+ */
+int
+PTP::Net::Reactor::Handler::GetEvents() const
+{
+	return m_events;
+}
@@ -0,0 +1,467 @@
+/*
+ * Copyright (c) 2001 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * 3. Neither the name of the Intel Corporation nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef WIN32
+#include <winsock.h>
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <ptp/resolver.h>
+#include <ptp/pool.h>
+#include <ptp/sem.h>
+#include <ptp/debug.h>
+
+/*
+ * PTP::Net::Resolver::Entry: Cached host name.
+ */
+class PTP::Net::Resolver::Entry:public PTP::List::Entry
+{
+public:
+	Entry(Resolver *resolver, const char *name)
+		:m_resolver(resolver), m_name(new char[strlen(name) + 1]),
+		 m_ip(INVALID), m_time(0), m_pending(1), m_requests(0)
+	{
+		strcpy(m_name, name);
+	}
+	~Entry() {delete [] m_name;}
+
+	Resolver *m_resolver;
+	char *m_name;
+	Net::Ip m_ip;
+	unsigned long m_time;
+	int m_pending;
+	PTP::List m_requests;
+};
+
+/*
+ * PTP::Net::Resolver::Request: Lookup waiting for a pending entry.
+ */
+class PTP::Net::Resolver::Request:public PTP::List::Entry
+{
+public:
+	Request(Callback callback, void *context)
+		:m_callback(callback), m_context(context), m_ip(INVALID) {}
+
+	Callback m_callback;
+	void *m_context;
+	Net::Ip m_ip;
+	PTP::Semaphore m_done;
+};
+
+/*
+ * GetTime
+ * Returns: Current time (in seconds).
+ */
+static unsigned long
+GetTime()
+{
+#ifdef WIN32
+	return (GetTickCount() / 1000);
+#else
+	return time(NULL);
+#endif
+}
+
+/*
+ * MatchName: Compare host names, ignoring case.
+ * @name1: Host name.
+ * @name2: Host name.
+ * Returns: 1 if the names match or 0 otherwise.
+ */
+static int
+MatchName(const char *name1, const char *name2)
+{
+	for (; *name1 && *name2; name1++, name2++)
+	{
+		if (tolower((unsigned char) *name1)
+		    != tolower((unsigned char) *name2))
+			return 0;
+	}
+	return (*name1 == *name2);
+}
+
+/**
+ * PTP::Net::Resolver::Resolver: Class constructor.
+ * @ttl: Seconds a resolved address is cached.
+ * @negativeTtl: Seconds a failed lookup is cached.
+ * @maxEntries: Maximum number of cached names.
+ */
+PTP::Net::Resolver::Resolver(int ttl, int negativeTtl, int maxEntries)
+	:m_entries(), m_ttl(ttl), m_negativeTtl(negativeTtl),
+	 m_maxEntries(maxEntries)
+{
+}
+
+#ifdef PTPTL_DLL
+
+/*
+ * PTP::Net::Resolver::Resolver: Copy constructor.
+ * @resolver: Source Resolver.
+ */
+PTP::Net::Resolver::Resolver(const Resolver& resolver)
+{
+	assert(0);
+}
+
+/*
+ * PTP::Net::Resolver::operator=: Copy constructor.
+ * @resolver: Source Resolver.
+ */
+PTP::Net::Resolver&
+PTP::Net::Resolver::operator=(const Resolver& resolver)
+{
+	assert(0);
+	return *this;
+}
+
+#endif // PTPTL_DLL
+
+/**
+ * PTP::Net::Resolver::~Resolver: Class destructor.
+ * Notes: Lookups running on a thread pool must complete first.
+ */
+PTP::Net::Resolver::~Resolver()
+{
+	Clear();
+}
+
+/**
+ * PTP::Net::Resolver::Lookup: Resolve a host name.
+ * @name: Host name, dotted IP address, or "localhost" for the local
+ *        address.
+ * Returns: IP address or %INVALID on error.
+ * Notes: If another thread is already resolving @name, its result is
+ *        shared rather than starting a second query.
+ * Example:
+ *   PTP::Net::Resolver resolver;
+ *   PTP::Net::Ip ip = resolver.$Lookup("www.linux.org");
+ *   if (ip == PTP::Net::INVALID)
+ *     return -1;
+ */
+PTP::Net::Ip
+PTP::Net::Resolver::Lookup(const char *name)
+{
+	if (!name)
+		return INVALID;
+
+	m_entries.Lock();
+	Entry *entry = Find(name);
+	if (entry && !entry->m_pending)
+	{
+		Net::Ip ip = entry->m_ip;
+		m_entries.Unlock();
+		return ip;
+	}
+	else if (entry)
+	{
+		// wait for the lookup already in progress
+		Request request(NULL, NULL);
+		entry->m_requests.Append(&request, 0);
+		m_entries.Unlock();
+		request.m_done.Wait();
+		return request.m_ip;
+	}
+	entry = Add(name);
+	m_entries.Unlock();
+
+	Net::Ip ip = Resolve(name);
+	Finish(entry, ip);
+	return ip;
+}
+
+/**
+ * PTP::Net::Resolver::Lookup: Resolve a host name without blocking.
+ * @name: Host name, dotted IP address, or "localhost" for the local
+ *        address.
+ * @callback: Function called with the result.
+ * @context: Context passed to @callback.
+ * @pool: Thread pool to resolve on.
+ * Returns: 0 on success or -1 on error.
+ * Notes: A cached result is passed to @callback before &Lookup
+ *        returns.  Otherwise @callback is called from the thread
+ *        that resolves the name.  If @pool is NULL or full, the name
+ *        is resolved on the calling thread.
+ * Example:
+ *   static void
+ *   Resolved(const char *name, PTP::Net::Ip ip, void *context)
+ *   {
+ *     ...
+ *   }
+ *
+ *   resolver.$Lookup("www.linux.org", Resolved, NULL, &pool);
+ */
+int
+PTP::Net::Resolver::Lookup(const char *name,
+			   Callback callback,
+			   void *context,
+			   PTP::ThreadPool *pool)
+{
+	if (!name || !callback)
+		return -1;
+
+	m_entries.Lock();
+	Entry *entry = Find(name);
+	if (entry && !entry->m_pending)
+	{
+		Net::Ip ip = entry->m_ip;
+		m_entries.Unlock();
+		(*callback)(name, ip, context);
+		return 0;
+	}
+
+	int start = !entry;
+	if (start)
+		entry = Add(name);
+	entry->m_requests.Append(new Request(callback, context), 0);
+	m_entries.Unlock();
+
+	if (start && (!pool || pool->Submit(Task, entry)))
+		Task(entry);
+	return 0;
+}
+
+/**
+ * PTP::Net::Resolver::Clear: Remove all cached names.
+ * Notes: Names still being resolved are kept.
+ */
+void
+PTP::Net::Resolver::Clear()
+{
+	m_entries.Lock();
+	Entry *entry;
+	PTP_LIST_FOREACH(Entry, entry, &m_entries)
+	{
+		if (!entry->m_pending)
+		{
+			m_entries.Remove(entry, 0);
+			delete entry;
+		}
+	}
+	m_entries.Unlock();
+}
+
+/**
+ * PTP::Net::Resolver::GetCached
+ * Returns: Number of cached names (including failed lookups).
+ */
+int
+PTP::Net::Resolver::GetCached()
+{
+	int count = 0;
+	m_entries.Lock();
+	Entry *entry;
+	PTP_LIST_FOREACH(Entry, entry, &m_entries)
+	{
+		if (!entry->m_pending)
+			count++;
+	}
+	m_entries.Unlock();
+	return count;
+}
+
+/**
+ * PTP::Net::Resolver::GetDefault
+ * Type: static
+ * Returns: Resolver used by &PTP::Net::Lookup.
+ */
+PTP::Net::Resolver *
+PTP::Net::Resolver::GetDefault()
+{
+	// created on first use so it is destroyed before the debug heap
+	static Resolver s_resolver;
+	return &s_resolver;
+}
+
+/*
+ * PTP::Net::Resolver::Find: Find a cached name.
+ * @name: Host name.
+ * Returns: Entry or NULL if not found.
+ * Notes: The entry list must be locked.  Expired entries are removed.
+ */
+PTP::Net::Resolver::Entry *
+PTP::Net::Resolver::Find(const char *name)
+{
+	unsigned long now = GetTime();
+	Entry *entry;
+	PTP_LIST_FOREACH(Entry, entry, &m_entries)
+	{
+		int ttl = (entry->m_ip != INVALID) ? m_ttl:m_negativeTtl;
+		if (!entry->m_pending
+		    && now - entry->m_time >= (unsigned long) ttl)
+		{
+			m_entries.Remove(entry, 0);
+			delete entry;
+		}
+		else if (MatchName(entry->m_name, name))
+		{
+			// most recently used first
+			m_entries.Remove(entry, 0);
+			m_entries.Insert(entry, 0);
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * PTP::Net::Resolver::Add: Add a pending entry.
+ * @name: Host name.
+ * Returns: New entry.
+ * Notes: The entry list must be locked.  The least recently used
+ *        entries beyond the maximum are removed.
+ */
+PTP::Net::Resolver::Entry *
+PTP::Net::Resolver::Add(const char *name)
+{
+	int count = 0;
+	Entry *entry;
+	PTP_LIST_FOREACH(Entry, entry, &m_entries)
+	{
+		if (++count >= m_maxEntries && !entry->m_pending)
+		{
+			m_entries.Remove(entry, 0);
+			delete entry;
+		}
+	}
+
+	entry = new Entry(this, name);
+	m_entries.Insert(entry, 0);
+	return entry;
+}
+
+/*
+ * PTP::Net::Resolver::Finish: Complete a pending entry.
+ * @entry: Pending entry.
+ * @ip: Resolved IP address or %INVALID.
+ * Notes: Waiting lookups are woken and callbacks are called.
+ */
+void
+PTP::Net::Resolver::Finish(Entry *entry, Net::Ip ip)
+{
+	PTP::List requests(0);
+	m_entries.Lock();
+	entry->m_ip = ip;
+	entry->m_time = GetTime();
+	entry->m_pending = 0;
+	Request *request;
+	PTP_LIST_FOREACH(Request, request, &entry->m_requests)
+	{
+		entry->m_requests.Remove(request, 0);
+		requests.Append(request, 0);
+	}
+
+	// the entry may be removed once it is unlocked
+	char *name = NULL;
+	if (requests.IsValid(requests.GetHead()))
+	{
+		name = new char[strlen(entry->m_name) + 1];
+		strcpy(name, entry->m_name);
+	}
+	m_entries.Unlock();
+
+	Request *waiter;
+	PTP_LIST_FOREACH(Request, waiter, &requests)
+	{
+		requests.Remove(waiter, 0);
+		if (waiter->m_callback)
+		{
+			(*waiter->m_callback)(name, ip, waiter->m_context);
+			delete waiter;
+		}
+		else
+		{
+			waiter->m_ip = ip;
+			waiter->m_done.Post();
+		}
+	}
+	delete [] name;
+}
+
+/*
+ * PTP::Net::Resolver::Task: Resolve a pending entry.
+ * Type: static
+ * @arg: Pending entry.
+ */
+void
+PTP::Net::Resolver::Task(void *arg)
+{
+	Entry *entry = (Entry*) arg;
+	entry->m_resolver->Finish(entry, Resolve(entry->m_name));
+}
+
+/*
+ * PTP::Net::Resolver::Resolve: Resolve a host name.
+ * Type: static
+ * @name: Host name, dotted IP address, or "localhost".
+ * Returns: IP address or %INVALID on error.
+ */
+PTP::Net::Ip
+PTP::Net::Resolver::Resolve(const char *name)
+{
+	char host[MAX_HOSTNAME];
+	if (strcmp(name, "localhost") == 0)
+	{
+		if (gethostname(host, sizeof(host)) == 0)
+			name = host;
+	}
+
+	Net::Ip ip = INVALID;
+#ifdef WIN32
+	// Winsock keeps gethostbyname() results per thread
+	struct hostent *entry = gethostbyname(name);
+	for (int i = 0; entry && entry->h_addr_list[i] && !ip; i++)
+		ip = ntohl(*(Ip*) entry->h_addr_list[i]);
+#else
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo *info = NULL;
+	if (getaddrinfo(name, NULL, &hints, &info) != 0)
+		return INVALID;
+	for (struct addrinfo *i = info; i && !ip; i = i->ai_next)
+		ip = ntohl(((struct sockaddr_in*) i->ai_addr)->sin_addr.s_addr);
+	freeaddrinfo(info);
+#endif
+	return ip;
+}
@@ -0,0 +1,1092 @@
+/*
+ * Copyright (c) 2001 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * 3. Neither the name of the Intel Corporation nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <string.h>
+#include <assert.h>
+#include <ptp/auth.h>
+#include <ptp/rand.h>
+#include <ptp/secure.h>
+#include <ptp/debug.h>
+
+/*
+ * PTP::SecureConnection::Cache::Entry: Cached session.
+ */
+class PTP::SecureConnection::Cache::Entry:public PTP::List::Entry
+{
+public:
+	Entry(const BYTE *id,
+	      PTP::Net::Ip ip,
+	      PTP::Net::Port port,
+	      const BYTE *secret,
+	      const PTP::Identity *peer)
+		:m_ip(ip), m_port(port),
+		 m_time(PTP::Authenticator::GetTime()),
+		 m_peer(new PTP::Identity(*peer))
+	{
+		memcpy(m_id, id, sizeof(m_id));
+		memcpy(m_secret, secret, sizeof(m_secret));
+	}
+	~Entry()
+	{
+		memset(m_secret, 0, sizeof(m_secret));
+		delete m_peer;
+	}
+
+	BYTE m_id[SESSION_ID_SIZE];
+	PTP::Net::Ip m_ip;	// peer address (client sessions only)
+	PTP::Net::Port m_port;
+	unsigned long m_time;
+	BYTE m_secret[SECRET_SIZE];
+	PTP::Identity *m_peer;
+};
+
+/**
+ * PTP::SecureConnection::SecureConnection: Class constructor.
+ * @conn: Blocking connection to secure.
+ * @store: Store with the local identity and trusted certificates.
+ * @cache: Session cache or NULL to always perform a full handshake.
+ * Notes: @conn, @store and @cache are not destroyed with the
+ *        secure connection.
+ * Example:
+ *   PTP::Net::Connection conn(PTP::Net::Connection::RAW, ip, port);
+ *   PTP::SecureConnection secure(&conn, &store, &cache);
+ *   if (secure.Connect() < 0)
+ *       return -1;
+ */
+PTP::SecureConnection::SecureConnection(PTP::Net::Connection *conn,
+					PTP::Store *store,
+					Cache *cache)
+	:m_conn(conn), m_store(store), m_cache(cache), m_peer(NULL),
+	 m_state(NONE), m_resumed(0), m_readSeq(0), m_writeSeq(0),
+	 m_keys(0), m_readBuffer(new BYTE[MAX_RECORD]), m_head(0),
+	 m_count(0),
+	 m_writeBuffer(new BYTE[HEADER_SIZE + MAX_RECORD + MAC_SIZE])
+{
+	memset(m_secret, 0, sizeof(m_secret));
+}
+
+#ifdef PTPTL_DLL
+
+/*
+ * PTP::SecureConnection::SecureConnection: Copy constructor.
+ * @conn: Source SecureConnection.
+ */
+PTP::SecureConnection::SecureConnection(const SecureConnection& conn)
+{
+	assert(0);
+}
+
+/*
+ * PTP::SecureConnection::operator=: Copy constructor.
+ * @conn: Source SecureConnection.
+ */
+PTP::SecureConnection&
+PTP::SecureConnection::operator=(const SecureConnection& conn)
+{
+	assert(0);
+	return *this;
+}
+
+#endif // PTPTL_DLL
+
+/**
+ * PTP::SecureConnection::~SecureConnection: Class destructor.
+ * Notes: Use &Close to notify the peer first.
+ */
+PTP::SecureConnection::~SecureConnection()
+{
+	if (m_keys)
+	{
+		EVP_CIPHER_CTX_cleanup(&m_readCtx);
+		EVP_CIPHER_CTX_cleanup(&m_writeCtx);
+	}
+	memset(m_secret, 0, sizeof(m_secret));
+	memset(m_readMac, 0, sizeof(m_readMac));
+	memset(m_writeMac, 0, sizeof(m_writeMac));
+	delete [] m_readBuffer;
+	delete [] m_writeBuffer;
+	delete m_peer;
+}
+
+/**
+ * PTP::SecureConnection::Connect: Perform the client handshake.
+ * @timeout: Milliseconds to wait for each server reply or 0 for
+ *           infinite.
+ * Returns: 0 on success or -1 on error.
+ * Notes: A session cached for the peer address is offered to the
+ *        server.  If the server resumes it, no public key operations
+ *        are performed.  Otherwise the server certificate is checked,
+ *        a new secret is sent encrypted with the server's public key
+ *        and the handshake is signed with the local private key.
+ * Example:
+ *   PTP::SecureConnection secure(&conn, &store, &cache);
+ *   if (secure.$Connect(5000) < 0)
+ *       return -1;
+ *   secure.Write((const BYTE*) "Hello", 5);
+ */
+int
+PTP::SecureConnection::Connect(int timeout)
+{
+	if (m_state != NONE || !m_conn || m_conn->Open(timeout) < 0)
+		return -1;
+	if (HandshakeClient(timeout) < 0)
+	{
+		// do not offer a session the server no longer accepts
+		if (m_cache && m_resumed)
+			m_cache->Remove(m_conn->GetIp(), m_conn->GetPort());
+		m_resumed = 0;
+		m_state = FAILED;
+		return -1;
+	}
+	m_state = OPEN;
+	return 0;
+}
+
+/**
+ * PTP::SecureConnection::Accept: Perform the server handshake.
+ * @timeout: Milliseconds to wait for each client message or 0 for
+ *           infinite.
+ * Returns: 0 on success or -1 on error.
+ * Notes: Sessions found in the cache are resumed.  Otherwise the
+ *        client certificate and signature are checked.
+ * Example:
+ *   PTP::Net::Connection *conn = server.Accept();
+ *   PTP::SecureConnection secure(conn, &store, &cache);
+ *   if (secure.$Accept(5000) < 0)
+ *       return -1;
+ */
+int
+PTP::SecureConnection::Accept(int timeout)
+{
+	if (m_state != NONE || !m_conn)
+		return -1;
+	if (HandshakeServer(timeout) < 0)
+	{
+		m_state = FAILED;
+		return -1;
+	}
+	m_state = OPEN;
+	return 0;
+}
+
+/**
+ * PTP::SecureConnection::Close: Notify the peer and close the
+ *                               connection.
+ * Notes: The peer's &Read then returns 0.  A connection closed
+ *        without notification is reported as an error instead, so
+ *        truncated data is never mistaken for a complete transfer.
+ */
+void
+PTP::SecureConnection::Close()
+{
+	if (m_state == OPEN)
+		WriteRecord(CLOSE, m_writeBuffer, 0);
+	if (m_state != NONE)
+		m_state = CLOSED;
+	if (m_conn)
+		m_conn->Close();
+}
+
+/**
+ * PTP::SecureConnection::Read: Read data from the connection.
+ * @data: [$OUT] Data buffer.
+ * @size: Buffer size.
+ * @timeout: Milliseconds to wait for data or 0 for infinite.
+ * Returns: Number of bytes read, 0 if the peer closed the connection,
+ *          or -1 on error, timeout or invalid data.
+ * Notes: Errors are not recoverable since the record stream can no
+ *        longer be trusted.
+ */
+int
+PTP::SecureConnection::Read(BYTE *data, int size, int timeout)
+{
+	if (size < 0 || (size > 0 && !data))
+		return -1;
+
+	while (!m_count && m_state == OPEN)
+	{
+		int s = ReadRecord(DATA, m_readBuffer, MAX_RECORD, timeout);
+		if (s < 0)
+		{
+			m_state = FAILED;
+			return -1;
+		}
+		m_head = 0;
+		m_count = s;
+	}
+	if (!m_count)
+		return (m_state == CLOSED) ? 0:-1;
+
+	if (size > m_count)
+		size = m_count;
+	memcpy(data, m_readBuffer + m_head, size);
+	m_head += size;
+	m_count -= size;
+	return size;
+}
+
+/**
+ * PTP::SecureConnection::Write: Write data to the connection.
+ * @data: Data buffer.
+ * @size: Data size.
+ * Returns: @size on success or -1 on error.
+ * Notes: Data is sent in records of up to %MAX_RECORD bytes.
+ */
+int
+PTP::SecureConnection::Write(const BYTE *data, int size)
+{
+	if (m_state != OPEN || size < 0 || (size > 0 && !data))
+		return -1;
+
+	for (int sent = 0; sent < size; )
+	{
+		int s = size - sent;
+		if (s > MAX_RECORD)
+			s = MAX_RECORD;
+		if (WriteRecord(DATA, data + sent, s) < 0)
+		{
+			m_state = FAILED;
+			return -1;
+		}
+		sent += s;
+	}
+	return size;
+}
+
+/**
+ * PTP::SecureConnection::GetConnection
+ * Returns: Underlying connection.
+ */
+PTP::Net::Connection *
+PTP::SecureConnection::GetConnection() const
+{
+	return m_conn;
+}
+
+/**
+ * PTP::SecureConnection::GetPeer
+ * Returns: Authenticated peer identity or NULL before the handshake.
+ */
+const PTP::Identity *
+PTP::SecureConnection::GetPeer() const
+{
+	return (m_state == NONE || m_state == FAILED) ? NULL:m_peer;
+}
+
+/**
+ * PTP::SecureConnection::IsResumed
+ * Returns: 1 if the handshake resumed a cached session or 0
+ *          otherwise.
+ */
+int
+PTP::SecureConnection::IsResumed() const
+{
+	return m_resumed;
+}
+
+/**
+ * PTP::SecureConnection::Verify: Check a peer certificate.
+ * @peer: Peer certificate.
+ * Returns: 0 if @peer is trusted or -1 otherwise.
+ * Notes: By default, a peer is trusted if its certificate is in the
+ *        store or was issued by a certificate in the store.
+ *        Override &Verify for other policies.
+ */
+int
+PTP::SecureConnection::Verify(const PTP::Identity *peer)
+{
+	const char *name = peer->GetName();
+	const char *issuerName = peer->GetIssuerName();
+	if (!name || !issuerName)
+		return -1;
+
+	BYTE key[PTP::Identity::KEY_SIZE];
+	peer->GetKey(key);
+	if (m_store->Find(name, 0, key))
+		return 0;
+
+	// self-signed certificates must be in the store
+	if (strcmp(name, issuerName) == 0)
+		return -1;
+	PTP::Identity *issuer = m_store->Find(issuerName);
+	if (!issuer || issuer->Verify((PTP::Identity*) peer) != 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * PTP::SecureConnection::HandshakeClient: Client side of &Connect.
+ * @timeout: Milliseconds to wait for each reply or 0 for infinite.
+ * Returns: 0 on success or -1 on error.
+ *
+ *   HELLO         version, client random, cached session id (or none)
+ *   SERVER_HELLO  version, server random, session id, certificate
+ *                 (the certificate is omitted when resuming)
+ *   KEY_EXCHANGE  certificate, encrypted secret, signature
+ *                 (not sent when resuming)
+ *   FINISHED      handshake digest (client, then server)
+ */
+int
+PTP::SecureConnection::HandshakeClient(int timeout)
+{
+	PTP::Identity *local = m_store->Find(NULL, 1);
+	if (!local)
+		return -1;
+	EVP_DigestInit(&m_hash, PTP_DIGEST);
+
+	// offer a session cached for this peer
+	PTP::Net::Ip ip = m_conn->GetIp();
+	PTP::Net::Port port = m_conn->GetPort();
+	int offer = 0;
+	if (m_cache)
+	{
+		m_cache->m_entries.Lock();
+		Cache::Entry *entry = m_cache->Find(ip, port);
+		if (entry)
+		{
+			memcpy(m_session, entry->m_id, sizeof(m_session));
+			memcpy(m_secret, entry->m_secret, sizeof(m_secret));
+			m_peer = new PTP::Identity(*entry->m_peer);
+			offer = 1;
+		}
+		m_cache->m_entries.Unlock();
+	}
+
+	BYTE hello[2 + RANDOM_SIZE + SESSION_ID_SIZE];
+	PTP::Random::Fill(m_random, RANDOM_SIZE);
+	hello[0] = VERSION;
+	memcpy(hello + 1, m_random, RANDOM_SIZE);
+	hello[1 + RANDOM_SIZE] = offer ? SESSION_ID_SIZE:0;
+	memcpy(hello + 2 + RANDOM_SIZE, m_session, SESSION_ID_SIZE);
+	int size = 2 + RANDOM_SIZE + (offer ? SESSION_ID_SIZE:0);
+	if (WriteRecord(HELLO, hello, size) < 0)
+		return -1;
+	Hash(hello, size);
+
+	size = ReadRecord(SERVER_HELLO, m_readBuffer, MAX_RECORD, timeout);
+	if (size < 1 + RANDOM_SIZE + SESSION_ID_SIZE
+	    || m_readBuffer[0] != VERSION)
+		return -1;
+	Hash(m_readBuffer, size);
+	memcpy(m_random + RANDOM_SIZE, m_readBuffer + 1, RANDOM_SIZE);
+
+	// the server echoes the session id to resume it
+	const BYTE *id = m_readBuffer + 1 + RANDOM_SIZE;
+	m_resumed = offer && !memcmp(id, m_session, SESSION_ID_SIZE);
+	if (!m_resumed)
+	{
+		memcpy(m_session, id, SESSION_ID_SIZE);
+		id += SESSION_ID_SIZE;
+		delete m_peer;
+		m_peer = PTP::Store::Import((BYTE*) id,
+					    size - (id - m_readBuffer),
+					    NULL,
+					    NULL);
+		if (!m_peer || Verify(m_peer) < 0 || ExchangeKey(local) < 0)
+			return -1;
+	}
+
+	SetKeys(1);
+	if (WriteFinished("client finished") < 0
+	    || ReadFinished("server finished", timeout) < 0)
+		return -1;
+
+	if (m_cache && !m_resumed)
+		m_cache->Add(m_session, ip, port, m_secret, m_peer);
+	return 0;
+}
+
+/*
+ * PTP::SecureConnection::HandshakeServer: Server side of &Accept.
+ * @timeout: Milliseconds to wait for each message or 0 for infinite.
+ * Returns: 0 on success or -1 on error.
+ */
+int
+PTP::SecureConnection::HandshakeServer(int timeout)
+{
+	PTP::Identity *local = m_store->Find(NULL, 1);
+	if (!local)
+		return -1;
+	EVP_DigestInit(&m_hash, PTP_DIGEST);
+
+	int size = ReadRecord(HELLO, m_readBuffer, MAX_RECORD, timeout);
+	if (size < 2 + RANDOM_SIZE || m_readBuffer[0] != VERSION)
+		return -1;
+	int idsize = m_readBuffer[1 + RANDOM_SIZE];
+	if ((idsize != 0 && idsize != SESSION_ID_SIZE)
+	    || size != 2 + RANDOM_SIZE + idsize)
+		return -1;
+	Hash(m_readBuffer, size);
+	memcpy(m_random, m_readBuffer + 1, RANDOM_SIZE);
+	PTP::Random::Fill(m_random + RANDOM_SIZE, RANDOM_SIZE);
+
+	// resume the offered session if it is still cached
+	m_resumed = 0;
+	if (idsize && m_cache)
+	{
+		m_cache->m_entries.Lock();
+		const BYTE *id = m_readBuffer + 2 + RANDOM_SIZE;
+		Cache::Entry *entry = m_cache->Find(id);
+		if (entry)
+		{
+			memcpy(m_session, entry->m_id, sizeof(m_session));
+			memcpy(m_secret, entry->m_secret, sizeof(m_secret));
+			m_peer = new PTP::Identity(*entry->m_peer);
+			m_resumed = 1;
+		}
+		m_cache->m_entries.Unlock();
+	}
+	if (!m_resumed)
+		PTP::Random::Fill(m_session, sizeof(m_session));
+
+	int certsize = 0;
+	if (!m_resumed)
+	{
+		certsize = PTP::Store::Export(local, 0, NULL, NULL, NULL);
+		if (certsize <= 0)
+			return -1;
+	}
+	size = 1 + RANDOM_SIZE + SESSION_ID_SIZE + certsize;
+	if (size > MAX_RECORD)
+		return -1;
+	BYTE *hello = new BYTE[size];
+	hello[0] = VERSION;
+	memcpy(hello + 1, m_random + RANDOM_SIZE, RANDOM_SIZE);
+	memcpy(hello + 1 + RANDOM_SIZE, m_session, SESSION_ID_SIZE);
+	if (certsize)
+		PTP::Store::Export(local,
+				   0,
+				   NULL,
+				   NULL,
+				   hello + 1 + RANDOM_SIZE + SESSION_ID_SIZE);
+	Hash(hello, size);
+	int err = WriteRecord(SERVER_HELLO, hello, size);
+	delete [] hello;
+	if (err < 0)
+		return -1;
+
+	if (!m_resumed && AcceptKey(local, timeout) < 0)
+		return -1;
+
+	SetKeys(0);
+	if (ReadFinished("client finished", timeout) < 0
+	    || WriteFinished("server finished") < 0)
+		return -1;
+
+	if (m_cache && !m_resumed)
+	{
+		m_cache->Add(m_session,
+			     PTP::Net::ANY,
+			     PTP::Net::ANY,
+			     m_secret,
+			     m_peer);
+	}
+	return 0;
+}
+
+/*
+ * PTP::SecureConnection::ExchangeKey: Send a new secret to the server.
+ * @local: Local identity.
+ * Returns: 0 on success or -1 on error.
+ * Notes: The secret is encrypted with the server's public key and
+ *        the handshake so far, including the encrypted secret, is
+ *        signed with the local private key.
+ */
+int
+PTP::SecureConnection::ExchangeKey(const PTP::Identity *local)
+{
+	int certsize = PTP::Store::Export(local, 0, NULL, NULL, NULL);
+	int size = 2
+		+ certsize
+		+ PTP::Identity::CIPHERTEXT_SIZE
+		+ PTP::Identity::SIGNATURE_SIZE;
+	if (certsize <= 0 || size > MAX_RECORD)
+		return -1;
+
+	BYTE *data = new BYTE[size];
+	PTP::Net::Set16(data, certsize);
+	PTP::Store::Export(local, 0, NULL, NULL, data + 2);
+	BYTE *cipher = data + 2 + certsize;
+	BYTE *sign = cipher + PTP::Identity::CIPHERTEXT_SIZE;
+
+	BYTE secret[SECRET_SIZE];
+	PTP::Random::Fill(secret, sizeof(secret));
+	BYTE digest[PTP_DIGEST_SIZE];
+	int err = -1;
+	if (m_peer->Encrypt(secret, sizeof(secret), cipher)
+	    == PTP::Identity::CIPHERTEXT_SIZE)
+	{
+		Hash(data, sign - data);
+		GetHash(digest);
+		if (local->Sign(digest, sizeof(digest), sign)
+		    == PTP::Identity::SIGNATURE_SIZE)
+		{
+			Hash(sign, PTP::Identity::SIGNATURE_SIZE);
+			err = WriteRecord(KEY_EXCHANGE, data, size);
+		}
+	}
+	delete [] data;
+
+	if (!err)
+	{
+		Derive(secret,
+		       sizeof(secret),
+		       "master secret",
+		       m_random,
+		       sizeof(m_random),
+		       m_secret,
+		       sizeof(m_secret));
+	}
+	memset(secret, 0, sizeof(secret));
+	return err;
+}
+
+/*
+ * PTP::SecureConnection::AcceptKey: Receive a new secret from the
+ *                                   client.
+ * @local: Local identity.
+ * @timeout: Milliseconds to wait or 0 for infinite.
+ * Returns: 0 on success or -1 on error.
+ */
+int
+PTP::SecureConnection::AcceptKey(const PTP::Identity *local, int timeout)
+{
+	int size = ReadRecord(KEY_EXCHANGE, m_readBuffer, MAX_RECORD, timeout);
+	if (size < 2)
+		return -1;
+	int certsize = PTP::Net::Get16(m_readBuffer);
+	if (size != 2
+	    + certsize
+	    + PTP::Identity::CIPHERTEXT_SIZE
+	    + PTP::Identity::SIGNATURE_SIZE)
+		return -1;
+
+	delete m_peer;
+	m_peer = PTP::Store::Import(m_readBuffer + 2, certsize, NULL, NULL);
+	if (!m_peer || Verify(m_peer) < 0)
+		return -1;
+
+	// check the client's signature before using the secret
+	const BYTE *cipher = m_readBuffer + 2 + certsize;
+	const BYTE *sign = cipher + PTP::Identity::CIPHERTEXT_SIZE;
+	BYTE digest[PTP_DIGEST_SIZE];
+	Hash(m_readBuffer, sign - m_readBuffer);
+	GetHash(digest);
+	if (m_peer->Verify(digest, sizeof(digest), sign) != 0)
+		return -1;
+	Hash(sign, PTP::Identity::SIGNATURE_SIZE);
+
+	BYTE secret[PTP::Identity::CIPHERTEXT_SIZE];
+	int err = -1;
+	if (local->Decrypt(cipher, secret) == SECRET_SIZE)
+	{
+		Derive(secret,
+		       SECRET_SIZE,
+		       "master secret",
+		       m_random,
+		       sizeof(m_random),
+		       m_secret,
+		       sizeof(m_secret));
+		err = 0;
+	}
+	memset(secret, 0, sizeof(secret));
+	return err;
+}
+
+/*
+ * PTP::SecureConnection::ReadFinished: Check the peer's handshake
+ *                                      digest.
+ * @label: Peer's label.
+ * @timeout: Milliseconds to wait or 0 for infinite.
+ * Returns: 0 on success or -1 on error.
+ */
+int
+PTP::SecureConnection::ReadFinished(const char *label, int timeout)
+{
+	BYTE digest[PTP_DIGEST_SIZE];
+	BYTE expect[FINISHED_SIZE];
+	GetHash(digest);
+	Derive(m_secret,
+	       sizeof(m_secret),
+	       label,
+	       digest,
+	       sizeof(digest),
+	       expect,
+	       sizeof(expect));
+
+	BYTE data[FINISHED_SIZE];
+	if (ReadRecord(FINISHED, data, sizeof(data), timeout) != sizeof(data)
+	    || memcmp(data, expect, sizeof(data)) != 0)
+		return -1;
+	Hash(data, sizeof(data));
+	return 0;
+}
+
+/*
+ * PTP::SecureConnection::WriteFinished: Send the handshake digest.
+ * @label: Local label.
+ * Returns: 0 on success or -1 on error.
+ */
+int
+PTP::SecureConnection::WriteFinished(const char *label)
+{
+	BYTE digest[PTP_DIGEST_SIZE];
+	BYTE data[FINISHED_SIZE];
+	GetHash(digest);
+	Derive(m_secret,
+	       sizeof(m_secret),
+	       label,
+	       digest,
+	       sizeof(digest),
+	       data,
+	       sizeof(data));
+	Hash(data, sizeof(data));
+	return WriteRecord(FINISHED, data, sizeof(data));
+}
+
+/*
+ * PTP::SecureConnection::ReadRecord: Read a record.
+ * @type: Expected record type.
+ * @data: [$OUT] Record data.
+ * @size: Data buffer size.
+ * @timeout: Milliseconds to wait or 0 for infinite.
+ * Returns: Data size, 0 if a %CLOSE record was received, or -1 on
+ *          error.
+ * Notes: Once the keys are set, the record's MAC is checked before
+ *        the data is decrypted.
+ */
+int
+PTP::SecureConnection::ReadRecord(Type type,
+				  BYTE *data,
+				  int size,
+				  int timeout)
+{
+	BYTE hdr[HEADER_SIZE];
+	if (m_conn->ReadAll(hdr, sizeof(hdr), timeout) != sizeof(hdr))
+		return -1;
+	if (hdr[0] != type && (hdr[0] != CLOSE || !m_keys))
+		return -1;
+	int s = PTP::Net::Get16(hdr + 1) - (m_keys ? MAC_SIZE:0);
+	if (s < 0 || s > size)
+		return -1;
+	if (s > 0 && m_conn->ReadAll(data, s, timeout) != s)
+		return -1;
+
+	if (m_keys)
+	{
+		BYTE mac[MAC_SIZE];
+		BYTE expect[MAC_SIZE];
+		if (m_conn->ReadAll(mac, sizeof(mac), timeout) != sizeof(mac))
+			return -1;
+		Mac(m_readMac, m_readSeq++, hdr, data, s, expect);
+		if (memcmp(mac, expect, sizeof(mac)) != 0)
+			return -1;
+		int decrypted;
+		EVP_DecryptUpdate(&m_readCtx, data, &decrypted, data, s);
+	}
+
+	if (hdr[0] == CLOSE)
+	{
+		m_state = CLOSED;
+		return 0;
+	}
+	return s;
+}
+
+/*
+ * PTP::SecureConnection::WriteRecord: Write a record.
+ * @type: Record type.
+ * @data: Record data.
+ * @size: Data size (at most %MAX_RECORD).
+ * Returns: 0 on success or -1 on error.
+ * Notes: The header, data and MAC are sent in a single write.
+ */
+int
+PTP::SecureConnection::WriteRecord(Type type, const BYTE *data, int size)
+{
+	if (size < 0 || size > MAX_RECORD)
+		return -1;
+
+	BYTE *dst = m_writeBuffer;
+	dst[0] = type;
+	PTP::Net::Set16(dst + 1, size + (m_keys ? MAC_SIZE:0));
+	if (m_keys)
+	{
+		int encrypted;
+		EVP_EncryptUpdate(&m_writeCtx,
+				  dst + HEADER_SIZE,
+				  &encrypted,
+				  (BYTE*) data,
+				  size);
+		Mac(m_writeMac,
+		    m_writeSeq++,
+		    dst,
+		    dst + HEADER_SIZE,
+		    size,
+		    dst + HEADER_SIZE + size);
+		size += MAC_SIZE;
+	}
+	else
+		memcpy(dst + HEADER_SIZE, data, size);
+
+	size += HEADER_SIZE;
+	return (m_conn->WriteAll(dst, size) == size) ? 0:-1;
+}
+
+/*
+ * PTP::SecureConnection::Hash: Add handshake data to the handshake
+ *                              digest.
+ * @data: Handshake data.
+ * @size: Data size.
+ */
+void
+PTP::SecureConnection::Hash(const BYTE *data, int size)
+{
+	EVP_DigestUpdate(&m_hash, data, size);
+}
+
+/*
+ * PTP::SecureConnection::GetHash: Get the handshake digest so far.
+ * @digest: [$OUT] Digest (%PTP_DIGEST_SIZE bytes).
+ */
+void
+PTP::SecureConnection::GetHash(BYTE *digest)
+{
+	EVP_MD_CTX ctx;
+	EVP_MD_CTX_copy(&ctx, &m_hash);
+	EVP_DigestFinal(&ctx, digest, NULL);
+}
+
+/*
+ * PTP::SecureConnection::SetKeys: Derive the record keys from the
+ *                                 session secret.
+ * @client: 1 for the client side or 0 for the server side.
+ * Notes: Each direction has its own cipher key, IV and MAC key, and
+ *        fresh random values give each connection (including
+ *        resumed ones) new keys.
+ */
+void
+PTP::SecureConnection::SetKeys(int client)
+{
+	enum {KEY_SIZE = PTP::Key::KEY_SIZE, IV_SIZE = PTP::Key::IV_SIZE};
+	BYTE block[2 * (MAC_SIZE + KEY_SIZE + IV_SIZE)];
+	Derive(m_secret,
+	       sizeof(m_secret),
+	       "key expansion",
+	       m_random,
+	       sizeof(m_random),
+	       block,
+	       sizeof(block));
+	BYTE *clientMac = block;
+	BYTE *serverMac = clientMac + MAC_SIZE;
+	BYTE *clientKey = serverMac + MAC_SIZE;
+	BYTE *serverKey = clientKey + KEY_SIZE;
+	BYTE *clientIv = serverKey + KEY_SIZE;
+	BYTE *serverIv = clientIv + IV_SIZE;
+
+	memcpy(m_writeMac, client ? clientMac:serverMac, MAC_SIZE);
+	memcpy(m_readMac, client ? serverMac:clientMac, MAC_SIZE);
+	EVP_EncryptInit(&m_writeCtx,
+			PTP_SESSION_CIPHER,
+			client ? clientKey:serverKey,
+			client ? clientIv:serverIv);
+	EVP_DecryptInit(&m_readCtx,
+			PTP_SESSION_CIPHER,
+			client ? serverKey:clientKey,
+			client ? serverIv:clientIv);
+	memset(block, 0, sizeof(block));
+	m_readSeq = 0;
+	m_writeSeq = 0;
+	m_keys = 1;
+}
+
+/*
+ * PTP::SecureConnection::Derive: Expand a secret (TLS-style P_SHA1).
+ * Type: static
+ * @secret: Secret.
+ * @secretsize: Secret size.
+ * @label: Purpose of the derived data (at most %MAX_LABEL chars).
+ * @seed: Seed data.
+ * @seedsize: Seed size (at most 2 * %RANDOM_SIZE).
+ * @data: [$OUT] Derived data.
+ * @size: Derived data size.
+ */
+void
+PTP::SecureConnection::Derive(const BYTE *secret,
+			      int secretsize,
+			      const char *label,
+			      const BYTE *seed,
+			      int seedsize,
+			      BYTE *data,
+			      int size)
+{
+	BYTE buffer[MAX_LABEL + 2 * RANDOM_SIZE];
+	int labelsize = strlen(label);
+	assert(labelsize <= MAX_LABEL && seedsize <= 2 * RANDOM_SIZE);
+	memcpy(buffer, label, labelsize);
+	memcpy(buffer + labelsize, seed, seedsize);
+	int buffersize = labelsize + seedsize;
+
+	BYTE a[PTP_DIGEST_SIZE];
+	BYTE out[PTP_DIGEST_SIZE];
+	HMAC(PTP_DIGEST, secret, secretsize, buffer, buffersize, a, NULL);
+	while (size > 0)
+	{
+		HMAC_CTX ctx;
+		HMAC_Init(&ctx, secret, secretsize, PTP_DIGEST);
+		HMAC_Update(&ctx, a, sizeof(a));
+		HMAC_Update(&ctx, buffer, buffersize);
+		HMAC_Final(&ctx, out, NULL);
+		HMAC_cleanup(&ctx);
+
+		int s = (size < (int) sizeof(out)) ? size:sizeof(out);
+		memcpy(data, out, s);
+		data += s;
+		size -= s;
+		HMAC(PTP_DIGEST, secret, secretsize, a, sizeof(a), a, NULL);
+	}
+	memset(out, 0, sizeof(out));
+}
+
+/*
+ * PTP::SecureConnection::Mac: Calculate a record MAC (HMAC-SHA1).
+ * Type: static
+ * @key: MAC key (%MAC_SIZE bytes).
+ * @seq: Record sequence number.
+ * @hdr: Record header.
+ * @data: Encrypted record data.
+ * @size: Data size.
+ * @mac: [$OUT] MAC (%MAC_SIZE bytes).
+ */
+void
+PTP::SecureConnection::Mac(const BYTE *key,
+			   UINT32 seq,
+			   const BYTE *hdr,
+			   const BYTE *data,
+			   int size,
+			   BYTE *mac)
+{
+	BYTE seqData[4];
+	PTP::Net::Set32(seqData, seq);
+	HMAC_CTX ctx;
+	HMAC_Init(&ctx, key, MAC_SIZE, PTP_DIGEST);
+	HMAC_Update(&ctx, seqData, sizeof(seqData));
+	HMAC_Update(&ctx, (BYTE*) hdr, HEADER_SIZE);
+	HMAC_Update(&ctx, (BYTE*) data, size);
+	HMAC_Final(&ctx, mac, NULL);
+	HMAC_cleanup(&ctx);
+}
+
+/**
+ * PTP::SecureConnection::Cache::Cache: Class constructor.
+ * @ttl: Seconds a session may be resumed.
+ * @maxEntries: Maximum number of cached sessions.
+ * Example:
+ *   PTP::SecureConnection::Cache cache;
+ *   PTP::SecureConnection secure(&conn, &store, &cache);
+ */
+PTP::SecureConnection::Cache::Cache(int ttl, int maxEntries)
+	:m_entries(), m_ttl(ttl), m_maxEntries(maxEntries)
+{
+}
+
+#ifdef PTPTL_DLL
+
+/*
+ * PTP::SecureConnection::Cache::Cache: Copy constructor.
+ * @cache: Source Cache.
+ */
+PTP::SecureConnection::Cache::Cache(const Cache& cache)
+{
+	assert(0);
+}
+
+/*
+ * PTP::SecureConnection::Cache::operator=: Copy constructor.
+ * @cache: Source Cache.
+ */
+PTP::SecureConnection::Cache&
+PTP::SecureConnection::Cache::operator=(const Cache& cache)
+{
+	assert(0);
+	return *this;
+}
+
+#endif // PTPTL_DLL
+
+/**
+ * PTP::SecureConnection::Cache::~Cache: Class destructor.
+ */
+PTP::SecureConnection::Cache::~Cache()
+{
+	Clear();
+}
+
+/**
+ * PTP::SecureConnection::Cache::Clear: Remove all cached sessions.
+ */
+void
+PTP::SecureConnection::Cache::Clear()
+{
+	m_entries.Lock();
+	Entry *entry;
+	PTP_LIST_FOREACH(Entry, entry, &m_entries)
+	{
+		m_entries.Remove(entry, 0);
+		delete entry;
+	}
+	m_entries.Unlock();
+}
+
+/**
+ * PTP::SecureConnection::Cache::GetCached
+ * Returns: Number of cached client and server sessions.
+ */
+int
+PTP::SecureConnection::Cache::GetCached()
+{
+	int count = 0;
+	m_entries.Lock();
+	Entry *entry;
+	PTP_LIST_FOREACH(Entry, entry, &m_entries)
+		count++;
+	m_entries.Unlock();
+	return count;
+}
+
+/*
+ * PTP::SecureConnection::Cache::Find: Find a server session.
+ * @id: Session id (%SESSION_ID_SIZE bytes).
+ * Returns: Entry or NULL if not found.
+ * Notes: The entry list must be locked.  Expired entries are removed.
+ */
+PTP::SecureConnection::Cache::Entry *
+PTP::SecureConnection::Cache::Find(const BYTE *id)
+{
+	unsigned long now = PTP::Authenticator::GetTime();
+	Entry *entry;
+	PTP_LIST_FOREACH(Entry, entry, &m_entries)
+	{
+		if (now - entry->m_time >= (unsigned long) m_ttl)
+		{
+			m_entries.Remove(entry, 0);
+			delete entry;
+		}
+		else if (entry->m_port == PTP::Net::ANY
+			 && memcmp(entry->m_id, id, sizeof(entry->m_id)) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+/*
+ * PTP::SecureConnection::Cache::Find: Find a client session.
+ * @ip: Server IP address.
+ * @port: Server port.
+ * Returns: Entry or NULL if not found.
+ * Notes: The entry list must be locked.  Expired entries are removed.
+ */
+PTP::SecureConnection::Cache::Entry *
+PTP::SecureConnection::Cache::Find(PTP::Net::Ip ip, PTP::Net::Port port)
+{
+	unsigned long now = PTP::Authenticator::GetTime();
+	Entry *entry;
+	PTP_LIST_FOREACH(Entry, entry, &m_entries)
+	{
+		if (now - entry->m_time >= (unsigned long) m_ttl)
+		{
+			m_entries.Remove(entry, 0);
+			delete entry;
+		}
+		else if (entry->m_port != PTP::Net::ANY
+			 && entry->m_ip == ip
+			 && entry->m_port == port)
+			return entry;
+	}
+	return NULL;
+}
+
+/*
+ * PTP::SecureConnection::Cache::Add: Add a session.
+ * @id: Session id (%SESSION_ID_SIZE bytes).
+ * @ip: Server IP address or %ANY for a server session.
+ * @port: Server port or %ANY for a server session.
+ * @secret: Session secret.
+ * @peer: Peer identity (copied).
+ * Notes: A client session replaces any other session for the same
+ *        server.  The oldest sessions beyond the maximum are removed.
+ */
+void
+PTP::SecureConnection::Cache::Add(const BYTE *id,
+				  PTP::Net::Ip ip,
+				  PTP::Net::Port port,
+				  const BYTE *secret,
+				  const PTP::Identity *peer)
+{
+	m_entries.Lock();
+	int count = 0;
+	Entry *entry;
+	PTP_LIST_FOREACH(Entry, entry, &m_entries)
+	{
+		if ((port != PTP::Net::ANY
+		     && entry->m_ip == ip
+		     && entry->m_port == port)
+		    || ++count >= m_maxEntries)
+		{
+			m_entries.Remove(entry, 0);
+			delete entry;
+		}
+	}
+	m_entries.Insert(new Entry(id, ip, port, secret, peer), 0);
+	m_entries.Unlock();
+}
+
+/*
+ * PTP::SecureConnection::Cache::Remove: Remove a client session.
+ * @ip: Server IP address.
+ * @port: Server port.
+ */
+void
+PTP::SecureConnection::Cache::Remove(PTP::Net::Ip ip, PTP::Net::Port port)
+{
+	m_entries.Lock();
+	Entry *entry = Find(ip, port);
+	if (entry)
+	{
+		m_entries.Remove(entry, 0);
+		delete entry;
+	}
+	m_entries.Unlock();
+}
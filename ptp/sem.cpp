@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2001 Intel Corporation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * 3. Neither the name of the Intel Corporation nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef WIN32
+#include <errno.h>
+#endif
+#include <assert.h>
+#include <ptp/sem.h>
+#include <ptp/debug.h>
+
+/**
+ * PTP::Semaphore::Semaphore: Class constructor.
+ * @count: Initial count.
+ */
+PTP::Semaphore::Semaphore(int count)
+{
+#ifdef WIN32
+	m_sem = CreateSemaphore(0, count, 0x7fffffff, 0);
+#else
+	sem_init(&m_sem, 0, count);
+#endif
+}
+
+#ifdef PTPTL_DLL
+
+/*
+ * PTP::Semaphore::Semaphore: Copy constructor.
+ * @sem: Source Semaphore.
+ */
+PTP::Semaphore::Semaphore(const Semaphore& sem)
+{
+	assert(0);
+}
+
+/*
+ * PTP::Semaphore::operator=: Copy constructor.
+ * @sem: Source Semaphore.
+ */
+PTP::Semaphore&
+PTP::Semaphore::operator=(const Semaphore& sem)
+{
+	assert(0);
+	return *this;
+}
+
+#endif // PTPTL_DLL
+
+/**
+ * PTP::Semaphore::~Semaphore: Class destructor.
+ */
+PTP::Semaphore::~Semaphore()
+{
+#ifdef WIN32
+	CloseHandle(m_sem);
+#else
+	sem_destroy(&m_sem);
+#endif
+}
+
+/**
+ * PTP::Semaphore::Post: Increment the count, waking waiting threads.
+ * @count: Amount to add to the count.
+ */
+void
+PTP::Semaphore::Post(int count)
+{
+#ifdef WIN32
+	if (count > 0)
+		ReleaseSemaphore(m_sem, count, NULL);
+#else
+	for (int i = 0; i < count; i++)
+		sem_post(&m_sem);
+#endif
+}
+
+/**
+ * PTP::Semaphore::Wait: Decrement the count (blocking).
+ * Notes: Blocks while the count is zero.
+ * Example:
+ *   PTP::Semaphore done;
+ *   ...
+ *   thread.Start(RunThread, &done); // RunThread calls done.Post()
+ *   done.$Wait();
+ */
+void
+PTP::Semaphore::Wait()
+{
+#ifdef WIN32
+	WaitForSingleObject(m_sem, INFINITE);
+#else
+	while (sem_wait(&m_sem) < 0 && errno == EINTR)
+		;
+#endif
+}
+
+/**
+ * PTP::Semaphore::TryWait: Decrement the count (non-blocking).
+ * Returns: 0 on success or -1 if the count is zero.
+ */
+int
+PTP::Semaphore::TryWait()
+{
+#ifdef WIN32
+	DWORD status = WaitForSingleObject(m_sem, 0);
+	return ((status == WAIT_OBJECT_0) ? 0:-1);
+#else
+	return ((sem_trywait(&m_sem) == 0) ? 0:-1);
+#endif
+}
@@ -302,9 +302,6 @@ PTP::Store::Remove(const PTP::Identity *ident)
 	if (!ident)
 		return -1;
 
-	BYTE modulus[PTP::Identity::KEY_SIZE];
-	ident->GetKey(modulus);
-
 	Entry *entry = NULL;
 	m_entries.Lock();
 	PTP_LIST_FOREACH(Entry, entry, &m_entries)
@@ -313,9 +310,9 @@ PTP::Store::Remove(const PTP::Identity *ident)
 		{
 			if (entry->ident.ident == ident)
 				break;
-			BYTE mod[PTP::Identity::KEY_SIZE];
-			entry->ident.ident->GetKey(mod);
-			if (memcmp(mod, modulus, sizeof(mod)) == 0)
+			if (memcmp(entry->ident.ident->m_fingerprint,
+				   ident->m_fingerprint,
+				   PTP::Identity::FINGERPRINT_SIZE) == 0)
 				break;
 		}
 	}
@@ -551,13 +548,13 @@ PTP::Store::Find(const char *name,
 			    && (!name
 				|| strcmp(name,
 					  entry->ident.ident->GetName()) == 0)
-			    && (!haskey || entry->ident.ident->m_key))
+			    && (!haskey || entry->ident.ident->HasPrivateKey()))
 			{
 				if (!modulus)
 					break;
-				BYTE mod[PTP::Identity::KEY_SIZE];
-				entry->ident.ident->GetKey(mod);
-				if (memcmp(mod, modulus, sizeof(mod)) == 0)
+				if (memcmp(entry->ident.ident->m_modulus,
+					   modulus,
+					   PTP::Identity::KEY_SIZE) == 0)
 					break;
 			}
 			else if (entry->ident.ident == from)
@@ -748,6 +745,7 @@ PTP::Store::ExportPEM(const PTP::Identity *ident, BYTE *data)
  * @recipient: Recipient identity.
  * @signer: Signer identity or NULL.
  * Returns: Enveloped data size or -1 on error.
+ * Notes: See &ExportEnvelope.
  * Example:
  *   PTP::Identity *id = ...;
  *   char *secret = "This is a secret...";
@@ -844,6 +842,8 @@ PTP::Store::ImportEnvelope(
  * @recipient: Recipient identity.
  * @signer: Signer identity or NULL.
  * Returns: Envelope size or -1 on error.
+ * Notes: The recipient and signer must be PTP::Identity::RSA_KEY
+ *        identities.
  * Example:
  *   PTP::Identity *id = ...;
  *   char *secret = "This is a secret.";
@@ -862,7 +862,8 @@ PTP::Store::ExportEnvelope(
 	const PTP::Identity *recipient,
 	const PTP::Identity *signer)
 {
-	if (!data || (signer && !signer->m_key))
+	if (!data || !recipient || !recipient->m_public
+	    || (signer && !signer->m_key))
 		return -1;
 	if (size == -1)
 		size = strlen((const char*) data);
@@ -971,20 +972,19 @@ PTP::Store::Import(BIO *bio,
 			if (!bag)
 				break;
 
-			EVP_PKEY *key = NULL;
-			PKCS8_PRIV_KEY_INFO *pkcs8;
+			PKCS8_PRIV_KEY_INFO *pkcs8 = NULL;
+			PKCS8_PRIV_KEY_INFO *shrouded = NULL;
 			ASN1_TYPE *attrib;
 			switch (M_PKCS12_bag_type(bag))
 			{
 			case NID_keyBag:
-				key = EVP_PKCS82PKEY(bag->value.keybag);
+				pkcs8 = bag->value.keybag;
 				break;
 			case NID_pkcs8ShroudedKeyBag:
-				pkcs8 = M_PKCS12_decrypt_skey(bag, passwd, -1);
-				if (!pkcs8)
-					break;
-				key = EVP_PKCS82PKEY(pkcs8);
-				PKCS8_PRIV_KEY_INFO_free(pkcs8);
+				shrouded = M_PKCS12_decrypt_skey(bag,
+								 passwd,
+								 -1);
+				pkcs8 = shrouded;
 				break;
 			default:
 				friendly = PKCS12_get_friendlyname(bag);
@@ -995,17 +995,18 @@ PTP::Store::Import(BIO *bio,
 
 			if (cert)
 			{
+				PTP::Identity *ident = new PTP::Identity(cert);
+				if (pkcs8)
+					ident->ImportPrivateKey(pkcs8);
 				Insert(list,
-				       new PTP::Identity(cert, key),
-				       (key != NULL),
+				       ident,
+				       ident->HasPrivateKey(),
 				       friendly,
 				       id ? id->data:NULL,
 				       id ? id->length:0);
 				cert = NULL;
-				key = NULL;
 			}
-			EVP_PKEY_free(key);
-			key = NULL;
+			PKCS8_PRIV_KEY_INFO_free(shrouded);
 		       
 			ASN1_OCTET_STRING *secret;
 			switch (M_PKCS12_bag_type(bag))
@@ -1120,12 +1121,13 @@ PTP::Store::Export(PTP::List *list,
 
 		if (entry->type == IDENTITY
 		    && entry->ident.exportkey
-		    && entry->ident.ident->m_key)
+		    && entry->ident.ident->HasPrivateKey())
 		{
 			PKCS8_PRIV_KEY_INFO *pkcs8
-				= EVP_PKEY2PKCS8(entry->ident.ident->m_key);
-			bag = PKCS12_MAKE_KEYBAG(pkcs8);
-			sk_PKCS12_SAFEBAG_push(bags, bag);
+				= entry->ident.ident->ExportPrivateKey();
+			bag = pkcs8 ? PKCS12_MAKE_KEYBAG(pkcs8):NULL;
+			if (bag)
+				sk_PKCS12_SAFEBAG_push(bags, bag);
 		}
 	}
 	list->Unlock();
@@ -38,7 +38,16 @@
 #include <ptp/auth.h>
 #include <ptp/rand.h>
 #include <ptp/key.h>
+#include <ptp/chacha.h>
+#include <ptp/ed25519.h>
 #include <ptp/thread.h>
+#include <ptp/pool.h>
+#include <ptp/sem.h>
+#include <ptp/net.h>
+#include <ptp/connpool.h>
+#include <ptp/resolver.h>
+#include <ptp/reactor.h>
+#include <ptp/secure.h>
 #include <ptp/console.h>
 #include <ptp/debug.h>
 
@@ -68,6 +77,17 @@ TestIdentity()
 	memset(data, 0, sizeof(data));
 	id.GetKey(data);
 	CHECK(data[0] != 0);
+	BYTE fp[PTP::Identity::FINGERPRINT_SIZE];
+	BYTE fp2[PTP::Identity::FINGERPRINT_SIZE];
+	CHECK(id.GetFingerprint(NULL) == sizeof(fp));
+	id.GetFingerprint(fp);
+	SHA1(data, sizeof(data), fp2);
+	CHECK(!memcmp(fp, fp2, sizeof(fp)));
+	PTP::Identity copy(id);
+	copy.GetFingerprint(fp2);
+	CHECK(!memcmp(fp, fp2, sizeof(fp)));
+	empty.GetFingerprint(fp2);
+	CHECK(memcmp(fp, fp2, sizeof(fp)) != 0);
 	BYTE plain[PTP::Identity::PLAINTEXT_SIZE];
 	BYTE cipher[PTP::Identity::CIPHERTEXT_SIZE];
 	memset(plain, 0, sizeof(plain));
@@ -95,6 +115,249 @@ TestIdentity()
 	delete key2;
 }
 
+static void *
+IdentityThread(void *context)
+{
+	PTP::Identity *id = (PTP::Identity*) context;
+	BYTE plain[PTP::Identity::PLAINTEXT_SIZE];
+	BYTE cipher[PTP::Identity::CIPHERTEXT_SIZE];
+	BYTE sign[PTP::Identity::SIGNATURE_SIZE];
+	for (int i = 0; i < 20; i++)
+	{
+		memset(plain, i, sizeof(plain));
+		if (id->Sign(plain, sizeof(plain), sign) != sizeof(sign)
+		    || id->Verify(plain, sizeof(plain), sign)
+		    || id->Encrypt(plain, sizeof(plain), cipher) <= 0
+		    || id->Decrypt(cipher, cipher) != sizeof(plain)
+		    || memcmp(cipher, plain, sizeof(plain)))
+			return (void*) 1;
+	}
+	return NULL;
+}
+
+static void
+TestIdentityThreads()
+{
+	PTP::Identity id("John Doe");
+	PTP::Thread threads[4];
+	int i;
+	for (i = 0; i < 4; i++)
+		CHECK(!threads[i].Start(IdentityThread, &id));
+	for (i = 0; i < 4; i++)
+		CHECK(threads[i].Wait() == 0);
+}
+
+struct IdentityContext
+{
+	PTP::Mutex mutex;
+	int done;
+	int failed;
+};
+
+static void
+IdentityDone(const PTP::Identity *id, int result, void *context)
+{
+	IdentityContext *ctx = (IdentityContext*) context;
+	ctx->mutex.Lock();
+	ctx->done++;
+	if (result < 0)
+		ctx->failed++;
+	ctx->mutex.Unlock();
+}
+
+static void
+TestIdentityAsync()
+{
+	PTP::Identity id("John Doe");
+	PTP::ThreadPool *pool = PTP::Identity::GetCryptoPool();
+	CHECK(pool && pool->GetThreads() > 0);
+
+	IdentityContext ctx;
+	ctx.done = 0;
+	ctx.failed = 0;
+	BYTE plain[8][PTP::Identity::PLAINTEXT_SIZE];
+	BYTE cipher[8][PTP::Identity::CIPHERTEXT_SIZE];
+	BYTE sign[8][PTP::Identity::SIGNATURE_SIZE];
+	int i;
+	for (i = 0; i < 8; i++)
+	{
+		memset(plain[i], i, sizeof(plain[i]));
+		id.Encrypt(plain[i], sizeof(plain[i]), cipher[i]);
+	}
+	CHECK(id.Sign(plain[0], sizeof(plain[0]), sign[0], NULL, NULL, pool)
+	      == -1);
+	for (i = 0; i < 8; i++)
+	{
+		CHECK(!id.Sign(plain[i], sizeof(plain[i]), sign[i],
+			       IdentityDone, &ctx, pool));
+		CHECK(!id.Decrypt(cipher[i], cipher[i],
+				  IdentityDone, &ctx, pool));
+	}
+	pool->Wait();
+	CHECK(ctx.done == 16 && ctx.failed == 0);
+	for (i = 0; i < 8; i++)
+	{
+		CHECK(!id.Verify(plain[i], sizeof(plain[i]), sign[i]));
+		CHECK(!memcmp(cipher[i], plain[i], sizeof(plain[i])));
+	}
+
+	// without a pool, the callback runs before the call returns
+	CHECK(!id.Verify(plain[0], sizeof(plain[0]), sign[1],
+			 IdentityDone, &ctx, NULL));
+	CHECK(ctx.done == 17 && ctx.failed == 1);
+	CHECK(!id.Encrypt(plain[0], sizeof(plain[0]), cipher[0],
+			  IdentityDone, &ctx, NULL));
+	CHECK(ctx.done == 18 && ctx.failed == 1);
+
+	// destroying an identity finishes its outstanding operations
+	PTP::Identity *copy = new PTP::Identity(id);
+	for (i = 0; i < 8; i++)
+	{
+		CHECK(!copy->Sign(plain[i], sizeof(plain[i]), sign[i],
+				  IdentityDone, &ctx, pool));
+	}
+	delete copy;
+	CHECK(ctx.done == 26 && ctx.failed == 1);
+	pool->Wait();
+	for (i = 0; i < 8; i++)
+		CHECK(!id.Verify(plain[i], sizeof(plain[i]), sign[i]));
+}
+
+static void
+TestIdentityEd25519()
+{
+	PTP::Identity id("Jane Doe", PTP::Identity::ED25519_KEY);
+	CHECK(id.GetKeyType() == PTP::Identity::ED25519_KEY);
+	CHECK(id.GetName() && !strcmp(id.GetName(), "Jane Doe"));
+	BYTE data[PTP::Identity::KEY_SIZE];
+	CHECK(id.GetKey(data) == sizeof(data));
+	BYTE fp[PTP::Identity::FINGERPRINT_SIZE];
+	BYTE fp2[PTP::Identity::FINGERPRINT_SIZE];
+	id.GetFingerprint(fp);
+	SHA1(data, sizeof(data), fp2);
+	CHECK(!memcmp(fp, fp2, sizeof(fp)));
+
+	BYTE plain[PTP::Identity::ED25519_PLAINTEXT_SIZE];
+	BYTE cipher[PTP::Identity::CIPHERTEXT_SIZE];
+	CHECK(id.GetPlaintextSize() == sizeof(plain));
+	PTP::Random::Fill(plain, sizeof(plain));
+	CHECK(id.Encrypt(plain, sizeof(plain) + 1, cipher) == -1);
+	CHECK(id.Encrypt(plain, sizeof(plain), cipher) == sizeof(cipher));
+	BYTE plain2[PTP::Identity::PLAINTEXT_SIZE];
+	CHECK(id.Decrypt(cipher, plain2) == sizeof(plain));
+	CHECK(!memcmp(plain, plain2, sizeof(plain)));
+	cipher[sizeof(cipher) - 1] ^= 1;
+	CHECK(id.Decrypt(cipher, plain2) == -1);
+
+	BYTE sign[PTP::Identity::SIGNATURE_SIZE];
+	CHECK(id.Sign(plain, sizeof(plain), sign) == sizeof(sign));
+	CHECK(!id.Verify(plain, sizeof(plain), sign));
+	sign[0] ^= 1;
+	CHECK(id.Verify(plain, sizeof(plain), sign) == -1);
+	CHECK(!id.Verify(&id));
+
+	// RSA and Ed25519 identities sign each other's certificates
+	PTP::Identity rsa("John Doe");
+	CHECK(!rsa.Sign(&id, 60));
+	CHECK(!rsa.Verify(&id));
+	CHECK(id.Verify(&id) == -1);
+	CHECK(!id.Sign(&rsa, 60));
+	CHECK(!id.Verify(&rsa));
+	CHECK(rsa.Verify(&rsa) == -1);
+	CHECK(rsa.Encrypt(plain, sizeof(plain), cipher) == sizeof(cipher));
+
+	PTP::Identity copy(id);
+	CHECK(copy.GetKeyType() == PTP::Identity::ED25519_KEY);
+	CHECK(copy.Sign(plain, sizeof(plain), sign) == sizeof(sign));
+	CHECK(!id.Verify(plain, sizeof(plain), sign));
+
+	const char *passwd = "Passwd";
+	int size = PTP::Store::Export(&id, 1, passwd, passwd, NULL);
+	CHECK(size > 0);
+	BYTE *buffer = new BYTE[size];
+	PTP::Store::Export(&id, 1, passwd, passwd, buffer);
+	PTP::Identity *id2 = PTP::Store::Import(buffer, size, passwd, passwd);
+	CHECK(id2 && id2->GetKeyType() == PTP::Identity::ED25519_KEY);
+	if (id2)
+	{
+		id.Encrypt(plain, sizeof(plain), cipher);
+		CHECK(id2->Decrypt(cipher, plain2) == sizeof(plain));
+		id2->GetFingerprint(fp2);
+		CHECK(!memcmp(fp, fp2, sizeof(fp)));
+		CHECK(!rsa.Verify(id2));
+	}
+	delete id2;
+	delete [] buffer;
+
+	size = PTP::Store::ExportPEM(&id, NULL);
+	buffer = new BYTE[size];
+	PTP::Store::ExportPEM(&id, buffer);
+	id2 = PTP::Store::ImportPEM(buffer, size);
+	CHECK(id2 && id2->GetKeyType() == PTP::Identity::ED25519_KEY);
+	CHECK(id2 && id2->Decrypt(cipher, plain2) == -1);
+	CHECK(id2 && !id2->Verify(plain, sizeof(plain), sign));
+	delete id2;
+	delete [] buffer;
+	CHECK(PTP::Store::ExportEnvelope(plain, sizeof(plain), NULL, &id, NULL)
+	      == -1);
+
+	PTP::Store store;
+	store.Insert(&id, 1, NULL, NULL, 0);
+	PTP::Authenticator auth(&store);
+	BYTE chal[PTP::Authenticator::CHALLENGE_SIZE];
+	auth.Challenge(&id, 60, (void*) 1, chal);
+	BYTE resp[PTP::Authenticator::RESPONSE_SIZE];
+	CHECK(auth.Respond(chal, resp) == sizeof(resp));
+	CHECK(auth.Verify(resp) == (void*) 1);
+}
+
+static void
+TestIdentityReserve()
+{
+	PTP::Identity::ReserveKeys(2, 2);
+	for (int i = 0; i < 60 && PTP::Identity::GetReservedKeys() < 2; i++)
+		PTP::Thread::Sleep(1);
+	CHECK(PTP::Identity::GetReservedKeys() == 2);
+
+	// without a low-water mark, taken keys are not replaced
+	PTP::Identity::ReserveKeys(2, 0);
+	PTP::Identity *id = PTP::Identity::Create("John Doe");
+	CHECK(id && id->GetKeyType() == PTP::Identity::RSA_KEY);
+	CHECK(PTP::Identity::GetReservedKeys() == 1);
+	PTP::Identity *id2 = PTP::Identity::Create("Jane Doe");
+	CHECK(id2 && PTP::Identity::GetReservedKeys() == 0);
+	if (id && id2)
+	{
+		CHECK(id->GetName() && !strcmp(id->GetName(), "John Doe"));
+		CHECK(!id->Verify(id));
+		BYTE fp[PTP::Identity::FINGERPRINT_SIZE];
+		BYTE fp2[PTP::Identity::FINGERPRINT_SIZE];
+		id->GetFingerprint(fp);
+		id2->GetFingerprint(fp2);
+		CHECK(memcmp(fp, fp2, sizeof(fp)));
+
+		BYTE plain[PTP::Identity::PLAINTEXT_SIZE];
+		BYTE sign[PTP::Identity::SIGNATURE_SIZE];
+		PTP::Random::Fill(plain, sizeof(plain));
+		CHECK(id->Sign(plain, sizeof(plain), sign) == sizeof(sign));
+		CHECK(!id->Verify(plain, sizeof(plain), sign));
+		CHECK(id2->Verify(plain, sizeof(plain), sign) == -1);
+	}
+	delete id;
+	delete id2;
+
+	// an empty reserve generates the key on the calling thread
+	PTP::Identity::ReserveKeys(0, 0);
+	CHECK(PTP::Identity::GetReservedKeys() == 0);
+	id = PTP::Identity::Create("John Doe");
+	CHECK(id && !id->Verify(id));
+	delete id;
+	id = PTP::Identity::Create("Jane Doe", PTP::Identity::ED25519_KEY);
+	CHECK(id && id->GetKeyType() == PTP::Identity::ED25519_KEY);
+	CHECK(id && !id->Verify(id));
+	delete id;
+}
+
 static void
 TestStore()
 {
@@ -247,6 +510,7 @@ TestKey()
 	{
 		int size = key.Encrypt(plain, psize, cipher);
 		CHECK(size > (int) psize);
+		CHECK(size == PTP::Key::GetCipherSize(psize));
 		size = key.Decrypt(cipher, size, cipher);
 		CHECK(size == psize && !memcmp(plain, cipher, size));
 	}
@@ -270,6 +534,7 @@ TestKey()
 
 		int size = key.Encrypt(KeyRead, KeyWrite, &ctx);
 		CHECK(size > (int) psize);
+		CHECK(size == PTP::Key::GetCipherSize(psize));
 		
 		ctx.read = cipher;
 		ctx.readend = cipher + size;
@@ -289,6 +554,7 @@ TestKey()
 
 		int size = key.Encrypt(KeyRead, KeyWrite, &ctx, 0, 0);
 		CHECK(size == (int) psize);
+		CHECK(size == PTP::Key::GetCipherSize(psize, 0, 0));
 		
 		ctx.read = cipher;
 		ctx.readend = cipher + size;
@@ -297,6 +563,324 @@ TestKey()
 		size = key.Decrypt(KeyRead, KeyWrite, &ctx, 0, 0);
 		CHECK(size == psize && !memcmp(plain, cipher, size));
 	}
+
+	// in place, reusing a context across keys
+	PTP::Key key2;
+	PTP::Key::Context kctx;
+	for (psize = sizeof(plain) - 5;
+	     psize <= (int) sizeof(plain); psize++)
+	{
+		const PTP::Key *k = (psize & 1) ? &key:&key2;
+		memcpy(cipher, plain, psize);
+		int size = k->Encrypt(cipher, psize, cipher, 1, 1, &kctx);
+		CHECK(size == PTP::Key::GetCipherSize(psize));
+		CHECK(k->Decrypt(cipher, size, cipher + size) == psize);
+		size = k->Decrypt(cipher, size, cipher, 1, 1, &kctx);
+		CHECK(size == psize && !memcmp(plain, cipher, size));
+	}
+
+	// scatter/gather pieces match the buffer format
+	memcpy(cipher + PTP::Key::IV_SIZE, plain, sizeof(plain));
+	PTP::Key::Span spans[2] = {
+		{cipher + PTP::Key::IV_SIZE, 100},
+		{cipher + PTP::Key::IV_SIZE + 100, sizeof(plain) - 100}};
+	BYTE *digest = cipher + PTP::Key::IV_SIZE + sizeof(plain);
+	CHECK(key.Encrypt(spans, 2, cipher, digest) == sizeof(plain));
+	int size = PTP::Key::GetCipherSize(sizeof(plain));
+	BYTE copy[sizeof(cipher)];
+	memcpy(copy, cipher, size);
+	CHECK(key.Decrypt(copy, size, copy) == sizeof(plain));
+	CHECK(!memcmp(copy, plain, sizeof(plain)));
+	CHECK(key.Decrypt(spans, 2, cipher, digest, &kctx) == sizeof(plain));
+	CHECK(!memcmp(cipher + PTP::Key::IV_SIZE, plain, sizeof(plain)));
+	CHECK(key.Encrypt(spans, 2, cipher, digest) == sizeof(plain));
+	spans[1].data[0] ^= 1;
+	CHECK(key.Decrypt(spans, 2, cipher, digest) == -1);
+	spans[1].size = -1;
+	CHECK(key.Encrypt(spans, 2, NULL, NULL) == -1);
+
+	// a context follows a key that is replaced
+	size = key.Encrypt(plain, sizeof(plain), cipher);
+	CHECK(key2.Decrypt(cipher, size, copy, 1, 1, &kctx) == -1);
+	key2.Import(data);
+	CHECK(key2.Decrypt(cipher, size, copy, 1, 1, &kctx) == sizeof(plain));
+	CHECK(!memcmp(copy, plain, sizeof(plain)));
+
+	// ChaCha20-Poly1305 in every format, sharing the context
+	CHECK(key2.SetCipher((PTP::Key::Cipher) 7) == -1);
+	CHECK(key2.SetCipher(PTP::Key::CHACHA20_POLY1305) == 0);
+	CHECK(key2.GetCipher() == PTP::Key::CHACHA20_POLY1305);
+	for (psize = sizeof(plain) - 5;
+	     psize <= (int) sizeof(plain); psize++)
+	{
+		memcpy(cipher, plain, psize);
+		size = key2.Encrypt(cipher, psize, cipher, 1, 1, &kctx);
+		CHECK(size == psize + key2.GetIvSize() + key2.GetDigestSize());
+		CHECK(size == PTP::Key::GetCipherSize(psize,
+						      1,
+						      1,
+						      key2.GetCipher()));
+		CHECK(key.Decrypt(cipher, size, copy) == -1);
+		size = key2.Decrypt(cipher, size, cipher, 1, 1, &kctx);
+		CHECK(size == psize && !memcmp(plain, cipher, size));
+
+		KeyContext ctx;
+		ctx.read = plain;
+		ctx.readend = plain + psize;
+		ctx.write = cipher;
+		size = key2.Encrypt(KeyRead, KeyWrite, &ctx, 1, 1, 7);
+		CHECK(size == PTP::Key::GetCipherSize(psize,
+						      1,
+						      1,
+						      key2.GetCipher()));
+		CHECK(key2.Decrypt(cipher, size, copy) == psize);
+		CHECK(!memcmp(copy, plain, psize));
+		ctx.read = cipher;
+		ctx.readend = cipher + size;
+		ctx.write = copy;
+		CHECK(key2.Decrypt(KeyRead, KeyWrite, &ctx, 1, 1, 7) == psize);
+		CHECK(!memcmp(copy, plain, psize));
+		cipher[size - 1] ^= 1;
+		ctx.read = cipher;
+		ctx.write = copy;
+		CHECK(key2.Decrypt(KeyRead, KeyWrite, &ctx) == -1);
+	}
+	int ivsize = key2.GetIvSize();
+	memcpy(cipher + ivsize, plain, sizeof(plain));
+	spans[0].data = cipher + ivsize;
+	spans[0].size = 100;
+	spans[1].data = cipher + ivsize + 100;
+	spans[1].size = sizeof(plain) - 100;
+	digest = cipher + ivsize + sizeof(plain);
+	CHECK(key2.Encrypt(spans, 2, cipher, digest, &kctx) == sizeof(plain));
+	size = PTP::Key::GetCipherSize(sizeof(plain), 1, 1, key2.GetCipher());
+	CHECK(key2.Decrypt(cipher, size, copy, 1, 1, &kctx) == sizeof(plain));
+	CHECK(!memcmp(copy, plain, sizeof(plain)));
+	CHECK(key2.Decrypt(spans, 2, cipher, digest) == sizeof(plain));
+	CHECK(!memcmp(cipher + ivsize, plain, sizeof(plain)));
+
+	// ChaCha20 never runs with a fixed nonce
+	CHECK(key2.Encrypt(plain, sizeof(plain), copy, 0, 1) == -1);
+	CHECK(key2.Decrypt(cipher, size - ivsize, copy, 0, 1) == -1);
+	CHECK(key2.Encrypt(spans, 2, NULL, digest) == -1);
+	CHECK(key2.Decrypt(spans, 2, NULL, digest) == -1);
+	KeyContext fixed;
+	fixed.read = plain;
+	fixed.readend = plain + sizeof(plain);
+	fixed.write = copy;
+	CHECK(key2.Encrypt(KeyRead, KeyWrite, &fixed, 0, 1) == -1);
+	fixed.read = cipher + ivsize;
+	fixed.readend = cipher + size;
+	CHECK(key2.Decrypt(KeyRead, KeyWrite, &fixed, 0, 1) == -1);
+	size = key.Encrypt(plain, sizeof(plain), cipher, 1, 1, &kctx);
+	CHECK(key.Decrypt(cipher, size, copy, 1, 1, &kctx) == sizeof(plain));
+
+	// messages larger than one pass keep the same format
+	static BYTE big[0x3000 + 100];
+	static BYTE bigCipher[sizeof(big) + 64];
+	PTP::Random::Fill(big, sizeof(big));
+	for (int c = 0; c <= 1; c++)
+	{
+		key2.SetCipher(c ? PTP::Key::CHACHA20_POLY1305
+			       :PTP::Key::SESSION_CIPHER);
+		size = key2.Encrypt(big, sizeof(big), bigCipher);
+		PTP::Key::Span span = {bigCipher + key2.GetIvSize(),
+				       sizeof(big)};
+		CHECK(key2.Decrypt(&span, 1, bigCipher, span.data + span.size)
+		      == sizeof(big));
+		CHECK(!memcmp(span.data, big, sizeof(big)));
+		if (c)
+			continue;
+
+		memcpy(bigCipher, big, sizeof(big));
+		span.data = bigCipher;
+		CHECK(key2.Encrypt(&span, 1, NULL, bigCipher + sizeof(big))
+		      == sizeof(big));
+		size = sizeof(big) + key2.GetDigestSize();
+		CHECK(key2.Decrypt(bigCipher, size, bigCipher, 0, 1)
+		      == sizeof(big));
+		CHECK(!memcmp(bigCipher, big, sizeof(big)));
+	}
+	// batches match the buffer functions, in place or not
+	static BYTE batch[40][100 + 64];
+	PTP::Key::Message msgs[40];
+	for (int c = 0; c <= 1; c++)
+	{
+		key2.SetCipher(c ? PTP::Key::CHACHA20_POLY1305
+			       :PTP::Key::SESSION_CIPHER);
+		int i;
+		for (i = 0; i < 40; i++)
+		{
+			msgs[i].src = (i & 1) ? batch[i]:big + i;
+			msgs[i].size = i + 61;
+			msgs[i].dst = batch[i];
+			if (i & 1)
+				memcpy(batch[i], big + i, msgs[i].size);
+		}
+		CHECK(key2.EncryptBatch(msgs, 40, &kctx) == 0);
+		for (i = 0; i < 40; i++)
+		{
+			size = PTP::Key::GetCipherSize(i + 61,
+						       1,
+						       1,
+						       key2.GetCipher());
+			CHECK(msgs[i].size == size);
+			CHECK(key2.Decrypt(batch[i], size, copy) == i + 61);
+			CHECK(!memcmp(copy, big + i, i + 61));
+			msgs[i].src = batch[i];
+		}
+		CHECK(memcmp(batch[0], batch[2], key2.GetIvSize()) != 0);
+
+		batch[7][key2.GetIvSize() + 3] ^= 1;
+		CHECK(key2.DecryptBatch(msgs, 40) == -1);
+		for (i = 0; i < 40; i++)
+		{
+			CHECK(msgs[i].size == ((i == 7) ? -1:i + 61));
+			if (i != 7)
+				CHECK(!memcmp(batch[i], big + i, i + 61));
+		}
+	}
+}
+
+static void
+TestChaCha()
+{
+	// RFC 7539 section 2.8.2
+	BYTE key[PTP::ChaCha::KEY_SIZE];
+	int i;
+	for (i = 0; i < (int) sizeof(key); i++)
+		key[i] = 0x80 + i;
+	BYTE nonce[] = {7, 0, 0, 0, 0x40, 0x41, 0x42, 0x43,
+			0x44, 0x45, 0x46, 0x47};
+	BYTE aad[] = {0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3,
+		      0xc4, 0xc5, 0xc6, 0xc7};
+	const char *text = "Ladies and Gentlemen of the class of '99: "
+		"If I could offer you only one tip for the future, "
+		"sunscreen would be it.";
+	BYTE start[] = {0xd3, 0x1a, 0x8d, 0x34, 0x64, 0x8e, 0x60, 0xdb};
+	BYTE end[] = {0x61, 0x16};
+	BYTE tag[] = {0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a,
+		      0x7e, 0x90, 0x2e, 0xcb, 0xd0, 0x60, 0x06, 0x91};
+	int size = strlen(text);
+
+	BYTE data[4096];
+	BYTE data2[sizeof(data)];
+	BYTE out[PTP::ChaCha::TAG_SIZE];
+	PTP::ChaCha chacha(key);
+	for (int simd = 0; simd <= 1; simd++)
+	{
+		PTP::ChaCha::SetSimd(simd);
+		chacha.Start(nonce, aad, sizeof(aad));
+		memcpy(data, text, size);
+		chacha.Encrypt(data, data, 10);
+		chacha.Encrypt(data + 10, data + 10, size - 10);
+		chacha.Finish(out);
+		CHECK(!memcmp(data, start, sizeof(start)));
+		CHECK(!memcmp(data + size - sizeof(end), end, sizeof(end)));
+		CHECK(!memcmp(out, tag, sizeof(tag)));
+
+		chacha.Start(nonce, aad, sizeof(aad));
+		chacha.Decrypt(data, data, size);
+		CHECK(chacha.Verify(tag) == 0);
+		CHECK(!memcmp(data, text, size));
+		chacha.Start(nonce, aad, sizeof(aad) - 1);
+		chacha.Decrypt(data, data, size);
+		CHECK(chacha.Verify(tag) == -1);
+	}
+
+	// the SIMD and portable key streams match across many blocks
+	PTP::Random::Fill(data, sizeof(data));
+	memcpy(data2, data, sizeof(data));
+	PTP::ChaCha::SetSimd(0);
+	chacha.Start(nonce);
+	chacha.Encrypt(data, data, sizeof(data));
+	chacha.Finish(out);
+	PTP::ChaCha::SetSimd(1);
+	chacha.Start(nonce);
+	for (i = 0; i < (int) sizeof(data2); i += 333)
+	{
+		int n = sizeof(data2) - i;
+		chacha.Encrypt(data2 + i, data2 + i, n < 333 ? n:333);
+	}
+	CHECK(!memcmp(data, data2, sizeof(data)));
+	CHECK(chacha.Verify(out) == 0);
+
+	CHECK(chacha.SetKey(key, 16) == 0);
+	CHECK(chacha.SetKey(key, 24) == -1);
+}
+
+static void
+TestEd25519()
+{
+	// RFC 8032 section 7.1 (test 2)
+	BYTE seed[] = {0x4c, 0xcd, 0x08, 0x9b, 0x28, 0xff, 0x96, 0xda,
+		       0x9d, 0xb6, 0xc3, 0x46, 0xec, 0x11, 0x4e, 0x0f,
+		       0x5b, 0x8a, 0x31, 0x9f, 0x35, 0xab, 0xa6, 0x24,
+		       0xda, 0x8c, 0xf6, 0xed, 0x4f, 0xb8, 0xa6, 0xfb};
+	BYTE pub[] = {0x3d, 0x40, 0x17, 0xc3, 0xe8, 0x43, 0x89, 0x5a,
+		      0x92, 0xb7, 0x0a, 0xa7, 0x4d, 0x1b, 0x7e, 0xbc,
+		      0x9c, 0x98, 0x2c, 0xcf, 0x2e, 0xc4, 0x96, 0x8c,
+		      0xc0, 0xcd, 0x55, 0xf1, 0x2a, 0xf4, 0x66, 0x0c};
+	BYTE sign[] = {0x92, 0xa0, 0x09, 0xa9, 0xf0, 0xd4, 0xca, 0xb8,
+		       0x72, 0x0e, 0x82, 0x0b, 0x5f, 0x64, 0x25, 0x40,
+		       0xa2, 0xb2, 0x7b, 0x54, 0x16, 0x50, 0x3f, 0x8f,
+		       0xb3, 0x76, 0x22, 0x23, 0xeb, 0xdb, 0x69, 0xda,
+		       0x08, 0x5a, 0xc1, 0xe4, 0x3e, 0x15, 0x99, 0x6e,
+		       0x45, 0x8f, 0x36, 0x13, 0xd0, 0xf1, 0x1d, 0x8c,
+		       0x38, 0x7b, 0x2e, 0xae, 0xb4, 0x30, 0x2a, 0xee,
+		       0xb0, 0x0d, 0x29, 0x16, 0x12, 0xbb, 0x0c, 0x00};
+	BYTE msg = 0x72;
+	BYTE key[PTP::Ed25519::KEY_SIZE];
+	PTP::Ed25519::CreateKey(seed, key);
+	CHECK(!memcmp(key, pub, sizeof(pub)));
+	BYTE sign2[PTP::Ed25519::SIGNATURE_SIZE];
+	PTP::Ed25519::Sign(seed, key, &msg, 1, sign2);
+	CHECK(!memcmp(sign2, sign, sizeof(sign)));
+	CHECK(!PTP::Ed25519::Verify(key, &msg, 1, sign));
+	msg ^= 1;
+	CHECK(PTP::Ed25519::Verify(key, &msg, 1, sign) == -1);
+	msg ^= 1;
+	sign[63] ^= 0x40;
+	CHECK(PTP::Ed25519::Verify(key, &msg, 1, sign) == -1);
+
+	// FIPS 180-2 appendix C.1
+	BYTE digest[] = {0xdd, 0xaf, 0x35, 0xa1, 0x93, 0x61, 0x7a, 0xba,
+			 0xcc, 0x41, 0x73, 0x49, 0xae, 0x20, 0x41, 0x31,
+			 0x12, 0xe6, 0xfa, 0x4e, 0x89, 0xa9, 0x7e, 0xa2,
+			 0x0a, 0x9e, 0xee, 0xe6, 0x4b, 0x55, 0xd3, 0x9a,
+			 0x21, 0x92, 0x99, 0x2a, 0x27, 0x4f, 0xc1, 0xa8,
+			 0x36, 0xba, 0x3c, 0x23, 0xa3, 0xfe, 0xeb, 0xbd,
+			 0x45, 0x4d, 0x44, 0x23, 0x64, 0x3c, 0xe8, 0x0e,
+			 0x2a, 0x9a, 0xc9, 0x4f, 0xa5, 0x4c, 0xa4, 0x9f};
+	BYTE digest2[PTP::Ed25519::DIGEST_SIZE];
+	PTP::Ed25519::Digest((const BYTE*) "abc", 3, digest2);
+	CHECK(!memcmp(digest, digest2, sizeof(digest)));
+
+	// RFC 7748 section 5.2
+	BYTE scalar[] = {0xa5, 0x46, 0xe3, 0x6b, 0xf0, 0x52, 0x7c, 0x9d,
+			 0x3b, 0x16, 0x15, 0x4b, 0x82, 0x46, 0x5e, 0xdd,
+			 0x62, 0x14, 0x4c, 0x0a, 0xc1, 0xfc, 0x5a, 0x18,
+			 0x50, 0x6a, 0x22, 0x44, 0xba, 0x44, 0x9a, 0xc4};
+	BYTE point[] = {0xe6, 0xdb, 0x68, 0x67, 0x58, 0x30, 0x30, 0xdb,
+			0x35, 0x94, 0xc1, 0xa4, 0x24, 0xb1, 0x5f, 0x7c,
+			0x72, 0x66, 0x24, 0xec, 0x26, 0xb3, 0x35, 0x3b,
+			0x10, 0xa9, 0x03, 0xa6, 0xd0, 0xab, 0x1c, 0x4c};
+	BYTE shared[] = {0xc3, 0xda, 0x55, 0x37, 0x9d, 0xe9, 0xc6, 0x90,
+			 0x8e, 0x94, 0xea, 0x4d, 0xf2, 0x8d, 0x08, 0x4f,
+			 0x32, 0xec, 0xcf, 0x03, 0x49, 0x1c, 0x71, 0xf7,
+			 0x54, 0xb4, 0x07, 0x55, 0x77, 0xa2, 0x85, 0x52};
+	BYTE shared2[PTP::Ed25519::SCALAR_SIZE];
+	CHECK(!PTP::Ed25519::X25519(scalar, point, shared2));
+	CHECK(!memcmp(shared, shared2, sizeof(shared)));
+
+	// the X25519 key for a seed matches its converted Ed25519 key
+	BYTE point2[PTP::Ed25519::SCALAR_SIZE];
+	PTP::Ed25519::GetScalar(seed, scalar);
+	CHECK(!PTP::Ed25519::X25519(scalar, NULL, point));
+	CHECK(!PTP::Ed25519::ToX25519(key, point2));
+	CHECK(!memcmp(point, point2, sizeof(point)));
+	memset(point, 0, sizeof(point));
+	CHECK(PTP::Ed25519::X25519(scalar, point, shared2) == -1);
 }
 
 static void *
@@ -415,17 +999,986 @@ TestList()
 	CHECK(count == 2);
 }
 
+struct PoolContext
+{
+	PTP::ThreadPool *pool;
+	PTP::Mutex mutex;
+	PTP::Semaphore sem;
+	int value;
+};
+
+static void
+PoolTask(void *context)
+{
+	PoolContext *ctx = (PoolContext*) context;
+	ctx->mutex.Lock();
+	ctx->value++;
+	ctx->mutex.Unlock();
+}
+
+static void
+PoolSpawnTask(void *context)
+{
+	PoolContext *ctx = (PoolContext*) context;
+	for (int i = 0; i < 10; i++)
+		CHECK(!ctx->pool->Submit(PoolTask, ctx));
+}
+
+static void
+PoolBlockTask(void *context)
+{
+	PoolContext *ctx = (PoolContext*) context;
+	ctx->sem.Wait();
+	PoolTask(context);
+}
+
+static void
+TestThreadPool()
+{
+	PTP::Semaphore sem(1);
+	CHECK(!sem.TryWait());
+	CHECK(sem.TryWait());
+	sem.Post(2);
+	sem.Wait();
+	CHECK(!sem.TryWait());
+
+	PTP::ThreadPool pool(4);
+	CHECK(pool.GetThreads() == 4);
+	PoolContext ctx;
+	ctx.pool = &pool;
+	ctx.value = 0;
+	for (int i = 0; i < 10; i++)
+		CHECK(!pool.Submit(PoolSpawnTask, &ctx));
+	pool.Wait();
+	CHECK(ctx.value == 100);
+
+	PTP::ThreadPool small(1, 1);
+	PoolContext ctx2;
+	ctx2.pool = &small;
+	ctx2.value = 0;
+	CHECK(!small.Submit(PoolBlockTask, &ctx2));
+	int queued = 0;
+	while (queued < 3 && small.Submit(PoolTask, &ctx2) == 0)
+		queued++;
+	CHECK(queued < 2);
+	ctx2.sem.Post();
+	small.Wait();
+	CHECK(ctx2.value == queued + 1);
+
+	PTP::ThreadPool pinned(2, 16, 1);
+	PoolContext ctx3;
+	ctx3.pool = &pinned;
+	ctx3.value = 0;
+	for (int i = 0; i < 10; i++)
+		CHECK(!pinned.Submit(PoolTask, &ctx3));
+	pinned.Wait();
+	CHECK(ctx3.value == 10);
+}
+
+struct ChunkedContext
+{
+	const PTP::Key *key;
+	PTP::ThreadPool *pool;
+	KeyContext io;
+	int size;
+};
+
+static void
+ChunkedTask(void *arg)
+{
+	ChunkedContext *ctx = (ChunkedContext*) arg;
+	ctx->size = ctx->key->EncryptChunked(KeyRead,
+					     KeyWrite,
+					     &ctx->io,
+					     ctx->pool,
+					     1000);
+}
+
+static void
+TestChunked()
+{
+	static BYTE plain[10 * 1000 + 7];
+	static BYTE cipher[sizeof(plain) + 512];
+	static BYTE copy[sizeof(cipher)];
+	PTP::Random::Fill(plain, sizeof(plain));
+	PTP::ThreadPool pool(4);
+	PTP::Key key;
+
+	int psizes[] = {0, 1, 999, 1000, 1001, 5000, sizeof(plain)};
+	for (int c = 0; c <= 1; c++)
+	{
+		key.SetCipher(c ? PTP::Key::CHACHA20_POLY1305
+			      :PTP::Key::SESSION_CIPHER);
+		for (int i = 0; i < (int) (sizeof(psizes) / sizeof(int)); i++)
+		{
+			int psize = psizes[i];
+			KeyContext ctx;
+			ctx.read = plain;
+			ctx.readend = plain + psize;
+			ctx.write = cipher;
+			int size = key.EncryptChunked(KeyRead,
+						      KeyWrite,
+						      &ctx,
+						      (i & 1) ? &pool:NULL,
+						      1000);
+			CHECK(size == key.GetChunkedSize(psize, 1000));
+
+			ctx.read = cipher;
+			ctx.readend = cipher + size;
+			ctx.write = copy;
+			size = key.DecryptChunked(KeyRead,
+						  KeyWrite,
+						  &ctx,
+						  (i & 1) ? NULL:&pool);
+			CHECK(size == psize);
+			CHECK(!memcmp(copy, plain, psize));
+
+			// dropping the last chunk is detected
+			int last = size - (psize % 1000)
+				- key.GetDigestSize();
+			ctx.read = cipher;
+			ctx.readend = cipher + last;
+			ctx.write = copy;
+			CHECK(key.DecryptChunked(KeyRead,
+						 KeyWrite,
+						 &ctx,
+						 &pool) == -1);
+		}
+
+		// so are altered and reordered chunks
+		KeyContext ctx;
+		ctx.read = plain;
+		ctx.readend = plain + sizeof(plain);
+		ctx.write = cipher;
+		int size = key.EncryptChunked(KeyRead,
+					      KeyWrite,
+					      &ctx,
+					      &pool,
+					      1000);
+		int chunk = 1000 + key.GetDigestSize();
+		BYTE *first = cipher + 4 + key.GetIvSize();
+		memcpy(copy, first, chunk);
+		memcpy(first, first + chunk, chunk);
+		memcpy(first + chunk, copy, chunk);
+		ctx.read = cipher;
+		ctx.readend = cipher + size;
+		ctx.write = copy;
+		CHECK(key.DecryptChunked(KeyRead, KeyWrite, &ctx, &pool) == -1);
+		memcpy(copy, first, chunk);
+		memcpy(first, first + chunk, chunk);
+		memcpy(first + chunk, copy, chunk);
+		first[5 * chunk + 3] ^= 1;
+		ctx.read = cipher;
+		ctx.write = copy;
+		CHECK(key.DecryptChunked(KeyRead, KeyWrite, &ctx, &pool) == -1);
+		first[5 * chunk + 3] ^= 1;
+		ctx.read = cipher;
+		ctx.write = copy;
+		CHECK(key.DecryptChunked(KeyRead, KeyWrite, &ctx, &pool)
+		      == sizeof(plain));
+
+		// knowing the plaintext does not help to patch a chunk tag
+		if (!c)
+		{
+			BYTE sum[2][PTP_DIGEST_SIZE];
+			for (int j = 0; j < 2; j++)
+			{
+				EVP_MD_CTX md;
+				EVP_DigestInit(&md, PTP_DIGEST);
+				plain[3] ^= j;
+				EVP_DigestUpdate(&md, plain, 1000);
+				plain[3] ^= j;
+				EVP_DigestFinal(&md, sum[j], NULL);
+			}
+			first[3] ^= 1;
+			for (int j = 0; j < PTP_DIGEST_SIZE; j++)
+				first[1000 + j] ^= sum[0][j] ^ sum[1][j];
+			ctx.read = cipher;
+			ctx.write = copy;
+			CHECK(key.DecryptChunked(KeyRead,
+						 KeyWrite,
+						 &ctx,
+						 &pool) == -1);
+			first[3] ^= 1;
+			for (int j = 0; j < PTP_DIGEST_SIZE; j++)
+				first[1000 + j] ^= sum[0][j] ^ sum[1][j];
+		}
+
+		// ranges decrypt to the matching part of the plaintext
+		int ranges[][2] = {{0, 0}, {0, 1}, {999, 2}, {1000, 1000},
+				   {2500, -1}, {3000, 5000}, {9999, 100},
+				   {10000, -1}, {sizeof(plain), -1}};
+		for (int r = 0; r < (int) (sizeof(ranges) / sizeof(ranges[0]));
+		     r++)
+		{
+			int offset = ranges[r][0];
+			int length = ranges[r][1];
+			int expect = (int) sizeof(plain) - offset;
+			if (length >= 0 && length < expect)
+				expect = length;
+
+			ctx.read = plain + PTP::Key::GetChunkedOffset(offset,
+								      1000);
+			ctx.readend = plain + sizeof(plain);
+			ctx.write = cipher;
+			size = key.EncryptRange(KeyRead,
+						KeyWrite,
+						&ctx,
+						offset,
+						length,
+						(r & 1) ? &pool:NULL,
+						1000);
+			CHECK(size == key.GetChunkedSize(sizeof(plain),
+							 1000,
+							 offset,
+							 length));
+			ctx.read = cipher;
+			ctx.readend = cipher + size;
+			ctx.write = copy;
+			CHECK(key.DecryptRange(KeyRead,
+					       KeyWrite,
+					       &ctx,
+					       offset,
+					       length,
+					       (r & 1) ? NULL:&pool) == expect);
+			CHECK(!memcmp(copy, plain + offset, expect));
+
+			// a range with one bit changed is refused
+			if (expect > 0)
+			{
+				BYTE *data = cipher + 4 + key.GetIvSize();
+				data[expect / 2] ^= 0x10;
+				ctx.read = cipher;
+				ctx.write = copy;
+				CHECK(key.DecryptRange(KeyRead,
+						       KeyWrite,
+						       &ctx,
+						       offset,
+						       length,
+						       &pool) == -1);
+				data[expect / 2] ^= 0x10;
+			}
+
+			// a range is only accepted at its own offset
+			if (expect > 0 && offset >= 1000)
+			{
+				ctx.read = cipher;
+				ctx.write = copy;
+				CHECK(key.DecryptRange(KeyRead,
+						       KeyWrite,
+						       &ctx,
+						       offset - 1000,
+						       length,
+						       &pool) == -1);
+			}
+		}
+	}
+
+	// a pool task can use its own (busy) pool
+	PTP::ThreadPool single(1);
+	ChunkedContext cctx;
+	cctx.key = &key;
+	cctx.pool = &single;
+	cctx.io.read = plain;
+	cctx.io.readend = plain + sizeof(plain);
+	cctx.io.write = cipher;
+	CHECK(!single.Submit(ChunkedTask, &cctx));
+	single.Wait();
+	CHECK(cctx.size == key.GetChunkedSize(sizeof(plain), 1000));
+}
+
+static void
+TestSendFile()
+{
+	FILE *fp = tmpfile();
+	CHECK(fp != NULL);
+	if (!fp)
+		return;
+	BYTE data[40000];
+	for (int i = 0; i < (int) sizeof(data); i++)
+		data[i] = (BYTE) (i * 7);
+	CHECK(fwrite(data, 1, sizeof(data), fp) == sizeof(data));
+	fflush(fp);
+
+	PTP::Net::Connection server(PTP::Net::Connection::RAW, 0);
+	CHECK(!server.Open());
+	PTP::Net::Connection client(PTP::Net::Connection::RAW,
+				    PTP::Net::LOOPBACK,
+				    server.GetPort());
+	CHECK(!client.Open());
+	PTP::Net::Connection *c = server.Accept();
+	CHECK(c != NULL);
+	if (!c)
+	{
+		fclose(fp);
+		return;
+	}
+
+	BYTE buffer[sizeof(data)];
+	CHECK(client.SendFile(fileno(fp), 100, 30000) == 30000);
+	CHECK(c->ReadAll(buffer, 30000, 5000) == 30000);
+	CHECK(!memcmp(buffer, data + 100, 30000));
+	CHECK(client.SendFile(fileno(fp), 39000, 5000) == 1000);
+	CHECK(c->ReadAll(buffer, 1000, 5000) == 1000);
+	CHECK(!memcmp(buffer, data + 39000, 1000));
+
+	delete c;
+	fclose(fp);
+}
+
+static void
+TestBuffer()
+{
+	PTP::Net::Connection server(PTP::Net::Connection::RAW, 0);
+	CHECK(!server.Open());
+	PTP::Net::Connection client(PTP::Net::Connection::RAW,
+				    PTP::Net::LOOPBACK,
+				    server.GetPort());
+	CHECK(!client.Open());
+	PTP::Net::Connection *c = server.Accept();
+	CHECK(c != NULL);
+	if (!c)
+		return;
+
+	const char msg[] = "HELLO\nGET / HTTP/1.0\r\nA: b\r\n\r\nbody";
+	CHECK(client.WriteAll((const BYTE*) msg, sizeof(msg) - 1)
+	      == sizeof(msg) - 1);
+
+	// the message is already queued, so the first read buffers all of it
+	BYTE buffer[64];
+	const BYTE *data = NULL;
+	CHECK(c->ReadAll(buffer, 2, 5000) == 2);
+	CHECK(!c->Unget(buffer, 2));
+	CHECK(c->GetBuffered() == sizeof(msg) - 1);
+	CHECK(c->Peek(&data, 5) == 5);
+	CHECK(!memcmp(data, "HELLO", 5));
+	CHECK(c->ReadUntil(buffer, 3, "\n") == -1);
+	CHECK(c->ReadUntil(buffer, sizeof(buffer), "\n") == 6);
+	CHECK(!memcmp(buffer, "HELLO\n", 6));
+
+	char *hdr = c->ReadHttpHdr();
+	CHECK(hdr && !strcmp(hdr, "GET / HTTP/1.0\r\nA: b\r\n\r\n"));
+	delete [] hdr;
+	CHECK(c->Peek(&data, sizeof(buffer)) == 4);
+	CHECK(c->Consume(2) == 2);
+	CHECK(c->Read(buffer, sizeof(buffer)) == 2);
+	CHECK(!memcmp(buffer, "dy", 2));
+	CHECK(c->GetBuffered() == 0);
+
+	// Unget of new data grows the buffer
+	CHECK(!c->Unget((const BYTE*) "xyz", 3));
+	CHECK(c->Read(buffer, sizeof(buffer)) == 3);
+	CHECK(!memcmp(buffer, "xyz", 3));
+
+	client.Close();
+	CHECK(c->Peek(&data, 1) == 0);
+
+	delete c;
+}
+
+static void
+TestHttp()
+{
+	PTP::Net::Connection server(PTP::Net::Connection::HTTP, 0);
+	CHECK(!server.Open());
+	PTP::Net::Connection client(PTP::Net::Connection::HTTP,
+				    PTP::Net::LOOPBACK,
+				    server.GetPort());
+	CHECK(!client.Open());
+	PTP::Net::Connection *c = server.Accept();
+	CHECK(c != NULL);
+	if (!c)
+		return;
+
+	// pipeline two requests on one connection
+	CHECK(!client.WriteHttp("PUT", "/a", NULL,
+				(const BYTE*) "one", NULL, -1));
+	CHECK(!client.WriteHttp("GET", "/b", NULL, NULL, NULL, 0));
+
+	int size = 0;
+	BYTE *data = c->ReadHttp(NULL, -1, NULL, &size, 5000);
+	CHECK(data && size == 3 && !memcmp(data, "one", 3));
+	delete [] data;
+	CHECK(c->GetKeepAlive());
+	data = c->ReadHttp(NULL, -1, NULL, &size, 5000);
+	CHECK(data && size == 0);
+	delete [] data;
+
+	CHECK(!c->WriteHttp(PTP::Net::HTTP_OK, NULL,
+			    (const BYTE*) "ab", NULL, 2));
+	CHECK(!c->WriteHttp(PTP::Net::HTTP_NOT_FOUND, NULL, NULL, NULL, 0));
+
+	int status = 0;
+	data = client.ReadHttp(NULL, -1, &status, &size, 5000);
+	CHECK(data && status == PTP::Net::HTTP_OK && size == 2);
+	delete [] data;
+	CHECK(client.GetKeepAlive());
+	data = client.ReadHttp(NULL, -1, &status, &size, 5000);
+	CHECK(data && status == PTP::Net::HTTP_NOT_FOUND && size == 0);
+	delete [] data;
+
+	// HTTP/1.0 requests close unless asked to keep the connection
+	const char rqst[] = "GET /c HTTP/1.0\r\n\r\n";
+	CHECK(client.WriteAll((const BYTE*) rqst, sizeof(rqst) - 1)
+	      == sizeof(rqst) - 1);
+	char *hdr = c->ReadHttpHdr(NULL, -1, NULL, NULL, 5000);
+	CHECK(hdr != NULL);
+	delete [] hdr;
+	CHECK(!c->GetKeepAlive());
+	CHECK(!c->WriteHttp(PTP::Net::HTTP_OK, NULL, NULL, NULL, 0));
+	hdr = client.ReadHttpHdr(NULL, -1, NULL, NULL, 5000);
+	CHECK(hdr && strstr(hdr, "Connection: close"));
+	delete [] hdr;
+	CHECK(!client.GetKeepAlive());
+
+	// chunked content keeps the connection open
+	client.Close();
+	delete c;
+	CHECK(!client.Open());
+	c = server.Accept();
+	CHECK(c != NULL);
+	if (!c)
+		return;
+
+	CHECK(!client.WriteHttp("PUT", "/d", NULL, NULL, NULL,
+				PTP::Net::Connection::CHUNKED));
+	CHECK(!client.WriteChunk((const BYTE*) "abc", 3));
+	CHECK(!client.WriteChunk((const BYTE*) "defghijklmnopqrstuvwxyz", 23));
+	CHECK(!client.WriteChunk(NULL, 0));
+	CHECK(!client.WriteHttp("GET", "/e", NULL, NULL, NULL, 0));
+
+	data = c->ReadHttp(NULL, -1, NULL, &size, 5000);
+	CHECK(data && size == 26
+	      && !memcmp(data, "abcdefghijklmnopqrstuvwxyz", 26));
+	delete [] data;
+	CHECK(c->GetKeepAlive());
+	hdr = c->ReadHttpHdr(NULL, -1, NULL, &size, 5000);
+	CHECK(hdr && !strncmp(hdr, "GET /e ", 7) && size == 0);
+	delete [] hdr;
+
+	CHECK(!c->WriteHttp(PTP::Net::HTTP_OK, NULL, NULL, NULL,
+			    PTP::Net::Connection::CHUNKED));
+	CHECK(!c->WriteChunk((const BYTE*) "xyz", 3));
+	CHECK(!c->WriteChunk(NULL, 0));
+	hdr = client.ReadHttpHdr(NULL, -1, NULL, &size, 5000);
+	CHECK(hdr && size == -1);
+	delete [] hdr;
+	BYTE buffer[2];
+	CHECK(client.ReadContent(buffer, sizeof(buffer), 5000) == 2);
+	CHECK(client.ReadContent(buffer, sizeof(buffer), 5000) == 1
+	      && buffer[0] == 'z');
+	CHECK(client.ReadContent(buffer, sizeof(buffer), 5000) == 0);
+	CHECK(client.GetKeepAlive());
+
+	// malformed and oversized chunk sizes fail instead of ending content
+	const char *bad[] = {"0zz\r\n", "x\r\n", "80000000\r\n",
+			     "100000000000000000\r\n"};
+	for (int i = 0; i < (int) (sizeof(bad) / sizeof(bad[0])); i++)
+	{
+		client.Close();
+		delete c;
+		CHECK(!client.Open());
+		c = server.Accept();
+		CHECK(c != NULL);
+		if (!c)
+			return;
+
+		CHECK(!c->WriteHttp(PTP::Net::HTTP_OK, NULL, NULL, NULL,
+				    PTP::Net::Connection::CHUNKED));
+		int n = strlen(bad[i]);
+		CHECK(c->WriteAll((const BYTE*) bad[i], n) == n);
+		hdr = client.ReadHttpHdr(NULL, -1, NULL, &size, 5000);
+		CHECK(hdr && size == -1);
+		delete [] hdr;
+		CHECK(client.ReadContent(buffer, sizeof(buffer), 5000) == -1);
+		CHECK(!client.GetKeepAlive());
+	}
+
+	// a huge content length is refused before anything is allocated
+	client.Close();
+	delete c;
+	CHECK(!client.Open());
+	c = server.Accept();
+	CHECK(c != NULL);
+	if (!c)
+		return;
+	const char huge[] = "HTTP/1.1 200 OK\r\n"
+			    "Content-Length: 2000000000\r\n\r\n";
+	CHECK(c->WriteAll((const BYTE*) huge, sizeof(huge) - 1)
+	      == sizeof(huge) - 1);
+	CHECK(client.ReadHttp(NULL, -1, NULL, &size, 5000) == NULL);
+	CHECK(!client.GetKeepAlive());
+
+	delete c;
+}
+
+static void
+TestConnectionPool()
+{
+	PTP::Net::Connection server(PTP::Net::Connection::RAW, 0);
+	CHECK(!server.Open());
+	PTP::Net::ConnectionPool pool(2, 60);
+
+	PTP::Net::Connection *c[3];
+	PTP::Net::Connection *s[3];
+	for (int i = 0; i < 3; i++)
+	{
+		c[i] = pool.Get(PTP::Net::Connection::RAW,
+				PTP::Net::LOOPBACK,
+				server.GetPort());
+		CHECK(c[i] != NULL);
+		s[i] = server.Accept();
+		CHECK(s[i] != NULL);
+	}
+	if (!c[0] || !c[1] || !c[2] || !s[0] || !s[1] || !s[2])
+		return;
+
+	// only two idle connections are kept for a peer
+	for (int i = 0; i < 3; i++)
+		pool.Put(c[i]);
+	CHECK(pool.GetIdle() == 2);
+
+	// the most recently used connection is reused first
+	PTP::Net::Connection *conn = pool.Get(PTP::Net::Connection::RAW,
+					      PTP::Net::LOOPBACK,
+					      server.GetPort());
+	CHECK(conn == c[2]);
+
+	// unread data makes a connection unusable
+	const BYTE *data = NULL;
+	CHECK(s[2]->WriteAll((const BYTE*) "x", 1) == 1);
+	CHECK(conn->Peek(&data, 1, 5000) == 1);
+	pool.Put(conn);
+	CHECK(pool.GetIdle() == 1);
+
+	conn = pool.Get(PTP::Net::Connection::RAW,
+			PTP::Net::LOOPBACK,
+			server.GetPort());
+	CHECK(conn == c[1]);
+	conn->SetKeepAlive(0);
+	pool.Put(conn);
+	CHECK(pool.GetIdle() == 0);
+
+	for (int i = 0; i < 3; i++)
+		delete s[i];
+}
+
+static void
+TestOptions()
+{
+	PTP::Net::Connection server(PTP::Net::Connection::HTTP, 0);
+	CHECK(!server.SetOptions(PTP::Net::Connection::LATENCY));
+	CHECK(!server.Open());
+	PTP::Net::Connection client(PTP::Net::Connection::HTTP,
+				    PTP::Net::LOOPBACK,
+				    server.GetPort());
+	CHECK(!client.SetOptions(PTP::Net::Connection::BULK));
+	CHECK(!client.Open());
+	CHECK(client.GetOptions() == PTP::Net::Connection::BULK);
+	PTP::Net::Connection *c = server.Accept();
+	CHECK(c && c->GetOptions() == PTP::Net::Connection::LATENCY);
+	if (!c)
+		return;
+	CHECK(!c->SetOptions(PTP::Net::Connection::LATENCY
+			     | PTP::Net::Connection::BULK));
+
+	// the header and content are written together
+	static BYTE data[100000];
+	for (int i = 0; i < (int) sizeof(data); i++)
+		data[i] = (BYTE) (i * 13);
+	CHECK(!client.WriteHttp("PUT", "/f", NULL, data, NULL, sizeof(data)));
+	int size = 0;
+	BYTE *d = c->ReadHttp(NULL, -1, NULL, &size, 5000);
+	CHECK(d && size == sizeof(data) && !memcmp(d, data, size));
+	delete [] d;
+
+	delete c;
+}
+
+static void
+TestAccept()
+{
+	PTP::Net::Connection server(PTP::Net::Connection::RAW, 0);
+	server.SetOptions(PTP::Net::Connection::REUSE_PORT);
+	server.SetBacklog(32);
+	CHECK(server.GetBacklog() == 32);
+	CHECK(!server.Open());
+
+	// a second socket can listen on the same port
+	PTP::Net::Connection server2(PTP::Net::Connection::RAW, 0);
+	server2.SetOptions(PTP::Net::Connection::REUSE_PORT);
+	CHECK(!server2.SetPortRange(server.GetPort(), server.GetPort()));
+	CHECK(!server2.Open());
+	CHECK(server2.GetPort() == server.GetPort());
+	server2.Close();
+
+	// but a server looking for a free port passes it by
+	PTP::Net::Connection server3(PTP::Net::Connection::RAW,
+				     server.GetPort());
+	server3.SetOptions(PTP::Net::Connection::REUSE_PORT);
+	CHECK(!server3.Open());
+	CHECK(server3.GetPort() != server.GetPort());
+	server3.Close();
+
+	PTP::Net::Connection *clients[3];
+	int i;
+	for (i = 0; i < 3; i++)
+	{
+		clients[i] = new PTP::Net::Connection(PTP::Net::Connection::RAW,
+						      PTP::Net::LOOPBACK,
+						      server.GetPort());
+		CHECK(!clients[i]->Open());
+	}
+
+	// pending connections are taken together
+	PTP::Net::Connection *conns[8];
+	CHECK(server.Accept(conns, 8) == 3);
+	for (i = 0; i < 3; i++)
+		delete conns[i];
+
+	server.SetBlocking(0);
+	CHECK(server.Accept(conns, 8) == 0);
+
+	for (i = 0; i < 3; i++)
+		delete clients[i];
+}
+
+static void
+TestPortRange()
+{
+	PTP::Net::Connection server(PTP::Net::Connection::RAW, 0);
+	CHECK(!server.Open());
+	PTP::Net::Port port = server.GetPort();
+
+	// a fixed port fails at once if it is in use
+	PTP::Net::Connection server2(PTP::Net::Connection::RAW, 0);
+	CHECK(!server2.SetPortRange(port, port));
+	CHECK(server2.Open() < 0);
+
+	PTP::Net::Connection server3(PTP::Net::Connection::RAW, 0);
+	CHECK(!server3.SetPortRange(port, port + 20));
+	CHECK(!server3.Open());
+	CHECK(server3.GetPort() > port && server3.GetPort() <= port + 20);
+	CHECK(server3.SetPortRange(port, port) < 0);
+
+	PTP::Net::Connection client(PTP::Net::Connection::RAW,
+				    PTP::Net::LOOPBACK,
+				    port);
+	CHECK(client.SetPortRange(port, port) < 0);
+}
+
+static void
+TestProxyRoute()
+{
+	PTP::Net::Connection proxy(PTP::Net::Connection::RAW, 0);
+	CHECK(!proxy.Open());
+	proxy.SetBlocking(0);
+
+	// find a port nothing listens on
+	PTP::Net::Connection dest(PTP::Net::Connection::RAW, 0);
+	CHECK(!dest.Open());
+	PTP::Net::Port port = dest.GetPort();
+	dest.Close();
+
+	PTP::Net::Connection::SetProxy(PTP::Net::LOOPBACK,
+				       proxy.GetPort(),
+				       1000);
+	PTP::Net::Connection c1(PTP::Net::Connection::RAW,
+				PTP::Net::LOOPBACK,
+				port);
+	CHECK(!c1.Open());
+	PTP::Net::Connection *c = proxy.Accept();
+	CHECK(c != NULL);
+	delete c;
+
+	// later connections go straight to the proxy
+	CHECK(!dest.SetPortRange(port, port));
+	CHECK(!dest.Open());
+	dest.SetBlocking(0);
+	PTP::Net::Connection c2(PTP::Net::Connection::RAW,
+				PTP::Net::LOOPBACK,
+				port);
+	CHECK(!c2.Open());
+	c = proxy.Accept();
+	CHECK(c != NULL);
+	delete c;
+	c = dest.Accept();
+	CHECK(c == NULL);
+	delete c;
+
+	// unreachable destinations fail at once
+	PTP::Net::Connection::SetProxy(PTP::Net::LOOPBACK, port, 1000);
+	dest.Close();
+	PTP::Net::Connection c3(PTP::Net::Connection::RAW,
+				PTP::Net::LOOPBACK,
+				port);
+	CHECK(c3.Open() < 0);
+	CHECK(!dest.Open());
+	CHECK(c3.Open() < 0);
+
+	PTP::Net::Connection::SetProxy(0, 0, 0);
+	CHECK(!c3.Open());
+}
+
+static void
+ResolverCallback(const char *name, PTP::Net::Ip ip, void *context)
+{
+	*(PTP::Net::Ip*) context = ip;
+}
+
+static void
+TestResolver()
+{
+	PTP::Net::Resolver resolver;
+	CHECK(resolver.Lookup("127.0.0.1") == PTP::Net::LOOPBACK);
+	CHECK(resolver.GetCached() == 1);
+	CHECK(resolver.Lookup("127.0.0.1") == PTP::Net::LOOPBACK);
+	CHECK(resolver.GetCached() == 1);
+
+	// failed lookups are cached too
+	CHECK(resolver.Lookup("") == PTP::Net::INVALID);
+	CHECK(resolver.GetCached() == 2);
+
+	PTP::ThreadPool pool(2);
+	PTP::Net::Ip ip = PTP::Net::INVALID;
+	CHECK(!resolver.Lookup("127.0.0.2", ResolverCallback, &ip, &pool));
+	pool.Wait();
+	CHECK(ip == PTP::Net::LOOPBACK + 1);
+	CHECK(resolver.GetCached() == 3);
+
+	// cached names complete immediately
+	ip = PTP::Net::INVALID;
+	CHECK(!resolver.Lookup("127.0.0.2", ResolverCallback, &ip, NULL));
+	CHECK(ip == PTP::Net::LOOPBACK + 1);
+
+	resolver.Clear();
+	CHECK(resolver.GetCached() == 0);
+
+	PTP::Net::Port port = 0;
+	CHECK(PTP::Net::Lookup("http://127.0.0.1:81/x", &port)
+	      == PTP::Net::LOOPBACK);
+	CHECK(port == 81);
+}
+
+struct ReactorContext
+{
+	PTP::Net::Reactor *reactor;
+	PTP::Net::Connection *client;
+	int echoed;
+	int closed;
+};
+
+static void
+ReactorEcho(PTP::Net::Reactor::Handler *h, int events, void *context)
+{
+	ReactorContext *ctx = (ReactorContext*) context;
+	BYTE data[64];
+	int size = h->GetConnection()->Read(data, sizeof(data));
+	if (size > 0)
+	{
+		h->GetConnection()->WriteAll(data, size);
+		ctx->echoed += size;
+	}
+	else if (size != PTP::Net::Connection::AGAIN)
+	{
+		ctx->reactor->Remove(h);
+		ctx->closed = 1;
+	}
+}
+
+static void
+ReactorAccept(PTP::Net::Reactor::Handler *h, int events, void *context)
+{
+	ReactorContext *ctx = (ReactorContext*) context;
+	PTP::Net::Connection *c = h->GetConnection()->Accept();
+	if (c)
+	{
+		ctx->client = c;
+		ctx->reactor->Add(c, PTP::Net::Reactor::READ, ReactorEcho, ctx);
+	}
+}
+
+static void
+TestReactor()
+{
+	PTP::Net::Reactor reactor(2);
+	ReactorContext ctx;
+	ctx.reactor = &reactor;
+	ctx.client = NULL;
+	ctx.echoed = 0;
+	ctx.closed = 0;
+
+	PTP::Net::Connection server(PTP::Net::Connection::RAW, 0);
+	CHECK(!server.SetBlocking(0));
+	CHECK(!server.Open());
+	CHECK(server.Accept() == NULL);
+	CHECK(reactor.Add(&server,
+			  PTP::Net::Reactor::READ,
+			  ReactorAccept,
+			  &ctx) != NULL);
+	CHECK(!reactor.Start());
+
+	PTP::Net::Connection *c = new PTP::Net::Connection(
+		PTP::Net::Connection::RAW,
+		PTP::Net::LOOPBACK,
+		server.GetPort());
+	BYTE data[5];
+	CHECK(c->WriteAll((const BYTE*) "hello", 5) == 5);
+	CHECK(c->ReadAll(data, sizeof(data), 5000) == 5);
+	CHECK(!memcmp(data, "hello", 5));
+	delete c;
+
+	for (int i = 0; i < 5 && !ctx.closed; i++)
+		PTP::Thread::Sleep(1);
+	CHECK(ctx.closed);
+	CHECK(ctx.echoed == 5);
+
+	reactor.Stop();
+	delete ctx.client;
+}
+
+struct SecureContext
+{
+	PTP::Net::Connection *server;
+	PTP::Store *store;
+	PTP::SecureConnection::Cache *cache;
+	int accepted;
+	int resumed;
+	int closed;
+};
+
+static void *
+SecureServer(void *context)
+{
+	SecureContext *ctx = (SecureContext*) context;
+	PTP::Net::Connection *c = ctx->server->Accept();
+	if (!c)
+		return NULL;
+
+	PTP::SecureConnection secure(c, ctx->store, ctx->cache);
+	if (!secure.Accept(5000))
+	{
+		ctx->accepted++;
+		ctx->resumed = secure.IsResumed();
+
+		// echo data until the client closes
+		BYTE data[1000];
+		int size;
+		while ((size = secure.Read(data, sizeof(data), 5000)) > 0)
+			secure.Write(data, size);
+		ctx->closed = (size == 0);
+	}
+	delete c;
+	return NULL;
+}
+
+static void
+TestSecureConnection()
+{
+	PTP::Identity serverId("Server");
+	PTP::Identity clientId("Client");
+	PTP::Store serverStore;
+	serverStore.Insert(&serverId, 1, NULL, NULL, 0);
+	serverStore.Insert(&clientId, 0, NULL, NULL, 0);
+	PTP::Store clientStore;
+	clientStore.Insert(&clientId, 1, NULL, NULL, 0);
+	clientStore.Insert(&serverId, 0, NULL, NULL, 0);
+	PTP::SecureConnection::Cache serverCache;
+	PTP::SecureConnection::Cache clientCache;
+
+	PTP::Net::Connection server(PTP::Net::Connection::RAW, 0);
+	CHECK(!server.Open());
+	SecureContext ctx;
+	ctx.server = &server;
+	ctx.store = &serverStore;
+	ctx.cache = &serverCache;
+	ctx.accepted = 0;
+
+	// full handshake, then a resumed session
+	for (int i = 0; i < 2; i++)
+	{
+		PTP::Thread thread;
+		CHECK(!thread.Start(SecureServer, &ctx));
+		PTP::Net::Connection conn(PTP::Net::Connection::RAW,
+					  PTP::Net::LOOPBACK,
+					  server.GetPort());
+		PTP::SecureConnection secure(&conn, &clientStore, &clientCache);
+		CHECK(!secure.Connect(5000));
+		CHECK(secure.IsResumed() == i);
+		CHECK(secure.GetPeer()
+		      && !strcmp(secure.GetPeer()->GetName(), "Server"));
+
+		// more than one record each way
+		static BYTE data[PTP::SecureConnection::MAX_RECORD + 100];
+		static BYTE echo[sizeof(data)];
+		PTP::Random::Fill(data, sizeof(data));
+		CHECK(secure.Write(data, sizeof(data)) == sizeof(data));
+		int size = 0;
+		while (size < (int) sizeof(echo))
+		{
+			int s = secure.Read(echo + size, sizeof(echo) - size, 5000);
+			if (s <= 0)
+				break;
+			size += s;
+		}
+		CHECK(size == sizeof(data) && !memcmp(data, echo, size));
+		secure.Close();
+		thread.Wait();
+		CHECK(ctx.accepted == i + 1);
+		CHECK(ctx.resumed == i);
+		CHECK(ctx.closed);
+	}
+	CHECK(clientCache.GetCached() == 1);
+	CHECK(serverCache.GetCached() == 1);
+
+	// untrusted clients are rejected
+	PTP::Identity otherId("Other");
+	PTP::Store otherStore;
+	otherStore.Insert(&otherId, 1, NULL, NULL, 0);
+	otherStore.Insert(&serverId, 0, NULL, NULL, 0);
+	PTP::Thread thread;
+	CHECK(!thread.Start(SecureServer, &ctx));
+	PTP::Net::Connection conn(PTP::Net::Connection::RAW,
+				  PTP::Net::LOOPBACK,
+				  server.GetPort());
+	PTP::SecureConnection secure(&conn, &otherStore);
+	CHECK(secure.Connect(5000) == -1);
+	CHECK(!secure.GetPeer());
+	CHECK(secure.Write((const BYTE*) "x", 1) == -1);
+	thread.Wait();
+	CHECK(ctx.accepted == 2);
+}
+
 int
 main(int argc, char **argv)
 {
 	TestIdentity();
+	TestIdentityThreads();
+	TestIdentityAsync();
+	TestIdentityEd25519();
+	TestIdentityReserve();
 	TestStore();
 	TestAuth();
 	TestKey();
+	TestChaCha();
+	TestEd25519();
 
 	TestThread();
 	TestMutex();
 	TestList();
+	TestThreadPool();
+	TestChunked();
+	TestReactor();
+	TestSendFile();
+	TestBuffer();
+	TestHttp();
+	TestConnectionPool();
+	TestResolver();
+	TestOptions();
+	TestAccept();
+	TestPortRange();
+	TestProxyRoute();
+	TestSecureConnection();
 
 	return 0;
 }
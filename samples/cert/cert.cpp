@@ -103,12 +103,12 @@ Load(const char *path, const char *passwd)
  * Returns: 0 on success or -1 on error.
  */
 static int
-Save(PTP::Identity *ident, const char *path, const char *passwd)
+Save(PTP::Identity *ident, int exportkey, const char *path, const char *passwd)
 {
 	if (!ident)
 		return -1;
 	PTP::Store store(path, passwd, passwd);
-	store.Insert(ident, 0);
+	store.Insert(ident, exportkey);
 	if (store.Save())
 		Error("Cannot save `%s'.\n", path);
 	return 0;
@@ -544,6 +544,8 @@ main(int argc, char **argv)
 	else
 	{
 		const char *passwd = NULL;
+		PTP::Identity::KeyType type = PTP::Identity::RSA_KEY;
+		int reserved = 0;
 		for (char **arg = argv + 1; arg < (argv + argc); arg++)
 		{
 			int remain = argc - (arg - argv) - 1;
@@ -575,7 +577,7 @@ main(int argc, char **argv)
 
 				PTP::Identity *ident = Find(&store, name);
 				if (ident)
-					Save(ident, path, passwd);
+					Save(ident, 0, path, passwd);
 			}
 			else if (strcmp(*arg, "--sign") == 0 && remain >= 2)
 			{
@@ -589,7 +591,7 @@ main(int argc, char **argv)
 
 				PTP::Identity *ident = Load(path, NULL);
 				if (ident && Sign(&store, ident, expire) == 0)
-					Save(ident, path, passwd);
+					Save(ident, 0, path, passwd);
 				delete ident;
 			}
 			else if (strcmp(*arg, "--remove") == 0 && remain >= 1)
@@ -603,7 +605,8 @@ main(int argc, char **argv)
 				arg++;
 				const char *name = **arg ? *arg:NULL;
 
-				PTP::Identity *ident = new PTP::Identity(name);
+				PTP::Identity *ident
+					= new PTP::Identity(name, type);
 				if (!ident)
 					Error("Cannot create `%s'.\n");
 				else
@@ -614,6 +617,38 @@ main(int argc, char **argv)
 				}
 				delete ident;
 			}
+			else if (strcmp(*arg, "--create") == 0 && remain >= 2)
+			{
+				// generate all remaining keys in parallel
+				if (!reserved && type == PTP::Identity::RSA_KEY)
+				{
+					int count = 0;
+					for (int i = 0; i <= remain; i++)
+					{
+						if (!strcmp(arg[i], "--create"))
+							count++;
+					}
+					if (count > 1)
+					{
+						PTP::Identity::ReserveKeys(
+							count, count);
+					}
+					reserved = 1;
+				}
+
+				arg++;
+				const char *name = **arg ? *arg:NULL;
+				arg++;
+				const char *path = *arg;
+
+				PTP::Identity *ident
+					= PTP::Identity::Create(name, type);
+				if (!ident)
+					Error("Cannot create `%s'.\n", name);
+				else
+					Save(ident, 1, path, passwd);
+				delete ident;
+			}
 			else if (strcmp(*arg, "--load") == 0 && remain >= 1)
 			{
 				arg++;
@@ -659,6 +694,16 @@ main(int argc, char **argv)
 				arg++;
 				passwd = (*arg && **arg) ? *arg:NULL;
 			}
+			else if (strcmp(*arg, "--keytype") == 0 && remain >= 1)
+			{
+				arg++;
+				if (strcmp(*arg, "rsa") == 0)
+					type = PTP::Identity::RSA_KEY;
+				else if (strcmp(*arg, "ed25519") == 0)
+					type = PTP::Identity::ED25519_KEY;
+				else
+					Error("Invalid key type `%s'.\n", *arg);
+			}
 			else if (**arg != '-')
 			{
 				const char *path = *arg;
@@ -685,12 +730,16 @@ main(int argc, char **argv)
 				      "Remove a certificate.\n"
 				      "  --setup NAME         "
 				      "Setup the local certificate.\n"
+				      "  --create NAME FILE   "
+				      "Create a certificate and key.\n"
 				      "  --load FILE          "
 				      "Load the entire store.\n"
 				      "  --save FILE          "
 				      "Save the entire store.\n"
 				      "  --passwd PASSWD      "
-				      "Set import/export password.\n",
+				      "Set import/export password.\n"
+				      "  --keytype TYPE       "
+				      "Set created key type (rsa, ed25519).\n",
 				      prog);
 				break;
 			}
@@ -8,6 +8,7 @@
 
 $EXPIRE = 30;
 $ISSUER = "Trusted CA";
+$KEYTYPE = "rsa";
 
 while ($ARGV[0] =~ m/^-/)
 {
@@ -21,6 +22,11 @@ while ($ARGV[0] =~ m/^-/)
 	shift(@ARGV);
 	$ISSUER = shift(@ARGV);
     }
+    elsif ($ARGV[0] eq "-k" || $ARGV[0] eq "--keytype")
+    {
+	shift(@ARGV);
+	$KEYTYPE = shift(@ARGV);
+    }
     else
     {
 	last;
@@ -32,23 +38,30 @@ if (!@ARGV)
     print "Usage: $ME [OPTIONS] NAME ...\n";
     print "  -e,--expire DAYS  Set expiration time\n";
     print "  -i,--issuer NAME  Set certificate issuer name\n";
+    print "  -k,--keytype TYPE Set key type (rsa or ed25519)\n";
     exit(1);
 }
 
 @name = ();
 $i = 0;
+$create = "";
 foreach (@ARGV)
 {
     $name[$i] = $_;
     print "$ME: creating ``$name[$i]'' (user${i}.pfx)\n";
-    system("./cert --setup \"$name[$i]\"");
-    system("./cert --export \"$name[$i]\" ${i}.pfx");
-    system("./cert --save user${i}.pfx");
+    $create .= " --create \"$name[$i]\" user${i}.pfx";
     $i++;
 }
 
-system("./cert --setup \"$ISSUER\"");
-system("./cert --export \"$ISSUER\" issuer.pfx");
+# create all keys in one run so that they are generated in parallel
+system("./cert --keytype $KEYTYPE$create --create \"$ISSUER\" issuer-key.pfx");
+
+for ($i = 0; $i <= $#name; $i++)
+{
+    system("./cert --load user${i}.pfx --export \"$name[$i]\" ${i}.pfx");
+}
+
+system("./cert --load issuer-key.pfx --export \"$ISSUER\" issuer.pfx");
 
 for ($i = 0; $i <= $#name; $i++)
 {
@@ -68,7 +81,7 @@ for ($i = 0; $i <= $#name; $i++)
     system("./cert --save user${i}.pfx");
 }
 
-unlink("issuer.pfx");
+unlink("issuer.pfx", "issuer-key.pfx");
 for ($i = 0; $i <= $#name; $i++)
 {
     unlink("${i}.pfx");
@@ -45,14 +45,19 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <time.h>
 #include <ptp/ptp.h>
 #include <ptp/id.h>
 #include <ptp/auth.h>
 #include <ptp/store.h>
 #include <ptp/collect.h>
 #include <ptp/net.h>
+#include <ptp/connpool.h>
 #include <ptp/key.h>
 #include <ptp/rand.h>
+#include <ptp/pool.h>
+#include <ptp/reactor.h>
+#include <ptp/thread.h>
 #include <ptp/debug.h>
 
 // Uncomment to build for performance testing
@@ -62,12 +67,24 @@ const char *prog = NULL;
 
 #define STRLEN_CONST(x) (sizeof(x) - 1)
 #define STRNCMP_CONST(x, y) strncmp((x), (y), sizeof(y) - 1)
+#define MATCH_CONST(x, size, y) \
+	((size) >= (int) sizeof(y) - 1 && STRNCMP_CONST((x), (y)) == 0)
 
 #define SFS_DEFAULT_PORT 8080
 #define SFS_READ_SIZE 8192
+#define SFS_IDLE_TIMEOUT (30 * 1000)
+#define SFS_IO_TIMEOUT (30 * 1000)
+#define SFS_REQUEST_PEEK 64
+#define SFS_IO_THREADS 64
+#define SFS_LISTEN_BACKLOG 256
+#define SFS_MAX_ACCEPTORS 16
+#define SFS_ACCEPT_BATCH 16
 
 #define SFS_FLAGS_ROLL 0x1
 #define SFS_FLAGS_PLAINTEXT_XFER 0x2
+#define SFS_FLAGS_CHACHA 0x4
+#define SFS_FLAGS_CHUNKED 0x8
+#define SFS_FLAGS_OFFERED (SFS_FLAGS_CHACHA | SFS_FLAGS_CHUNKED)
 
 #define SFS_AUTH_URL "/auth"
 #define SFS_RESP_URL "/resp"
@@ -80,7 +97,11 @@ const char *prog = NULL;
  *   HTTP PUT /auth | CERT
  *   HTTP OK | CHAL | CERT
  *   HTTP PUT /resp | RESP | CHAL | ENVELOPE(FLAGS)
- *   HTTP OK | RESP | ENVELOPE(KEYID | SHADOW | KEY)
+ *   HTTP OK | RESP | ENVELOPE(KEYID | SHADOW | KEY [| FLAGS])
+ *
+ * Clients offer SFS_FLAGS_CHACHA and SFS_FLAGS_CHUNKED, and servers
+ * accept either by appending FLAGS to the key envelope.  Otherwise
+ * the session cipher and a single encrypted stream are used.
  *
  * Search:
  *   HTTP PUT /search | KEYID | E(DATA)
@@ -89,6 +110,17 @@ const char *prog = NULL;
  * Get:
  *   HTTP GET /KEYID/FILEID
  *   HTTP OK | E(DATA)
+ *
+ * With SFS_FLAGS_CHUNKED, E(DATA) for a get is encrypted in chunks by
+ * all processors (see PTP::Key::EncryptChunked).
+ *
+ * Resume:
+ *   HTTP GET /KEYID/FILEID | Range: bytes=OFFSET-
+ *   HTTP PARTIAL CONTENT | Content-Range: bytes OFFSET-END/SIZE | E(DATA)
+ *
+ * Servers only send part of a file with SFS_FLAGS_CHUNKED (see
+ * PTP::Key::EncryptRange) or SFS_FLAGS_PLAINTEXT_XFER, and otherwise
+ * send the whole file.
  */
 
 struct Key:public PTP::List::Entry
@@ -100,13 +132,22 @@ struct Key:public PTP::List::Entry
 		BYTE key[PTP::Key::KEY_SIZE];
 	};
 
-	BYTE id[PTP::Identity::KEY_SIZE];
+	// one key exchange, replaced (not changed) by the next so that
+	// transfers still using it are not affected
+	struct Session
+	{
+		unsigned long keyid;
+		unsigned long shadow;
+		int flags;
+		Shared shared;
+		PTP::Key cipher;	// set up with shared.key
+		int refs;		// guarded by the key list lock
+	};
+
+	BYTE id[PTP::Identity::FINGERPRINT_SIZE];
 	PTP::Net::Ip ip;
 	PTP::Net::Port port;
-	unsigned long keyid;
-	unsigned long shadow;
-	int flags;
-	Shared shared;
+	Session *session;
 };
 
 struct Response:public PTP::List::Entry
@@ -116,13 +157,52 @@ struct Response:public PTP::List::Entry
 	char *url;
 };
 
+struct ShareContext
+{
+	ShareContext(PTP::Store *st, PTP::List *k, PTP::Collection *c)
+		:store(st), auth(st), keys(k), collect(c) {}
+
+	PTP::Store *store;
+	PTP::Authenticator auth;
+	PTP::List *keys;
+	PTP::Net::Ip localIp;
+	PTP::Net::Port localPort;
+	PTP::Collection *collect;
+	PTP::ThreadPool *pool;
+	PTP::ThreadPool *ioPool;
+	PTP::Net::Reactor reactor;	// idle keep-alive clients
+	PTP::List clients;
+};
+
+struct ClientContext:public PTP::List::Entry
+{
+	ClientContext(ShareContext *sh, PTP::Net::Connection *conn)
+		:share(sh), c(conn), handler(NULL),
+		 idle(time(NULL)), busy(0), stop(0) {}
+
+	ShareContext *share;
+	PTP::Net::Connection *c;
+	PTP::Net::Reactor::Handler *handler;
+	PTP::Mutex mutex;
+	time_t idle;		// waiting for the next request since
+	int busy;		// handling a request on the I/O pool
+	int stop;		// closed once no longer busy
+};
+
+struct AcceptContext
+{
+	ShareContext *share;
+	PTP::Net::Connection *serv;
+};
+
 struct TransferContext
 {
 	TransferContext(PTP::Net::Connection *conn, FILE *filep)
-		:c(conn), fp(filep) {}
+		:c(conn), fp(filep), remain(-1) {}
 
 	PTP::Net::Connection *c;
 	FILE *fp;
+	int remain;
 };
 
 
@@ -132,9 +212,9 @@ FindKey(PTP::List *keys,
 	PTP::Net::Ip ip,
 	PTP::Net::Port port)
 {
-	BYTE id[PTP::Identity::KEY_SIZE];
+	BYTE id[PTP::Identity::FINGERPRINT_SIZE];
 	if (ident)
-		ident->GetKey(id);
+		ident->GetFingerprint(id);
 
 	Key *key = NULL;
 	keys->Lock();
@@ -149,37 +229,104 @@ FindKey(PTP::List *keys,
 	return key;
 }
 
-static Key *
+static Key::Session *
+CreateSession(unsigned long keyid,
+	      unsigned long shadow,
+	      int flags,
+	      const Key::Shared *shared)
+{
+	Key::Session *session = new Key::Session;
+	session->keyid = keyid;
+	session->shadow = shadow;
+	session->flags = (flags & ~SFS_FLAGS_ROLL);
+	memcpy(&session->shared, shared, sizeof(session->shared));
+	session->cipher.Import(session->shared.key);
+	if (session->flags & SFS_FLAGS_CHACHA)
+		session->cipher.SetCipher(PTP::Key::CHACHA20_POLY1305);
+	else
+		session->cipher.SetCipher(PTP::Key::SESSION_CIPHER);
+	session->refs = 1;
+	return session;
+}
+
+static Key::Session *
+AcquireSession(PTP::List *keys, Key *key)
+{
+	keys->Lock();
+	Key::Session *session = key->session;
+	session->refs++;
+	keys->Unlock();
+	return session;
+}
+
+static void
+ReleaseSession(PTP::List *keys, Key::Session *session)
+{
+	keys->Lock();
+	int refs = --session->refs;
+	keys->Unlock();
+	if (!refs)
+		delete session;
+}
+
+static void
+SetSession(PTP::List *keys, Key *key, Key::Session *session)
+{
+	keys->Lock();
+	Key::Session *old = key->session;
+	key->session = session;
+	keys->Unlock();
+	if (old)
+		ReleaseSession(keys, old);
+}
+
+static Key::Session *
 CreateKey(PTP::List *keys, const PTP::Identity *id, PTP::Net::Ip ip, int flags)
 {
 	static unsigned long keyid = 0;
 
+	keys->Lock();
 	Key *key = FindKey(keys, id, ip, 0);
 	if (!key)
 	{
 		key = new Key;
-		id->GetKey(key->id);
+		id->GetFingerprint(key->id);
 		key->ip = ip;
 		key->port = 0;
-		key->keyid = 0;
+		key->session = NULL;
 		keys->Insert(key);
 		flags |= SFS_FLAGS_ROLL;
 	}
 
+	Key::Session *session = NULL;
 	if (flags & SFS_FLAGS_ROLL)
 	{
-		key->keyid = keyid++;
-		PTP::Net::Set32(key->shared.keyid, key->keyid);
-		PTP::Random::Fill((BYTE*) &key->shadow, sizeof(key->shadow));
-		PTP::Net::Set32(key->shared.shadow, key->shadow);
-		PTP::Random::Fill(key->shared.key, sizeof(key->shared.key));
+		Key::Shared shared;
+		unsigned long shadow = 0;
+		PTP::Net::Set32(shared.keyid, keyid);
+		PTP::Random::Fill((BYTE*) &shadow, sizeof(shadow));
+		PTP::Net::Set32(shared.shadow, shadow);
+		PTP::Random::Fill(shared.key, sizeof(shared.key));
 		unsigned long shadow2 = 0;
 		PTP::Random::Fill((BYTE*) &shadow2, sizeof(shadow2));
-		key->shadow ^= shadow2;
+		session = CreateSession(keyid++,
+					shadow ^ shadow2,
+					flags,
+					&shared);
+		memset(&shared, 0, sizeof(shared));
+	}
+	else
+	{
+		session = CreateSession(key->session->keyid,
+					key->session->shadow,
+					flags,
+					&key->session->shared);
 	}
-	key->flags = (flags & ~SFS_FLAGS_ROLL);
+	SetSession(keys, key, session);
+	session->refs++;
+	keys->Unlock();
 	
-	return key;
+	return session;
 }
 
 static Key *
@@ -190,40 +337,45 @@ ImportKey(PTP::List *keys,
 	  int flags,
 	  const Key::Shared *shared)
 {
+	// set up the new cipher before replacing the one in use
+	Key::Session *session = CreateSession(
+		PTP::Net::Get32(shared->keyid),
+		PTP::Net::Get32(shared->shadow),
+		flags,
+		shared);
+
+	keys->Lock();
 	Key *key = FindKey(keys, id, ip, port);
 	if (!key)
 	{
 		key = new Key;
-		id->GetKey(key->id);
+		id->GetFingerprint(key->id);
 		key->ip = ip;
 		key->port = port;
-		key->keyid = PTP::Net::Get32(shared->keyid);
-		key->shadow = PTP::Net::Get32(shared->shadow);
-		memcpy(&key->shared, shared, sizeof(key->shared));
+		key->session = NULL;
 		keys->Insert(key);
 	}
-	else
-	{
-		key->keyid = PTP::Net::Get32(shared->keyid);
-		key->shadow = PTP::Net::Get32(shared->shadow);
-		memcpy(&key->shared, shared, sizeof(key->shared));
-	}
-	key->flags = (flags & ~SFS_FLAGS_ROLL);
+	SetSession(keys, key, session);
+	keys->Unlock();
 	return key;
 }
 
-static Key *
-FindKey(PTP::List *keys, unsigned long keyid)
+static Key::Session *
+FindSession(PTP::List *keys, unsigned long keyid)
 {
 	Key *key = NULL;
+	Key::Session *session = NULL;
 	keys->Lock();
 	PTP_LIST_FOREACH(Key, key, keys)
 	{
-		if (key->keyid == keyid)
+		if (key->session->keyid == keyid)
+		{
+			session = AcquireSession(keys, key);
 			break;
+		}
 	}
 	keys->Unlock();
-	return key;
+	return session;
 }
 
 static void
@@ -234,6 +386,7 @@ DestroyKeys(PTP::List *keys)
 	PTP_LIST_FOREACH(Key, key, keys)
 	{
 		keys->Remove(key, 0);
+		ReleaseSession(keys, key->session);
 		delete key;
 	}
 	keys->Unlock();
@@ -326,7 +479,7 @@ DestroyResponses(PTP::List *resps)
 }
 
 static PTP::Net::Connection *
-Connect(const char *url)
+Connect(PTP::Net::ConnectionPool *conns, const char *url)
 {
 	PTP::Net::Port port;
 	PTP::Net::Ip ip = PTP::Net::Lookup(url, &port, SFS_DEFAULT_PORT);
@@ -336,14 +489,12 @@ Connect(const char *url)
 		return NULL;
 	}
 
+	// reuse an (already authenticated) connection to the host
 	PTP::Net::Connection *c
-		= new PTP::Net::Connection(PTP::Net::Connection::HTTP,
-					   ip,
-					   port);
-	if (c->Open())
+		= conns->Get(PTP::Net::Connection::HTTP, ip, port);
+	if (!c)
 	{
 		printf("%s: connection to `%s' failed.\n", prog, url);
-		delete c;
 		return NULL;
 	}
 
@@ -396,7 +547,6 @@ Auth(PTP::Store *store, PTP::List *keys, PTP::Net::Connection *c, int flags)
 	}
 
 	buffer = c->ReadHttp(NULL, -1, NULL, &size);
-	c->Close();
 	if (!buffer || size <= PTP::Authenticator::CHALLENGE_SIZE)
 	{
 		delete [] buffer;
@@ -417,7 +567,7 @@ Auth(PTP::Store *store, PTP::List *keys, PTP::Net::Connection *c, int flags)
 		return NULL;
 	}
 
-	BYTE fl = (BYTE) flags;
+	BYTE fl = (BYTE) (flags | SFS_FLAGS_OFFERED);
 	size = PTP::Store::ExportEnvelope(
 		&fl,
 		sizeof(fl),
@@ -453,23 +603,31 @@ Auth(PTP::Store *store, PTP::List *keys, PTP::Net::Connection *c, int flags)
 	}
 
 	buffer = c->ReadHttp(NULL, -1, NULL, &size);
-	c->Close();
-
-	if (!buffer
-	    || size <= PTP::Authenticator::RESPONSE_SIZE
-	    || auth.Verify(buffer) != remoteId
-	    || PTP::Store::ImportEnvelope(
-		    buffer + PTP::Authenticator::RESPONSE_SIZE,
-		    size - PTP::Authenticator::RESPONSE_SIZE,
-		    buffer,
-		    localId,
-		    remoteId) != sizeof(Key::Shared))
+	if (buffer
+	    && size > PTP::Authenticator::RESPONSE_SIZE
+	    && auth.Verify(buffer) == remoteId)
+	{
+		size = PTP::Store::ImportEnvelope(
+			buffer + PTP::Authenticator::RESPONSE_SIZE,
+			size - PTP::Authenticator::RESPONSE_SIZE,
+			buffer,
+			localId,
+			remoteId);
+	}
+	else
+		size = -1;
+	if (size != sizeof(Key::Shared) && size != sizeof(Key::Shared) + 1)
 	{
 		delete [] buffer;
 		delete remoteId;
 		return NULL;
 	}
 
+	// older servers send no flags
+	flags &= ~SFS_FLAGS_OFFERED;
+	if (size > (int) sizeof(Key::Shared))
+		flags |= (buffer[sizeof(Key::Shared)] & SFS_FLAGS_OFFERED);
+
 	key = ImportKey(keys,
 			remoteId,
 			c->GetIp(),
@@ -491,7 +649,7 @@ HandleAuth(PTP::Store *store,
 	   PTP::Net::Connection *c)
 {	
 	int size = 0;
-	BYTE *buffer = c->ReadHttp(NULL, -1, NULL, &size);
+	BYTE *buffer = c->ReadHttp(NULL, -1, NULL, &size, SFS_IO_TIMEOUT);
 	if (!buffer)
 		return -1;
 
@@ -501,10 +659,7 @@ HandleAuth(PTP::Store *store,
 		= PTP::Store::Import(buffer, size, NULL, NULL);
 	delete [] buffer;
 	if (!remoteId)
-	{
-		c->Close();
 		return -1;
-	}
 	
 	size = PTP::Authenticator::CHALLENGE_SIZE;
 	size += PTP::Store::Export(localId, 0, NULL, NULL, NULL);
@@ -520,7 +675,6 @@ HandleAuth(PTP::Store *store,
 	
 	int st = c->WriteHttp(PTP::Net::HTTP_OK, NULL, buffer, NULL, size);
 	delete [] buffer;
-	c->Close();
 
 	if (st)
 		return -1;
@@ -534,7 +688,7 @@ HandleResp(PTP::Store *store,
 	   PTP::Net::Connection *c)
 {	
 	int size = 0;
-	BYTE *buffer = c->ReadHttp(NULL, -1, NULL, &size);
+	BYTE *buffer = c->ReadHttp(NULL, -1, NULL, &size, SFS_IO_TIMEOUT);
 	if (!buffer)
 		return -1;
 
@@ -576,13 +730,22 @@ HandleResp(PTP::Store *store,
 	int flags = (int) fl;
 	delete [] buffer;
 	
-	Key *key = CreateKey(keys, remoteId, c->GetIp(), flags);
-	if (!key)
+	Key::Session *session = CreateKey(keys, remoteId, c->GetIp(), flags);
+	if (!session)
 		return -1;
-	
+
+	// accept the offered flags by appending them
+	BYTE shared[sizeof(Key::Shared) + 1];
+	memcpy(shared, &session->shared, sizeof(Key::Shared));
+	ReleaseSession(keys, session);
+	shared[sizeof(Key::Shared)] = (BYTE) (flags & SFS_FLAGS_OFFERED);
+	int ssize = sizeof(Key::Shared);
+	if (flags & SFS_FLAGS_OFFERED)
+		ssize++;
+
 	size = PTP::Store::ExportEnvelope(
-		(BYTE*) &key->shared,
-		sizeof(key->shared),
+		shared,
+		ssize,
 		NULL,
 		remoteId,
 		localId);
@@ -590,16 +753,16 @@ HandleResp(PTP::Store *store,
 	buffer = new BYTE[size];
 	auth->Respond(chal, buffer);
 	PTP::Store::ExportEnvelope(
-		(BYTE*) &key->shared,
-		sizeof(key->shared),
+		shared,
+		ssize,
 		buffer + PTP::Authenticator::RESPONSE_SIZE,
 		remoteId,
 		localId);
+	memset(shared, 0, sizeof(shared));
 	delete remoteId;
 
 	int st = c->WriteHttp(PTP::Net::HTTP_OK, NULL, buffer, NULL, size);
 	delete [] buffer;
-	c->Close();
 	
 	if (st)
 		return -1;
@@ -607,30 +770,39 @@ HandleResp(PTP::Store *store,
 }
 
 static int
-Search(PTP::Net::Connection *c, Key *key, const char *str, PTP::List *resps)
+Search(PTP::Net::Connection *c,
+       PTP::List *keys,
+       Key *key,
+       const char *str,
+       PTP::List *resps)
 {
 	DestroyResponses(resps);
 
-	PTP::Key k(key->shared.key);
+	Key::Session *session = AcquireSession(keys, key);
+	PTP::Key &k = session->cipher;
 	int size = k.Encrypt(NULL, strlen(str), NULL);
 	if (size <= 0)
+	{
+		ReleaseSession(keys, session);
 		return -1;
+	}
 	size += 4;
 
 	BYTE *buffer = new BYTE[size];
-	memcpy(buffer, key->shared.keyid, 4);
+	memcpy(buffer, session->shared.keyid, 4);
 	k.Encrypt((const BYTE*) str, strlen(str), buffer + 4);
 
 	int st = c->WriteHttp("PUT", SFS_SEARCH_URL, NULL, buffer, NULL, size);
 	delete [] buffer;
-	if (st)
-		return -1;
-
-	buffer = c->ReadHttp(NULL, -1, NULL, &size);
+	buffer = st ? NULL:c->ReadHttp(NULL, -1, NULL, &size);
 	if (!buffer)
+	{
+		ReleaseSession(keys, session);
 		return -1;
+	}
 
 	size = k.Decrypt(buffer, size, buffer);
+	ReleaseSession(keys, session);
 	if (size <= 0)
 	{
 		delete [] buffer;
@@ -659,22 +831,23 @@ HandleSearch(PTP::Collection *collect,
 	     PTP::Net::Connection *c)
 {	
 	int datasize;
-	BYTE *data = c->ReadHttp(NULL, -1, NULL, &datasize);
+	BYTE *data = c->ReadHttp(NULL, -1, NULL, &datasize, SFS_IO_TIMEOUT);
 	if (!data)
 		return -1;
 
 	unsigned long keyid = PTP::Net::Get32(data);
-	Key *key = FindKey(keys, keyid);
-	if (!key)
+	Key::Session *session = FindSession(keys, keyid);
+	if (!session)
 	{
 		delete [] data;
 		return -1;
 	}
 
-	PTP::Key k(key->shared.key);
+	PTP::Key &k = session->cipher;
 	int size = k.Decrypt(data + 4, datasize - 4, data);
 	if (size <= 0)
 	{
+		ReleaseSession(keys, session);
 		delete [] data;
 		return -1;
 	}
@@ -698,12 +871,13 @@ HandleSearch(PTP::Collection *collect,
 			     (localIp >> 8) & 0xff,
 			     localIp & 0xff,
 			     localPort,
-			     PTP::Net::Get32(key->shared.keyid),
-			     entry->GetId() ^ key->shadow,
+			     session->keyid,
+			     entry->GetId() ^ session->shadow,
 			     entry->GetName());
 	}
 	b += sprintf(b, "</HTML>\n");
 	size = k.Encrypt(buffer, strlen((char*) buffer), buffer);
+	ReleaseSession(keys, session);
 	delete [] data;
 	
 	if (c->WriteHttp(PTP::Net::HTTP_OK, NULL, buffer, NULL, size))
@@ -716,7 +890,16 @@ static int
 GetRead(BYTE *buffer, int size, void *context)
 {
 	TransferContext *ctx = (TransferContext*) context;
-	return ctx->c->Read(buffer, size);
+
+	// stop at the end of the content, since the connection stays open
+	if (ctx->remain >= 0 && size > ctx->remain)
+		size = ctx->remain;
+	if (!size)
+		return 0;
+	size = ctx->c->Read(buffer, size);
+	if (size > 0 && ctx->remain >= 0)
+		ctx->remain -= size;
+	return size;
 }
 
 static int
@@ -728,47 +911,98 @@ GetWrite(const BYTE *buffer, int size, void *context)
 
 static int
 Get(PTP::Net::Connection *c,
+    PTP::List *keys,
     Key *key,
     const char *url,
     const char *path,
-    int *total)
+    int *total,
+    PTP::ThreadPool *pool,
+    int resume)
 {
 	if (STRNCMP_CONST(url, "http://") == 0)
 		url = strchr(url + 7, '/');
 	else
 		url = strchr(url, '/');
 
-	if (c->WriteHttp("GET", url, NULL, NULL, NULL, 0))
+	// ask for the rest of a partial file
+	int offset = 0;
+	char range[64] = "";
+	FILE *fp = resume ? fopen(path, "rb"):NULL;
+	if (fp)
+	{
+		if (fseek(fp, 0, SEEK_END) == 0 && ftell(fp) > 0)
+		{
+			offset = (int) ftell(fp);
+			sprintf(range, "Range: bytes=%d-\r\n", offset);
+		}
+		fclose(fp);
+	}
+
+	if (c->WriteHttp("GET", url, range, NULL, NULL, 0))
 		return -1;
 
 	int status;
-	char *hdr = c->ReadHttpHdr(NULL, -1, &status, NULL);
+	int contentsize;
+	char *hdr = c->ReadHttpHdr(NULL, -1, &status, &contentsize);
+	if (!hdr)
+		return -1;
+
+	// a partial response must start where the file ends
+	if (status == PTP::Net::HTTP_PARTIAL_CONTENT && offset > 0)
+	{
+		const char *value = strstr(hdr, "\r\nContent-Range: ");
+		int start = -1;
+		if (value)
+			sscanf(value + 2, "Content-Range: bytes %d", &start);
+		if (start != offset)
+			status = 0;
+	}
+	else if (status == PTP::Net::HTTP_OK)
+		offset = 0;
+	else
+		status = 0;
 	delete [] hdr;
-	if (status != PTP::Net::HTTP_OK)
+	if (!status)
 		return -1;
 
-	FILE *fp = fopen(path, "wb");
+	fp = fopen(path, offset ? "ab":"wb");
 	if (!fp)
 		return -1;
 
-	PTP::Key k(key->shared.key);
+	Key::Session *session = AcquireSession(keys, key);
+	PTP::Key &k = session->cipher;
 	TransferContext ctx(c, fp);
+	ctx.remain = contentsize;
 	int size = 0;
 
-	if ((key->flags & SFS_FLAGS_PLAINTEXT_XFER) == 0)
-		size = k.Decrypt(GetRead, GetWrite, &ctx, SFS_READ_SIZE);
-	else
+	if (session->flags & SFS_FLAGS_PLAINTEXT_XFER)
 	{
 		size = PTP::Key::Transfer(GetRead,
 					  GetWrite,
 					  &ctx,
 					  SFS_READ_SIZE);
 	}
+	else if (session->flags & SFS_FLAGS_CHUNKED)
+	{
+		size = k.DecryptRange(GetRead,
+				      GetWrite,
+				      &ctx,
+				      offset,
+				      -1,
+				      pool);
+	}
+	else if (!offset)
+		size = k.Decrypt(GetRead, GetWrite, &ctx, SFS_READ_SIZE);
+	else
+		size = -1;
+	ReleaseSession(keys, session);
 	fclose(fp);
 
-	if (size <= 0)
+	// keep a partial file so it can be resumed again
+	if (size < 0 || (size == 0 && !offset))
 	{
-		unlink(path);
+		if (!offset)
+			unlink(path);
 		return -1;
 	}
 	if (total)
@@ -792,48 +1026,299 @@ HandleGetWrite(const BYTE *buffer, int size, void *context)
 }
 
 static int
-HandleGet(PTP::Collection *collect, PTP::List *keys, PTP::Net::Connection *c)
+HandleGet(PTP::Collection *collect,
+	  PTP::List *keys,
+	  PTP::Net::Connection *c,
+	  PTP::ThreadPool *pool)
 {	
-	char *hdr = c->ReadHttpHdr(NULL, -1, NULL, NULL);
+	char *hdr = c->ReadHttpHdr(NULL, -1, NULL, NULL, SFS_IO_TIMEOUT);
 	if (!hdr)
 		return -1;
 
 	char *d = hdr + 5;
 	unsigned long keyid = strtoul(d, &d, 16);
 	unsigned long id = strtoul(d + 1, NULL, 16);
+	int offset = 0;
+	d = strstr(hdr, "\r\nRange: ");
+	if (d)
+		sscanf(d + 2, "Range: bytes=%d-", &offset);
 	delete [] hdr;
 	
-	Key *key = FindKey(keys, keyid);
-	if (!key)
+	Key::Session *session = FindSession(keys, keyid);
+	if (!session)
 		return -1;
-	id ^= key->shadow;
+	id ^= session->shadow;
 	
 	PTP::Collection::Entry *entry = collect->Find(id);
-	if (!entry)
-		return -1;
-
-	FILE *fp = fopen(entry->GetPath(), "rb");
+	FILE *fp = entry ? fopen(entry->GetPath(), "rb"):NULL;
 	if (!fp)
+	{
+		ReleaseSession(keys, session);
 		return -1;
+	}
 
-	PTP::Key k(key->shared.key);
-	int size = k.Encrypt(NULL, entry->GetSize(), NULL);
-	if (c->WriteHttp(PTP::Net::HTTP_OK, NULL, NULL, NULL, size))
+	PTP::Key &k = session->cipher;
+	int flags = session->flags;
+	int size = entry->GetSize();
+
+	// only chunked and plaintext transfers can start part way
+	char range[64] = "";
+	if (offset <= 0
+	    || offset > size
+	    || (flags & (SFS_FLAGS_CHUNKED | SFS_FLAGS_PLAINTEXT_XFER))
+	    == 0)
+		offset = 0;
+	else
+	{
+		sprintf(range,
+			"Content-Range: bytes %d-%d/%d\r\n",
+			offset,
+			size - 1,
+			size);
+	}
+
+	if ((flags & SFS_FLAGS_PLAINTEXT_XFER) == 0)
+	{
+		if (flags & SFS_FLAGS_CHUNKED)
+		{
+			size = k.GetChunkedSize(size,
+						PTP::Key::CHUNK_SIZE_DEFAULT,
+						offset);
+			fseek(fp, PTP::Key::GetChunkedOffset(offset), SEEK_SET);
+		}
+		else
+			size = k.Encrypt(NULL, size, NULL);
+	}
+	else
+		size -= offset;
+	if (c->WriteHttp(offset ? PTP::Net::HTTP_PARTIAL_CONTENT
+			 :PTP::Net::HTTP_OK,
+			 range,
+			 NULL,
+			 NULL,
+			 size))
+	{
+		ReleaseSession(keys, session);
+		fclose(fp);
 		return -1;
+	}
 
+	// a short transfer leaves the client waiting, so close instead
 	TransferContext ctx(c, fp);
-	if ((key->flags & SFS_FLAGS_PLAINTEXT_XFER) == 0)
-		k.Encrypt(HandleGetRead, HandleGetWrite, &ctx, SFS_READ_SIZE);
-	else
+	int sent = 0;
+	if ((flags & SFS_FLAGS_PLAINTEXT_XFER) == 0)
 	{
-		PTP::Key::Transfer(HandleGetRead,
-				   HandleGetWrite,
-				   &ctx,
-				   SFS_READ_SIZE);
+		// SendFile would enlarge the buffers itself, but
+		// encrypted data is written instead
+		c->SetOptions(c->GetOptions() | PTP::Net::Connection::BULK);
+		if (flags & SFS_FLAGS_CHUNKED)
+		{
+			sent = k.EncryptRange(HandleGetRead,
+					      HandleGetWrite,
+					      &ctx,
+					      offset,
+					      -1,
+					      pool);
+		}
+		else
+		{
+			sent = k.Encrypt(HandleGetRead,
+					 HandleGetWrite,
+					 &ctx,
+					 SFS_READ_SIZE);
+		}
 	}
+	else
+		sent = c->SendFile(fileno(fp), offset, size);
+	ReleaseSession(keys, session);
 	fclose(fp);
 
-	return 0;
+	return ((sent == size) ? 0:-1);
+}
+
+static int
+WatchClient(ClientContext *ctx, int ok)
+{
+	ShareContext *share = ctx->share;
+
+	ctx->mutex.Lock();
+	ctx->busy = 0;
+	ctx->idle = time(NULL);
+	if (ok
+	    && !ctx->stop
+	    && share->reactor.Modify(ctx->handler,
+				     PTP::Net::Reactor::READ
+				     | PTP::Net::Reactor::ONESHOT) == 0)
+	{
+		ctx->mutex.Unlock();
+		return 0;
+	}
+
+	int removed = ctx->stop;
+	ctx->stop = 1;
+	ctx->mutex.Unlock();
+
+	if (!removed)
+		share->clients.Remove(ctx);
+	if (ctx->handler)
+		share->reactor.Remove(ctx->handler);
+	delete ctx->c;
+	delete ctx;
+	return -1;
+}
+
+static void
+RemoveClients(ShareContext *share, int idle)
+{
+	PTP::List closed;
+	ClientContext *ctx;
+	time_t now = time(NULL);
+
+	// clients handling a request are closed once they finish
+	share->clients.Lock();
+	PTP_LIST_FOREACH(ClientContext, ctx, &share->clients)
+	{
+		ctx->mutex.Lock();
+		int expired = (!idle
+			       || (now - ctx->idle) * 1000 > SFS_IDLE_TIMEOUT);
+		if (!ctx->stop && expired && (!ctx->busy || !idle))
+		{
+			ctx->stop = 1;
+			share->clients.Remove(ctx, 0);
+			if (ctx->busy)
+				ctx->c->Shutdown();
+			else
+				closed.Append(ctx);
+		}
+		ctx->mutex.Unlock();
+	}
+	share->clients.Unlock();
+
+	ClientContext *dead;
+	PTP_LIST_FOREACH(ClientContext, dead, &closed)
+	{
+		closed.Remove(dead);
+		share->reactor.Remove(dead->handler);
+		delete dead->c;
+		delete dead;
+	}
+}
+
+static void
+HandleClient(void *context)
+{
+	ClientContext *ctx = (ClientContext*) context;
+	ShareContext *share = ctx->share;
+	PTP::Net::Connection *client = ctx->c;
+
+	// serve the requests received so far
+	int ok = 0;
+	do
+	{
+		const BYTE *data = NULL;
+		int size = client->Peek(&data,
+					SFS_REQUEST_PEEK,
+					SFS_IO_TIMEOUT);
+		if (size <= 0)
+			break;
+		const char *buf = (const char*) data;
+
+		// peek again once the rest of the request line arrives
+		if (size < SFS_REQUEST_PEEK && !memchr(buf, '\n', size))
+		{
+			ok = 1;
+			break;
+		}
+
+		int st = -1;
+		if (MATCH_CONST(buf, size, "GET "))
+			st = HandleGet(share->collect,
+				       share->keys,
+				       client,
+				       share->pool);
+		else if (MATCH_CONST(buf, size, "PUT " SFS_SEARCH_URL))
+		{
+			st = HandleSearch(share->collect,
+					  share->keys,
+					  share->localIp,
+					  share->localPort,
+					  client);
+		}
+		else if (MATCH_CONST(buf, size, "PUT " SFS_AUTH_URL))
+		{
+			st = HandleAuth(share->store,
+					&share->auth,
+					share->keys,
+					client);
+		}
+		else if (MATCH_CONST(buf, size, "PUT " SFS_RESP_URL))
+		{
+			st = HandleResp(share->store,
+					&share->auth,
+					share->keys,
+					client);
+		}
+		ok = (!st && client->GetKeepAlive());
+	} while (ok && client->GetBuffered() > 0);
+
+	// wait for the next request in the reactor, not here
+	WatchClient(ctx, ok);
+}
+
+static void
+ClientEvent(PTP::Net::Reactor::Handler *handler, int events, void *context)
+{
+	ClientContext *ctx = (ClientContext*) context;
+	ShareContext *share = ctx->share;
+
+	ctx->mutex.Lock();
+	if (!ctx->stop)
+	{
+		ctx->busy = 1;
+		if (share->ioPool->Submit(HandleClient, ctx))
+		{
+			// pool is full, so try again later
+			ctx->busy = 0;
+			share->reactor.Modify(handler,
+					      PTP::Net::Reactor::READ
+					      | PTP::Net::Reactor::ONESHOT);
+		}
+	}
+	ctx->mutex.Unlock();
+}
+
+static void *
+AcceptClients(void *context)
+{
+	AcceptContext *actx = (AcceptContext*) context;
+	ShareContext *share = actx->share;
+	PTP::Net::Connection *clients[SFS_ACCEPT_BATCH];
+
+	for (;;)
+	{
+		int count = actx->serv->Accept(clients, SFS_ACCEPT_BATCH);
+		if (count > 0)
+			RemoveClients(share, 1);
+		for (int i = 0; i < count; i++)
+		{
+			// wait for the first request in the reactor
+			ClientContext *ctx;
+			ctx = new ClientContext(share, clients[i]);
+			share->clients.Insert(ctx);
+			ctx->mutex.Lock();
+			ctx->handler = share->reactor.Add(
+				clients[i],
+				(PTP::Net::Reactor::READ
+				 | PTP::Net::Reactor::ONESHOT),
+				ClientEvent,
+				ctx);
+			ctx->mutex.Unlock();
+			if (!ctx->handler)
+				WatchClient(ctx, 0);
+		}
+	}
+
+	return NULL;
 }
 
 static int
@@ -843,35 +1328,67 @@ Share(PTP::Store *store,
       PTP::Net::Port localPort,
       PTP::Collection *collect)
 {
-	PTP::Net::Connection serv(PTP::Net::Connection::HTTP, localPort);
-	PTP::Authenticator auth(store);
+	ShareContext share(store, keys, collect);
+	share.localIp = localIp;
+	share.localPort = localPort;
+
+	// encrypt chunked transfers on all processors, but serve clients
+	// on more threads, since a slow client blocks its thread
+	PTP::ThreadPool pool;
+	PTP::ThreadPool ioPool(SFS_IO_THREADS);
+	share.pool = &pool;
+	share.ioPool = &ioPool;
+	if (share.reactor.Start())
+		return -1;
 
-	for (;;)
+	// accept on one listening socket per processor
+	int count = PTP::ThreadPool::GetCpuCount();
+	if (count > SFS_MAX_ACCEPTORS)
+		count = SFS_MAX_ACCEPTORS;
+	if (count < 1)
+		count = 1;
+
+	PTP::Net::Connection *servs[SFS_MAX_ACCEPTORS];
+	AcceptContext accepts[SFS_MAX_ACCEPTORS];
+	PTP::Thread threads[SFS_MAX_ACCEPTORS];
+	PTP::Net::Port port = localPort;
+	int i;
+	for (i = 0; i < count; i++)
 	{
-                PTP::Net::Connection *client = serv.Accept(1);
-                if (!client)
-                        continue;
-
-		char buf[64];
-		int size = client->Read((BYTE*) buf, sizeof(buf));
-		if (size <= 0)
+		servs[i] = new PTP::Net::Connection(PTP::Net::Connection::HTTP,
+						    port);
+		servs[i]->SetOptions(PTP::Net::Connection::LATENCY
+				     | ((count > 1)
+					? PTP::Net::Connection::REUSE_PORT:0));
+		servs[i]->SetBacklog(SFS_LISTEN_BACKLOG);
+
+		// the first socket takes a free port, which the others
+		// then share (without port sharing, they fail instead)
+		if (i > 0)
+			servs[i]->SetPortRange(port, port);
+		if (servs[i]->Open())
 		{
-			delete client;
-			continue;
+			delete servs[i];
+			break;
 		}
-		client->Unget((BYTE*) buf, size);
-
-		if (STRNCMP_CONST(buf, "GET ") == 0)
-			HandleGet(collect, keys, client);
-		else if (STRNCMP_CONST(buf, "PUT " SFS_SEARCH_URL)== 0)
-			HandleSearch(collect, keys,localIp, localPort, client);
-		else if (STRNCMP_CONST(buf, "PUT " SFS_AUTH_URL) == 0)
-			HandleAuth(store, &auth, keys, client);
-		else if (STRNCMP_CONST(buf, "PUT " SFS_RESP_URL) == 0)
-			HandleResp(store, &auth, keys, client);
-		delete client;
+		port = servs[i]->GetPort();
+
+		accepts[i].share = &share;
+		accepts[i].serv = servs[i];
 	}
+	count = i;
+	if (!count)
+		return -1;
 
+	for (i = 1; i < count; i++)
+		threads[i].Start(AcceptClients, &accepts[i]);
+	AcceptClients(&accepts[0]);
+
+	RemoveClients(&share, 0);
+	ioPool.Wait();
+	share.reactor.Stop();
+	for (i = 0; i < count; i++)
+		delete servs[i];
 	return 0;
 }
 
@@ -897,6 +1414,8 @@ HandleOpts(PTP::Store *store, int argc, char **argv)
 	PTP::Collection collect;
 	PTP::List keys;
 	PTP::List resps;
+	PTP::Net::ConnectionPool conns;
+	PTP::ThreadPool pool;
 
 	int flags = 0;
 	int i = 1;
@@ -910,35 +1429,53 @@ HandleOpts(PTP::Store *store, int argc, char **argv)
 
 		if (MatchOpt(args, "search", 3))
 		{
-			PTP::Net::Connection *c	= Connect(args[1]);
+			PTP::Net::Connection *c	= Connect(&conns, args[1]);
 			Key *key = Auth(store, &keys, c, flags);
 			if (!key)
 				printf("%s: authorization failed.\n", prog);
-			else if (Search(c, key, args[2], &resps))
+			else if (Search(c, &keys, key, args[2], &resps))
 			{
 				printf("%s: search of `%s' failed.\n",
 				       prog,
 				       args[1]);
 			}
 			else
+			{
 				ShowResponses(&resps, 0);
+				conns.Put(c);
+				c = NULL;
+			}
 			delete c;
 			i += 2;
 		}
-		else if (MatchOpt(args, "get", 3))
+		else if (MatchOpt(args, "get", 3)
+			 || MatchOpt(args, "resume", 3))
 		{
-			PTP::Net::Connection *c	= Connect(args[1]);
+			int resume = (strcmp(args[0], "--resume") == 0);
+			PTP::Net::Connection *c	= Connect(&conns, args[1]);
 			Key *key = Auth(store, &keys, c, flags);
 			if (!key)
 				printf("%s: authorization failed.\n", prog);
-			else if (Get(c, key, args[1], args[2], NULL))
+			else if (Get(c,
+				     &keys,
+				     key,
+				     args[1],
+				     args[2],
+				     NULL,
+				     &pool,
+				     resume))
 			{
 				printf("%s: get of `%s' failed.\n",
 				       prog,
 				       args[1]);
 			}
+			else
+			{
+				conns.Put(c);
+				c = NULL;
+			}
 			delete c;
-			i++;
+			i += 2;
 		}
 		else if (MatchOpt(args, "share", 2))
 		{
@@ -972,6 +1509,7 @@ HandleOpts(PTP::Store *store, int argc, char **argv)
 			printf("Usage: %s [OPTIONS]\n", prog);
 			printf("  --search URL STRING\n");
 			printf("  --get URL PATH\n");
+			printf("  --resume URL PATH\n");
 			printf("  --share DIR\n");
 			printf("  --port PORT\n");
 			printf("  --proxy URL\n");
@@ -1024,6 +1562,8 @@ HandleCmds(PTP::Store *store, FILE *in)
 	PTP::Collection collect;
 	PTP::List keys;
 	PTP::List resps;
+	PTP::Net::ConnectionPool conns;
+	PTP::ThreadPool pool;
 
 	int flags = 0;
 	int quiet = 0;
@@ -1070,35 +1610,48 @@ HandleCmds(PTP::Store *store, FILE *in)
 
 		if (MatchCmd(args, "search", 2))
 		{
-			PTP::Net::Connection *c	= Connect(args[1]);
+			PTP::Net::Connection *c	= Connect(&conns, args[1]);
 			Key *key = Auth(store, &keys, c, flags);
 			if (!key)
 				printf("%s: authorization failed.\n", prog);
-			else if (Search(c, key, args[2], &resps))
+			else if (Search(c, &keys, key, args[2], &resps))
 			{
 				printf("%s: search of `%s' failed.\n",
 				       prog,
 				       args[1]);
 			}
 			else
+			{
 				ShowResponses(&resps, 1);
+				conns.Put(c);
+				c = NULL;
+			}
 			delete c;
 		}
-		else if (MatchCmd(args, "get", 2))
+		else if (MatchCmd(args, "get", 2)
+			 || MatchCmd(args, "resume", 2))
 		{
+			int resume = (strcmp(args[0], "resume") == 0);
 			int id = (int) strtoul(args[1], NULL, 10);
 			Response *resp = FindResponse(&resps, id);
 			if (!resp)
 				continue;
 
-			PTP::Net::Connection *c	= Connect(resp->url);
+			PTP::Net::Connection *c	= Connect(&conns, resp->url);
 			Key *key = Auth(store, &keys, c, flags);
 			if (!key)
 				printf("%s: authorization failed.\n", prog);
 			else
 			{
 				int size = 0;
-				if (Get(c, key, resp->url, args[2], &size))
+				if (Get(c,
+					&keys,
+					key,
+					resp->url,
+					args[2],
+					&size,
+					&pool,
+					resume))
 				{
 					printf("%s: get of `%s' "
 					       "failed.\n",
@@ -1106,7 +1659,11 @@ HandleCmds(PTP::Store *store, FILE *in)
 					       resp->url);
 				}
 				else
+				{
 					total += (unsigned long) size;
+					conns.Put(c);
+					c = NULL;
+				}
 			}
 			delete c;
 		}
@@ -1182,6 +1739,7 @@ HandleCmds(PTP::Store *store, FILE *in)
 			printf("Commands:\n");
 			printf("  search URL STRING\n");
 			printf("  get ID PATH\n");
+			printf("  resume ID PATH\n");
 			printf("  share [DIR]\n");
 			printf("  wait\n");
 			printf("  port PORT\n");
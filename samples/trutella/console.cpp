@@ -362,11 +362,12 @@ HandleCmds(Trut *trut, const char *prompt, FILE *in)
 			trut->Search(arg, FindFile, NULL, s_group);
 			PTP::Thread::Sleep(2);
 		}
-		else if (MatchCmd(cmd, "get"))
+		else if (MatchCmd(cmd, "get") || MatchCmd(cmd, "resume"))
 		{
 			if (!arg)
 				continue;
 
+			int resume = MatchCmd(cmd, "resume");
 			int id = (int) strtoul(arg, NULL, 10);
 			SearchResponse *resp = FindResponse(id);
 			if (resp)
@@ -380,7 +381,8 @@ HandleCmds(Trut *trut, const char *prompt, FILE *in)
 				trut->Get(resp->file,
 					  resp->file->GetName(),
 					  GetFile,
-					  resp);
+					  resp,
+					  resume);
 				trut->GetWait(resp->file);
 				total += resp->file->GetSize();
 			}
@@ -459,6 +461,7 @@ HandleCmds(Trut *trut, const char *prompt, FILE *in)
 			printf("  open HOST[:PORT]  Open connection\n");
 			printf("  search STRING     Search GnutellaNet\n");
 			printf("  get INDEX         Fetch file\n");
+			printf("  resume INDEX      Fetch the rest of a file\n");
 			printf("  join GROUP        Join group\n");
 			printf("  leave GROUP       Leave group\n");
 			printf("  share DIR         Share directory files\n");
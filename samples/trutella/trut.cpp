@@ -62,13 +62,16 @@ struct Trut::SearchContext:public PTP::List::Entry
 struct Trut::TransferContext
 {
 	TransferContext(FILE *f, PTP::Net::Connection *c = NULL)
-		:fp(f), conn(c), callback(NULL), size(0) {}
+		:fp(f), conn(c), callback(NULL), size(0), remain(-1),
+		 stop(NULL) {}
 	FILE *fp;
 	PTP::Net::Connection *conn;
 	Trut::GetCallback callback;
 	Trut::File *file;
 	void *context;
 	unsigned long size;
+	long remain;
+	const int *stop;
 };
 
 /*
@@ -76,7 +79,8 @@ struct Trut::TransferContext
  */
 struct Trut::GetContext:public PTP::List::Entry
 {
-	GetContext():m_conn(NULL), m_path(NULL) {}
+	GetContext():m_conn(NULL), m_path(NULL), m_offset(0), m_chunked(0),
+		m_waiters(0), m_stop(0) {}
 	~GetContext()
 	{
 		delete [] m_path;
@@ -95,8 +99,26 @@ struct Trut::GetContext:public PTP::List::Entry
 	void *m_context;
 
 	unsigned long m_size;
+	int m_offset;		// where a resumed file continues
+	int m_chunked;
 
-	PTP::Thread m_thread;
+	// waiters are woken through m_done; the last one frees the context
+	PTP::Semaphore m_done;
+	int m_waiters;
+	int m_stop;
+};
+
+/*
+ * Trut::SearchReply: Search request being answered.
+ */
+struct Trut::SearchReply
+{
+	const char *m_str;		// query, or NULL to not answer
+	BYTE *m_plain;			// decrypted query
+	Trut::Group *m_group;
+	int m_key;			// a group key request
+	Gnutella::SearchResp *m_resp;
+	PTP::Key::Message m_msg;	// data to decrypt or encrypt
 };
 
 /*
@@ -105,10 +127,20 @@ struct Trut::GetContext:public PTP::List::Entry
 struct Trut::PutContext
 {
 	Trut::Host *m_host;
+	char *m_rqst;
 	BYTE *m_resp;
 	const PTP::Identity *m_id;
 };
 
+/*
+ * Trut::CryptContext: Identity operation run on the crypto pool.
+ */
+struct Trut::CryptContext
+{
+	PTP::Semaphore done;
+	int result;
+};
+
 /*
  * Trut::Host::SendGnutella: Send a Gnutella packet.
  * @pkt: Gnutella packet.
@@ -134,31 +166,42 @@ Trut::Host::SendGnutella(const BYTE *pkt)
 BYTE *
 Trut::Host::ReceiveGnutella()
 {
-        char buffer[512];
-        int readsize = m_conn->Read((BYTE*) buffer, sizeof(buffer) - 1);
-        if (readsize <= 0)
+        // connect messages start with "GNUTELLA" and end with a blank line
+        BYTE hdr[sizeof(Gnutella::Packet)];
+        const BYTE *data = NULL;
+        int size = m_conn->Peek(&data, 8, IO_TIMEOUT);
+        if (size < 8)
                 return NULL;
 
-        int size = 0;
-        if (STRNCMP_CONST(buffer, GNUTELLA_CONNECT_REQUEST) != 0
-            && STRNCMP_CONST(buffer, GNUTELLA_CONNECT_RESPONSE) != 0)
+        if (STRNCMP_CONST(data, "GNUTELLA") == 0)
         {
-                Gnutella::Packet *pkt = (Gnutella::Packet*) buffer;
-                size = sizeof(*pkt) + Gnutella::Get32(pkt->size);
-        }
-        else
-        {
-                buffer[readsize] = '\0';
-                size = readsize;
+                BYTE *pkt = new BYTE[MAX_CONNECT_MESSAGE];
+                size = m_conn->ReadUntil(pkt,
+                                             MAX_CONNECT_MESSAGE - 1,
+                                             "\n\n",
+                                             IO_TIMEOUT);
+                if (size <= 0)
+                {
+                        delete [] pkt;
+                        return NULL;
+                }
+                pkt[size] = '\0';
+                return pkt;
         }
 
-	if (size < 0)
-		return NULL;
-	
-        BYTE *pkt = new BYTE[size];
-        memcpy(pkt, buffer, readsize);
-        if (size > readsize
-	    && m_conn->ReadAll(pkt + readsize, size - readsize) < 0)
+        // read exactly one packet, leaving any others buffered
+        if (m_conn->ReadAll(hdr, sizeof(hdr), IO_TIMEOUT) < 0)
+                return NULL;
+
+        Gnutella::Packet *p = (Gnutella::Packet*) hdr;
+        size = Gnutella::Get32(p->size);
+        if (size < 0 || size > MAX_PACKET_SIZE)
+                return NULL;
+
+        BYTE *pkt = new BYTE[sizeof(hdr) + size];
+        memcpy(pkt, hdr, sizeof(hdr));
+        if (size > 0
+            && m_conn->ReadAll(pkt + sizeof(hdr), size, IO_TIMEOUT) < 0)
         {
                 delete [] pkt;
                 pkt = NULL;
@@ -166,17 +209,83 @@ Trut::Host::ReceiveGnutella()
         return pkt;
 }
 
+/*
+ * Trut::Host::HasPacket: Check for a whole Gnutella packet.
+ * Returns: 1 if a packet (or a bad one) is received, 0 if only part
+ *          of one is, or -1 if the connection is closed.
+ * Notes: Reads only data that has already arrived, so the rest of
+ *        a packet can be waited for in the reactor.
+ */
+int
+Trut::Host::HasPacket()
+{
+        const BYTE *data = NULL;
+        int size = m_conn->Peek(&data,
+                                sizeof(Gnutella::Packet),
+                                IO_TIMEOUT);
+        if (size <= 0)
+                return -1;
+        if (size < 8)
+                return 0;
+
+        if (STRNCMP_CONST(data, "GNUTELLA") == 0)
+        {
+                size = m_conn->Peek(&data, MAX_CONNECT_MESSAGE - 1);
+                for (int i = 1; i < size; i++)
+                {
+                        if (data[i - 1] == '\n' && data[i] == '\n')
+                                return 1;
+                }
+                return (size >= MAX_CONNECT_MESSAGE - 1);
+        }
+        if (size < (int) sizeof(Gnutella::Packet))
+                return 0;
+
+        Gnutella::Packet *p = (Gnutella::Packet*) data;
+        int need = Gnutella::Get32(p->size);
+        if (need < 0 || need > MAX_PACKET_SIZE)
+                return 1;
+        need += sizeof(Gnutella::Packet);
+        return (m_conn->Peek(&data, need) >= need);
+}
+
+/*
+ * Trut::Host::HasRequest: Check for a whole HTTP request header.
+ * Returns: 1 if a header (or a bad one) is received, 0 if only part
+ *          of one is, or -1 if the connection is closed.
+ * Notes: Reads only data that has already arrived, like &HasPacket.
+ */
+int
+Trut::Host::HasRequest()
+{
+        const BYTE *data = NULL;
+        int size = m_conn->Peek(&data, HEADER_SIZE - 1, IO_TIMEOUT);
+        if (size <= 0)
+                return -1;
+        for (int i = 1; i < size; i++)
+        {
+                if (data[i] == '\n'
+                    && (data[i - 1] == '\n'
+                        || (i > 2
+                            && data[i - 1] == '\r'
+                            && data[i - 2] == '\n')))
+                        return 1;
+        }
+        return (size >= HEADER_SIZE - 1);
+}
+
 /**
  * Trut::Trut: Class constructor.
  * @store: Certificate store.
  */
 Trut::Trut(PTP::Store *store)
-	:m_store(store), m_open(NULL), m_close(NULL)
+	:m_store(store), m_open(NULL), m_close(NULL), m_ioPool(IO_THREADS)
 {
 	m_ip = PTP::Net::Lookup("localhost");
 	m_port = PORT_DEFAULT;
 	m_local = m_store->Find(NULL, 1);
 	m_auth = new PTP::Authenticator(m_store);
+	m_reactor.Start();
 }
 
 /**
@@ -184,12 +293,27 @@ Trut::Trut(PTP::Store *store)
  */
 Trut::~Trut()
 {
-	delete m_auth;
 	SearchStop();
-	LeaveAllGroups();
-	RemoveAllShared();
 	RemoveAllPorts();
+	RemoveAllClients(0);
 	RemoveAllHosts();
+
+	// abort transfers and let the pool drain
+	GetContext *get;
+	m_gets.Lock();
+	PTP_LIST_FOREACH(GetContext, get, &m_gets)
+	{
+		get->m_stop = 1;
+		get->m_conn->Shutdown();
+	}
+	m_gets.Unlock();
+	m_ioPool.Wait();
+	m_pool.Wait();
+	m_reactor.Stop();
+
+	delete m_auth;
+	LeaveAllGroups();
+	RemoveAllShared();
 }
 
 /**
@@ -204,125 +328,332 @@ Trut::AddPort(PTP::Net::Port port)
 	p->m_trut = this;
 	p->m_conn = new PTP::Net::Connection(PTP::Net::Connection::RAW,
 					     port ? port:PORT_DEFAULT);
+	p->m_conn->SetBlocking(0);
+	p->m_conn->SetOptions(PTP::Net::Connection::LATENCY);
+	p->m_conn->SetBacklog(LISTEN_BACKLOG);
 	if (p->m_conn->Open())
 	{
 		delete p;
 		return NULL;
 	}
 
+	p->m_handler = m_reactor.Add(p->m_conn,
+				     PTP::Net::Reactor::READ,
+				     PortEvent,
+				     p);
+	if (!p->m_handler)
+	{
+		delete p;
+		return NULL;
+	}
+
 	m_port = (PTP::Net::Port) p->GetPort();
 	m_ports.Insert(p);
-	p->m_thread.Start(PortThread, p);
 
 	return p;
 }
 
 /*
- * Trut::PortThread: Handle server connection.
+ * Trut::PortEvent: Accept server connections.
+ * @handler: Reactor handler.
+ * @events: Reactor events.
  * @context: Port context.
- * Returns: NULL.
  */
-void *
-Trut::PortThread(void *context)
+void
+Trut::PortEvent(PTP::Net::Reactor::Handler *handler,
+		int events,
+		void *context)
 {
 	Port *port = (Port*) context;
-	for (;;)
+	Trut *trut = port->m_trut;
+	PTP::Net::Connection *conns[ACCEPT_BATCH];
+	int count;
+	while ((count = port->m_conn->Accept(conns, ACCEPT_BATCH)) > 0)
 	{
-		PTP::Net::Connection *conn = port->m_conn->Accept(1);
-		if (!conn)
-			continue;
+		for (int i = 0; i < count; i++)
+		{
+			PTP::Net::Connection *conn = conns[i];
+			conn->SetBlocking(1);
+
+			char url[256];
+			sprintf(url,
+				"%lu.%lu.%lu.%lu:%u",
+				(conn->GetIp() >> 24) & 0xff,
+				(conn->GetIp() >> 16) & 0xff,
+				(conn->GetIp() >> 8) & 0xff,
+				(conn->GetIp() & 0xff),
+				conn->GetPort());
+
+			Host *host = new Host;
+			host->m_trut = trut;
+			host->m_conn = conn;
+			host->m_url = strdup(url);
+			host->m_idle = time(NULL);
+
+			// handle the first request once it arrives
+			host->m_handler = trut->m_reactor.Add(
+				conn,
+				(PTP::Net::Reactor::READ
+				 | PTP::Net::Reactor::ONESHOT),
+				ClientEvent,
+				host);
+			if (!host->m_handler)
+				delete host;
+			else
+				trut->m_clients.Insert(host);
+		}
+	}
+}
 
-		char url[256];
-		sprintf(url,
-			"%lu.%lu.%lu.%lu:%u",
-			(conn->GetIp() >> 24) & 0xff,
-			(conn->GetIp() >> 16) & 0xff,
-			(conn->GetIp() >> 8) & 0xff,
-			(conn->GetIp() & 0xff),
-			conn->GetPort());
-
-		Host *host = new Host;
-		host->m_trut = port->m_trut;
-		host->m_conn = conn;
-		host->m_url = strdup(url);
-		
-		if (host->m_conn->GetType() == PTP::Net::Connection::HTTP)
+/*
+ * Trut::ClientEvent: Handle server connection data.
+ * @handler: Reactor handler.
+ * @events: Reactor events.
+ * @context: Host context.
+ */
+void
+Trut::ClientEvent(PTP::Net::Reactor::Handler *handler,
+		  int events,
+		  void *context)
+{
+	Host *host = (Host*) context;
+	Trut *trut = host->m_trut;
+
+	host->m_mutex.Lock();
+	if (!host->m_stop)
+	{
+		host->m_busy = 1;
+		if (trut->m_ioPool.Submit(AcceptTask, host))
 		{
-			PutContext ctx;
-			ctx.m_host = host;
-			ctx.m_resp = new BYTE[HEADER_SIZE];
+			// pool is full, so try again later
+			host->m_busy = 0;
+			trut->m_reactor.Modify(handler,
+					       PTP::Net::Reactor::READ
+					       | PTP::Net::Reactor::ONESHOT);
+		}
+	}
+	host->m_mutex.Unlock();
+}
+
+/*
+ * Trut::AcceptTask: Handle requests on a server connection.
+ * @context: Host context (with m_busy set).
+ */
+void
+Trut::AcceptTask(void *context)
+{
+	Host *host = (Host*) context;
+	Trut *trut = host->m_trut;
+
+	// make room for new connections
+	if (!host->m_upload)
+		trut->RemoveAllClients(1);
+
+	// HTTP requests are uploads; anything else is a Gnutella peer
+	const BYTE *buffer = NULL;
+	int size = host->m_conn->Peek(&buffer, 4, IO_TIMEOUT);
+	if (size > 0 && size < 4)
+	{
+		// wait for the rest of the request in the reactor
+		trut->WatchClient(host, 1);
+		return;
+	}
+	if (size == 4 && STRNCMP_CONST(buffer, "GET ") == 0)
+	{
+		PutContext ctx;
+		ctx.m_host = host;
+		ctx.m_rqst = new char[HEADER_SIZE];
+		ctx.m_resp = new BYTE[HEADER_SIZE];
+
+		// serve the requests received so far
+		int ok = 1;
+		int served = 0;
+		host->m_upload = 1;
+		for (;;)
+		{
+			int ready = host->HasRequest();
+			if (ready <= 0)
+			{
+				ok = (ready == 0);
+				break;
+			}
+
+			// read the request header once for both steps
 			ctx.m_id = NULL;
+			ok = (host->m_conn->ReadHttpHdr(ctx.m_rqst,
+							HEADER_SIZE,
+							NULL,
+							NULL,
+							IO_TIMEOUT)
+			      && !trut->PutAuth(host->m_conn,
+						ctx.m_rqst,
+						&ctx.m_id,
+						ctx.m_resp)
+			      && !trut->Put(host, &ctx)
+			      && host->m_conn->GetKeepAlive());
+			served = 1;
+			if (!ok || host->m_conn->GetBuffered() <= 0)
+				break;
 
-			if (host->m_trut->PutAuth(conn,
-						  &ctx.m_id,
-						  ctx.m_resp) == 0)
-				host->m_thread.Start(PutThread, &ctx);
-			else
+			size = host->m_conn->Peek(&buffer, 4, IO_TIMEOUT);
+			if (size == 4 && STRNCMP_CONST(buffer, "GET ") != 0)
 			{
-				delete [] ctx.m_resp;
-				delete host;
+				ok = 0;
+				break;
 			}
 		}
-		else
+		delete [] ctx.m_rqst;
+		delete [] ctx.m_resp;
+
+		// wait for the next request in the reactor, not here
+		if (served)
+			host->m_idle = time(NULL);
+		trut->WatchClient(host, ok);
+		return;
+	}
+
+	if (size <= 0 || host->m_upload)
+	{
+		trut->WatchClient(host, 0);
+		return;
+	}
+
+	// hand the connection over to the Gnutella hosts
+	trut->m_clients.Lock();
+	trut->m_clients.Remove(host, 0);
+	host->m_mutex.Lock();
+	int stop = host->m_stop;
+	host->m_mutex.Unlock();
+	trut->m_clients.Unlock();
+	if (stop)
+	{
+		trut->WatchClient(host, 0);
+		return;
+	}
+
+	trut->m_reactor.Remove(host->m_handler);
+	host->m_handler = NULL;
+	trut->m_hosts.Insert(host);
+	if (trut->m_open)
+		(*trut->m_open)(host, &host->m_context);
+	HostTask(host);
+}
+
+/*
+ * Trut::WatchClient: Wait for the next request or close the connection.
+ * @host: Server connection (with m_busy set).
+ * @ok: 1 to keep the connection or 0 to close it.
+ * Returns: 0 if the connection is still open or -1 if closed.
+ */
+int
+Trut::WatchClient(Host *host, int ok)
+{
+	host->m_mutex.Lock();
+	host->m_busy = 0;
+	if (ok && !host->m_stop)
+	{
+		int events = (PTP::Net::Reactor::READ
+			      | PTP::Net::Reactor::ONESHOT);
+		if (m_reactor.Modify(host->m_handler, events) == 0)
 		{
-			host->m_trut->m_hosts.Insert(host);
-			if (host->m_trut->m_open)
-				(*host->m_trut->m_open)(host,
-							&host->m_context);
-			host->m_thread.Start(HostThread, host);
+			host->m_mutex.Unlock();
+			return 0;
 		}
 	}
 
-	port->m_trut->m_ports.Remove(port);
-	delete port;
-	PTP::Thread::Exit(0);
+	int removed = host->m_stop;
+	host->m_stop = 1;
+	host->m_mutex.Unlock();
+
+	if (!removed)
+		m_clients.Remove(host);
+	m_reactor.Remove(host->m_handler);
+	delete host;
 
-	return NULL;
+	return -1;
 }
 
 /*
- * Trut::PutThread: Handle file transmit.
- * @context: Transmit context.
- * Returns: NULL.
+ * Trut::RemoveAllClients: Destroy server connections.
+ * @idle: 1 to only destroy connections that have waited longer than
+ *        %KEEP_ALIVE_TIME seconds for their next request, or 0 for all.
+ * Notes: Connections handling a request are destroyed once the
+ *        handler finishes.
  */
-void *
-Trut::PutThread(void *context)
+void
+Trut::RemoveAllClients(int idle)
 {
-	PutContext *ctx = (PutContext*) context;
+	PTP::List closed;
+	Host *host;
+	time_t now = time(NULL);
+	m_clients.Lock();
+	PTP_LIST_FOREACH(Host, host, &m_clients)
+	{
+		host->m_mutex.Lock();
+		int expired = (!idle || now - host->m_idle > KEEP_ALIVE_TIME);
+		if (!host->m_stop && expired && (!host->m_busy || !idle))
+		{
+			host->m_stop = 1;
+			m_clients.Remove(host, 0);
+			if (host->m_busy)
+				host->m_conn->Shutdown();
+			else
+				closed.Append(host);
+		}
+		host->m_mutex.Unlock();
+	}
+	m_clients.Unlock();
 
-	Host *host = ctx->m_host;
+	Host *dead;
+	PTP_LIST_FOREACH(Host, dead, &closed)
+	{
+		closed.Remove(dead);
+		m_reactor.Remove(dead->m_handler);
+		delete dead;
+	}
+}
+
+/*
+ * Trut::Put: Handle file transmit.
+ * @host: Client connection.
+ * @ctx: Transmit context.
+ * Returns: 0 if the file was sent or -1 on error.
+ */
+int
+Trut::Put(Host *host, PutContext *ctx)
+{
 	PTP::Collection::Entry *entry = NULL;
 	PTP::Key *key = NULL;
 	int size = 0;
+	int chunked = 0;
+	int offset = 0;
+	const char *range = NULL;
+	char *hdr = ctx->m_rqst;
 
-	char *hdr = new char[HEADER_SIZE];
-	if (!host->m_conn->ReadHttpHdr(hdr, HEADER_SIZE))
-	{
-		delete [] hdr;
-		delete [] ctx->m_resp;
-		delete host;
-		PTP::Thread::Exit(0);
-		return NULL;
-	}
+	// the request line is cut below, so look at the header first
+	chunked = (strstr(hdr, "\r\nAccept-Encoding: ptp-chunked\r\n") != NULL);
+	range = strstr(hdr, "\r\nRange: ");
+	if (range)
+		sscanf(range + 2, "Range: bytes=%d-", &offset);
 
 	if (STRNCMP_CONST(hdr, "GET /get/") == 0)
 	{
 		char *start = hdr + STRLEN_CONST("GET /get/");
 		unsigned long ref = strtoul(start, NULL, 10);
-		entry = host->m_trut->m_collect.Find(ref);
+		entry = m_collect.Find(ref);
 	}
 	else if (STRNCMP_CONST(hdr, "GET /gets/") == 0)
 	{
 		char *start = hdr + STRLEN_CONST("GET /gets/");
 		char *end = strchr(start, '/');
 		*end = '\0';
-		Group *group = host->m_trut->FindGroup(start);
+		Group *group = FindGroup(start);
 		if (!group || !group->m_key)
 			goto fail;
 		key = group->m_key;
 		start = end + 1;
 		unsigned long ref = strtoul(start, NULL, 16);
-		entry = host->m_trut->m_collect.Find(ref);
+		entry = m_collect.Find(ref);
 
 		start = (char*) entry->GetName();
 		end = strrchr(start, '/');
@@ -347,85 +678,131 @@ Trut::PutThread(void *context)
 	if (!entry)
 		goto fail;
 
-	// get data size
+	// files sent from disk in the clear or in chunks can start part way
 	size = entry->GetSize();
+	if (offset <= 0
+	    || offset > size
+	    || !entry->GetPath()
+	    || ctx->m_id
+	    || (key && !chunked))
+		offset = 0;
+	else
+	{
+		sprintf((char*) ctx->m_resp + strlen((char*) ctx->m_resp),
+			"Content-Range: bytes %d-%d/%d\r\n",
+			offset,
+			size - 1,
+			size);
+	}
+
+	// get data size
 	if (ctx->m_id)
 	{
 		size = PTP::Identity::CIPHERTEXT_SIZE;
 	}
+	else if (key && chunked && entry->GetPath())
+	{
+		// the file is encrypted in chunks on the thread pool
+		size = key->GetChunkedSize(entry->GetSize(),
+					   PTP::Key::CHUNK_SIZE_DEFAULT,
+					   offset);
+		strcat((char*) ctx->m_resp,
+		       "Content-Encoding: ptp-chunked\r\n");
+	}
 	else if (key)
 	{
-		if (entry->GetPath())
-		{
-			TransferContext ctx(fopen(entry->GetPath(), "rb"));
-			if (!ctx.fp)
-				goto fail;
-			size = key->Encrypt(PutRead, NULL, &ctx);
-			fclose(ctx.fp);
-		}
-		else
-		{
-			size = key->Encrypt(entry->GetData(),
-					    entry->GetSize(),
-					    NULL);
-		}
+		// the file is encrypted once, while it is sent
+		chunked = 0;
+		size = PTP::Key::GetCipherSize(entry->GetSize(),
+					       1,
+					       1,
+					       key->GetCipher());
 	}
-
-	// send header
-	sprintf(hdr,
-		"HTTP 200\r\n"
-		"Content-type:application/binary\r\n"
-		"Content-length:%d\r\n"
-		"%s\r\n",
-		size,
-		ctx->m_resp);
-	host->m_conn->WriteAll((BYTE*) hdr, strlen(hdr));
+	else
+		size -= offset;
 
 	// send data
 	if (entry->GetPath())
 	{
+		if (host->m_conn->WriteHttp(offset
+					    ? PTP::Net::HTTP_PARTIAL_CONTENT
+					    :PTP::Net::HTTP_OK,
+					    (const char*) ctx->m_resp,
+					    NULL,
+					    NULL,
+					    size))
+			return -1;
+
 		TransferContext ctx(fopen(entry->GetPath(), "rb"),
 				    host->m_conn);
 		if (!ctx.fp)
-			goto fail;
+			return -1;
+		int sent = 0;
 		if (key)
-			key->Encrypt(PutRead, PutWrite, &ctx);
+		{
+			// SendFile would enlarge the buffers itself, but
+			// encrypted data is written instead
+			host->m_conn->SetOptions(host->m_conn->GetOptions()
+						 | PTP::Net::Connection::BULK);
+			if (chunked)
+			{
+				fseek(ctx.fp,
+				      PTP::Key::GetChunkedOffset(offset),
+				      SEEK_SET);
+				sent = key->EncryptRange(PutRead,
+							 PutWrite,
+							 &ctx,
+							 offset,
+							 -1,
+							 &m_pool);
+			}
+			else
+				sent = key->Encrypt(PutRead, PutWrite, &ctx);
+		}
 		else
-			PTP::Key::Transfer(PutRead, PutWrite, &ctx);
+			sent = host->m_conn->SendFile(fileno(ctx.fp),
+						      offset,
+						      size);
 		fclose(ctx.fp);
+		if (sent != size)
+			return -1;
 	}
 	else
 	{
+		// send the header and data together
+		BYTE *buffer = NULL;
 		if (ctx->m_id)
 		{
-			BYTE buffer[PTP::Identity::CIPHERTEXT_SIZE];
-			ctx->m_id->Encrypt(entry->GetData(),
-					   entry->GetSize(),
-					   buffer);
-			host->m_conn->WriteAll(buffer, sizeof(buffer));
+			// queue the RSA work with other peers' handshakes
+			buffer = new BYTE[size];
+			CryptContext crypt;
+			if (ctx->m_id->Encrypt(entry->GetData(),
+					       entry->GetSize(),
+					       buffer,
+					       CryptDone,
+					       &crypt,
+					       PTP::Identity::GetCryptoPool())
+			    == 0)
+				crypt.done.Wait();
 		}
 		else if (key)
 		{
-			BYTE *buffer = new BYTE[size];
+			buffer = new BYTE[size];
 			key->Encrypt(entry->GetData(),
 				     entry->GetSize(),
 				     buffer);
-			host->m_conn->WriteAll(buffer, size);
-			delete [] buffer;
-		}
-		else
-		{
-			host->m_conn->WriteAll(entry->GetData(),
-					       entry->GetSize());
 		}
+		int status = host->m_conn->WriteHttp(PTP::Net::HTTP_OK,
+						     (const char*) ctx->m_resp,
+						     (buffer
+						      ? buffer:entry->GetData()),
+						     NULL,
+						     size);
+		delete [] buffer;
+		if (status)
+			return -1;
 	}
-
-	delete [] hdr;
-	delete [] ctx->m_resp;
-	delete host;
-	PTP::Thread::Exit(0);
-
-	return NULL;
+	return 0;
 
  fail:
 	sprintf(hdr,
@@ -434,12 +811,7 @@ Trut::PutThread(void *context)
 		"<B>404 NOT FOUND</B>\n");
 	host->m_conn->WriteAll((BYTE*) hdr, strlen(hdr));
 
-	delete [] hdr;
-	delete [] ctx->m_resp;
-	delete host;
-	PTP::Thread::Exit(0);
-
-	return NULL;
+	return -1;
 }
 
 /**
@@ -450,7 +822,7 @@ void
 Trut::RemovePort(Port *port)
 {
 	m_ports.Remove(port);
-	port->m_thread.Kill();
+	m_reactor.Remove(port->m_handler);
 	delete port;
 }
 
@@ -465,7 +837,7 @@ Trut::RemoveAllPorts()
 	PTP_LIST_FOREACH(Port, port, &m_ports)
         {
 		m_ports.Remove(port, 0);
-		port->m_thread.Kill();
+		m_reactor.Remove(port->m_handler);
 		delete port;
 	}
 	m_ports.Unlock();
@@ -490,6 +862,7 @@ Trut::AddHost(const char *url)
 	host->m_conn = new PTP::Net::Connection(PTP::Net::Connection::RAW,
 						ip,
 						port);
+	host->m_conn->SetOptions(PTP::Net::Connection::LATENCY);
 	host->SendGnutella((BYTE*) GNUTELLA_CONNECT_REQUEST);
 
 	BYTE *pkt = host->ReceiveGnutella();
@@ -503,78 +876,182 @@ Trut::AddHost(const char *url)
 		return NULL;
 	}
 
+	host->m_busy = 1;
 	m_hosts.Insert(host);
 	if (m_open)
 		(*m_open)(host, &host->m_context);
 
-	host->m_thread.Start(HostThread, host);
+	if (WatchHost(host, 1))
+		return NULL;
 
 	return host;
 }
 
 /*
- * Trut::HostThread: Handle client connection.
- * @context: Client context.
- * Returns: NULL.
+ * Trut::HostEvent: Handle Gnutella connection data.
+ * @handler: Reactor handler.
+ * @events: Reactor events.
+ * @context: Host context.
  */
-void *
-Trut::HostThread(void *context)
+void
+Trut::HostEvent(PTP::Net::Reactor::Handler *handler,
+		int events,
+		void *context)
 {
 	Host *host = (Host*) context;
-	for (;;)
+	Trut *trut = host->m_trut;
+
+	host->m_mutex.Lock();
+	if (!host->m_stop)
+	{
+		host->m_busy = 1;
+		if (trut->m_ioPool.Submit(HostTask, host))
+		{
+			// pool is full, so try again later
+			host->m_busy = 0;
+			trut->m_reactor.Modify(handler,
+					       PTP::Net::Reactor::READ
+					       | PTP::Net::Reactor::ONESHOT);
+		}
+	}
+	host->m_mutex.Unlock();
+}
+
+/*
+ * Trut::HostTask: Handle a Gnutella packet.
+ * @context: Host context.
+ */
+void
+Trut::HostTask(void *context)
+{
+	Host *host = (Host*) context;
+	Gnutella::SearchRqst *rqsts[SEARCH_BATCH];
+	int count = 0;
+	int ok = 1;
+
+	// handle every buffered packet, since the reactor only reports
+	// newly received data, and leave partly received ones to it
+	for (int more = 1; more; )
 	{
-		Gnutella::Packet *pkt
-			= (Gnutella::Packet*) host->ReceiveGnutella();
+		int ready = host->HasPacket();
+		Gnutella::Packet *pkt = NULL;
+		if (ready > 0)
+			pkt = (Gnutella::Packet*) host->ReceiveGnutella();
 		if (!pkt)
-			break;
-		
-		if (STRNCMP_CONST((char*) pkt, GNUTELLA_CONNECT_REQUEST) == 0)
+			ok = (ready == 0);
+		else if (STRNCMP_CONST((char*) pkt,
+				       GNUTELLA_CONNECT_REQUEST) == 0)
 		{
 			host->SendGnutella((BYTE*) GNUTELLA_CONNECT_RESPONSE);
 		}
-		else
+		else if (pkt->type == Gnutella::SEARCH_RESPONSE)
 		{
-			switch (pkt->type)
-			{
-			case Gnutella::SEARCH_RESPONSE:
-				host->m_trut->HandleSearchResponse(
-					host,
-					(Gnutella::SearchResp*) pkt);
-				break;
-			case Gnutella::SEARCH_REQUEST:
-				host->m_trut->HandleSearchRequest(
-					host,
-					(Gnutella::SearchRqst*) pkt);
-				break;
-			default:
-				break;
-			}
+			host->m_trut->HandleSearchResponse(
+				host,
+				(Gnutella::SearchResp*) pkt);
+		}
+		else if (pkt->type == Gnutella::SEARCH_REQUEST)
+		{
+			rqsts[count++] = (Gnutella::SearchRqst*) pkt;
+			pkt = NULL;
 		}
-
 		delete [] ((BYTE*) pkt);
+		more = (ready > 0
+			&& ok
+			&& host->m_conn->GetBuffered() > 0
+			&& !host->m_stop);
+
+		// answer the buffered search requests together
+		if (count == SEARCH_BATCH || (count > 0 && !more))
+		{
+			host->m_trut->HandleSearchRequests(host, rqsts, count);
+			while (count > 0)
+				delete [] ((BYTE*) rqsts[--count]);
+		}
 	}
 
-	host->m_trut->m_hosts.Remove(host);
-	if (host->m_trut->m_close)
-		(*host->m_trut->m_close)(host, host->m_context);
-	delete host;
-	PTP::Thread::Exit(0);
+	host->m_trut->WatchHost(host, ok);
+}
+
+/*
+ * Trut::WatchHost: Wait for the next packet or close the connection.
+ * @host: Client connection (with m_busy set).
+ * @ok: 1 to keep the connection or 0 to close it.
+ * Returns: 0 if the connection is still open or -1 if closed.
+ */
+int
+Trut::WatchHost(Host *host, int ok)
+{
+	host->m_mutex.Lock();
+	host->m_busy = 0;
+	if (ok && !host->m_stop)
+	{
+		int events = (PTP::Net::Reactor::READ
+			      | PTP::Net::Reactor::ONESHOT);
+		if (host->m_handler)
+			ok = (m_reactor.Modify(host->m_handler, events) == 0);
+		else
+		{
+			host->m_handler = m_reactor.Add(host->m_conn,
+							events,
+							HostEvent,
+							host);
+			ok = (host->m_handler != NULL);
+		}
+		if (ok)
+		{
+			host->m_mutex.Unlock();
+			return 0;
+		}
+	}
+
+	int removed = host->m_stop;
+	host->m_stop = 1;
+	host->m_mutex.Unlock();
+
+	if (!removed)
+		m_hosts.Remove(host);
+	CloseHost(host);
 
-	return NULL;
+	return -1;
+}
+
+/*
+ * Trut::CloseHost: Destroy a client connection.
+ * @host: Client connection (no longer in the host list).
+ */
+void
+Trut::CloseHost(Host *host)
+{
+	if (host->m_handler)
+		m_reactor.Remove(host->m_handler);
+	if (m_close)
+		(*m_close)(host, host->m_context);
+	delete host;
 }
 
 /**
  * Trut::RemoveHost: Destroy a client connection.
  * @host: Client connection.
+ * Notes: If a packet is being handled, the connection is
+ *        destroyed once the handler finishes.
  */
 void
 Trut::RemoveHost(Host *host)
 {
-	m_hosts.Remove(host);
-	host->m_thread.Kill();
-	if (m_close)
-		(*m_close)(host, host->m_context);
-	delete host;
+	m_hosts.Lock();
+	m_hosts.Remove(host, 0);
+
+	host->m_mutex.Lock();
+	int idle = (!host->m_stop && !host->m_busy);
+	host->m_stop = 1;
+	if (host->m_busy)
+		host->m_conn->Shutdown();
+	host->m_mutex.Unlock();
+
+	if (idle)
+		CloseHost(host);
+	m_hosts.Unlock();
 }
 
 /**
@@ -587,11 +1064,7 @@ Trut::RemoveAllHosts()
 	m_hosts.Lock();
 	PTP_LIST_FOREACH(Host, host, &m_hosts)
 	{
-		m_hosts.Remove(host, 0);
-		host->m_thread.Kill();
-		if (m_close)
-			(*m_close)(host, host->m_context);
-		delete host;
+		RemoveHost(host);
 	}
 	m_hosts.Unlock();
 }
@@ -714,16 +1187,18 @@ Trut::SearchStop(void *context)
 /*
  * Trut::GetAuth: Handle client-side authentication.
  * @conn: Client connection.
- * @rqst: HTTP request.
+ * @hdr: [IN/OUT] HTTP request, replaced by the response header.
+ * @status: [OUT] HTTP status.
+ * @size: [OUT] Content size.
  * Returns: 0 on success or -1 on failed authentication.
  */
 int
-Trut::GetAuth(PTP::Net::Connection *conn, const BYTE *rqst)
+Trut::GetAuth(PTP::Net::Connection *conn, char *hdr, int *status, int *size)
 {
-	int secure = (STRNCMP_CONST(rqst, "GET /gets/") == 0);
-	char *hdr = new char[HEADER_SIZE];
+	int secure = (STRNCMP_CONST(hdr, "GET /gets/") == 0);
+	char *rqst = new char[HEADER_SIZE];
 
-	strcpy(hdr, (char*) rqst);
+	strcpy(rqst, hdr);
 	BYTE key[PTP::Identity::KEY_SIZE];
 	m_local->GetKey(key);
 	if (secure)
@@ -731,16 +1206,15 @@ Trut::GetAuth(PTP::Net::Connection *conn, const BYTE *rqst)
 	strcat(hdr, "\r\n");
 	conn->WriteAll((BYTE*) hdr, strlen(hdr));
 
-	if (!conn->ReadHttpHdr(hdr, HEADER_SIZE))
+	if (!conn->ReadHttpHdr(hdr, HEADER_SIZE, status, size, IO_TIMEOUT))
 	{
-		delete [] hdr;
+		delete [] rqst;
 		return -1;
 	}
 
 	if (!secure)
 	{
-		conn->Unget((BYTE*) hdr, strlen(hdr));
-		delete [] hdr;
+		delete [] rqst;
 		return 0;
 	}
 
@@ -751,17 +1225,17 @@ Trut::GetAuth(PTP::Net::Connection *conn, const BYTE *rqst)
 	if (GetAuthValue(hdr, "Identity", rkey, sizeof(rkey))
 	    || GetAuthValue(hdr, "Challenge", rchal, sizeof(rchal)))
 	{
-		delete [] hdr;
+		delete [] rqst;
 		return -1;
 	}
 	const PTP::Identity *rid = m_store->Find(NULL, 0, rkey);
 	if (!rid)
 	{
-		delete [] hdr;
+		delete [] rqst;
 		return -1;
 	}
 
-	strcpy(hdr, (char*) rqst);
+	strcpy(hdr, rqst);
 	BYTE chal[PTP::Authenticator::CHALLENGE_SIZE];
 	m_auth->Challenge(rid, CHALLENGE_TIME, (void*) rid, chal);
 	AppendAuthValue(hdr, "Challenge", chal, sizeof(chal));
@@ -770,23 +1244,15 @@ Trut::GetAuth(PTP::Net::Connection *conn, const BYTE *rqst)
 	AppendAuthValue(hdr, "Response", resp, sizeof(resp));
 	strcat(hdr, "\r\n");
 	conn->WriteAll((BYTE*) hdr, strlen(hdr));
+	delete [] rqst;
 
-	if (!conn->ReadHttpHdr(hdr, HEADER_SIZE))
-	{
-		delete [] hdr;
+	if (!conn->ReadHttpHdr(hdr, HEADER_SIZE, status, size, IO_TIMEOUT))
 		return -1;
-	}
 	
 	BYTE rresp[PTP::Authenticator::RESPONSE_SIZE];
 	if (GetAuthValue(hdr, "Response", rresp, sizeof(rresp))
 	    || m_auth->Verify(rresp) == NULL)
-	{
-		delete [] hdr;
 		return -1;
-	}
-
-	conn->Unget((BYTE*) hdr, strlen(hdr));
-	delete [] hdr;
 
 	return 0;
 }
@@ -794,54 +1260,45 @@ Trut::GetAuth(PTP::Net::Connection *conn, const BYTE *rqst)
 /*
  * Trut::PutAuth: Handle server-side authentication.
  * @conn: Client connection.
+ * @hdr: HTTP request header.
  * @id: [!OUT] Client identity.
  * @rsp: [!OUT] Authentication response.
  * Returns: 0 on success or -1 on failed or partial authentication.
  */
 int
-Trut::PutAuth(PTP::Net::Connection *conn, const PTP::Identity **id, BYTE *rsp)
+Trut::PutAuth(PTP::Net::Connection *conn,
+	      const char *hdr,
+	      const PTP::Identity **id,
+	      BYTE *rsp)
 {
 	const char *rqst = "HTTP/1.1 401 Unauthorized\r\n"
 		           "Connection: Keep-Alive\r\n";
 
 	rsp[0] = '\0';
 
-	char *hdr = new char[HEADER_SIZE];
-	if (!conn->ReadHttpHdr(hdr, HEADER_SIZE))
-	{
-		delete [] hdr;
-		return -1;
-	}
-
 	int secure = (STRNCMP_CONST(hdr, "GET /gets/") == 0);
 	if (!secure)
-	{
-		conn->Unget((BYTE*) hdr, strlen(hdr));
-		delete [] hdr;
 		return 0;
-	}
 
 	BYTE rkey[PTP::Identity::KEY_SIZE];
 	if (GetAuthValue(hdr, "Identity", rkey, sizeof(rkey)) == 0)
 	{
 		const PTP::Identity *rid = m_store->Find(NULL, 0, rkey);
 		if (!rid)
-		{
-			delete [] hdr;
 			return -1;
-		}
 		
-		strcpy(hdr, rqst);
+		// the challenge goes out now, in place of a response
+		char *chdr = (char*) rsp;
+		strcpy(chdr, rqst);
 		BYTE key[PTP::Identity::KEY_SIZE];
 		m_local->GetKey(key);
-		AppendAuthValue(hdr, "Identity", key, sizeof(key));
+		AppendAuthValue(chdr, "Identity", key, sizeof(key));
 		BYTE chal[PTP::Authenticator::CHALLENGE_SIZE];
 		m_auth->Challenge(rid, CHALLENGE_TIME, (void*) rid, chal);
-		AppendAuthValue(hdr, "Challenge", chal, sizeof(chal));
-		strcat(hdr, "\r\n");
-		conn->WriteAll((BYTE*) hdr, strlen(hdr));
-
-		delete [] hdr;
+		AppendAuthValue(chdr, "Challenge", chal, sizeof(chal));
+		strcat(chdr, "\r\n");
+		conn->WriteAll((BYTE*) chdr, strlen(chdr));
+		rsp[0] = '\0';
 		return -1;
 	}
 
@@ -849,27 +1306,17 @@ Trut::PutAuth(PTP::Net::Connection *conn, const PTP::Identity **id, BYTE *rsp)
 	BYTE rchal[PTP::Authenticator::CHALLENGE_SIZE];
 	if (GetAuthValue(hdr, "Response", rresp, sizeof(rresp))
 	    || GetAuthValue(hdr, "Challenge", rchal, sizeof(rchal)))
-	{
-		delete [] hdr;
 		return -1;
-	}
 	
 	const PTP::Identity *rid
 		= (const PTP::Identity*) m_auth->Verify(rresp);
 	if (!rid)
-	{
-		delete [] hdr;
 		return -1;
-	}
-	conn->Unget((BYTE*) hdr, strlen(hdr));
 	
-	strcpy(hdr, rqst);
 	BYTE resp[PTP::Authenticator::RESPONSE_SIZE];
 	m_auth->Respond(rchal, resp);
 	AppendAuthValue((char*) rsp, "Response", resp, sizeof(resp));
 	*id = rid;
-	
-	delete [] hdr;
 
 	return 0;
 }
@@ -926,15 +1373,37 @@ Trut::AppendAuthValue(char *hdr, const char *name, const BYTE *value, int size)
 	strcat(hdr, "\r\n");
 }
 
+/*
+ * Trut::GetRangeOffset: Retrieve the start of an HTTP content range.
+ * @hdr: HTTP header.
+ * Returns: Content offset or -1 if there is no content range.
+ */
+int
+Trut::GetRangeOffset(const char *hdr)
+{
+	const char *range = strstr(hdr, "\r\nContent-Range: ");
+	int offset = -1;
+	if (range)
+		sscanf(range + 2, "Content-Range: bytes %d-", &offset);
+	return offset;
+}
+
 /**
  * Trut::Get: Retrieve file.
  * @file: File.
  * @path: Destination file name.
  * @callback: Get callback.
  * @context: Callback context.
+ * @resume: 1 to fetch only the rest of a partial file at @path.
+ * Notes: Peers that cannot send part of the file send all of it, and
+ *        @path is then rewritten.
  */
 void
-Trut::Get(File *file, const char *path, GetCallback callback, void *context)
+Trut::Get(File *file,
+	  const char *path,
+	  GetCallback callback,
+	  void *context,
+	  int resume)
 {
 	GetContext *get = new GetContext;
 	get->m_trut = this;
@@ -943,10 +1412,9 @@ Trut::Get(File *file, const char *path, GetCallback callback, void *context)
 	get->m_callback = callback;
 	get->m_context = context;
 
-	get->m_conn = new PTP::Net::Connection(
-		PTP::Net::Connection::HTTP,
-		file->GetIp(),
-		file->GetPort());
+	get->m_conn = m_conns.Get(PTP::Net::Connection::HTTP,
+				  file->GetIp(),
+				  file->GetPort());
 
 	const Group *group = file->GetGroup();
 	get->m_key = group ? group->m_key:NULL;
@@ -962,6 +1430,10 @@ Trut::Get(File *file, const char *path, GetCallback callback, void *context)
 			"Connection: Keep-Alive\r\n",
 			group->GetName(),
 			file->m_ref);
+
+		// files saved to disk can be received in parallel chunks
+		if (get->m_path && !get->m_id)
+			strcat(hdr, "Accept-Encoding: ptp-chunked\r\n");
 	}
 	else
 	{
@@ -972,12 +1444,28 @@ Trut::Get(File *file, const char *path, GetCallback callback, void *context)
 			file->GetName());
 	}
 
+	// ask for the rest of a partial file
+	FILE *fp = (resume && get->m_path) ? fopen(get->m_path, "rb"):NULL;
+	if (fp)
+	{
+		if (fseek(fp, 0, SEEK_END) == 0 && ftell(fp) > 0)
+		{
+			get->m_offset = (int) ftell(fp);
+			sprintf(hdr + strlen(hdr),
+				"Range: bytes=%d-\r\n",
+				get->m_offset);
+		}
+		fclose(fp);
+	}
+
 	int status = 0;
 	int size = 0;
 	
-	if (GetAuth(get->m_conn, (BYTE*) hdr)
-	    || !get->m_conn->ReadHttpHdr(hdr, HEADER_SIZE, &status, &size)
-	    || status != PTP::Net::HTTP_OK
+	if (!get->m_conn
+	    || GetAuth(get->m_conn, hdr, &status, &size)
+	    || (status != PTP::Net::HTTP_OK
+		&& (status != PTP::Net::HTTP_PARTIAL_CONTENT
+		    || GetRangeOffset(hdr) != get->m_offset))
 	    || size <= 0)
 	{
 		if (get->m_callback)
@@ -994,56 +1482,103 @@ Trut::Get(File *file, const char *path, GetCallback callback, void *context)
 	}
 
 	get->m_size = size;
+	if (status == PTP::Net::HTTP_OK)
+		get->m_offset = 0;
+	get->m_chunked = (strstr(hdr, "\r\nContent-Encoding: ptp-chunked\r\n")
+			  != NULL);
 	delete [] hdr;
 	m_gets.Insert(get);
-	get->m_thread.Start(GetThread, get);
+	if (m_ioPool.Submit(GetTask, get))
+	{
+		m_gets.Remove(get);
+		if (get->m_callback)
+		{
+			(*get->m_callback)(get->m_file,
+					   GET_ERROR,
+					   NULL,
+					   0,
+					   get->m_context);
+		}
+		delete get;
+	}
 }
 
-/**
- * Trut::GetThread: Handle file receive.
+/*
+ * Trut::GetTask: Handle file receive.
  * @context: Receive context.
- * Returns: NULL.
  */
-void *
-Trut::GetThread(void *context)
+void
+Trut::GetTask(void *context)
 {
 	GetContext *get = (GetContext*) context;
 
 	int size = 0;
 	BYTE *buffer = NULL;
+	int complete = 0;
 
 	GetStatus status = GET_ERROR;
 	if (get->m_path)
 	{
-		TransferContext ctx(fopen(get->m_path, "wb"), get->m_conn);
+		TransferContext ctx(fopen(get->m_path,
+					  get->m_offset ? "ab":"wb"),
+				    get->m_conn);
 		ctx.callback = get->m_callback;
 		ctx.file = get->m_file;
 		ctx.context = get->m_context;
-		ctx.size = 0;
+		ctx.size = get->m_offset;
+		ctx.remain = get->m_size;
+		ctx.stop = &get->m_stop;
 		if (ctx.fp)
 		{
-			if (get->m_key)
+			if (get->m_key && get->m_chunked)
+			{
+				size = get->m_key->DecryptRange(
+					GetRead,
+					GetWrite,
+					&ctx,
+					get->m_offset,
+					-1,
+					&get->m_trut->m_pool);
+			}
+			else if (get->m_key && !get->m_offset)
 			{
 				size = get->m_key->Decrypt(GetRead,
 							   GetWrite,
 							   &ctx);
 			}
-			else
+			else if (!get->m_key)
 			{
 				size = PTP::Key::Transfer(GetRead,
 							  GetWrite,
 							  &ctx);
 			}
+			else
+				size = -1;
+			if (size >= 0)
+				size += get->m_offset;
 			fclose(ctx.fp);
 			status = GET_DONE;
+			complete = (ctx.remain == 0);
 		}
 	}
 	else
 	{
 		buffer = new BYTE[get->m_size];
-		size = get->m_conn->ReadAll(buffer, get->m_size);
+		size = get->m_conn->ReadAll(buffer, get->m_size, IO_TIMEOUT);
+		complete = (size == (int) get->m_size);
 		if (get->m_id)
-			size = get->m_id->Decrypt(buffer, buffer);
+		{
+			CryptContext crypt;
+			crypt.result = -1;
+			if (get->m_id->Decrypt(buffer,
+					       buffer,
+					       CryptDone,
+					       &crypt,
+					       PTP::Identity::GetCryptoPool())
+			    == 0)
+				crypt.done.Wait();
+			size = crypt.result;
+		}
 		else if (get->m_key)
 			size = get->m_key->Decrypt(buffer, size, buffer);
 		status = GET_DONE;
@@ -1051,7 +1586,7 @@ Trut::GetThread(void *context)
 
 	if (size < 0)
 		status = GET_ERROR;
-	if (get->m_callback)
+	if (get->m_callback && !get->m_stop)
 	{
 		(*get->m_callback)(get->m_file,
 				   status,
@@ -1061,11 +1596,24 @@ Trut::GetThread(void *context)
 	}
 
 	delete [] buffer;
-	get->m_trut->m_gets.Remove(get);
-	delete get;
-	PTP::Thread::Exit(0);
 
-	return NULL;
+	Trut *trut = get->m_trut;
+	trut->m_gets.Lock();
+	trut->m_gets.Remove(get, 0);
+
+	// keep a fully read connection for the next get from this peer
+	PTP::Net::Connection *conn = NULL;
+	if (complete && !get->m_stop)
+	{
+		conn = get->m_conn;
+		get->m_conn = NULL;
+	}
+	int waiters = get->m_waiters;
+	get->m_done.Post(waiters);
+	trut->m_gets.Unlock();
+	if (!waiters)
+		delete get;
+	trut->m_conns.Put(conn);
 }
 
 /**
@@ -1082,14 +1630,25 @@ Trut::GetWait(File *file)
 		if (get->m_file == file)
 			break;
 	}
-	m_gets.Unlock();
 	if (get)
-		get->m_thread.Wait();
+		get->m_waiters++;
+	m_gets.Unlock();
+	if (!get)
+		return;
+
+	get->m_done.Wait();
+
+	m_gets.Lock();
+	int last = (--get->m_waiters == 0);
+	m_gets.Unlock();
+	if (last)
+		delete get;
 }
 
 /**
  * Trut::GetStop: Terminate get request.
  * @file: File.
+ * Notes: No further callbacks are made for the request.
  */
 void
 Trut::GetStop(File *file)
@@ -1100,13 +1659,13 @@ Trut::GetStop(File *file)
 	{
 		if (get->m_file == file)
 		{
-			get->m_thread.Kill();
-			m_gets.Remove(get, 0);
-			delete get;
+			get->m_stop = 1;
+			get->m_conn->Shutdown();
 			break;
 		}
 	}
 	m_gets.Unlock();
+	GetWait(file);
 }
 
 /**
@@ -1437,59 +1996,114 @@ Trut::HandleSearchResponse(Host *host, Gnutella::SearchResp *resp)
 }
 
 /**
- * Trut::HandleSearchRequest: Handle a search request.
+ * Trut::HandleSearchRequests: Handle a batch of search requests.
  * @host: Request source.
- * @rqst: Search request.
- * Returns: 0 on success or -1 on error.
+ * @rqsts: Search requests.
+ * @count: Number of requests (at most SEARCH_BATCH).
+ * Notes: The secure group queries in the batch are decrypted, and
+ *        their responses encrypted, a group at a time with
+ *        &PTP::Key::DecryptBatch and &PTP::Key::EncryptBatch.
  */
-int
-Trut::HandleSearchRequest(Host *host, Gnutella::SearchRqst *rqst)
+void
+Trut::HandleSearchRequests(Host *host,
+			   Gnutella::SearchRqst **rqsts,
+			   int count)
 {
-	char *str = rqst->search;
+	SearchReply replies[SEARCH_BATCH];
+	int i;
 
-	BYTE *plain = NULL;
-	Group *group = NULL;
-	int key = 0;
-
-	if (STRNCMP_CONST(str, "/secure/") == 0)
+	// find each query's group and decode secure queries
+	for (i = 0; i < count; i++)
 	{
+		SearchReply *reply = replies + i;
+		char *str = rqsts[i]->search;
+		reply->m_str = str;
+		reply->m_plain = NULL;
+		reply->m_group = NULL;
+		reply->m_key = 0;
+		reply->m_resp = NULL;
+		reply->m_msg.src = NULL;
+
+		if (STRNCMP_CONST(str, "/secure/") != 0)
+			continue;
 		char *start = str + STRLEN_CONST("/secure/");
 		char *end = strchr(start, '/');
 		if (!end)
-			return -1;
+		{
+			reply->m_str = NULL;
+			continue;
+		}
 		*end = '\0';
-		group = FindGroup(start);
+		reply->m_group = FindGroup(start);
 		*end = '/';
-		
+
 		start = end + 1;
-		key = (strcmp(start, "key") == 0);
-		if (key)
-			group = NULL;
-		
-		if (group)
+		reply->m_key = (strcmp(start, "key") == 0);
+		if (reply->m_key)
+			reply->m_group = NULL;
+		if (reply->m_group && !reply->m_group->m_key)
+		{
+			reply->m_group = NULL;
+			reply->m_str = NULL;
+		}
+		else if (reply->m_group)
 		{
 			int ciphersize = strlen(start);
-			int plainsize = group->m_key->Decrypt(
-				NULL,
-				ciphersize >> 1,
-				NULL);
-			plain = new BYTE[ciphersize + 4];
-			ciphersize = PTP::Encoding::DecodeBase64(
+			reply->m_plain = new BYTE[ciphersize + 4];
+			reply->m_msg.src = reply->m_plain;
+			reply->m_msg.size = PTP::Encoding::DecodeBase64(
 				start,
 				ciphersize,
-				plain);
-			plainsize = group->m_key->Decrypt(plain,
-							  ciphersize,
-							  plain);
-			if (plainsize < 0)
+				reply->m_plain);
+			reply->m_msg.dst = reply->m_plain;
+		}
+	}
+
+	// decrypt the queries, answer them and encrypt the responses
+	PTP::Key::Context ctx;
+	CryptSearch(replies, count, 0, &ctx);
+	for (i = 0; i < count; i++)
+	{
+		SearchReply *reply = replies + i;
+		if (reply->m_group)
+		{
+			reply->m_str = NULL;
+			if (reply->m_msg.size >= 0)
 			{
-				delete [] plain;
-				return 0;
+				reply->m_plain[reply->m_msg.size] = '\0';
+				reply->m_str = (char*) reply->m_plain;
 			}
-			plain[plainsize] = '\0';
-			str = (char*) plain;
-                }
-        }
+			reply->m_msg.src = NULL;
+		}
+		if (reply->m_str)
+			BuildSearchResponse(rqsts[i], reply);
+	}
+	CryptSearch(replies, count, 1, &ctx);
+
+	for (i = 0; i < count; i++)
+	{
+		SearchReply *reply = replies + i;
+		if (reply->m_resp
+		    && (!reply->m_msg.src || reply->m_msg.size >= 0))
+			host->SendGnutella((const BYTE*) reply->m_resp);
+		delete [] ((BYTE*) reply->m_resp);
+		delete [] reply->m_plain;
+	}
+}
+
+/*
+ * Trut::BuildSearchResponse: Create the response to a search request.
+ * @rqst: Search request.
+ * @reply: [!OUT] Search reply with the query string.  The response
+ *         is left in m_resp (or NULL if nothing matches), and its
+ *         data to encrypt in m_msg.
+ */
+void
+Trut::BuildSearchResponse(Gnutella::SearchRqst *rqst, SearchReply *reply)
+{
+	const char *str = reply->m_str;
+	Group *group = reply->m_group;
+	int key = reply->m_key;
 
 	PTP::Collection::Entry *entry = NULL;
         int size = ((sizeof(Gnutella::SearchResp)
@@ -1509,10 +2123,7 @@ Trut::HandleSearchRequest(Host *host, Gnutella::SearchRqst *rqst)
         }
 
         if (!count)
-	{
-		delete [] plain;
-		return 0;
-	}
+		return;
 
 	int osize = size;
 	if (group)
@@ -1552,23 +2163,63 @@ Trut::HandleSearchRequest(Host *host, Gnutella::SearchRqst *rqst)
 		}
 	}
 
-	delete [] plain;
-
         Gnutella::SearchTrailer *trailer = (Gnutella::SearchTrailer*) srch;
         PTP::Random::Fill(trailer->guid, sizeof(trailer->guid));
 
+	// the data after the packet header is encrypted in place
+	reply->m_resp = resp;
 	if (group)
 	{
 		BYTE *data = (BYTE*) resp + sizeof(Gnutella::Packet);
-		int size = osize - sizeof(Gnutella::Packet);
-		size = group->m_key->Encrypt(data, size, data);
+		reply->m_msg.src = data;
+		reply->m_msg.size = osize - sizeof(Gnutella::Packet);
+		reply->m_msg.dst = data;
 	}
-	
-        host->SendGnutella((const BYTE*) resp);
+}
 
-        delete [] ((BYTE*) resp);
+/*
+ * Trut::CryptSearch: Encrypt or decrypt the secure messages of a batch.
+ * @replies: Search replies.
+ * @count: Number of replies.
+ * @enc: 1 to encrypt or 0 to decrypt.
+ * @ctx: Cipher context.
+ */
+void
+Trut::CryptSearch(SearchReply *replies,
+		  int count,
+		  int enc,
+		  PTP::Key::Context *ctx)
+{
+	PTP::Key::Message msgs[SEARCH_BATCH];
+	int index[SEARCH_BATCH];
+	int done[SEARCH_BATCH];
+	memset(done, 0, sizeof(done));
 
-	return 0;
+	// each group's messages go through its key together
+	for (int i = 0; i < count; i++)
+	{
+		if (done[i] || !replies[i].m_msg.src)
+			continue;
+		const PTP::Key *key = replies[i].m_group->m_key;
+		int n = 0;
+		for (int j = i; j < count; j++)
+		{
+			if (!done[j]
+			    && replies[j].m_msg.src
+			    && replies[j].m_group->m_key == key)
+			{
+				index[n] = j;
+				msgs[n++] = replies[j].m_msg;
+				done[j] = 1;
+			}
+		}
+		if (enc)
+			key->EncryptBatch(msgs, n, ctx);
+		else
+			key->DecryptBatch(msgs, n, ctx);
+		for (int k = 0; k < n; k++)
+			replies[index[k]].m_msg = msgs[k];
+	}
 }
 
 /**
@@ -1582,7 +2233,15 @@ int
 Trut::GetRead(BYTE *buffer, int size, void *context)
 {
 	TransferContext *ctx = (TransferContext*) context;
-	int s = ctx->conn->Read(buffer, size);
+
+	// stop at the end of the content, since the connection may be reused
+	if (ctx->remain >= 0 && size > ctx->remain)
+		size = (int) ctx->remain;
+	if (!size)
+		return 0;
+	int s = ctx->conn->Read(buffer, size, IO_TIMEOUT);
+	if (s > 0 && ctx->remain >= 0)
+		ctx->remain -= s;
 	return s;
 }
 
@@ -1601,7 +2260,7 @@ Trut::GetWrite(const BYTE *buffer, int size, void *context)
 	if (s >= 0)
 	{
 		ctx->size += s;
-		if (ctx->callback)
+		if (ctx->callback && !(ctx->stop && *ctx->stop))
 		{
 			(*ctx->callback)(ctx->file,
 					 Trut::GET_OK,
@@ -1613,6 +2272,20 @@ Trut::GetWrite(const BYTE *buffer, int size, void *context)
 	return s;
 }
 
+/*
+ * Trut::CryptDone: Finish an identity operation.
+ * @ident: Identity.
+ * @result: Operation result.
+ * @context: Crypto context.
+ */
+void
+Trut::CryptDone(const PTP::Identity *ident, int result, void *context)
+{
+	CryptContext *ctx = (CryptContext*) context;
+	ctx->result = result;
+	ctx->done.Post();
+}
+
 /**
  * Trut::PutRead: Read data from a file.
  * @buffer: [!OUT] Data buffer.
@@ -40,6 +40,7 @@
 
 #define modulus modu
 
+#include <time.h>
 #include <ptp/ptp.h>
 #include <ptp/list.h>
 #include <ptp/key.h>
@@ -48,7 +49,11 @@
 #include <ptp/store.h>
 #include <ptp/collect.h>
 #include <ptp/net.h>
+#include <ptp/connpool.h>
 #include <ptp/thread.h>
+#include <ptp/sem.h>
+#include <ptp/pool.h>
+#include <ptp/reactor.h>
 #include "gnutella.h"
 
 #undef modulus
@@ -109,7 +114,8 @@ public:
 	void Get(File *file,
 		 const char *path,
 		 GetCallback callback,
-		 void *context);
+		 void *context,
+		 int resume = 0);
 	void GetWait(File *file);
 	void GetStop(File *file);
 
@@ -135,19 +141,41 @@ protected:
 		READ_SIZE = 4096,
 		PORT_DEFAULT = 6346,
 		HEADER_SIZE = 1024,
+		KEEP_ALIVE_TIME = 15,
+		IO_TIMEOUT = 30 * 1000,
+		IO_THREADS = 64,
+		MAX_CONNECT_MESSAGE = 64,
+		MAX_PACKET_SIZE = 0x10000,
+		LISTEN_BACKLOG = 256,
+		ACCEPT_BATCH = 16,
+		SEARCH_BATCH = 16,
 	};
 	
 	struct SearchContext;
 	struct TransferContext;
 	struct GetContext;
 	struct PutContext;
+	struct CryptContext;
+	struct SearchReply;
 
 	int HandleSearchResponse(Host *host, Gnutella::SearchResp *resp);
-	int HandleSearchRequest(Host *host, Gnutella::SearchRqst *rqst);
+	void HandleSearchRequests(Host *host,
+				  Gnutella::SearchRqst **rqsts,
+				  int count);
+	void BuildSearchResponse(Gnutella::SearchRqst *rqst,
+				 SearchReply *reply);
+	static void CryptSearch(SearchReply *replies,
+				int count,
+				int enc,
+				PTP::Key::Context *ctx);
 	int HandleConnect(Host *host, Gnutella::Packet *packet);
 
-	int GetAuth(PTP::Net::Connection *conn, const BYTE *rqst);
+	int GetAuth(PTP::Net::Connection *conn,
+		    char *hdr,
+		    int *status,
+		    int *size);
 	int PutAuth(PTP::Net::Connection *conn,
+		    const char *hdr,
 		    const PTP::Identity **id,
 		    BYTE *resp);
 	static int GetAuthValue(const char *hdr,
@@ -158,6 +186,7 @@ protected:
 				    const char *name,
 				    const BYTE *value,
 				    int size);
+	static int GetRangeOffset(const char *hdr);
 
 	static void FindKey(File *file, void *context);
 	static void FetchKey(File *file,
@@ -166,11 +195,28 @@ protected:
 			     unsigned long size,
 			     void *context);
 
-	static void *PortThread(void *context);
-	static void *HostThread(void *context);
-	static void *PutThread(void *context);
-	static void *GetThread(void *context);
-
+	int Put(Host *host, PutContext *ctx);
+	int WatchHost(Host *host, int ok);
+	void CloseHost(Host *host);
+	int WatchClient(Host *host, int ok);
+	void RemoveAllClients(int idle);
+
+	static void PortEvent(PTP::Net::Reactor::Handler *handler,
+			      int events,
+			      void *context);
+	static void ClientEvent(PTP::Net::Reactor::Handler *handler,
+				int events,
+				void *context);
+	static void HostEvent(PTP::Net::Reactor::Handler *handler,
+			      int events,
+			      void *context);
+	static void AcceptTask(void *context);
+	static void HostTask(void *context);
+	static void GetTask(void *context);
+
+	static void CryptDone(const PTP::Identity *ident,
+			      int result,
+			      void *context);
 	static int PutRead(BYTE *buffer, int size, void *context);
 	static int PutWrite(const BYTE *buffer, int size, void *context);
 	static int GetRead(BYTE *buffer, int size, void *context);
@@ -181,6 +227,7 @@ protected:
 
 	PTP::List m_ports;
 	PTP::List m_hosts;
+	PTP::List m_clients;	// new connections and uploads
 	PTP::List m_groups;
 	PTP::List m_shared;
 
@@ -194,6 +241,13 @@ protected:
 
 	OpenCallback m_open;
 	CloseCallback m_close;
+
+	// blocking connection work runs on m_ioPool, so that slow peers
+	// can not hold up the processors m_pool encrypts on
+	PTP::Net::Reactor m_reactor;
+	PTP::ThreadPool m_pool;
+	PTP::ThreadPool m_ioPool;
+	PTP::Net::ConnectionPool m_conns;
 };
 
 /**
@@ -207,12 +261,12 @@ public:
 protected:
 	friend class Trut;
 
-	Port():m_conn(NULL) {}
+	Port():m_conn(NULL), m_handler(NULL) {}
 	~Port() {delete m_conn;}
 
 	Trut *m_trut;
 	PTP::Net::Connection *m_conn;
-	PTP::Thread m_thread;
+	PTP::Net::Reactor::Handler *m_handler;
 };
 
 /**
@@ -230,7 +284,8 @@ public:
 protected:
 	friend class Trut;
 
-	Host():m_url(NULL), m_conn(NULL) {}
+	Host():m_url(NULL), m_conn(NULL), m_handler(NULL),
+	       m_busy(0), m_stop(0), m_upload(0), m_idle(0) {}
 	~Host()
 	{
 		delete [] m_url;
@@ -239,12 +294,23 @@ protected:
 
 	void SendGnutella(const BYTE *pkt);
 	BYTE *ReceiveGnutella();
+	int HasPacket();
+	int HasRequest();
 
 	Trut *m_trut;
 	char *m_url;
 	PTP::Net::Connection *m_conn;
-	PTP::Thread m_thread;
+	PTP::Net::Reactor::Handler *m_handler;
 	void *m_context;
+
+	// m_busy is set while a pool task is reading from the host
+	PTP::Mutex m_mutex;
+	int m_busy;
+	int m_stop;
+
+	// server connections wait for their next request from m_idle on
+	int m_upload;
+	time_t m_idle;
 };
 
 /**